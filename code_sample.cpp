@@ -6,9 +6,7 @@
 //
 // This sample contains a set of classes
 // designed to fit simple raytracer app.
-// Classes (with the exception of class
-// 'Space', which is currently under
-// development) are provided with definitions
+// Classes are provided with definitions
 // of all member methods, constructors
 // operators, destructors etc. 
 // 
@@ -26,16 +24,46 @@
 #pragma comment ( lib, "d3d10.lib" )
 #pragma comment ( lib, "d3dx10d.lib" )
 #pragma comment ( lib, "d3dx9d.lib" )
+#pragma comment ( lib, "ws2_32.lib" )
 
+// winsock has to be included before windows.h
+// (which comes along with d3d10.h)
+#include <winsock2.h>
+#include <afunix.h>
 #include <d3d10.h>
 #include <D3DX10.h>
 #include <xnamath.h>
 
+// wider vectors for the transform kernels, if the compiler
+// was allowed to use them (/arch:AVX2 or /arch:AVX512)
+#if defined( __AVX2__ ) || defined( __AVX512F__ )
+#include <immintrin.h>
+#endif
+
 #include <string>
 #include <vector>
 #include <memory>
 #include <sstream>
 #include <algorithm>
+#include <map>
+#include <new>
+#include <cstdlib>
+#include <cstddef>
+#include <cmath>
+#include <cfloat>
+#include <cassert>
+
+// compilers with c++14 constexpr (loops in constexpr functions)
+// generate index buffers of common spheres while compiling
+#if !defined( HAS_CONSTEXPR ) && ( ( defined( _MSC_VER ) && _MSC_VER >= 1910 ) || __cplusplus >= 201402L )
+#define	HAS_CONSTEXPR
+#endif
+
+#ifdef HAS_CONSTEXPR
+#define	TOPOLOGY_CONSTEXPR		constexpr
+#else
+#define	TOPOLOGY_CONSTEXPR
+#endif
 
 #define XMFLOAT_WSTREAM( f )	f.x << L" " << f.y << L" " << f.z
 #define	ERRORMACRO( x )			MessageBox( NULL, x, L"Error macro", MB_OK )
@@ -45,13 +73,155 @@ class 	Mateyko;
 class 	ShaderInput;
 class	Camera;
 class	Space;
+class	JobSystem;
+class	SweepAndPrune;
+class	SpatialGrid;
+class	SphereBVH;
+class	RayQueries;
+class	FloorLightmap;
+class	LightClusters;
+class	SkyLight;
+class	ColorTable;
+class	AnimationSet;
+class	ParticleSystem;
+class	SphereImpostors;
 class 	Object3D;
+class	InputLayoutCache;
+class	SceneGenerator;
+class	SceneJournal;
+class	ReplicationServer;
+class	ReplicationClient;
+class	SceneEditBatch;
+class	SceneEditQueue;
+class	SceneVersionStore;
+class	NameIndex;
 
 struct	Timer;
+struct	PreciseTimer;
 struct 	Vertex;
+struct	CompactVertex;
+struct	SceneDesc;
+struct	ShadingControls;
+struct	SnapshotHeader;
+struct	SnapshotMesh;
+struct	SnapshotObject;
+struct	AllocationCounter;
+struct	Statistics;
+struct	Material;
+struct	SceneVersion;
+struct	SpherePair;
+struct	ParticleInstance;
+struct	ImpostorCorner;
+struct	ImpostorInstance;
+struct	RayHit;
+struct	RayQuery;
+struct	TraversalStats;
+struct	FloorDesc;
+struct	Light;
+
+template< class V >
+struct	VertexFormat;
 
 // forward function declarations.
-XMMATRIX	getSpaceMatrix( XMFLOAT3, XMFLOAT3, bool );
+XMMATRIX			getSpaceMatrix( XMFLOAT3, XMFLOAT3, bool );
+XMMATRIX			getSphereMatrix( const XMFLOAT4&, float );
+void				getSpaceMatrices( const XMFLOAT3*, const XMFLOAT3*, UINT, bool, XMFLOAT4X4* );
+AllocationCounter	getThreadAllocations();
+AllocationCounter	getProcessAllocations();
+UINT64				hashBytes( const void*, size_t, UINT64 );
+static float		radicalInverse( UINT );
+bool				sphereInFrustum( const XMFLOAT4*, const XMFLOAT4& );
+int					boxInFrustum( const XMFLOAT4*, const XMFLOAT3&, const XMFLOAT3& );
+bool				raySphere( const XMFLOAT3&, const XMFLOAT3&, const XMFLOAT4&, float& );
+bool				rayBox( const XMFLOAT3&, const XMFLOAT3&, const XMFLOAT3&, const XMFLOAT3&, float, float& );
+bool				rayFloor( const XMFLOAT3&, const XMFLOAT3&, const FloorDesc&, float& );
+void				buildSphereMesh( UINT, UINT, float, XMFLOAT4, std::vector< Vertex >&, std::vector< DWORD >& );
+const DWORD*		findSphereTopology( UINT, UINT );
+void				transformPoints( const float*, const float*, const float*, UINT, CXMMATRIX, float*, float*, float* );
+void				transformNormals( const float*, const float*, const float*, UINT, CXMMATRIX, float*, float*, float* );
+void				projectPoints( const float*, const float*, const float*, UINT, CXMMATRIX, float*, float*, float*, float* );
+
+// results of the boxInFrustum function
+#define	FRUSTUM_OUTSIDE		0
+#define	FRUSTUM_PARTIAL		1
+#define	FRUSTUM_INSIDE		2
+
+// axes given to getSpaceMatrix count as orthonormal if their
+// squared lengths and their dot product are that close to 1 and 0
+#define	ORTHONORMAL_TOLERANCE	1e-4f
+
+// starting value for hashBytes function
+#define	HASH_OFFSET_BASIS	0xCBF29CE484222325ULL
+
+// number of frames PaintScene is allowed to allocate memory
+// in, before the debug build starts asserting that rendering
+// is allocation-free. first frames may still be filling
+// the capacity of various containers.
+#define	ALLOCATION_WARMUP_FRAMES	3
+
+// object handles. unlike indices they never change, and are
+// never reused - a handle of a removed object stays invalid
+typedef UINT	ObjectHandle;
+#define	NO_OBJECT		0xFFFFFFFF		// no object at all
+#define	FLOOR_OBJECT	0xFFFFFFFE		// the floor, which is kept apart from other objects
+
+// ids of the Space's transform nodes are never reused either
+#define	NO_NODE			0xFFFFFFFF
+#define	REMOVED_NODE	0xFFFFFFFE
+
+// subtrees of the transform hierarchy bigger than that 
+// are split into their children's subtrees, so they can
+// be evaluated in parallel, in batches of NODE_BATCH_SIZE
+#define	NODE_SPLIT_SIZE		1024
+#define	NODE_BATCH_SIZE		64
+
+// spheres processed by a single job while building the spatial grid
+#define	GRID_BATCH_SIZE		4096
+
+// animation tracks evaluated by a single job
+#define	ANIMATION_BATCH_SIZE	1024
+
+// spheres in a leaf of the SphereBVH, and the depth 
+// the tree never exceeds (it's the size of traversal stack)
+#define	BVH_LEAF_SIZE		4
+#define	BVH_MAX_DEPTH		64
+
+// kinds of ray queries. closest hit finds the nearest thing hit,
+// any hit stops at the first one (e.g. for line of sight)
+#define	RAY_CLOSEST_HIT		0
+#define	RAY_ANY_HIT			1
+
+// rays traversing the SphereBVH together, and packets of
+// them processed by a single job of RayQueries
+#define	RAY_PACKET_SIZE		8
+#define	RAY_PACKET_BATCH	16
+
+// rays cast from every texel of the FloorLightmap (multiple
+// of RAY_PACKET_SIZE), and texels baked by a single job
+#define	FLOOR_AO_RAYS		64
+#define	FLOOR_BAKE_BATCH	64
+
+// light clusters: tiles across and down the screen (their product 
+// must be a multiple of 4), depth slices, and lights binned by a job
+#define	LIGHT_CLUSTERS_X	16
+#define	LIGHT_CLUSTERS_Y	8
+#define	LIGHT_CLUSTERS_Z	24
+#define	LIGHT_BATCH_SIZE	64
+
+// directions the sky is sampled in, when projected by SkyLight
+#define	SKY_SH_SAMPLES		4096
+
+// particles updated or culled by a single job
+#define	PARTICLE_BATCH_SIZE		4096
+
+// particles whose distances to the frustum planes are
+// computed together, while culling (on the stack)
+#define	PARTICLE_CULL_CHUNK		256
+
+// projected diameter (in pixels) below which spheres are drawn 
+// as impostors by default, and spheres picked by a single job
+#define	IMPOSTOR_DEFAULT_SIZE	8.0f
+#define	IMPOSTOR_BATCH_SIZE		4096
 
 // ////////////////////////////////////////////////
 // ///////////////////////////////////////////////
@@ -91,6 +261,136 @@ public:
 	
 };
 
+// //////////////////////////////////////////////
+// 
+// STATISTICS STRUCTURES
+// 
+// /////////////////////////////////////////
+
+// allocation counter keeps the number of heap allocations
+// and the number of bytes requested by them. every thread
+// has its own counter (see getThreadAllocations), there's
+// also one shared by the whole process (getProcessAllocations).
+// counters are only incremented if the TRACK_ALLOCATIONS
+// macro is defined, otherwise they always stay zeroed.
+struct	AllocationCounter
+{
+	AllocationCounter()
+		:	allocations( 0 ), frees( 0 ), bytes( 0 )	{}
+	
+	UINT64	allocations;		// number of calls to operator new
+	UINT64	frees;				// number of calls to operator delete
+	UINT64	bytes;				// bytes requested by all the allocations
+};
+
+// statistics gathered by Mateyko during the PaintScene method.
+// the structure is overwritten every frame, so if you want 
+// to keep track of them, copy it after the frame was painted
+struct	Statistics
+{
+	Statistics()
+		:	frameNumber( 0 ), drawnObjects( 0 ), drawnImpostors( 0 ), drawnParticles( 0 ), appliedEdits( 0 )	{}
+	
+	UINT64				frameNumber;			// number of frames painted so far
+	UINT				drawnObjects;			// objects drawn during the last frame (floor included)
+	UINT				drawnImpostors;			// objects drawn as impostors instead (not counted above)
+	UINT				drawnParticles;			// particles that passed the culling in the last frame
+	UINT				appliedEdits;			// queued edits applied at the beginning of the last frame
+	
+	AllocationCounter	frameAllocations;		// allocations done by the render thread within the last frame
+	AllocationCounter	threadAllocations;		// all allocations done by the render thread so far
+	AllocationCounter	processAllocations;		// all allocations done by the whole process so far
+};
+
+// how an object is shaded. all of them multiply the global shading
+// values of ShaderInput, so the default material looks exactly like
+// the scene did before materials. it's 16 bytes, a single float4 in
+// the effect's OMaterials array, indexed the same way colors are
+struct	Material
+{
+	Material()
+		:	reflectance( 1.0f ), diffuse( 1.0f ), brightness( 1.0f ), sky( 1.0f )	{}
+	Material( float _reflectance, float _diffuse, float _brightness, float _sky )
+		:	reflectance( _reflectance ), diffuse( _diffuse ), brightness( _brightness ), sky( _sky )	{}
+	
+	float	reflectance;		// times ShadingControls::reflectance
+	float	diffuse;			// times diffusePower
+	float	brightness;			// times brightness
+	float	sky;				// times skyBrightness
+};
+
+// //////////////////////////////////////////////
+// 
+// NAME INDEX CLASS
+// 
+// /////////////////////////////////////////
+
+// maps names of the objects to their handles. all the names are
+// interned - kept once, one after another in a single pool of
+// characters, so storing them costs no allocation per name.
+// lookup goes through an open addressing hash table (linear probing,
+// FNV hashes), so finding, adding, renaming or removing a name
+// takes the same time no matter how many objects there are.
+// names must be unique, adding a taken one fails.
+// prefix queries use an array of handles sorted by names. it's 
+// rebuilt only when a query comes after the names have changed
+class NameIndex
+{
+	// entry of the hash table. name is an offset into the pool,
+	// or one of the markers below for unused entries
+	struct Slot
+	{
+		UINT64			hash;
+		UINT			name;
+		ObjectHandle	handle;
+	};
+	
+	enum { EMPTY_SLOT = 0xFFFFFFFF, REMOVED_SLOT = 0xFFFFFFFE, NO_NAME = 0xFFFFFFFF };
+	
+	std::vector< Slot >				slots;			// size is always a power of two
+	UINT							used;			// slots holding a name
+	UINT							removed;		// slots marked as removed, they still lengthen the probes
+	std::vector< wchar_t >			pool;			// zero terminated names, one after another
+	UINT							deadChars;		// characters of removed names still in the pool
+	std::vector< UINT >				handleNames;	// offset of the name for every handle
+	std::vector< ObjectHandle >		sorted;			// handles sorted by names, for prefix queries
+	bool							sortedValid;
+	
+	UINT	findSlot( LPCWSTR name, UINT64 hash ) const;
+	void	rehash( UINT size );
+	void	compact();
+	
+public:
+
+	// copy-constructor, destructor and assigment operator 
+	// may be auto-generated, the class holds only vectors
+	NameIndex();
+	
+	bool			Insert( LPCWSTR name, ObjectHandle handle );	// false if the name is taken
+	bool			Rename( ObjectHandle handle, LPCWSTR name );	// also names a nameless handle
+	void			Remove( ObjectHandle handle );
+	void			Clear();
+	
+	ObjectHandle	Find( LPCWSTR name ) const;						// NO_OBJECT if nothing has that name
+	LPCWSTR			GetName( ObjectHandle handle ) const;			// NULL if the handle has no name
+	
+	// appends handles of all the objects whose names start with
+	// the prefix (in order of names), returns how many were found
+	UINT			FindPrefix( LPCWSTR prefix, std::vector< ObjectHandle >& found );
+	
+	UINT			size() const;
+};
+
+// rectangle the floor is made of, in world space (as it's drawn).
+// its corners are centre +/- halfLength +/- halfWidth
+struct	FloorDesc
+{
+	XMFLOAT3	centre;
+	XMFLOAT3	normal;
+	XMFLOAT3	halfLength;
+	XMFLOAT3	halfWidth;
+};
+
 // class Mateyko is the main drawing-painting-rendering
 // class, that holds all the directx components needed
 // for displaying an image. those components are initialized
@@ -105,6 +405,20 @@ class Mateyko
 	// for as we know, std::vector likes to reallocate its content from time to time
 	std::vector< std::shared_ptr< Object3D > >	objects;
 	std::vector< XMFLOAT4 >						oColors;
+	std::vector< Material >						oMaterials;		// under the same indices, like colors
+	
+	// handles of the objects (stored under the same indices as
+	// objects), current index of an object for every handle ever
+	// given away (NO_OBJECT once it was removed), and the names
+	std::vector< ObjectHandle >					oHandles;
+	std::vector< UINT >							handleIndices;
+	NameIndex									oNames;
+	std::wstring								FloorName;
+	FloorDesc									FloorRect;
+	bool										FloorDescribed;	// false if the floor's shape is unknown
+	
+	// point and spot lights, lighting the scene along with the sky
+	std::vector< Light >						lights;
 	
 	// variables for various parts of the engine
 	ID3D10Device*				pd3dDevice;
@@ -115,18 +429,57 @@ class Mateyko
 
 	// other variables
 	ID3D10ShaderResourceView*	FloorTextureRV;	
+	std::wstring				FloorTextureFile;		// file the floor texture was loaded from
 	D3D10_DRIVER_TYPE			pDriverType;
 	UINT						Width, Height;
+	
+	// statistics of the last painted frame. updated by PaintScene
+	Statistics					stats;
 
 	// pointers to the various devices that manage events on the scene
 	// they need to be manually binded, by default are set to NULL
 	ShaderInput*				pInput;
 	Camera*						pCam;
 	Space*						pSpace;
+	SceneJournal*				pJournal;		// optional. records all changes of the scene
+	SceneEditQueue*				pEdits;			// optional. edits submitted by other threads
+	SceneVersionStore*			pVersions;		// optional. if set, the scene is painted from its versions
+	ParticleSystem*				pParticles;		// optional. drawn after the floor
+	SphereImpostors*			pImpostors;		// optional. draws small spheres as quads instead of their meshes
+	SphereBVH*					pBVH;			// optional. speeds up picking
+	FloorLightmap*				pLightmap;		// optional. shades the floor, if it's known (see GetFloor)
+	LightClusters*				pClusters;		// optional. without it the scene is lit by the sky only
+	SkyLight*					pSky;			// optional. diffuse light of the sky, projected whenever it changes
+	ColorTable*					pColorTable;	// optional. packed colors, only the changed ones are uploaded
+	
+	// indices of the objects recolored by UpdateColors. it only
+	// grows, so recoloring doesn't allocate after a while
+	std::vector< UINT >			recolored;
+	
+	// colors and spheres of the pinned scene version, gathered
+	// into flat arrays for the shaders. they only grow, so
+	// painting doesn't allocate unless the scene got bigger
+	std::vector< XMFLOAT4 >		frameColors;
+	std::vector< XMFLOAT4 >		frameSpheres;
+	std::vector< Material >		frameMaterials;
+	std::vector< float >		frameMeshRadii;
+	
+	// whether the mesh of an object is a sphere, gathered every
+	// frame for the impostors. it only grows, like the ones above
+	std::vector< BYTE >			frameSphereMeshes;
 
 	// a ground/floor object
 	Object3D*					oGroundZero;
 	
+	// give a handle to the object inserted a moment ago,
+	// and put its color into the color table
+	void				addHandle();
+	void				appendColor();
+	
+	// describes the floor, if the vertices make a rectangle
+	// (the way formRectangleObject makes it)
+	void				describeFloor( const Vertex* vertices, UINT count );
+	
 public:
 
 	// standard constructors and assigment operator
@@ -149,7 +502,10 @@ public:
 
 	HRESULT				InitDevice( HWND hWnd );			// initializes the device
 	HRESULT				loadTexture( LPCWSTR szFileName );	// loads the texture for the floor
+	HRESULT				SaveScene( LPCWSTR szFileName );	// writes the whole scene into a binary snapshot file
+	HRESULT				LoadScene( LPCWSTR szFileName );	// replaces the scene with the one stored in a snapshot file
 	ID3D10Device*		GetDevice();						// returns a pointer to the device, so other classes can use it (e.g. shader input)
+	ShaderInput*		GetInput();							// the bound shader input, NULL if none
 	void				ReleaseMe();
 	void				PaintScene();						// paints a scene
 
@@ -158,15 +514,28 @@ public:
 	void				BindInput( ShaderInput* shi );
 	void				BindCamera( Camera* cam );
 	void				BindSpace( Space* spa );
+	void				BindJournal( SceneJournal* jou );
+	void				BindEditQueue( SceneEditQueue* seq );
+	void				BindSceneVersions( SceneVersionStore* svs );
+	void				BindParticles( ParticleSystem* pas );
+	void				BindImpostors( SphereImpostors* sim );
+	void				BindBVH( SphereBVH* bvh );
+	void				BindLightmap( FloorLightmap* flm );
+	void				BindLightClusters( LightClusters* lcs );
+	void				BindSkyLight( SkyLight* sky );
+	void				BindColorTable( ColorTable* cot );
 
 	// those can create standard shapes - a flat rectangle surface and a sphere
-	// of a desired number of parallels and meridians
-	void				formSphere( LPCWSTR _name, UINT meridians, UINT parallels, float radius, XMFLOAT4 color );
+	// of a desired number of parallels and meridians. compact spheres
+	// keep their vertices as CompactVertex structs, half the size
+	void				formSphere( LPCWSTR _name, UINT meridians, UINT parallels, float radius, XMFLOAT4 color, bool compact = false );
 	void				formRectangleObject( LPCWSTR _name, float length, float width, XMFLOAT3 planeNormal, XMFLOAT3 lenDir );
 
 	// insert and remove methods.
 	// responsible for adding new objects to the objects vector (and removing from it)
 	void				InsertObject( Object3D* );
+	void				InsertObject( std::shared_ptr< Object3D > o3ptr, XMFLOAT4 color );
+	void				InsertFloor( Object3D* );
 	void				InsertObject( void* verts, DWORD* inds, UINT vSize, UINT iSize, XMFLOAT4 colololo );
 	void				RemoveObject( int oNum );
 	void				RemoveAll();
@@ -174,6 +543,58 @@ public:
 	// remaining methods
 	void				updateColor( unsigned int oNumber, XMFLOAT4 color );	// update color of a desired number
 	void				GetClientRectSize( UINT& _width, UINT& _height );		// get the size of a client window
+	const Statistics&	GetStatistics();										// statistics of the last painted frame
+	UINT				GetObjectCount();										// number of objects on the scene (floor excluded)
+	Object3D*			GetObject3D( UINT oNumber );							// pointer to the object of a desired number
+	std::shared_ptr< Object3D >	GetSharedObject( UINT oNumber );				// the same, but shared
+	XMFLOAT4			GetColor( UINT oNumber );								// color of the object of a desired number
+	XMFLOAT4*			GetColorArray();										// colors of all objects, for bulk updates (see ColorsWritten)
+	
+	// recolors count objects at once, colors[ i ] goes to the object
+	// of handles[ i ] (unknown handles are skipped), or to the object
+	// first + i. journaled like updateColor, if the journal is bound.
+	// colors written through GetColorArray must be announced with
+	// ColorsWritten, otherwise the bound ColorTable and the journal 
+	// won't see them
+	void				UpdateColors( const ObjectHandle* handles, const XMFLOAT4* colors, UINT count );
+	void				UpdateColors( UINT first, const XMFLOAT4* colors, UINT count );
+	void				ColorsWritten( const UINT* indices, UINT count );
+	ColorTable*			GetColorTable();
+	
+	// materials of the objects. new objects get the default one
+	void				SetMaterial( UINT oNumber, const Material& material );
+	const Material&		GetMaterial( UINT oNumber );
+	Material*			GetMaterialArray();										// for bulk updates, like GetColorArray (not journaled)
+	
+	// handles and names of the objects. handle identifies an object for its
+	// whole life, no matter how its index changes when others are removed.
+	// the floor has a FLOOR_OBJECT handle, but no index
+	ObjectHandle		GetHandle( UINT oNumber );
+	UINT				GetObjectIndex( ObjectHandle handle );					// NO_OBJECT if there's no such object
+	ObjectHandle		FindObject( LPCWSTR name );								// NO_OBJECT if nothing has that name
+	LPCWSTR				GetObjectName( ObjectHandle handle );					// NULL if the object has no name
+	bool				RenameObject( ObjectHandle handle, LPCWSTR name );		// false if the name is taken
+	UINT				FindObjects( LPCWSTR prefix, std::vector< ObjectHandle >& found );	// by the beginning of the name
+	
+	// object under the pixel (x, y) of the client rectangle, NO_OBJECT
+	// if there's none. hit gets the point and the normal, if provided.
+	// uses the bound SphereBVH, which must be refitted after spheres 
+	// moved, otherwise tests all the spheres of the Space
+	ObjectHandle		Pick( UINT x, UINT y, RayHit* hit = NULL );
+	
+	// rectangle of the floor, for ray queries. false if there's no
+	// floor, or it was inserted as an object of unknown shape
+	bool				GetFloor( FloorDesc& floor );
+	
+	// lights of the scene. they are indexed like objects, so removing
+	// one moves the last light into its place. they're only shaded
+	// when LightClusters are bound, which cull them every frame
+	UINT				AddLight( const Light& light );
+	void				SetLight( UINT lNumber, const Light& light );
+	void				RemoveLight( UINT lNumber );
+	void				RemoveAllLights();
+	const Light&		GetLight( UINT lNumber );
+	UINT				GetLightCount();
 };
 
 // //////////////////////////////////////////////
@@ -211,6 +632,7 @@ class ShaderInput
 	ID3D10EffectVectorVariable*			CamEye;				// current camera position
 	ID3D10EffectVectorVariable*			BigBalls;			// position of all of the spheres
 	ID3D10EffectVectorVariable*			OColors;			// colors of those spheres
+	ID3D10EffectVectorVariable*			OMaterials;			// and their materials (see Material)
 
 	// those two tells the shader how many objects are on the scene
 	// and which number in the vector arrays above has the currently rendered object
@@ -231,6 +653,16 @@ class ShaderInput
 
 	// textures and maps
 	ID3D10EffectShaderResourceVariable*	FloorTexture;	
+	ID3D10EffectShaderResourceVariable*	LightmapTexture;	// occlusion and sky visibility of the floor (see FloorLightmap)
+	ID3D10EffectVectorVariable*			LightmapRect;		// centre and both axes, to map world positions onto the lightmap
+	ID3D10EffectShaderResourceVariable*	LightRanges;		// offset and count of lights in every cluster
+	ID3D10EffectShaderResourceVariable*	LightIndices;		// lights of all clusters, one after another
+	ID3D10EffectShaderResourceVariable*	LightData;			// the lights themselves
+	ID3D10EffectVectorVariable*			LightGrid;			// number of lights, and the cluster grid size (see PrepareLights)
+	ID3D10EffectVectorVariable*			LightSlices;		// scale and bias turning log( depth ) into the cluster's slice
+	ID3D10EffectVectorVariable*			SkySH;				// nine coefficients of sky's diffuse light (see SkyLight)
+	ID3D10EffectShaderResourceVariable*	OColorTable;		// packed colors of the objects, if the ColorTable is used
+	ID3D10EffectScalarVariable*			UseColorTable;		// whether shaders read colors from it instead of OColors
 	
 	// those variables hold the values that need to be passed
 	// to shaders. names are the same, except for 'v' prefix
@@ -280,14 +712,34 @@ public:
 	void	PrepareEyePos( float* );					// camera-eye position
 	void	PreparePositions( float*, int );			// scene object's positions
 	void	PrepareColors( float*, int );				// scene object's colors
+	void	PrepareMaterials( float*, int );			// scene object's materials, four floats each
 	void	PrepareObject( float*, int );				// passes current object's world matrix and its index on the object list. 
 	// invoked for every object separately
 	
 	void	SetFPS( float );							// sets fps variable
 	void	SetFloorTex( ID3D10ShaderResourceView* );	// sets the resource view to floor's resource variable
+	void	SetFloorLightmap( ID3D10ShaderResourceView*, const FloorDesc& );	// the same for the baked lightmap, along with the floor it covers
+	void	PrepareLights( LightClusters* );			// lights culled by the clusters, uploaded already
+	void	PrepareSkyLight( SkyLight* );				// sky's coefficients, projected already
+	void	PrepareColorTable( ColorTable* );			// colors uploaded already, NULL goes back to OColors
+	
+	// get and set all the shading control values at once
+	void	GetShadingControls( ShadingControls& );
+	void	SetShadingControls( const ShadingControls& );
 	
 	ID3D10EffectTechnique*		GetTech();	
 	ID3D10InputLayout*			GetLayout();
+	ID3D10Effect*				GetEffect();				// for other techniques of the same file (e.g. particles)
+	
+	// creates an input layout of the given elements for the technique's
+	// first pass. the template one takes them from the VertexFormat
+	// of a vertex type
+	HRESULT	CreateLayout( ID3D10Device*, const D3D10_INPUT_ELEMENT_DESC*, UINT, ID3D10InputLayout** );
+	template< class V >
+	HRESULT	CreateLayout( ID3D10Device* pd3dDevice, ID3D10InputLayout** layout )
+	{
+		return CreateLayout( pd3dDevice, VertexFormat< V >::Elements, VertexFormat< V >::Count, layout );
+	}
 	
 	// methods inherited from UserInput interface.
 	// only two are supposed to do something.
@@ -312,14 +764,6 @@ public:
 
 };
 
-// input layout description, matches the Vertex struct
-const D3D10_INPUT_ELEMENT_DESC 	vertex_desc[]  =	
-{
-	{ "POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D10_INPUT_PER_VERTEX_DATA, 0 },
-	{ "NORMAL", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 12, D3D10_INPUT_PER_VERTEX_DATA, 0 },
-	{ "COLOR", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, 24, D3D10_INPUT_PER_VERTEX_DATA, 0 },
-};
-
 // //////////////////////////////////////////////
 // 
 // CAMERA CLASS
@@ -390,11 +834,28 @@ public:
 	XMMATRIX	GetView();
 	XMFLOAT4	GetEyePos();
 	
+	// fills an array of six planes bounding the view frustum
+	// (left, right, bottom, top, near, far). normals point
+	// inside, so a point is visible if it's on the positive
+	// side of all of them
+	void		GetFrustumPlanes( XMFLOAT4* planes );
+	
+	// ray from the eye through the pixel (x, y) of a client rectangle 
+	// width x height. direction is normalized, origin lies on the
+	// near plane, so objects behind it can't be picked
+	void		GetPickRay( float x, float y, float width, float height, XMFLOAT3& origin, XMFLOAT3& direction );
+	
 	// setters
 	void		SetFPS( float );
 	void		SetScreenRatio( float );
 	void		SetFoV( float );
 	
+	// get and set the camera placement at once.
+	// velocities are not a part of it, so setting
+	// the placement stops the camera
+	void		GetPlacement( XMFLOAT3& _eye, XMFLOAT3& _at, XMFLOAT3& _up, float& _fov );
+	void		SetPlacement( XMFLOAT3 _eye, XMFLOAT3 _at, XMFLOAT3 _up, float _fov );
+	
 	// decreases the velocities by braking value divided by fps.
 	// this guarantees steady fps-independent velocity decrease.
 	// ought to be called every frame when velocities could
@@ -425,1479 +886,10527 @@ public:
 
 // //////////////////////////////////////////////
 // 
-// OBJECT3D CLASS
+// JOB SYSTEM CLASS
 // 
 // /////////////////////////////////////////
 
-class Object3D
+// signature of a job run by the JobSystem. it gets the data
+// pointer passed to ParallelFor and a range of items to process
+typedef void	( *JobFunc )( void* data, UINT begin, UINT end );
+
+// a pool of worker threads splitting loops between them. 
+// ParallelFor cuts the range of items into batches, and
+// all the workers, along with the calling thread, take 
+// batches until nothing's left. running a loop doesn't 
+// allocate any memory, so it may be used while painting.
+// only one thread at a time may call ParallelFor
+class JobSystem
 {
-	// buffer pointers for the drawing device
-	// the initial idea was to keep them as shared_ptrs
-	// but IUnknown interface from which buffers inherit
-	// provide similar features.
-	ID3D10Buffer*		vBuffer;
-	ID3D10Buffer*		iBuffer;
+	HANDLE*				threads;
+	HANDLE*				wakeEvents;		// one per worker, set when there's a loop to run
+	HANDLE				doneEvent;		// set by the last worker leaving the loop
+	UINT				workerCount;
+	
+	// the loop being run
+	JobFunc				job;
+	void*				jobData;
+	UINT				jobCount;
+	UINT				jobBatch;
+	volatile LONG		nextBatch;		// first item of the next batch to be taken
+	volatile LONG		activeWorkers;	// workers still in the loop
+	volatile LONG		startedWorkers;
+	volatile LONG		quit;
+	
+	static DWORD WINAPI	workerMain( LPVOID param );
+	void				runBatches();
+	
+public:
 
-	// size of the buffers, and its position
-	// within the memory chunk passed to shdaers
-	UINT				iSize, vSize;
-	UINT				stride, offset;
+	// starts workerCount threads. zero means one less than 
+	// the number of processors (calling thread is the last one)
+	JobSystem( UINT workerCount = 0 );
+	~JobSystem();
+private:	JobSystem( const JobSystem& );
+			JobSystem&	operator=( const JobSystem& );
+public:
+
+	// calls job( data, begin, end ) for ranges covering [0, count),
+	// none of them longer than batchSize. returns when all are done
+	void	ParallelFor( UINT count, UINT batchSize, JobFunc job, void* data );
+	
+	UINT	GetThreadCount();		// workers and the calling thread
+};
+
+// //////////////////////////////////////////////
+// 
+// SWEEP AND PRUNE CLASS
+// 
+// /////////////////////////////////////////
+
+// pair of overlapping spheres, a < b
+struct	SpherePair
+{
+	UINT	a;
+	UINT	b;
+};
+
+// broadphase finding overlapping spheres. spheres are kept sorted
+// by the lowest point of their bounds along a single axis - the one
+// spheres are spread along the most. then only spheres whose ranges
+// on that axis overlap need to be tested. spheres move a little from
+// frame to frame, so the order stays nearly right, and insertion sort
+// fixes it in about linear time. full sort happens only if the number
+// of spheres or the axis has changed
+class SweepAndPrune
+{
+	// lowest point of a sphere along the axis, kept
+	// next to its index so sorting touches one array only
+	struct Endpoint
+	{
+		float	min;
+		UINT	sphere;
+	};
+	
+	std::vector< Endpoint >		endpoints;
+	std::vector< SpherePair >	pairs;
+	UINT						axis;			// 0 - x, 1 - y, 2 - z
 	
-private:	Object3D(); // yep everytime you call it, linker shouts
 public:
 
-	// Object3D construction requires pointer to the device
-	// so it is impossible for the default construction to work
-	// properly. therefore default constructor was set private
-	// to avoid calling it
+	// copy-constructor, destructor and assigment operator
+	// may be auto-generated, the class holds only vectors
+	SweepAndPrune();
+	
+	// finds all the overlapping pairs of spheres (xyz - centre, 
+	// w - radius). returned vector is valid until the next update
+	const std::vector< SpherePair >&	Update( const XMFLOAT4* spheres, UINT count );
+	const std::vector< SpherePair >&	GetPairs();
+	UINT								GetAxis();
+};
 
-	Object3D( ID3D10Device*	_device, /* pointer to the device that will do the hard work */
-		void* vertices, DWORD* indices, UINT _vSize, UINT _iSize );
-	Object3D( const Object3D& );
-	Object3D&	operator=( const Object3D& );
+// //////////////////////////////////////////////
+// 
+// SPATIAL GRID CLASS
+// 
+// /////////////////////////////////////////
+
+// uniform grid of cubic cells, each sphere is put into the cell 
+// holding its centre. cells are not stored as a 3d array (scene
+// could be huge and mostly empty), they're hashed into a table of
+// buckets instead, about as many as there are spheres. the grid is
+// meant to be built anew every frame: spheres are counted per
+// bucket, then placed in bucket order (counting sort), both passes
+// in parallel if the JobSystem is bound.
+// with cell size at least twice the biggest radius, overlapping 
+// spheres are always in neighbouring cells, so grid works best
+// for many spheres of similar size
+class SpatialGrid
+{
+	// non-empty bucket, with the box bounding all of its spheres
+	struct Cell
+	{
+		UINT		start;
+		UINT		end;
+		XMFLOAT3	boxMin;
+		XMFLOAT3	boxMax;
+	};
 	
-	// destructor:
-	~Object3D();
+	float					cellSize;
+	float					invCellSize;
+	float					maxRadius;
+	UINT					mask;			// number of buckets - 1
 	
-#ifdef HAS_MOVE_SEMANTICS
-	// if compiler we use employ move semantics define
-	// move constructor and move operator
-	Object3D( Object3D&& );
-	Object3D&	operator=( Object3D&& );
-#endif
+	std::vector< UINT >		bucketStarts;	// first sphere of each bucket
+	std::vector< LONG >		bucketEnds;		// counters while building, then ends of the buckets
+	std::vector< UINT >		keys;			// bucket of every sphere, by sphere index
+	std::vector< UINT >		ids;			// sphere indices in bucket order
+	std::vector< XMFLOAT4 >	sorted;			// spheres in bucket order
+	std::vector< Cell >		cells;
+	
+	const XMFLOAT4*			source;			// spheres being built from
+	JobSystem*				pJobs;
+	
+	void		cellOf( const XMFLOAT4& sphere, int* cell );
+	UINT		bucketOf( int x, int y, int z );
+	
+	void		run( UINT count, UINT batchSize, JobFunc job );
+	static void	countJob( void* grid, UINT begin, UINT end );
+	static void	placeJob( void* grid, UINT begin, UINT end );
+	static void	boundsJob( void* grid, UINT begin, UINT end );
+	
+public:
 
-	// nice methods:
-	void	Draw( ID3D10Device* device, ID3D10EffectTechnique* tech );
+	// copy-constructor, destructor and assigment operator
+	// may be auto-generated, the class holds only vectors
+	SpatialGrid();
+	
+	// puts all the spheres of the Space into the grid. cell size of zero
+	// means twice the radius of the biggest sphere. sphere indices 
+	// reported by the queries are those of the Space
+	void	Build( Space& spa, float _cellSize = 0.0f );
+	
+	// queries. spheres within a single bucket are placed by many 
+	// threads at once, so the order of the results may differ
+	// from build to build, but not the results themselves
+	UINT	FindSpheres( XMFLOAT3 centre, float radius, std::vector< UINT >& found );	// spheres overlapping the given one
+	UINT	FindOverlaps( std::vector< SpherePair >& pairs );							// all overlapping pairs
+	UINT	CullSpheres( const XMFLOAT4* planes, std::vector< UINT >& visible );		// spheres within the frustum
+	
+	void	BindJobs( JobSystem* jobs );
+	UINT	GetCellCount();															// non-empty buckets
+	float	GetCellSize();
 };
 
 // //////////////////////////////////////////////
 // 
-// STRUCTURES
+// SPHERE BVH CLASS
 // 
 // /////////////////////////////////////////
 
-// timer is a simple struct that holds the time got from
-// windows GetTickCount func in its initialization time, 
-// and calculates number of seconds that passed since that moment
-struct Timer
+// result of a ray query. sphere is an index of the Space's
+// sphere hit (NO_OBJECT if nothing was hit, FLOOR_OBJECT for 
+// the floor), distance is measured along the ray, in units
+// of its direction
+struct	RayHit
 {
-	// since this is only small struct all methods and constructors
-	// are defined here for the sake of simplicity
+	UINT		sphere;
+	float		distance;
+	XMFLOAT3	position;
+	XMFLOAT3	normal;
+};
+
+// a ray, or a segment if maxDistance is finite.
+// flags is RAY_CLOSEST_HIT or RAY_ANY_HIT
+struct	RayQuery
+{
+	XMFLOAT3	origin;
+	float		maxDistance;
+	XMFLOAT3	direction;
+	UINT		flags;
+};
+
+// work done while searching a SphereBVH: boxes and spheres
+// tested, and rays answered by the occluder cache alone
+struct	TraversalStats
+{
+	TraversalStats()
+		:	rays( 0 ), boxTests( 0 ), sphereTests( 0 ), cacheHits( 0 )	{}
 	
-	// constructors, assign operator and destructor:
-	Timer()
-		: dwTimeStart( GetTickCount() )		{}
-	Timer( const Timer& tim )
-		:	dwTimeStart( tim.dwTimeStart )	{}
-	Timer&	operator=( const Timer& tim )	{
-		if( this != &tim )	{
-			dwTimeStart = tim.dwTimeStart;
-			return *this;
-		}
-	}
-	~Timer()	{}
+	UINT64	rays;
+	UINT64	boxTests;
+	UINT64	sphereTests;
+	UINT64	cacheHits;
 	
-	// returns time in seconds that passed since the start of the timer
-	float	GetTime()	{
-		return ( GetTickCount() - dwTimeStart ) / 1000.0f;
-	}
+	// steps per ray, to compare ways of tracing the same rays
+	double	GetStepsPerRay() const	{	return rays ? ( double )( boxTests + sphereTests ) / rays : 0.0;	}
+};
+
+// bounding volume hierarchy over the spheres of a Space, for
+// ray queries. every node holds a box bounding its subtree;
+// inner nodes have two children lying next to each other,
+// leaves up to BVH_LEAF_SIZE spheres. spheres are copied into
+// leaf order, so a leaf is tested without jumping around memory.
+// tree is split by median of sphere centres along the longest
+// axis, so it's balanced no matter how the spheres are spread.
+// when spheres just move, Refit is much cheaper than Build,
+// but the tree gets worse if they move far
+class SphereBVH
+{
+	struct Node
+	{
+		XMFLOAT3	boxMin;
+		UINT		first;			// first child, or first sphere of a leaf
+		XMFLOAT3	boxMax;
+		UINT		count;			// spheres of a leaf, 0 for inner nodes
+	};
 	
-private: 	
-	DWORD	dwTimeStart;	// keeps time Timer started
+	std::vector< Node >			nodes;			// root first, children always after their parent
+	std::vector< XMFLOAT4 >		spheres;		// in leaf order
+	std::vector< UINT >			ids;			// Space's index of every sphere above
+	std::vector< XMFLOAT3 >		centres;		// used only while building
+	
+	void		split( UINT node, UINT depth );
+	void		fitNode( UINT node );
+	void		fillHit( UINT sphere, const XMFLOAT3& origin, const XMFLOAT3& direction, float distance, RayHit& hit );
+	
+public:
+
+	// copy-constructor, destructor and assigment operator
+	// may be auto-generated, the class holds only vectors
+	SphereBVH();
+	
+	// builds the tree of all the spheres of the Space
+	void	Build( Space& spa );
 	
+	// reads positions of the same spheres again and fixes the
+	// boxes. Space must have the same number of spheres as when
+	// the tree was built, otherwise the tree is built anew
+	void	Refit( Space& spa );
+	
+	// finds the closest sphere hit by the ray within maxDistance.
+	// direction doesn't have to be normalized. spheres containing 
+	// the origin are hit from the inside
+	bool	Intersect( const XMFLOAT3& origin, const XMFLOAT3& direction, float maxDistance, RayHit& hit, TraversalStats* stats = NULL );
+	
+	// shadow rays: is anything at all hit within maxDistance? the 
+	// search stops at the first sphere hit, in whatever order. 
+	// occluder is the cache of a pixel or a tile - the sphere that
+	// blocked its previous ray (start with NO_OBJECT) is tested 
+	// before the tree, and it's replaced by a new one when found.
+	// neighbouring shadow rays are mostly blocked by the same sphere
+	bool	Occluded( const XMFLOAT3& origin, const XMFLOAT3& direction, float maxDistance, UINT& occluder, TraversalStats* stats = NULL );
+	
+	// the same for a packet of up to RAY_PACKET_SIZE rays traversing
+	// the tree together; a node is visited if any ray still searching
+	// hits its box. hits must hold what was found so far (at least
+	// sphere set to NO_OBJECT), only closer spheres replace it.
+	// any hit rays stop searching at their first hit, and test the
+	// packet's occluder first, if it's given (see Occluded)
+	void	IntersectPacket( const RayQuery* rays, UINT count, RayHit* hits, UINT* occluder = NULL, TraversalStats* stats = NULL );
+	
+	UINT	GetNodeCount();
+	UINT	size();
 };
 
-// represents a vertex in the 3d space
-// with defined color and normal;
-struct	Vertex
+// //////////////////////////////////////////////
+// 
+// RAY QUERY CLASS
+// 
+// /////////////////////////////////////////
+
+// runs batches of ray queries against the spheres and the floor,
+// in the background. rays submitted during a frame are started by
+// Kick, usually at its end, and their results are read the next 
+// frame. Kick refits (or builds) the class' own SphereBVH from 
+// the Space, so Space may change while the rays are traced.
+// rays are grouped into packets of RAY_PACKET_SIZE in order of 
+// submission, so rays going the same way should be submitted 
+// together. packets are traced in parallel by a JobSystem of 
+// the class' own, run by a dispatcher thread
+class RayQueries
 {
-	XMFLOAT3	Pos;
-	XMFLOAT3	Norm;
-	XMFLOAT4	Color;
+	std::vector< RayQuery >		submitted;		// waiting for the next Kick
+	std::vector< RayQuery >		running;		// being traced
+	std::vector< RayHit >		results[ 2 ];	// by the parity of the batch
+	TraversalStats				stats[ 2 ];		// the same
+	UINT						batch;			// number of batches kicked so far
+	
+	SphereBVH					bvh;
+	FloorDesc					floor;
+	bool						hasFloor;
+	
+	JobSystem					jobs;
+	HANDLE						thread;
+	HANDLE						startEvent;		// set by Kick
+	HANDLE						doneEvent;		// set when the batch is done
+	volatile LONG				quit;
+	
+	static DWORD WINAPI	dispatcherMain( LPVOID param );
+	static void			traceJob( void* queries, UINT begin, UINT end );
+	void				trace( UINT begin, UINT end );
+	
+private:	RayQueries( const RayQueries& );
+			RayQueries&	operator=( const RayQueries& );
+public:
+
+	// workerCount is passed to the JobSystem
+	RayQueries( UINT workerCount = 0 );
+	~RayQueries();
+	
+	// queues rays for the next Kick. returns the index of 
+	// the first of them within the results of that batch
+	UINT	Submit( const RayQuery* rays, UINT count );
+	
+	// waits until the previous batch is done, then starts tracing
+	// the rays submitted since. floor may be NULL (see Mateyko::GetFloor)
+	void	Kick( Space& spa, const FloorDesc* floor );
+	
+	// results of the last kicked batch, in order of submission.
+	// waits until they're ready. they stay valid while the next
+	// batch is traced, until the Kick after it
+	const RayHit*	GetResults( UINT& count );
+	void			Wait();
+	
+	// how much searching the last kicked batch took
+	const TraversalStats&	GetStatistics();
 };
 
-// ////////////////////////////////////////////////
-// ///////////////////////////////////////////////
 // //////////////////////////////////////////////
 // 
-// MATEYKO	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// FLOOR LIGHTMAP CLASS
 // 
 // /////////////////////////////////////////
-// ////////////////////////////////////////
-// ///////////////////////////////////////
 
-// default constructor (and the only one, except copy)
-// of the Mateyko class. it sets all members nullified
-// those members can be set up via InitDevice method
+// ambient occlusion and sky visibility of the floor, baked on
+// the cpu by casting rays from every texel against the spheres.
+// both are fractions of the sky (cosine weighted) not hidden by
+// any sphere; occlusion counts only spheres closer than aoRange
+// (so it gives contact shadows), sky visibility those closer
+// than skyRange. texels span the whole floor rectangle, texel
+// (0, 0) lies at centre - halfLength - halfWidth.
+// Update rebakes only texels some moved sphere could affect, 
+// in parallel if the JobSystem is bound. values are kept as
+// floats for Sample, and as a R8G8 texture (occlusion, sky)
+// uploaded by Upload, only the rows that changed
+class FloorLightmap
+{
+	UINT						resolution;			// texels along each side
+	float						aoRange;
+	float						skyRange;
+	
+	std::vector< XMFLOAT2 >		texels;				// occlusion, sky visibility
+	std::vector< BYTE >			dirty;				// texels to be baked
+	std::vector< UINT >			dirtyTexels;		// the same, as a list
+	std::vector< XMFLOAT4 >		baked;				// spheres as they were at the last bake
+	std::vector< RayQuery >		directions;			// rays of a texel at the floor's centre
+	UINT						uploadBegin;		// rows changed since the last upload
+	UINT						uploadEnd;
+	
+	FloorDesc					floor;
+	bool						hasFloor;
+	SphereBVH					bvh;
+	
+	ID3D10Texture2D*			texture;
+	ID3D10ShaderResourceView*	textureView;
+	std::vector< BYTE >			uploadRows;
+	
+	JobSystem*					pJobs;
+	
+	void		markAll();
+	void		markSphere( const XMFLOAT4& sphere );
+	void		bake( UINT begin, UINT end );
+	static void	bakeJob( void* lightmap, UINT begin, UINT end );
+	
+private:	FloorLightmap( const FloorLightmap& );
+			FloorLightmap&	operator=( const FloorLightmap& );
+public:
 
-Mateyko::Mateyko()
-	:	pd3dDevice( NULL ),
-		pSwapChain( NULL ),
-		pRenderTargetView( NULL ),
-		pInput( NULL ),
-		pCam( NULL ),
-		pSpace( NULL ),
-		pDepthStencil( NULL ),
-		pDepthStencilView( NULL ),
-		oGroundZero( NULL ),
-		FloorTextureRV( NULL ),
-		Width( 0 ),
-		Height( 0 )
-		// note that there's no need for manual initialization
-		// of vector members. therefore they are not mentioned here
-{}
+	FloorLightmap( UINT resolution = 128, float aoRange = 2.0f, float skyRange = 20.0f );
+	~FloorLightmap();
+	
+	// rebakes texels affected by spheres that moved, appeared or
+	// disappeared since the last update (all of them if the floor 
+	// changed). returns the number of texels baked
+	UINT	Update( Space& spa, const FloorDesc& _floor );
+	
+	// copies changed rows into the texture, creating it first if
+	// needed. returns the view to be passed to ShaderInput
+	ID3D10ShaderResourceView*	Upload( ID3D10Device* device );
+	void						ReleaseDevice();
+	
+	// bilinear sample at a point of the floor. x is occlusion, 
+	// y sky visibility. both are 1 if nothing was baked yet
+	XMFLOAT2	Sample( const XMFLOAT3& point );
+	
+	void		BindJobs( JobSystem* jobs );
+	UINT		GetResolution();
+};
 
-// copy constructor of the Mateyko class.
-// it does NOT copy devices, textures or 
-// shader vars. to use copied instance of
-// this class it must be initialazed.
-// it'll still share its cameras, input
-// Space and sets of objects with the 
-// instance it was copied from though.
+// //////////////////////////////////////////////
+// 
+// LIGHT CLUSTERS CLASS
+// 
+// /////////////////////////////////////////
 
-Mateyko::Mateyko( const Mateyko& mat )
-	:	pd3dDevice( NULL ),
-		pSwapChain( NULL ),
-		pRenderTargetView( NULL ),
-		pDepthStencil( NULL ),
-		pDepthStencilView( NULL ),
-		oGroundZero( NULL ),
-		FloorTextureRV( NULL ),
+// point or spot light. it's 48 bytes, three float4s on the gpu
+struct	Light
+{
+	XMFLOAT3	position;
+	float		range;			// light doesn't reach further than that
+	XMFLOAT3	color;			// multiplied by intensity already
+	float		spotCos;		// cosine of spot's half angle, -1 for point lights
+	XMFLOAT3	direction;		// where spot light points, normalized
+	float		spotInnerCos;	// cosine of the angle where spot's edge starts fading
+};
+
+// clustered light culling. view frustum is cut into a grid of
+// LIGHT_CLUSTERS_X x Y tiles on the screen and Z slices in depth
+// (exponentially, so clusters stay more or less cubic). Build
+// finds which lights reach which clusters: a light's bounding
+// sphere is tested against four cluster boxes at once, counted
+// per cluster, then placed, both passes in parallel if the 
+// JobSystem is bound (it's the same counting sort SpatialGrid 
+// does). a pixel then shades only lights of its own cluster.
+// Upload puts the clusters, light indices and lights into
+// buffers for the effect; GetLights gives them to the cpu
+class LightClusters
+{
+	// where a cluster's lights lie in the index list
+	struct Range
+	{
+		UINT	offset;
+		UINT	count;
+	};
+	
+	// cluster boxes in view space, by slice, then row, then column.
+	// x and y are kept apart, four clusters per vector, all clusters
+	// of a slice lie within the same depths
+	std::vector< XMFLOAT4 >		boxMinX, boxMaxX, boxMinY, boxMaxY;
+	float						sliceDepths[ LIGHT_CLUSTERS_Z + 1 ];
+	float						sliceScale;		// slice = log( depth ) * scale + bias
+	float						sliceBias;
+	XMFLOAT4X4					projection;		// clusters were built for that one
+	XMFLOAT4X4					view;
+	
+	const Light*				source;
+	UINT						lightCount;
+	std::vector< float >		centreX;		// bounding spheres of the lights, in view space
+	std::vector< float >		centreY;
+	std::vector< float >		centreZ;
+	std::vector< float >		radii;
+	std::vector< LONG >			counts;			// counters while building, then cursors
+	std::vector< Range >		ranges;
+	std::vector< UINT >			indices;
+	bool						placing;		// second pass of Build
+	
+	// gpu copies
+	ID3D10Buffer*				rangeBuffer;
+	ID3D10Buffer*				indexBuffer;
+	ID3D10Buffer*				lightBuffer;
+	ID3D10ShaderResourceView*	rangeView;
+	ID3D10ShaderResourceView*	indexView;
+	ID3D10ShaderResourceView*	lightView;
+	UINT						indexCapacity;
+	UINT						lightCapacity;
+	
+	JobSystem*					pJobs;
+	
+	void		buildClusters();
+	UINT		sliceOf( float depth );
+	void		binLights( UINT begin, UINT end );
+	static void	binJob( void* clusters, UINT begin, UINT end );
+	
+private:	LightClusters( const LightClusters& );
+			LightClusters&	operator=( const LightClusters& );
+public:
+
+	LightClusters();
+	~LightClusters();
+	
+	// bins the lights into clusters of camera's view frustum
+	void	Build( const Light* lights, UINT count, Camera* cam );
+	
+	// copies everything into the buffers, which only grow. false if
+	// they couldn't be created. views below are valid afterwards
+	bool	Upload( ID3D10Device* device );
+	void	ReleaseDevice();
+	
+	ID3D10ShaderResourceView*	GetRangeView();		// offset and count of every cluster (uint2)
+	ID3D10ShaderResourceView*	GetIndexView();		// light indices of all clusters (uint)
+	ID3D10ShaderResourceView*	GetLightView();		// the lights (three float4s each)
+	
+	// lights that may reach a point in world space.
+	// indices point into the array passed to Build
+	UINT	GetLights( const XMFLOAT3& point, const UINT*& lights );
+	
+	// scale and bias of the slices, and the number of lights
+	void	GetSliceParams( float& scale, float& bias );
+	UINT	GetLightCount();
+	UINT	GetIndexCount();
+	
+	void	BindJobs( JobSystem* jobs );
+};
+
+// //////////////////////////////////////////////
+// 
+// SKY LIGHT CLASS
+// 
+// /////////////////////////////////////////
+
+// radiance of the sky seen in a direction (normalized)
+typedef XMFLOAT3	( *SkyFunc )( const XMFLOAT3& direction, void* param );
+
+// diffuse light of the sky, as nine spherical harmonic coefficients.
+// the sky is projected onto them once, whenever it changes (see 
+// Update), with the cosine lobe folded in, so the light reaching 
+// a surface of any normal is a short polynomial of the normal's 
+// coordinates instead of many rays. the same polynomial is 
+// evaluated by the cpu (Irradiance) and by the shaders (SkySH):
+//
+//	c0 + c1 y + c2 z + c3 x + c4 xy + c5 yz + c6 ( 3 z*z - 1 ) + c7 xz + c8 ( x*x - y*y )
+//
+// result is what a white diffuse surface reflects, so a sky of
+// the same radiance everywhere gives that radiance back. sky 
+// brightness and occlusion are still applied on top of it
+class SkyLight
+{
+	SkyFunc		function;			// NULL for the built-in gradient
+	void*		param;
+	XMFLOAT3	zenith;
+	XMFLOAT3	horizon;
+	XMFLOAT3	ground;
+	
+	XMFLOAT4	coefficients[ 9 ];	// rgb, one per row of the polynomial above
+	bool		changed;
+	UINT		version;			// projections done so far
+	
+	static XMFLOAT3	gradient( const XMFLOAT3& direction, void* sky );
+	
+public:
+
+	// copy-constructor, destructor and assigment operator
+	// may be auto-generated. starts with a blue gradient
+	// much like the color the back buffer is cleared with
+	SkyLight();
+	
+	// a sky going from zenith to horizon above, and from
+	// horizon to ground below
+	void	SetGradient( const XMFLOAT3& zenith, const XMFLOAT3& horizon, const XMFLOAT3& ground );
+	
+	// any other sky, e.g. sampled from an environment map.
+	// call Invalidate whenever what it returns changes
+	void	SetFunction( SkyFunc function, void* param );
+	void	Invalidate();
+	
+	// projects the sky if it changed since. true if it did
+	bool	Update();
+	
+	// light reflected by a white diffuse surface facing normal
+	// (normalized). rgb in xyz, w is undefined
+	XMVECTOR	Irradiance( FXMVECTOR normal ) const;
+	
+	const XMFLOAT4*	GetCoefficients() const;	// nine of them, as the shaders get them
+	UINT			GetVersion() const;
+};
+
+// //////////////////////////////////////////////
+// 
+// COLOR TABLE CLASS
+// 
+// /////////////////////////////////////////
+
+// formats colors may be stored in by the ColorTable. the packed
+// ones lose some precision (8 or 10 bits per channel, alpha of
+// RGB10A2 only has 4 levels), but take a quarter of the memory
+enum ColorFormat
+{
+	COLOR_RGBA8,			// 4 bytes
+	COLOR_RGB10A2,			// 4 bytes
+	COLOR_FLOAT				// 16 bytes, as XMFLOAT4
+};
+
+// colors of all the objects, packed the way the shaders read them 
+// from a buffer (the hardware unpacks them into floats). changes 
+// widen a single dirty range, and Upload sends only that range, so
+// recoloring a part of the scene costs as much as the part does.
+// colors are kept under the same indices as Mateyko's objects
+// (see Mateyko::BindColorTable, which keeps them in step)
+class ColorTable
+{
+	ColorFormat					format;
+	UINT						stride;				// bytes per color
+	std::vector< BYTE >			colors;
+	UINT						count;
+	UINT						dirtyBegin, dirtyEnd;	// empty if begin >= end
+	
+	// the buffer on the gpu
+	ID3D10Buffer*				buffer;
+	ID3D10ShaderResourceView*	view;
+	UINT						capacity;			// in colors
+	
+	void		touch( UINT begin, UINT end );
+	void		scatter( const UINT* indices, const XMFLOAT4* colors, UINT count, bool gather );
+	
+	// copying would share the gpu buffer, so it's disabled
+private:	ColorTable( const ColorTable& );
+			ColorTable&	operator=( const ColorTable& );
+public:
+
+	ColorTable( ColorFormat format = COLOR_RGBA8 );
+	~ColorTable();
+	
+	// changing the format repacks all the colors, and 
+	// recreates the buffer with the next upload
+	void		SetFormat( ColorFormat format );
+	ColorFormat	GetFormat();
+	
+	// new colors are transparent black until they're set.
+	// Erase moves the colors after index one place back
+	void		Resize( UINT count );
+	void		Erase( UINT index );
+	
+	// Set writes count colors from first on, Scatter colors[ i ] to
+	// the index indices[ i ]. Gather is the same, but takes the color 
+	// of source[ indices[ i ] ] instead, for colors written elsewhere.
+	// whatever doesn't fit in the table is skipped
+	void		Set( UINT first, const XMFLOAT4* colors, UINT count );
+	void		Scatter( const UINT* indices, const XMFLOAT4* colors, UINT count );
+	void		Gather( const UINT* indices, const XMFLOAT4* source, UINT count );
+	XMFLOAT4	Get( UINT index );
+	
+	// sends the dirty range into the buffer, or the whole table if 
+	// the buffer had to be (re)created. false if that failed
+	bool		Upload( ID3D10Device* device );
+	void		ReleaseDevice();
+	
+	ID3D10ShaderResourceView*	GetView();			// colors in the table's format, one element each
+	UINT		GetDirtyCount();					// colors the next Upload sends
+	UINT		size();
+};
+
+// //////////////////////////////////////////////
+// 
+// SPACE CLASS
+// 
+// /////////////////////////////////////////
+
+// space class keeps track of where the objects 
+// of the scene are. for now every object is a sphere,
+// so the class stores its centre and radius, packed
+// in a single XMFLOAT4 (xyz - centre, w - radius),
+// the same way the shader expects to get them.
+// sphere with index i belongs to the object with
+// index i of the Mateyko class, so both should be
+// filled and emptied together.
+// spheres may also be attached to nodes of a transform
+// hierarchy. every node has a local transform, relative
+// to its parent, and a sphere attached to a node is 
+// placed in the world position of that node. moving
+// a node moves its whole subtree.
+class Space
+{
+	// centres and radii of the spheres
+	std::vector< XMFLOAT4 >		spheres;
+	std::vector< UINT >			sphereNodes;	// node id of every sphere, NO_NODE if not attached
+	std::vector< float >		meshRadii;		// radii spheres were inserted with (and meshes built for)
+	
+	// transform hierarchy. nodes are identified by ids, which
+	// never change, but their data is stored by position, in
+	// preorder - parent always comes before its children, and
+	// every subtree takes a continuous range of positions.
+	// that way world transforms are evaluated in one pass,
+	// and subtrees not overlapping each other are independent
+	std::vector< UINT >			nodeParentIds;	// by id. NO_NODE for roots, REMOVED_NODE for removed nodes
+	std::vector< UINT >			nodePositions;	// by id
+	std::vector< UINT >			nodeIds;		// by position, the rest as well
+	std::vector< UINT >			nodeParents;	// position of the parent
+	std::vector< UINT >			nodeEnds;		// position right after the node's subtree
+	std::vector< UINT >			nodeSpheres;	// attached sphere, NO_NODE if none
+	std::vector< BYTE >			nodeDirty;
+	std::vector< XMFLOAT4X4 >	nodeLocals;
+	std::vector< XMFLOAT4X4 >	nodeWorlds;
+	
+	// positions of nodes whose local transform changed since
+	// the last update, and the subtrees to evaluate during it.
+	// when nodes are added in a way that breaks the preorder
+	// (or removed), the layout is rebuilt on the next update
+	std::vector< UINT >			dirtyNodes;
+	std::vector< UINT >			updateTasks;
+	std::vector< UINT >			splitTasks;
+	bool						layoutDirty;
+	
+	// optional. records all changes of the spheres
+	SceneJournal*				pJournal;
+	
+	// optional. evaluates the hierarchy in parallel
+	JobSystem*					pJobs;
+	
+	// keeps spheres sorted between the overlap queries
+	SweepAndPrune				broadphase;
+	
+	void		rebuildLayout();
+	bool		isNode( UINT node );				// exists and isn't removed
+	void		evaluateNode( UINT position );
+	void		evaluateNodes( UINT begin, UINT end );
+	static void	evaluateJob( void* space, UINT begin, UINT end );
+	
+public:
+
+	// constructor. copy-constructor, destructor and
+	// assigment operator may be auto-generated, as 
+	// the class holds nothing but std::vectors
+	Space();
+	
+	// insert and remove methods. indices behave
+	// the same as those of Mateyko's objects vector
+	void		InsertSphere( XMFLOAT3 centre, float radius );
+	void		RemoveSphere( UINT sNum );
+	void		RemoveAll();
+	
+	// replaces all spheres with the ones from an array
+	// (xyz - centre, w - radius, same as GetShaderPositionArray).
+	// meshes are assumed to be built for those radii, unless
+	// their own radii are given (see GetMeshRadii)
+	void		SetSpheres( const XMFLOAT4* _spheres, UINT count, const float* _meshRadii = NULL );
+	
+	// setters and getters
+	void		SetPosition( UINT sNum, XMFLOAT3 centre );
+	void		SetSphere( UINT sNum, XMFLOAT4 sphere );		// centre and radius at once
+	XMFLOAT4	GetSphere( UINT sNum );
+	
+	// spheres written straight into GetShaderPositionArray 
+	// must be announced, otherwise the journal won't see them
+	void		SpheresWritten( const UINT* indices, UINT count );
+	
+	// methods used by the PaintScene method of a Mateyko class.
+	// GetShaderPositionArray returns the array of all spheres
+	// ready to be passed to shaders, GetWorldPosition returns
+	// a world matrix of a desired object. if the radius has 
+	// changed since the sphere was inserted, the matrix
+	// scales the mesh accordingly
+	UINT		size();
+	float*		GetShaderPositionArray();
+	const float*	GetMeshRadii();								// radii the spheres were inserted with
+	XMMATRIX	GetWorldPosition( UINT sNum );
+	
+	// binds the journal, the same way it's done with Mateyko
+	void		BindJournal( SceneJournal* jou );
+	void		BindJobs( JobSystem* jobs );
+	
+	// transform hierarchy. CreateNode returns the id of a new node,
+	// or NO_NODE if the parent doesn't exist. parent may be NO_NODE.
+	// removing a node removes its whole subtree, spheres attached
+	// to it stay where they were. ids of removed (or never created)
+	// nodes are ignored by all the methods. attached spheres are
+	// moved by UpdateTransforms only (called by Mateyko every frame), 
+	// and only those whose nodes, or their ancestors, have changed
+	UINT		CreateNode( UINT parent, CXMMATRIX local );
+	void		RemoveNode( UINT node );
+	void		SetLocal( UINT node, CXMMATRIX local );
+	XMMATRIX	GetLocal( UINT node );
+	XMMATRIX	GetWorld( UINT node );						// as of the last update
+	void		AttachSphere( UINT sNum, UINT node );		// node may be NO_NODE, to detach
+	void		UpdateTransforms();
+	UINT		GetNodeCount();								// nodes alive
+	
+	// finds all the pairs of overlapping spheres. meant to be
+	// called every frame, the cost is lowest when spheres move
+	// a little between calls. vector is valid until the next call
+	const std::vector< SpherePair >&	FindOverlaps();
+};
+
+// //////////////////////////////////////////////
+// 
+// OBJECT3D CLASS
+// 
+// /////////////////////////////////////////
+
+// turns vertices of some compact format back into full Vertex structs
+// (see VertexFormat::Decode). Object3D keeps one, so the meshes it reads 
+// back look the same whatever format they are stored on the gpu in
+typedef void	( *VertexDecoder )( const void* vertices, UINT count, Vertex* out );
+
+// input layouts of a single vertex format, created on demand for
+// every input signature it's drawn with. a layout matches only the
+// signature it was created for, and passes of different techniques
+// may expect different ones, so a layout made for the first pass
+// of one technique can't be used for all of them
+class InputLayoutCache
+{
+	const D3D10_INPUT_ELEMENT_DESC*										elements;
+	UINT																count;
+	std::vector< std::pair< const void*, ID3D10InputLayout* > >		layouts;	// by the signature
+	
+public:
+
+	InputLayoutCache( const D3D10_INPUT_ELEMENT_DESC* _elements, UINT _count );
+	~InputLayoutCache();
+private:	InputLayoutCache( const InputLayoutCache& );
+			InputLayoutCache&	operator=( const InputLayoutCache& );
+public:
+
+	// layout for the input signature of the pass. NULL if
+	// it can't be created (the failure is reported once)
+	ID3D10InputLayout*	Get( ID3D10Device* device, ID3D10EffectPass* pass );
+};
+
+class Object3D
+{
+	// buffer pointers for the drawing device
+	// the initial idea was to keep them as shared_ptrs
+	// but IUnknown interface from which buffers inherit
+	// provide similar features.
+	ID3D10Buffer*		vBuffer;
+	ID3D10Buffer*		iBuffer;
+
+	// size of the buffers, and its position
+	// within the memory chunk passed to shdaers
+	UINT				iSize, vSize;
+	UINT				stride, offset;
+	
+	// layouts and decoder of vertices other than the Vertex struct.
+	// both are NULL for the Vertex ones, which are drawn with
+	// whatever layout the ShaderInput has set. copies of the 
+	// object share the layouts, the same way they share buffers
+	std::shared_ptr< InputLayoutCache >	layouts;
+	VertexDecoder		decode;
+	
+	// set for the meshes of spheres (see Mateyko::formSphere).
+	// only those may be drawn as impostors, the rest isn't round
+	bool				sphere;
+	
+private:	Object3D(); // yep everytime you call it, linker shouts
+public:
+
+	// Object3D construction requires pointer to the device
+	// so it is impossible for the default construction to work
+	// properly. therefore default constructor was set private
+	// to avoid calling it
+
+	Object3D( ID3D10Device*	_device, /* pointer to the device that will do the hard work */
+		void* vertices, DWORD* indices, UINT _vSize, UINT _iSize,
+		UINT _stride = 0, const D3D10_INPUT_ELEMENT_DESC* _elements = NULL, UINT _elementCount = 0, VertexDecoder _decode = NULL );
+	Object3D( const Object3D& );
+	Object3D&	operator=( const Object3D& );
+	
+	// destructor:
+	~Object3D();
+	
+#ifdef HAS_MOVE_SEMANTICS
+	// if compiler we use employ move semantics define
+	// move constructor and move operator
+	Object3D( Object3D&& );
+	Object3D&	operator=( Object3D&& );
+#endif
+
+	// nice methods:
+	void	Draw( ID3D10Device* device, ID3D10EffectTechnique* tech );
+	
+	// copies the content of both buffers back from the device.
+	// it's slow, as it waits for the gpu, so use it only for
+	// tasks like saving the scene. vertices always come back
+	// as Vertex structs, whatever format the object draws them in
+	HRESULT	ReadBack( ID3D10Device* device, std::vector< BYTE >& vertices, std::vector< DWORD >& indices );
+	
+	// getters
+	UINT			GetVertexCount();
+	UINT			GetIndexCount();
+	UINT			GetStride();						// size of a vertex in the vertex buffer
+	ID3D10Buffer*	GetVertexBuffer();
+	
+	// marks the mesh as a sphere, centred at 0 with the radius of
+	// its Space's sphere. copies of the object are spheres too
+	void			MarkSphere();
+	bool			IsSphere();
+};
+
+// //////////////////////////////////////////////
+// 
+// SCENE GENERATOR CLASS
+// 
+// /////////////////////////////////////////
+
+// the ways scene generator may scatter spheres around
+enum SceneDistribution
+{
+	SCENE_UNIFORM,			// anywhere within the scene's extent
+	SCENE_CLUSTERED,		// around a few randomly chosen cluster centres
+	SCENE_GRID				// on a regular cubic grid
+};
+
+// description of a scene that SceneGenerator should produce.
+// the default constructor sets reasonable values, so usually
+// only seed, count and distribution need to be changed
+struct SceneDesc
+{
+	SceneDesc();
+	
+	UINT				seed;						// same seed always gives the same scene
+	UINT				count;						// number of spheres
+	SceneDistribution	distribution;
+	
+	float				extent;						// spheres are placed within [-extent, extent] on xz plane
+	float				height;						// and within [0, height] along y axis
+	float				minRadius, maxRadius;		
+	UINT				radiusLevels;				// number of different radii between min and max
+	UINT				minMeridians, maxMeridians;	// tessellation ranges
+	UINT				minParallels, maxParallels;
+	UINT				tessellationLevels;			// number of different tessellations between min and max
+	UINT				clusters;					// used by SCENE_CLUSTERED only
+	float				clusterSpread;				// how far from its centre sphere may be placed
+	bool				compactVertices;			// spheres are built of CompactVertex structs
+	
+	float				floorSize;					// zero means no floor
+	LPCWSTR				floorTexture;				// NULL means no texture
+};
+
+// scene generator populates Mateyko and Space with spheres
+// of varied radius, tessellation and color. it uses its
+// own pseudo random generator instead of rand() or <random>
+// distributions, so a given seed produces exactly the same
+// scene on every machine and every standard library.
+// spheres of the same radius and tessellation share
+// their buffers (see Object3D's copy constructor), so
+// scenes of million objects do not need million meshes.
+class SceneGenerator
+{
+	SceneDesc	desc;
+	UINT		state;			// state of xorshift generator
+	
+	// random numbers helpers
+	UINT		NextUInt();
+	float		NextFloat( float lo, float hi );
+	UINT		NextLevel( UINT levels );
+	
+public:
+
+	SceneGenerator( const SceneDesc& _desc );
+	
+	// removes everything from both Mateyko and Space
+	// and fills them anew. Mateyko must be initialized
+	// via InitDevice before calling this method
+	void		Populate( Mateyko& mat, Space& spa );
+};
+
+// //////////////////////////////////////////////
+// 
+// SCENE JOURNAL AND REPLICATION CLASSES
+// 
+// /////////////////////////////////////////
+
+// all the values controling the shading at once. used
+// to save and restore the state of ShaderInput class
+struct	ShadingControls
+{
+	float	gamma;
+	float	brightness;
+	float	reflectance;
+	float	skyBrightness;
+	float	diffusePower;
+	int		channel;
+};
+
+// codes of the records stored in the journal
+enum JournalOp
+{
+	JOURNAL_DEFINE_MESH = 1,		// mesh id, stride, vertex and index count, vertices, delta encoded indices
+	JOURNAL_INSERT_OBJECT,			// mesh id, color
+	JOURNAL_REMOVE_OBJECT,			// object index
+	JOURNAL_REMOVE_ALL,
+	JOURNAL_COLOR,					// object index, color
+	JOURNAL_FLOOR,					// mesh id
+	JOURNAL_SPHERE_INSERT,			// centre and radius
+	JOURNAL_SPHERE_REMOVE,			// sphere index
+	JOURNAL_SPHERE_MOVE,			// sphere index, centre
+	JOURNAL_SPHERES,				// count, all spheres, their mesh radii
+	JOURNAL_CAMERA,					// eye, at, up, field of view
+	JOURNAL_SHADING,				// shading control values
+	JOURNAL_SNAPSHOT,				// name of the snapshot file to load
+	JOURNAL_SPHERE_SET,				// sphere index, centre and radius
+	JOURNAL_MATERIAL				// object index, material
+};
+
+// scene journal records changes of the scene as compact
+// records, so they can be sent to other processes showing
+// the same scene. Mateyko and Space record their changes
+// themselves once the journal is bound to them. every record
+// is prefixed with its length, integers are stored as 
+// variable length numbers, and indices of the meshes are
+// delta encoded. meshes are sent only once, then objects
+// refer to them by id, so copying an object costs just
+// a few bytes. size of a record depends only on the size
+// of the change, never on the size of the scene.
+class SceneJournal
+{
+	std::vector< BYTE >					records;		// finished records waiting to be sent
+	std::vector< BYTE >					current;		// the record being built
+	
+	// meshes already defined in the journal, by their vertex 
+	// buffer. buffers are AddRef'ed while they're in the map,
+	// so the address can't be reused by another buffer
+	std::map< ID3D10Buffer*, DWORD >	sentMeshes;
+	DWORD								nextMesh;
+	
+	// last recorded camera and shading values. they're 
+	// checked every frame but recorded only if changed
+	bool								hasCamera;
+	bool								hasShading;
+	float								lastCamera[ 10 ];
+	ShadingControls						lastShading;
+	
+	void	Begin( BYTE op );
+	void	End();
+	DWORD	MeshOf( ID3D10Device*, Object3D*, const void* verts, const DWORD* inds );
+	
+public:
+
+	// constructor and destructor. copying a journal makes no sense,
+	// so copy constructor and assigment operator are disabled
+	SceneJournal();
+	~SceneJournal();
+private:	SceneJournal( const SceneJournal& );
+			SceneJournal&	operator=( const SceneJournal& );
+public:
+
+	// recording methods called by Mateyko. verts and inds
+	// may be NULL, then mesh is read back from the device
+	// (if it wasn't sent already)
+	void	RecordInsert( ID3D10Device*, Object3D*, const void* verts, const DWORD* inds, XMFLOAT4 color );
+	void	RecordRemove( UINT oNum );
+	void	RecordRemoveAll();
+	void	RecordColor( UINT oNum, XMFLOAT4 color );
+	void	RecordMaterial( UINT oNum, const Material& material );
+	void	RecordFloor( ID3D10Device*, Object3D*, const void* verts, const DWORD* inds );
+	void	RecordCamera( Camera* );
+	void	RecordShading( ShaderInput* );
+	
+	// recording methods called by Space
+	void	RecordSphereInsert( XMFLOAT4 sphere );
+	void	RecordSphereRemove( UINT sNum );
+	void	RecordSphereMove( UINT sNum, XMFLOAT3 centre );
+	void	RecordSphereSet( UINT sNum, XMFLOAT4 sphere );
+	void	RecordSpheres( const XMFLOAT4* spheres, const float* meshRadii, UINT count );
+	
+	// tells the receiver to load the whole scene from a
+	// snapshot file. since that scene may contain meshes
+	// the receiver has never seen, the journal forgets
+	// all the meshes it sent and will send them again
+	void	RecordSnapshot( LPCWSTR szFileName );
+	void	ForgetMeshes();
+	
+	// recorded data. Clear removes records, but keeps 
+	// the memory, so recording doesn't allocate every frame
+	const BYTE*	GetData();
+	UINT		GetSize();
+	void		Clear();
+};
+
+// replication server sends the journal to all the processes
+// subscribed via unix domain socket. it's supposed to be
+// called once per frame, after the scene was changed.
+// processes that subscribe later get the current scene
+// as a snapshot file first, then the changes as usual
+class ReplicationServer
+{
+	SOCKET									listener;
+	std::vector< SOCKET >					subscribers;
+	std::vector< std::vector< BYTE > >		pending;		// bytes subscriber couldn't take yet
+	std::wstring							snapshotFile;
+	UINT									snapshotCount;	// suffix of the next snapshot file
+	
+	void	Send( UINT sub, const BYTE* data, UINT size );
+	
+public:
+
+	ReplicationServer();
+	~ReplicationServer();
+private:	ReplicationServer( const ReplicationServer& );
+			ReplicationServer&	operator=( const ReplicationServer& );
+public:
+
+	// starts listening. snapshot file is where the scene is
+	// saved for new subscribers, so it should be a local file.
+	// every snapshot gets its own copy, named with a number
+	// appended, so a subscriber still reading the previous
+	// one doesn't get it overwritten
+	HRESULT	Start( LPCSTR socketPath, LPCWSTR szSnapshotFile );
+	
+	// sends the journal to all subscribers, accepts the new
+	// ones and clears the journal
+	void	Publish( Mateyko& mat, SceneJournal& journal );
+	UINT	GetSubscriberCount();
+};
+
+// replication client receives the journal from the server
+// and applies it to its own Mateyko, Space, Camera and
+// ShaderInput. any of those but Mateyko may be NULL,
+// then changes meant for them are skipped
+class ReplicationClient
+{
+	SOCKET										sock;
+	std::vector< BYTE >							incoming;		// received bytes, may end with an incomplete record
+	std::vector< std::shared_ptr< Object3D > >	meshes;			// meshes defined by the server, by their id
+	
+	Mateyko*									pMat;
+	Space*										pSpace;
+	Camera*										pCam;
+	ShaderInput*								pInput;
+	
+	bool	ApplyRecord( const BYTE* data, UINT size );
+	
+public:
+
+	ReplicationClient( Mateyko* mat, Space* spa, Camera* cam, ShaderInput* shi );
+	~ReplicationClient();
+private:	ReplicationClient( const ReplicationClient& );
+			ReplicationClient&	operator=( const ReplicationClient& );
+public:
+
+	HRESULT	Connect( LPCSTR socketPath );
+	
+	// receives whatever came from the server and applies
+	// all complete records. never blocks. returns number
+	// of the records applied
+	UINT	Poll();
+};
+
+// //////////////////////////////////////////////
+// 
+// SCENE EDIT QUEUE CLASSES
+// 
+// /////////////////////////////////////////
+
+// kinds of edits that may be queued
+enum SceneEditType
+{
+	EDIT_INSERT,			// adds an object along with its sphere
+	EDIT_REMOVE,			// removes an object along with its sphere
+	EDIT_RECOLOR,			// changes object's color
+	EDIT_TRANSFORM,			// moves object's sphere
+	EDIT_MATERIAL			// changes object's material
+};
+
+// a single edit of the scene. inserted object may be given
+// either as an already created Object3D (which may be shared
+// with other objects) or as vertices and indices, then
+// the object is created by the thread applying the edit
+struct SceneEdit
+{
+	SceneEditType					type;
+	UINT							index;			// object affected by remove, recolor, transform and material
+	XMFLOAT4						color;			// used by insert and recolor
+	XMFLOAT4						sphere;			// centre and radius for insert, centre only for transform
+	Material						material;		// material only
+	std::shared_ptr< Object3D >		object;			// insert only
+	std::vector< Vertex >			vertices;		// insert only, if object is NULL
+	std::vector< DWORD >			indices;
+};
+
+// batch of edits that should become visible at once. producer
+// fills it at will, then submits the whole batch to the queue.
+// applying thread either applies all of the batch or nothing
+class SceneEditBatch
+{
+	friend class SceneEditQueue;
+	
+	std::vector< SceneEdit >		edits;
+	
+public:
+
+	// all the methods just append an edit to the batch
+	void	Insert( std::shared_ptr< Object3D > o3ptr, XMFLOAT4 color, XMFLOAT3 centre, float radius );
+	void	Insert( const Vertex* verts, const DWORD* inds, UINT vSize, UINT iSize, XMFLOAT4 color, XMFLOAT3 centre, float radius );
+	void	Remove( UINT oNum );
+	void	Recolor( UINT oNum, XMFLOAT4 color );
+	void	Transform( UINT oNum, XMFLOAT3 centre );
+	void	SetMaterial( UINT oNum, const Material& material );
+	
+	UINT	size();
+	void	clear();
+};
+
+// multiple producers, single consumer queue of edit batches.
+// Mateyko's vectors aren't thread safe, so other threads
+// must not touch them while the scene is being painted.
+// instead they submit their edits here, and Mateyko applies
+// them at the beginning of the PaintScene method.
+// the queue is lock free: submitting is a single interlocked
+// exchange, so producers never wait for each other nor for
+// the render thread, and render thread never waits for
+// producers. if a producer is caught in the middle of 
+// a submit, its batch simply waits for the next frame.
+class SceneEditQueue
+{
+	// node of the intrusive linked list. head is where 
+	// producers push, tail is where the consumer pops.
+	// stub node keeps the list never empty
+	struct Node
+	{
+		Node* volatile				next;
+		std::vector< SceneEdit >	edits;
+	};
+	
+	Node* volatile					head;
+	Node*							tail;
+	Node							stub;
+	
+	void	Push( Node* node );
+	Node*	Pop();
+	
+public:
+
+	SceneEditQueue();
+	~SceneEditQueue();
+private:	SceneEditQueue( const SceneEditQueue& );
+			SceneEditQueue&	operator=( const SceneEditQueue& );
+public:
+
+	// may be called by any thread. takes the content of the 
+	// batch, leaving it empty and ready for the next edits
+	void	Submit( SceneEditBatch& batch );
+	
+	// must be called by one thread only (the one painting the
+	// scene). applies all batches submitted so far, returns
+	// the number of edits applied
+	UINT	ApplyPending( Mateyko& mat, Space* spa );
+};
+
+// //////////////////////////////////////////////
+// 
+// SCENE VERSION CLASSES
+// 
+// /////////////////////////////////////////
+
+// persistent (immutable) array. it behaves like a value - copying
+// it is as cheap as copying a single shared_ptr, and modifying a copy
+// never affects other copies. elements are stored in a tree of small
+// fixed-size nodes, and the tree is never changed once built. setting
+// an element copies only the nodes on the way from the root to that 
+// element (a few dozen pointers), every other node is shared with 
+// the previous version. therefore the cost of an edit doesn't depend
+// on the size of the array, and old versions stay valid as long
+// as anybody holds them
+template< class T >
+class PersistentArray
+{
+	// every node has 32 slots. inner nodes point to other nodes,
+	// leaves keep the elements themselves. which one is which
+	// is known from the node's level, so nodes carry no type info
+	enum { BITS = 5, WIDTH = 1 << BITS, MASK = WIDTH - 1 };
+	
+	struct Leaf		{	T								items[ WIDTH ];		};
+	struct Branch	{	std::shared_ptr< const void >	children[ WIDTH ];	};
+	
+	std::shared_ptr< const void >	root;
+	UINT							count;
+	UINT							shift;		// level of the root node, in bits of the index
+	
+	static std::shared_ptr< const void >	setIn( const std::shared_ptr< const void >& node, UINT level, UINT index, const T& value );
+	
+public:
+
+	// empty array. copy-constructor, destructor and assigment
+	// operator may be auto-generated, they only deal with root
+	PersistentArray();
+	
+	// all the modifying methods create new nodes on their path,
+	// leaving the old ones (and the arrays holding them) intact
+	void		Set( UINT index, const T& value );
+	void		PushBack( const T& value );
+	void		PopBack();
+	void		SwapRemove( UINT index );		// moves the last element into the gap
+	void		Clear();
+	
+	UINT		size() const;
+	const T&	Get( UINT index ) const;
+	
+	// elements of a single leaf lie next to each other, so whole array
+	// may be walked leaf by leaf. returns pointer to the index-th element
+	// and sets length to the number of elements following it in the same leaf
+	const T*	GetRun( UINT index, UINT& length ) const;
+	void		CopyTo( T* dest ) const;
+};
+
+// single version of the scene. objects, colors and spheres
+// of object i are kept at index i of respective arrays, just
+// like in Mateyko and Space. versions are never changed once
+// published, an editor copies the current version (which is
+// cheap), modifies the copy and publishes it as the new one
+struct	SceneVersion
+{
+	SceneVersion()
+		:	number( 0 )	{}
+	
+	// helpers keeping all the arrays in step. removing 
+	// moves the last object into the gap, so it changes
+	// only two elements instead of shifting all of them.
+	// mesh radius is the one the mesh was built for (see
+	// Space::GetMeshRadii), zero if it's the sphere's radius
+	void	Insert( std::shared_ptr< Object3D > o3ptr, XMFLOAT4 color, XMFLOAT3 centre, float radius, const Material& material = Material(), float meshRadius = 0.0f );
+	void	Remove( UINT oNum );
+	
+	PersistentArray< std::shared_ptr< Object3D > >	objects;
+	PersistentArray< XMFLOAT4 >						colors;
+	PersistentArray< Material >						materials;
+	PersistentArray< XMFLOAT4 >						spheres;	// xyz - centre, w - radius
+	PersistentArray< float >						meshRadii;
+	UINT64											number;		// set by the store when published
+};
+
+// keeps the current version of the scene. any number of editors
+// may publish new versions, and a single render thread pins one
+// version for the whole frame. editors are serialized by a lock,
+// but render thread never takes it - pinning is just a pointer
+// read announced through a hazard pointer, so editors know
+// which old version they must not delete yet.
+class SceneVersionStore
+{
+	const SceneVersion* volatile		current;
+	const SceneVersion* volatile		pinned;		// version used by the render thread, or NULL
+	std::vector< const SceneVersion* >	retired;	// old versions waiting to be deleted
+	CRITICAL_SECTION					editLock;
+	
+	void	Reclaim();
+	
+public:
+
+	SceneVersionStore();
+	~SceneVersionStore();
+private:	SceneVersionStore( const SceneVersionStore& );
+			SceneVersionStore&	operator=( const SceneVersionStore& );
+public:
+
+	// editors. Begin locks the store and returns a copy of the current
+	// version, Commit publishes the modified copy and unlocks the store.
+	// every Begin must be followed by exactly one Commit or Cancel
+	SceneVersion	Begin();
+	void			Commit( const SceneVersion& next );
+	void			Cancel();
+	
+	// single edits, each one publishes a new version
+	void	Insert( std::shared_ptr< Object3D > o3ptr, XMFLOAT4 color, XMFLOAT3 centre, float radius );
+	void	Remove( UINT oNum );
+	void	Recolor( UINT oNum, XMFLOAT4 color );
+	void	SetMaterial( UINT oNum, const Material& material );
+	void	Transform( UINT oNum, XMFLOAT3 centre );
+	
+	// publishes the whole content of a Mateyko and Space as a new version
+	void	Capture( Mateyko& mat, Space& spa );
+	
+	// render thread only. the pinned version stays valid until Unpin
+	// (or the next Pin) is called, no matter what editors do meanwhile
+	const SceneVersion*	Pin();
+	void				Unpin();
+};
+
+// //////////////////////////////////////////////
+// 
+// ANIMATION CLASS
+// 
+// /////////////////////////////////////////
+
+// what an animation track changes. position tracks change
+// the centre of object's sphere (value's xyz), scale tracks 
+// its radius (value's x), color tracks object's color
+enum AnimationChannel
+{
+	ANIMATE_POSITION,
+	ANIMATE_SCALE,
+	ANIMATE_COLOR,
+	ANIMATION_CHANNELS
+};
+
+// set of keyframe tracks animating the objects. tracks of every 
+// channel are stored as separate arrays (target, keys, last used 
+// key), and keys of all the tracks lie one after another, so
+// evaluating a channel is a single pass through a few arrays.
+// each key value is a whole XMVECTOR, so interpolating it is
+// a single SIMD lerp. results are written straight into Space's
+// spheres and Mateyko's colors, then announced to both, so their
+// journals record the changes once all the tracks are done.
+// an object may have one track per channel at most, otherwise
+// two threads could be writing to it at once
+class AnimationSet
+{
+	struct Channel
+	{
+		std::vector< UINT >			targets;		// index of the animated object
+		std::vector< UINT >			firstKeys;
+		std::vector< UINT >			keyCounts;
+		std::vector< UINT >			cursors;		// key the track was at last time
+		std::vector< float >		times;			// keys of all the tracks
+		std::vector< XMFLOAT4 >		values;
+	};
+	
+	Channel						channels[ ANIMATION_CHANNELS ];
+	float						duration;			// time of the last key of all tracks
+	
+	// spheres changed by position or scale tracks, sorted and
+	// each one once, so the journal gets a single record for
+	// a sphere no matter how many tracks animate it
+	std::vector< UINT >			animatedSpheres;
+	
+	// evaluation in progress
+	float						time;
+	UINT						channel;
+	XMFLOAT4*					pSpheres;
+	XMFLOAT4*					pColors;
+	UINT						sphereCount;
+	UINT						colorCount;
+	
+	JobSystem*					pJobs;
+	
+	void		evaluateTracks( UINT begin, UINT end );
+	static void	evaluateJob( void* set, UINT begin, UINT end );
+	
+public:
+
+	// copy-constructor, destructor and assigment operator
+	// may be auto-generated, the class holds only vectors
+	AnimationSet();
+	
+	// adds a track of keyCount keys. times must grow. 
+	// returns the number of tracks of that channel
+	UINT	AddTrack( AnimationChannel channel, UINT object, const float* times, const XMFLOAT4* values, UINT keyCount );
+	void	RemoveAll();
+	
+	// sets all the animated values to those at time t. before 
+	// the first key and after the last one tracks hold still.
+	// tracks run in parallel if the JobSystem is bound
+	void	Evaluate( float t, Space& spa, Mateyko& mat );
+	
+	void	BindJobs( JobSystem* jobs );
+	UINT	GetTrackCount();
+	float	GetDuration();
+};
+
+// //////////////////////////////////////////////
+// 
+// PARTICLE SYSTEM CLASS
+// 
+// /////////////////////////////////////////
+
+// instance data of a single particle, as read by the
+// RenderParticles technique (see particle_desc)
+struct	ParticleInstance
+{
+	XMFLOAT4	Sphere;			// xyz - centre, w - radius
+	XMFLOAT4	Color;
+};
+
+// swarm of small balls, far too many to make an Object3D of
+// each. every attribute is kept in its own array, so moving
+// particles is a few SIMD operations on four of them at once.
+// all the particles share one sphere mesh, created once, and
+// are drawn with a single instanced draw call. only those in
+// camera's frustum get into the instance buffer.
+// the effect file must provide RenderParticles technique, taking
+// mesh vertices in the first slot and ParticleInstances in the second
+class ParticleSystem
+{
+	std::vector< float >		posX, posY, posZ;
+	std::vector< float >		velX, velY, velZ;
+	std::vector< float >		lifetimes;			// seconds left to live
+	std::vector< float >		radii;
+	std::vector< XMFLOAT4 >		colors;
+	
+	// instances of the visible particles. every batch is culled
+	// into the same indices its particles have, and the number
+	// of visible ones is kept per batch. batches are then
+	// copied into the instance buffer one after another
+	std::vector< ParticleInstance >	instances;
+	std::vector< UINT >				batchVisible;
+	UINT							visible;
+	
+	XMFLOAT3					gravity;
+	UINT						seed;				// for the spread of emitted particles
+	
+	// update or culling in progress
+	float						step;
+	XMFLOAT4					planes[ 6 ];
+	XMFLOAT4X4					planeMatrices[ 2 ];	// three planes each, see Cull
+	
+	// the shared mesh and the instance buffer
+	ID3D10Device*				pd3dDevice;
+	ID3D10Buffer*				meshVertices;
+	ID3D10Buffer*				meshIndices;
+	ID3D10Buffer*				instanceBuffer;
+	ID3D10InputLayout*			Layout;
+	ID3D10EffectTechnique*		Technique;
+	UINT						meshIndexCount;
+	UINT						instanceCapacity;	// in instances
+	
+	JobSystem*					pJobs;
+	
+	void		integrate( UINT begin, UINT end );
+	void		cull( UINT begin, UINT end );
+	void		removeDead();
+	static void	integrateJob( void* system, UINT begin, UINT end );
+	static void	cullJob( void* system, UINT begin, UINT end );
+	
+	// copying would share the gpu buffers, so it's disabled
+private:	ParticleSystem( const ParticleSystem& );
+			ParticleSystem&	operator=( const ParticleSystem& );
+public:
+
+	ParticleSystem();
+	~ParticleSystem();
+	
+	// creates the shared sphere mesh of radius 1 and the input
+	// layout for the RenderParticles technique of shader's effect.
+	// particles can be updated and culled without it
+	HRESULT	InitDevice( ID3D10Device* device, ShaderInput* shi, UINT meridians, UINT parallels );
+	void	ReleaseDevice();
+	
+	// emits count particles at origin, with velocities spread 
+	// randomly by up to spread around velocity. returns the 
+	// number of particles alive. emitting more than reserved 
+	// reallocates, so it's better not done in the middle of a frame
+	UINT	Emit( UINT count, XMFLOAT3 origin, XMFLOAT3 velocity, float spread, float lifetime, float radius, XMFLOAT4 color );
+	void	Reserve( UINT capacity );
+	void	RemoveAll();
+	
+	// moves all the particles by dt seconds and removes the dead ones
+	void	Update( float dt );
+	
+	// Cull gathers the particles visible by the camera, Draw 
+	// culls them and then draws them. both return the number
+	// of visible particles. Draw expects the camera matrices
+	// to be already passed to the effect (see PaintScene)
+	UINT	Cull( Camera* cam );
+	UINT	Draw( Camera* cam );
+	
+	void	SetGravity( XMFLOAT3 g );
+	void	BindJobs( JobSystem* jobs );
+	UINT	size();
+};
+
+// //////////////////////////////////////////////
+// 
+// SPHERE IMPOSTORS CLASS
+// 
+// /////////////////////////////////////////
+
+// corner of the quad impostors are drawn with, 
+// from (-1,-1) to (1,1) (see impostor_desc)
+struct	ImpostorCorner
+{
+	XMFLOAT2	Corner;
+};
+
+// instance data of a single impostor, as read by the RenderImpostors
+// technique. like a particle, but with the object's material
+struct	ImpostorInstance
+{
+	XMFLOAT4	Sphere;			// xyz - centre, w - radius
+	XMFLOAT4	Color;
+	XMFLOAT4	Material;		// reflectance, diffuse, brightness, sky (see Material)
+};
+
+// spheres of the scene that are too small on the screen to be
+// worth their meshes. each of them is drawn as a quad facing the
+// camera instead, all of them in a single instanced draw of the
+// RenderImpostors technique. its pixel shader intersects the view
+// ray with the sphere, so depth and normal are exact and impostors
+// look the same as meshes do, only rounder. Select picks them
+// every frame, and PaintScene skips the meshes of those picked
+class SphereImpostors
+{
+	float						threshold;			// in pixels, diameter of the biggest impostor
+	
+	// selection in progress. spheres are picked into the same
+	// indices they have, per batch, like particles are culled
+	const XMFLOAT4*				spheres;
+	const XMFLOAT4*				colors;
+	const Material*				materials;
+	const BYTE*					eligible;
+	UINT						count;
+	XMFLOAT4					planes[ 6 ];
+	XMFLOAT3					eye;
+	float						scale;				// threshold over pixels per unit at the distance of 1
+	
+	std::vector< BYTE >			flags;				// 1 - sphere is an impostor this frame
+	std::vector< ImpostorInstance >	instances;
+	std::vector< UINT >			batchVisible;
+	UINT						visible;
+	
+	// the quad and the instance buffer
+	ID3D10Device*				pd3dDevice;
+	ID3D10Buffer*				quadVertices;
+	ID3D10Buffer*				instanceBuffer;
+	ID3D10InputLayout*			Layout;
+	ID3D10EffectTechnique*		Technique;
+	UINT						instanceCapacity;	// in instances
+	
+	JobSystem*					pJobs;
+	
+	void		select( UINT begin, UINT end );
+	static void	selectJob( void* impostors, UINT begin, UINT end );
+	
+	// copying would share the gpu buffers, so it's disabled
+private:	SphereImpostors( const SphereImpostors& );
+			SphereImpostors&	operator=( const SphereImpostors& );
+public:
+
+	SphereImpostors();
+	~SphereImpostors();
+	
+	// creates the quad and the input layout for the RenderImpostors
+	// technique of shader's effect. selection works without it
+	HRESULT	InitDevice( ID3D10Device* device, ShaderInput* shi );
+	void	ReleaseDevice();
+	bool	IsReady();							// InitDevice succeeded, so impostors can be drawn
+	
+	// picks the spheres (xyz - centre, w - radius) that are inside the
+	// camera's frustum and smaller than the threshold on a screen of
+	// the given height. spheres outside the frustum are never picked,
+	// their meshes are drawn as they always were. so are the objects
+	// whose eligible byte is 0, as their meshes aren't spheres (all
+	// are eligible if it's NULL). materials may be NULL, impostors get
+	// the default one then. returns the number of impostors, valid 
+	// until the next Select
+	UINT	Select( Camera* cam, const XMFLOAT4* spheres, const XMFLOAT4* colors, const Material* materials, 
+				const BYTE* eligible, UINT count, UINT screenHeight );
+	bool	IsImpostor( UINT sphere );
+	
+	// draws the impostors picked by the last Select. expects the camera
+	// matrices to be passed to the effect already. leaves its own
+	// input layout and topology set, like ParticleSystem::Draw does
+	UINT	Draw();
+	
+	void	SetThreshold( float pixels );
+	float	GetThreshold();
+	void	BindJobs( JobSystem* jobs );
+};
+
+// //////////////////////////////////////////////
+// 
+// STRUCTURES
+// 
+// /////////////////////////////////////////
+
+// timer is a simple struct that holds the time got from
+// windows GetTickCount func in its initialization time, 
+// and calculates number of seconds that passed since that moment
+struct Timer
+{
+	// since this is only small struct all methods and constructors
+	// are defined here for the sake of simplicity
+	
+	// constructors, assign operator and destructor:
+	Timer()
+		: dwTimeStart( GetTickCount() )		{}
+	Timer( const Timer& tim )
+		:	dwTimeStart( tim.dwTimeStart )	{}
+	Timer&	operator=( const Timer& tim )	{
+		if( this != &tim )	{
+			dwTimeStart = tim.dwTimeStart;
+			return *this;
+		}
+	}
+	~Timer()	{}
+	
+	// returns time in seconds that passed since the start of the timer
+	float	GetTime()	{
+		return ( GetTickCount() - dwTimeStart ) / 1000.0f;
+	}
+	
+private: 	
+	DWORD	dwTimeStart;	// keeps time Timer started
+	
+};
+
+// precise timer works like the Timer above, but uses
+// performance counter instead of GetTickCount, which
+// resolution is way too low for measuring anything
+// shorter than a few dozens of milliseconds.
+struct PreciseTimer
+{
+	PreciseTimer()	{
+		QueryPerformanceFrequency( &liFrequency );
+		QueryPerformanceCounter( &liTimeStart );
+	}
+	
+	// starts measuring anew
+	void	Restart()	{
+		QueryPerformanceCounter( &liTimeStart );
+	}
+	
+	// returns time in milliseconds that passed since the start of the timer
+	double	GetMilliseconds()	{
+		LARGE_INTEGER	liNow;
+		QueryPerformanceCounter( &liNow );
+		return ( liNow.QuadPart - liTimeStart.QuadPart ) * 1000.0 / liFrequency.QuadPart;
+	}
+	
+private:
+	LARGE_INTEGER	liFrequency;	// ticks per second
+	LARGE_INTEGER	liTimeStart;	// keeps time timer started
+};
+
+// ///////////////////////////////////////////////
+// scene snapshot file structures
+//
+// snapshot file consists of a header, the table of objects,
+// their materials, an array of Space's spheres (as they are now, and radii
+// their meshes were built for), the table of meshes, floor
+// texture's file name, and finally the mesh data section.
+// mesh data section starts at the multiple of
+// SNAPSHOT_SECTION_ALIGNMENT, which is the allocation
+// granularity of MapViewOfFile, so it may be mapped 
+// on its own, and every mesh inside of it is aligned to 
+// SNAPSHOT_DATA_ALIGNMENT. meshes are stored only once,
+// no matter how many objects use them. all offsets
+// are counted from the beginning of the file.
+
+#define	SNAPSHOT_MAGIC				0x534B544D		// 'MTKS'
+#define	SNAPSHOT_VERSION			2
+#define	SNAPSHOT_NO_MESH			0xFFFFFFFF
+#define	SNAPSHOT_SECTION_ALIGNMENT	65536
+#define	SNAPSHOT_DATA_ALIGNMENT		16
+
+// flags telling which parts of the scene the snapshot contains
+#define	SNAPSHOT_HAS_CAMERA			0x1
+#define	SNAPSHOT_HAS_SHADING		0x2
+#define	SNAPSHOT_HAS_SPACE			0x4
+
+struct	SnapshotHeader
+{
+	DWORD			magic;
+	DWORD			version;
+	DWORD			flags;
+	DWORD			objectCount;
+	DWORD			meshCount;
+	DWORD			sphereCount;
+	DWORD			floorMesh;				// SNAPSHOT_NO_MESH if there's no floor
+	DWORD			textureChars;			// length of the floor texture's file name
+	
+	XMFLOAT3		camEye;
+	XMFLOAT3		camAt;
+	XMFLOAT3		camUp;
+	float			camFoV;
+	ShadingControls	shading;
+	
+	UINT64			objectsOffset;			// SnapshotObject[ objectCount ]
+	UINT64			materialsOffset;		// Material[ objectCount ]
+	UINT64			spheresOffset;			// XMFLOAT4[ sphereCount ]
+	UINT64			radiiOffset;			// float[ sphereCount ], radii of the meshes
+	UINT64			meshesOffset;			// SnapshotMesh[ meshCount ]
+	UINT64			textureOffset;			// WCHAR[ textureChars ]
+	UINT64			dataOffset;				// mesh data section
+	UINT64			dataSize;
+};
+
+struct	SnapshotMesh
+{
+	UINT64			vertexOffset;
+	UINT64			indexOffset;
+	DWORD			vertexCount;
+	DWORD			indexCount;
+	DWORD			stride;					// size of a single vertex
+	DWORD			reserved;
+};
+
+struct	SnapshotObject
+{
+	XMFLOAT4		color;
+	DWORD			mesh;					// index in the table of meshes
+	DWORD			reserved[ 3 ];
+};
+
+// represents a vertex in the 3d space
+// with defined color and normal;
+struct	Vertex
+{
+	XMFLOAT3	Pos;
+	XMFLOAT3	Norm;
+	XMFLOAT4	Color;
+};
+
+// vertex of meshes that don't need full precision. the normal
+// and the color take four bytes each, so it's 20 bytes instead
+// of 40 - half the memory and bandwidth of the vertex stage
+struct	CompactVertex
+{
+	XMFLOAT3	Pos;
+	XMBYTEN4	Norm;					// w is always 0
+	XMUBYTEN4	Color;
+};
+
+// ////////////////////////////////////////////////
+//
+// VERTEX FORMATS
+//
+// /////////////////////////////////////////////////
+
+// formats of vertex attributes, derived from their types. there is
+// no general case, so a member of a type not listed below doesn't 
+// compile instead of getting the wrong format. Load and Store 
+// convert an attribute to and from a vector, for the encoders
+template< class T >
+struct	VertexAttribute;
+
+template<>
+struct	VertexAttribute< XMFLOAT2 >
+{
+	static DXGI_FORMAT	Format()								{	return DXGI_FORMAT_R32G32_FLOAT;	}
+	static XMVECTOR		Load( const XMFLOAT2* src )				{	return XMLoadFloat2( src );	}
+	static void			Store( XMFLOAT2* dst, FXMVECTOR v )		{	XMStoreFloat2( dst, v );	}
+};
+
+template<>
+struct	VertexAttribute< XMFLOAT3 >
+{
+	static DXGI_FORMAT	Format()								{	return DXGI_FORMAT_R32G32B32_FLOAT;	}
+	static XMVECTOR		Load( const XMFLOAT3* src )				{	return XMLoadFloat3( src );	}
+	static void			Store( XMFLOAT3* dst, FXMVECTOR v )		{	XMStoreFloat3( dst, v );	}
+};
+
+template<>
+struct	VertexAttribute< XMFLOAT4 >
+{
+	static DXGI_FORMAT	Format()								{	return DXGI_FORMAT_R32G32B32A32_FLOAT;	}
+	static XMVECTOR		Load( const XMFLOAT4* src )				{	return XMLoadFloat4( src );	}
+	static void			Store( XMFLOAT4* dst, FXMVECTOR v )		{	XMStoreFloat4( dst, v );	}
+};
+
+template<>
+struct	VertexAttribute< XMBYTEN4 >
+{
+	static DXGI_FORMAT	Format()								{	return DXGI_FORMAT_R8G8B8A8_SNORM;	}
+	static XMVECTOR		Load( const XMBYTEN4* src )				{	return XMLoadByteN4( src );	}
+	static void			Store( XMBYTEN4* dst, FXMVECTOR v )		{	XMStoreByteN4( dst, v );	}
+};
+
+template<>
+struct	VertexAttribute< XMUBYTEN4 >
+{
+	static DXGI_FORMAT	Format()								{	return DXGI_FORMAT_R8G8B8A8_UNORM;	}
+	static XMVECTOR		Load( const XMUBYTEN4* src )			{	return XMLoadUByteN4( src );	}
+	static void			Store( XMUBYTEN4* dst, FXMVECTOR v )	{	XMStoreUByteN4( dst, v );	}
+};
+
+template<>
+struct	VertexAttribute< XMUDECN4 >
+{
+	static DXGI_FORMAT	Format()								{	return DXGI_FORMAT_R10G10B10A2_UNORM;	}
+	static XMVECTOR		Load( const XMUDECN4* src )				{	return XMLoadUDecN4( src );	}
+	static void			Store( XMUDECN4* dst, FXMVECTOR v )		{	XMStoreUDecN4( dst, v );	}
+};
+
+// format of the member pointed by a pointer to member. it's only
+// there to deduce the member's type, which offsetof can't do
+template< class V, class T >
+DXGI_FORMAT	attributeFormat( T V::* )
+{
+	return VertexAttribute< T >::Format();
+}
+
+// elements of input layouts, taken from a member of a vertex (or 
+// instance) struct. the format and the offset come from the member
+// itself, so they can't get out of sync with the struct
+#define	VERTEX_ELEMENT( type, member, semantic, index )				\
+	{ semantic, index, attributeFormat( &type::member ), 0,			\
+	  ( UINT )offsetof( type, member ), D3D10_INPUT_PER_VERTEX_DATA, 0 }
+#define	INSTANCE_ELEMENT( type, member, semantic, index, slot )		\
+	{ semantic, index, attributeFormat( &type::member ), slot,		\
+	  ( UINT )offsetof( type, member ), D3D10_INPUT_PER_INSTANCE_DATA, 1 }
+
+// everything needed to put vertices of type V into a vertex buffer:
+// the input layout's elements, the size of a vertex, and functions
+// converting the Vertex structs meshes are built of into V and back.
+// every vertex type defines its Elements, and a packVertex and 
+// unpackVertex overload; the rest comes from the template
+template< class V >
+struct	VertexFormat
+{
+	static const D3D10_INPUT_ELEMENT_DESC	Elements[];
+	static const UINT						Count;
+	static const UINT						Stride = sizeof( V );
+	
+	static void	Encode( const Vertex* src, UINT count, V* dst )
+	{
+		for( UINT i = 0; i < count; i++ )
+			packVertex( src[ i ], dst[ i ] );
+	}
+	
+	// matches VertexDecoder, so Object3D can read meshes back
+	static void	Decode( const void* src, UINT count, Vertex* dst )
+	{
+		const V* vertices = ( const V* )src;
+		for( UINT i = 0; i < count; i++ )
+			unpackVertex( vertices[ i ], dst[ i ] );
+	}
+};
+
+// Vertex itself. packing it is just a copy
+template<>
+const D3D10_INPUT_ELEMENT_DESC	VertexFormat< Vertex >::Elements[] =
+{
+	VERTEX_ELEMENT( Vertex, Pos, "POSITION", 0 ),
+	VERTEX_ELEMENT( Vertex, Norm, "NORMAL", 0 ),
+	VERTEX_ELEMENT( Vertex, Color, "COLOR", 0 ),
+};
+template<>
+const UINT	VertexFormat< Vertex >::Count = sizeof( VertexFormat< Vertex >::Elements ) / sizeof( D3D10_INPUT_ELEMENT_DESC );
+
+inline void	packVertex( const Vertex& src, Vertex& dst )		{	dst = src;	}
+inline void	unpackVertex( const Vertex& src, Vertex& dst )		{	dst = src;	}
+
+// the compact one. the shaders read the same three attributes,
+// the input assembler expands bytes back into floats
+template<>
+const D3D10_INPUT_ELEMENT_DESC	VertexFormat< CompactVertex >::Elements[] =
+{
+	VERTEX_ELEMENT( CompactVertex, Pos, "POSITION", 0 ),
+	VERTEX_ELEMENT( CompactVertex, Norm, "NORMAL", 0 ),
+	VERTEX_ELEMENT( CompactVertex, Color, "COLOR", 0 ),
+};
+template<>
+const UINT	VertexFormat< CompactVertex >::Count = sizeof( VertexFormat< CompactVertex >::Elements ) / sizeof( D3D10_INPUT_ELEMENT_DESC );
+
+inline void	packVertex( const Vertex& src, CompactVertex& dst )
+{
+	typedef VertexAttribute< XMBYTEN4 >		Normal;
+	typedef VertexAttribute< XMUBYTEN4 >	Color;
+	
+	// the normal's w is loaded as 0, and components get clamped
+	// to [-1,1] or [0,1] by the stores, before they're scaled
+	dst.Pos = src.Pos;
+	Normal::Store( &dst.Norm, XMLoadFloat3( &src.Norm ) );
+	Color::Store( &dst.Color, XMLoadFloat4( &src.Color ) );
+}
+
+inline void	unpackVertex( const CompactVertex& src, Vertex& dst )
+{
+	dst.Pos = src.Pos;
+	XMStoreFloat3( &dst.Norm, VertexAttribute< XMBYTEN4 >::Load( &src.Norm ) );
+	XMStoreFloat4( &dst.Color, VertexAttribute< XMUBYTEN4 >::Load( &src.Color ) );
+}
+
+// input layout of the instanced particles. the mesh comes in the
+// first slot, ParticleInstance structs in the second one
+const D3D10_INPUT_ELEMENT_DESC 	particle_desc[]  =	
+{
+	VERTEX_ELEMENT( Vertex, Pos, "POSITION", 0 ),
+	VERTEX_ELEMENT( Vertex, Norm, "NORMAL", 0 ),
+	VERTEX_ELEMENT( Vertex, Color, "COLOR", 0 ),
+	INSTANCE_ELEMENT( ParticleInstance, Sphere, "INSTANCE", 0, 1 ),
+	INSTANCE_ELEMENT( ParticleInstance, Color, "INSTANCE", 1, 1 ),
+};
+
+// input layout of the impostors. a corner of the quad in the first
+// slot, the sphere, its color and material in the second
+const D3D10_INPUT_ELEMENT_DESC 	impostor_desc[]  =	
+{
+	VERTEX_ELEMENT( ImpostorCorner, Corner, "POSITION", 0 ),
+	INSTANCE_ELEMENT( ImpostorInstance, Sphere, "INSTANCE", 0, 1 ),
+	INSTANCE_ELEMENT( ImpostorInstance, Color, "INSTANCE", 1, 1 ),
+	INSTANCE_ELEMENT( ImpostorInstance, Material, "INSTANCE", 2, 1 ),
+};
+
+// creates an object of vertices stored in the format V. they're
+// encoded from the Vertex structs first, and drawn with layouts 
+// of V, created for whatever technique draws the object
+template< class V >
+Object3D*	createObject3D( 
+	ID3D10Device* pd3dDevice, 		// device that will create the buffers
+	const Vertex* vertices, 		// vertices to encode
+	DWORD* indices, 
+	UINT vSize, 
+	UINT iSize )
+{
+	std::vector< V >		packed( vSize );
+	
+	VertexFormat< V >::Encode( vertices, vSize, packed.data() );
+	return new Object3D( pd3dDevice, packed.data(), indices, vSize, iSize, VertexFormat< V >::Stride, 
+		VertexFormat< V >::Elements, VertexFormat< V >::Count, &VertexFormat< V >::Decode );
+}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// NAME INDEX	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+NameIndex::NameIndex()
+	:	used( 0 ),
+		removed( 0 ),
+		deadChars( 0 ),
+		sortedValid( true )
+{}
+
+// hash of a zero terminated name
+static UINT64	hashName( LPCWSTR name )
+{
+	return hashBytes( name, wcslen( name ) * sizeof( wchar_t ), HASH_OFFSET_BASIS );
+}
+
+// returns the slot holding the name, or the first free
+// slot on its probe sequence if the name isn't there.
+// removed slots are reused, but don't stop the search
+UINT	NameIndex::findSlot( LPCWSTR name, UINT64 hash ) const
+{
+	UINT	mask = slots.size() - 1;
+	UINT	freeSlot = EMPTY_SLOT;
+	
+	for( UINT i = ( UINT )hash & mask; ; i = ( i + 1 ) & mask )
+	{
+		const Slot& slot = slots[ i ];
+		if( slot.name == EMPTY_SLOT )
+			return freeSlot != EMPTY_SLOT ? freeSlot : i;
+		
+		if( slot.name == REMOVED_SLOT )
+		{
+			if( freeSlot == EMPTY_SLOT )
+				freeSlot = i;
+		}
+		else if( slot.hash == hash && wcscmp( &pool[ slot.name ], name ) == 0 )
+			return i;
+	}
+}
+
+// moves all the names into a new table of a given size.
+// removed slots are gone afterwards
+void	NameIndex::rehash( UINT size )
+{
+	std::vector< Slot >	old( size );
+	old.swap( slots );
+	for( UINT i = 0; i < size; i++ )
+		slots[ i ].name = EMPTY_SLOT;
+	
+	UINT	mask = size - 1;
+	for( UINT i = 0; i < old.size(); i++ )
+	{
+		if( old[ i ].name >= REMOVED_SLOT )		continue;
+		
+		UINT j = ( UINT )old[ i ].hash & mask;
+		while( slots[ j ].name != EMPTY_SLOT )
+			j = ( j + 1 ) & mask;
+		slots[ j ] = old[ i ];
+	}
+	removed = 0;
+}
+
+// removed names are left in the pool, until they take
+// more space than the live ones. then the pool is rewritten
+void	NameIndex::compact()
+{
+	std::vector< wchar_t >	live;
+	live.reserve( pool.size() - deadChars );
+	
+	for( UINT i = 0; i < slots.size(); i++ )
+	{
+		Slot& slot = slots[ i ];
+		if( slot.name >= REMOVED_SLOT )		continue;
+		
+		const wchar_t* name = &pool[ slot.name ];
+		slot.name = live.size();
+		handleNames[ slot.handle ] = slot.name;
+		live.insert( live.end(), name, name + wcslen( name ) + 1 );
+	}
+	pool.swap( live );
+	deadChars = 0;
+}
+
+bool	NameIndex::Insert( LPCWSTR name, ObjectHandle handle )
+{
+	// keep at least a quarter of the table empty, 
+	// otherwise probe sequences get too long
+	// after rehashing the table is at most half full
+	if( ( used + removed + 1 ) * 4 > slots.size() * 3 )
+	{
+		UINT size = 16;
+		while( ( used + 1 ) * 2 > size )
+			size *= 2;
+		rehash( size );
+	}
+	
+	UINT64	hash = hashName( name );
+	UINT	i = findSlot( name, hash );
+	if( slots[ i ].name < REMOVED_SLOT )
+		return false;
+	
+	if( slots[ i ].name == REMOVED_SLOT )
+		removed--;
+	
+	slots[ i ].hash = hash;
+	slots[ i ].name = pool.size();
+	slots[ i ].handle = handle;
+	pool.insert( pool.end(), name, name + wcslen( name ) + 1 );
+	used++;
+	
+	if( handle >= handleNames.size() )
+		handleNames.resize( handle + 1, NO_NAME );
+	handleNames[ handle ] = slots[ i ].name;
+	sortedValid = false;
+	return true;
+}
+
+// the old name is dropped only if the new one was free
+bool	NameIndex::Rename( ObjectHandle handle, LPCWSTR name )
+{
+	ObjectHandle owner = Find( name );
+	if( owner != NO_OBJECT )
+		return owner == handle;
+	
+	Remove( handle );
+	return Insert( name, handle );
+}
+
+void	NameIndex::Remove( ObjectHandle handle )
+{
+	LPCWSTR name = GetName( handle );
+	if( name == NULL )		return;
+	
+	Slot&	slot = slots[ findSlot( name, hashName( name ) ) ];
+	slot.name = REMOVED_SLOT;
+	deadChars += wcslen( name ) + 1;
+	handleNames[ handle ] = NO_NAME;
+	used--;
+	removed++;
+	sortedValid = false;
+	
+	if( deadChars > pool.size() / 2 )
+		compact();
+}
+
+void	NameIndex::Clear()
+{
+	slots.clear();
+	pool.clear();
+	handleNames.clear();
+	sorted.clear();
+	used = removed = deadChars = 0;
+	sortedValid = true;
+}
+
+ObjectHandle	NameIndex::Find( LPCWSTR name ) const
+{
+	if( used == 0 )		return NO_OBJECT;
+	
+	const Slot& slot = slots[ findSlot( name, hashName( name ) ) ];
+	return slot.name < REMOVED_SLOT ? slot.handle : NO_OBJECT;
+}
+
+LPCWSTR		NameIndex::GetName( ObjectHandle handle ) const
+{
+	if( handle >= handleNames.size() || handleNames[ handle ] == NO_NAME )
+		return NULL;
+	return &pool[ handleNames[ handle ] ];
+}
+
+// compares handles by their names, used for sorting
+struct NameIndexOrder
+{
+	const wchar_t*	pool;
+	const UINT*		names;
+	
+	bool	operator()( ObjectHandle a, ObjectHandle b ) const	{	return wcscmp( pool + names[ a ], pool + names[ b ] ) < 0;	}
+	bool	operator()( ObjectHandle a, LPCWSTR b ) const		{	return wcscmp( pool + names[ a ], b ) < 0;	}
+};
+
+UINT	NameIndex::FindPrefix( LPCWSTR prefix, std::vector< ObjectHandle >& found )
+{
+	if( used == 0 )		return 0;
+	
+	NameIndexOrder	order = { pool.data(), handleNames.data() };
+	if( !sortedValid )
+	{
+		sorted.clear();
+		for( UINT i = 0; i < slots.size(); i++ )
+			if( slots[ i ].name < REMOVED_SLOT )
+				sorted.push_back( slots[ i ].handle );
+		std::sort( sorted.begin(), sorted.end(), order );
+		sortedValid = true;
+	}
+	
+	// all the names starting with the prefix lie
+	// together, right after the first one not less than it
+	size_t	length = wcslen( prefix );
+	UINT	count = 0;
+	for( std::vector< ObjectHandle >::iterator it = std::lower_bound( sorted.begin(), sorted.end(), prefix, order );
+		it != sorted.end() && wcsncmp( &pool[ handleNames[ *it ] ], prefix, length ) == 0; ++it )
+	{
+		found.push_back( *it );
+		count++;
+	}
+	return count;
+}
+
+UINT	NameIndex::size() const		{	return used;	}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// MATEYKO	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+// default constructor (and the only one, except copy)
+// of the Mateyko class. it sets all members nullified
+// those members can be set up via InitDevice method
+
+Mateyko::Mateyko()
+	:	FloorDescribed( false ),
+		pd3dDevice( NULL ),
+		pSwapChain( NULL ),
+		pRenderTargetView( NULL ),
+		pInput( NULL ),
+		pCam( NULL ),
+		pSpace( NULL ),
+		pDepthStencil( NULL ),
+		pDepthStencilView( NULL ),
+		oGroundZero( NULL ),
+		FloorTextureRV( NULL ),
+		Width( 0 ),
+		Height( 0 ),
+		pJournal( NULL ),
+		pEdits( NULL ),
+		pVersions( NULL ),
+		pParticles( NULL ),
+		pImpostors( NULL ),
+		pBVH( NULL ),
+		pLightmap( NULL ),
+		pClusters( NULL ),
+		pSky( NULL ),
+		pColorTable( NULL )
+		// note that there's no need for manual initialization
+		// of vector members. therefore they are not mentioned here
+{}
+
+// copy constructor of the Mateyko class.
+// it does NOT copy devices, textures or 
+// shader vars. to use copied instance of
+// this class it must be initialazed.
+// it'll still share its cameras, input
+// Space and sets of objects with the 
+// instance it was copied from though.
+
+Mateyko::Mateyko( const Mateyko& mat )
+	:	pd3dDevice( NULL ),
+		pSwapChain( NULL ),
+		pRenderTargetView( NULL ),
+		pDepthStencil( NULL ),
+		pDepthStencilView( NULL ),
+		oGroundZero( NULL ),
+		FloorTextureRV( NULL ),
+		
+		// we do not allow copying devices.
+		// every new instance of Mateyko class
+		// must be initialazed anew via the
+		// InitDevice method. therefore we have
+		// to set all device's pointers to NULL
+		
+		pInput( mat.pInput ),
+		pCam( mat.pCam ),
+		pSpace( mat.pSpace ),
+		
+		// the exceptions are pointers of other objects
+		// like Camera, Input and Space. we allow to copy 
+		// those pointers, because they exist separately anyway
+		
+		objects( mat.objects.begin(), mat.objects.end() ),
+		oColors( mat.oColors.begin(), mat.oColors.end() ),
+		oMaterials( mat.oMaterials ),
+		oHandles( mat.oHandles ),
+		handleIndices( mat.handleIndices ),
+		oNames( mat.oNames ),
+		FloorName( mat.FloorName ),
+		FloorRect( mat.FloorRect ),
+		FloorDescribed( mat.FloorDescribed ),
+		lights( mat.lights ),
+		
+		// other exceptions are std::vector sets of
+		// objects and colors on the scene. those also
+		// can be safely copied. (remember objects
+		// is a vector of shared ptrs). handles and 
+		// names go along with them
+		
+		Width( 0 ),
+		Height( 0 ),
+		
+		// those two will be set right when InitDevice
+		// will be called. unless so, they're set to zero
+		// in case GetClientRect will be called.
+		
+		pJournal( NULL ),
+		pEdits( NULL ),
+		pVersions( mat.pVersions ),
+		pParticles( mat.pParticles ),
+		pImpostors( mat.pImpostors ),
+		pBVH( mat.pBVH ),
+		pLightmap( mat.pLightmap ),
+		pClusters( mat.pClusters ),
+		pSky( mat.pSky ),
+		pColorTable( NULL )
+		
+		// optional devices are shared the same way.
+		// journal, edit queue and color table are not copied, the 
+		// copy is a different scene and shouldn't be treated as the same one
+{}
+
+// assigment operator of the Mateyko class
+// does NOT assign directx related stuff
+// only copy outer device's pointers and 
+// the content of std::vectors. to use
+// an instance after cpuying initialize
+// it with InitDevice method.
+
+Mateyko&	Mateyko::operator=( const Mateyko& mat )
+{
+	if( this != &mat )
+	{
+		// as was specified above in the copy constructor
+		// comment section, we do not allow to copy devices
+		// textures and other directx related stuff. it is
+		// way simpler to code it that way safely,
+		// and anyway we don't expect anyone
+		// be juggling with plenty of drawing devices
+		// just for the sake of it. in fact Mateyko
+		// should have one, maybe up to few instances,
+		// and there's hardly any scenario where
+		// a direct copy of this class would be necessary.
+		// therefore every time there's a need for
+		// copying, copied instance must be initialized anew
+		
+		// first clean up the left operand
+		if( pd3dDevice )			pd3dDevice->ClearState();
+		if( pSwapChain )			pSwapChain->Release();
+		if( pRenderTargetView )		pRenderTargetView->Release();
+		if( pDepthStencil )			pDepthStencil->Release();
+		if( pDepthStencilView )		pDepthStencilView->Release();
+		if( FloorTextureRV )		FloorTextureRV->Release();
+		if( oGroundZero )			delete oGroundZero;
+		
+		// clean up vectors
+		objects.clear();
+		oColors.clear();
+		oMaterials.clear();
+		
+		// set null to pd3dDevice
+		pd3dDevice = NULL;
+		
+		// set null to screen proportions
+		Width = 0;
+		Height = 0;
+		
+		// assign outer devices. we do not need to erase
+		// them, for they are only binded, not created
+		// within the mateyko class
+		pInput = mat.pInput;
+		pCam = mat.pCam;
+		pSpace = mat.pSpace;
+		pVersions = mat.pVersions;
+		pParticles = mat.pParticles;
+		pImpostors = mat.pImpostors;
+		pBVH = mat.pBVH;
+		pLightmap = mat.pLightmap;
+		pClusters = mat.pClusters;
+		pSky = mat.pSky;
+		
+		// insert the content of right operand's std::vectors
+		// into the left's vectors, cleared a moment ago
+		objects.insert( objects.begin(), mat.objects.begin(), mat.objects.end() );
+		oColors.insert( oColors.begin(), mat.oColors.begin(), mat.oColors.end() );
+		oMaterials = mat.oMaterials;
+		oHandles = mat.oHandles;
+		handleIndices = mat.handleIndices;
+		oNames = mat.oNames;
+		FloorName = mat.FloorName;
+		FloorRect = mat.FloorRect;
+		FloorDescribed = mat.FloorDescribed;
+		lights = mat.lights;
+		
+		// our own color table gets the new colors
+		BindColorTable( pColorTable );
+		
+		return *this;
+	}
+}
+
+void	Mateyko::ReleaseMe()
+{
+	if( pd3dDevice )			pd3dDevice->ClearState();
+	if( pSwapChain )			pSwapChain->Release();
+	if( pRenderTargetView )		pRenderTargetView->Release();
+	if( pDepthStencil )			pDepthStencil->Release();
+	if( pDepthStencilView )		pDepthStencilView->Release();
+	if( FloorTextureRV )		FloorTextureRV->Release();
+	if( oGroundZero )			delete oGroundZero;
+	if( pd3dDevice )			pd3dDevice->Release();
+}
+
+// class destructor
+Mateyko::~Mateyko()
+{
+	if( pd3dDevice )			pd3dDevice->ClearState();
+	if( pSwapChain )			pSwapChain->Release();
+	if( pRenderTargetView )		pRenderTargetView->Release();
+	if( pDepthStencil )			pDepthStencil->Release();
+	if( pDepthStencilView )		pDepthStencilView->Release();
+	if( FloorTextureRV )		FloorTextureRV->Release();
+	if( oGroundZero )			delete oGroundZero;
+	if( pd3dDevice )			pd3dDevice->Release();
+	
+	// note, we do not delete pointer to Camera, Space and Input.
+	// those were binded here, not created, so we don't want to 
+	// delete them.
+}
+
+// init device method of Mateyko class.
+// calling this method is required for using Mateyko class.
+// it creates the device, depth stencil and a swapchain
+// defines render target view, also saves some info about
+// the client rectangle. 
+
+HRESULT		Mateyko::InitDevice( HWND hWnd )
+{
+	// hresult that will be returned in the end, or when sth go wrong
+	HRESULT hr = S_OK;
+
+	// finding client rectangle
+	RECT rc;
+	GetClientRect( hWnd, &rc );
+	Height = rc.bottom - rc.top;
+	Width = rc.right - rc.left;
+
+	// define the array of driver types
+	// required during swap chain creation
+	D3D10_DRIVER_TYPE driverTypes[] =
+    {
+        D3D10_DRIVER_TYPE_HARDWARE,
+        D3D10_DRIVER_TYPE_WARP,
+        D3D10_DRIVER_TYPE_REFERENCE,
+    };
+    UINT numDriverTypes = ARRAYSIZE( driverTypes );
+
+	UINT createDeviceFlags = 0;
+#ifdef _DEBUG
+    createDeviceFlags |= D3D10_CREATE_DEVICE_DEBUG;
+#endif
+
+	// //////////////////////////////////////
+	// SWAPCHAIN
+	//
+	// create swap chain desc and set some info about swapchain
+	DXGI_SWAP_CHAIN_DESC sd;
+    ZeroMemory( &sd, sizeof( sd ) );
+    sd.BufferCount = 1;
+    sd.BufferDesc.Width = Width;							// previously stored width
+    sd.BufferDesc.Height = Height;							// previously stored height
+    sd.BufferDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;		// standard rgb 8-bit format
+    sd.BufferDesc.RefreshRate.Numerator = 60;				// standard 60 hz refresh rate
+    sd.BufferDesc.RefreshRate.Denominator = 1;
+    sd.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
+    sd.OutputWindow = hWnd;									// window handler passed as an argument
+    sd.SampleDesc.Count = 1;								// no multisampling
+    sd.SampleDesc.Quality = 0;
+    sd.Windowed = TRUE;										// stay windowed
+
+
+	// create swap chain using the description already filled
+	// search for the right driver starting from the best one
+	// (if the best one succeeds, no need for further search)
+	for( UINT driverTypeIndex = 0; driverTypeIndex < numDriverTypes; driverTypeIndex++ )
+    {
+        pDriverType = driverTypes[driverTypeIndex];
+        hr = D3D10CreateDeviceAndSwapChain( NULL, pDriverType, NULL, createDeviceFlags,
+                                            D3D10_SDK_VERSION, &sd, &pSwapChain, &pd3dDevice );
+        if( SUCCEEDED( hr ) )
+            break;
+    }
+
+	// ////////////////////////////////////////////
+	// RENDER TARGET
+	//
+	// Create a render target view
+    ID3D10Texture2D* pBuffer;
+    hr = pSwapChain->GetBuffer( 0, __uuidof( ID3D10Texture2D ), ( LPVOID* )&pBuffer );
+    if( FAILED( hr ) )
+		ERRORMACRO( L"Texture initialization failed" );
+
+    hr = pd3dDevice->CreateRenderTargetView( pBuffer, NULL, &pRenderTargetView );
+    pBuffer->Release();
+    if( FAILED( hr ) )
+		ERRORMACRO( L"Render Target View initialization failed" );
+
+	// ////////////////////////////////////////////
+	// DEPTH STENCIL TEXTURE
+	//
+	// Create depth stencil texture
+    D3D10_TEXTURE2D_DESC descDepth;
+    descDepth.Width = Width;
+    descDepth.Height = Height;
+    descDepth.MipLevels = 1;
+    descDepth.ArraySize = 1;
+    descDepth.Format = DXGI_FORMAT_D32_FLOAT;
+    descDepth.SampleDesc.Count = 1;
+    descDepth.SampleDesc.Quality = 0;
+    descDepth.Usage = D3D10_USAGE_DEFAULT;
+    descDepth.BindFlags = D3D10_BIND_DEPTH_STENCIL;
+    descDepth.CPUAccessFlags = 0;
+    descDepth.MiscFlags = 0;
+
+    hr = pd3dDevice->CreateTexture2D( &descDepth, NULL, &pDepthStencil );
+    if( FAILED( hr ) )
+		ERRORMACRO( L"DepthStencil texture initialization failed" );
+
+    // Create the depth stencil view
+    D3D10_DEPTH_STENCIL_VIEW_DESC descDSV;
+    descDSV.Format = descDepth.Format;
+    descDSV.ViewDimension = D3D10_DSV_DIMENSION_TEXTURE2D;
+    descDSV.Texture2D.MipSlice = 0;
+
+    hr = pd3dDevice->CreateDepthStencilView( pDepthStencil, &descDSV, &pDepthStencilView );
+    if( FAILED( hr ) )
+		ERRORMACRO( L"Depth Stencil View initialization failed" );	//*/
+
+	// set render targets
+	pd3dDevice->OMSetRenderTargets( 1, &pRenderTargetView, pDepthStencilView );
+
+	 // Setup the viewport
+    D3D10_VIEWPORT vp;
+    vp.Width = Width;
+    vp.Height = Height;
+    vp.MinDepth = 0.0f;
+    vp.MaxDepth = 1.0f;
+    vp.TopLeftX = 0;
+    vp.TopLeftY = 0;
+    pd3dDevice->RSSetViewports( 1, &vp );
+
+	// set primitive topology
+	pd3dDevice->IASetPrimitiveTopology( D3D10_PRIMITIVE_TOPOLOGY_TRIANGLELIST );
+
+	return hr;
+};
+
+// paint scene method. as name suggests it paints the scene.
+// needs Input, Camera and Space to work.
+void	Mateyko::PaintScene()
+{
+	// ////////////////////////////////////
+	// safety belt
+
+	// if any of those devices isn't binded, or InitDevice
+	// methods hasn't been called (it initializes the pd3dDevice)
+	// don't do anything
+	if( pd3dDevice == NULL )		return;
+	if( pInput == NULL )			return;
+	if( pCam == NULL )				return;
+	if( pSpace == NULL )			return;
+	
+	// ////////////////////////////////////
+	// frame boundary
+	
+	// apply edits submitted by other threads since the last
+	// frame. it's the only moment objects may change, so
+	// all edits of a batch show up in the same frame
+	stats.appliedEdits = pEdits ? pEdits->ApplyPending( *this, pSpace ) : 0;
+	
+	// spheres attached to the transform hierarchy follow
+	// their nodes. only changed subtrees are evaluated
+	pSpace->UpdateTransforms();
+
+	// remember how many allocations render thread has done
+	// so far. the difference at the end of this method
+	// tells us how much PaintScene allocated itself.
+	// edits applied above are not counted, inserting
+	// objects can't be done without allocating memory
+	AllocationCounter	allocsAtStart = getThreadAllocations();
+	
+	// camera and shading are changed by the user input
+	// between frames, so the journal checks them here
+	if( pJournal )
+	{
+		pJournal->RecordCamera( pCam );
+		pJournal->RecordShading( pInput );
+	}
+
+	// ////////////////////////////////////
+    // Clear the back buffer
+
+    float ClearColor[4] = { 0.0f, 0.4f, 0.9f, 1.0f }; // red, green, blue, alpha
+    pd3dDevice->ClearRenderTargetView( pRenderTargetView, ClearColor );
+
+	// /////////////////////////////////////
+    // Clear the depth buffer to 1.0 (max depth)
+    
+    pd3dDevice->ClearDepthStencilView( pDepthStencilView, D3D10_CLEAR_DEPTH, 1.0f, 0 );
+
+	// ///////////////////////////////////
+	// pick the data to paint
+	
+	// by default the scene is painted straight from our vectors
+	// and the Space. if scene versions are used, pin the current
+	// one instead. editors may publish new versions meanwhile,
+	// but the pinned one stays untouched until the frame is done.
+	// objects without spheres are not painted, there's nowhere to
+	// put them. it happens e.g. after loading a snapshot saved 
+	// without a Space, until spheres are given to the objects
+	const SceneVersion*	version = pVersions ? pVersions->Pin() : NULL;
+	UINT				oCount = objects.size();
+	UINT				sCount = pSpace->size();
+	float*				positions = pSpace->GetShaderPositionArray();
+	float*				colors = ( float* )oColors.data();
+	float*				materials = ( float* )oMaterials.data();
+	
+	if( version )
+	{
+		oCount = sCount = version->objects.size();
+		if( frameColors.size() < oCount )
+		{
+			frameColors.resize( oCount );
+			frameSpheres.resize( oCount );
+			frameMaterials.resize( oCount );
+			frameMeshRadii.resize( oCount );
+		}
+		version->colors.CopyTo( frameColors.data() );
+		version->spheres.CopyTo( frameSpheres.data() );
+		version->materials.CopyTo( frameMaterials.data() );
+		version->meshRadii.CopyTo( frameMeshRadii.data() );
+		positions = ( float* )frameSpheres.data();
+		colors = ( float* )frameColors.data();
+		materials = ( float* )frameMaterials.data();
+	}
+
+	// ///////////////////////////////////
+	// prepare general (same for all object on the scene) rendering parameters
+	
+	pInput->PrepareShadingControlVars(
+		oCount );
+	
+	pInput->PrepareCameraMatrices( 
+		( float* )pCam->GetView().m,
+		( float* )pCam->GetProjection().m );
+	
+	pInput->PrepareEyePos( 
+		( float* )&pCam->GetEyePos() );
+	
+	// the sky is projected again only if it was changed
+	if( pSky )
+	{
+		pSky->Update();
+		pInput->PrepareSkyLight( pSky );
+	}
+	
+	// lights are culled against the camera's frustum every frame,
+	// it's cheap enough even for thousands of them
+	if( pClusters )
+	{
+		pClusters->Build( lights.data(), lights.size(), pCam );
+		if( pClusters->Upload( pd3dDevice ) )
+			pInput->PrepareLights( pClusters );
+	}
+	
+	pInput->PreparePositions( 
+		positions, 
+		sCount );
+	
+	// the color table has only the changed colors uploaded, and
+	// only a quarter of their size if they're packed. versions 
+	// have colors of their own, so they always go the old way
+	if( pColorTable && !version && pColorTable->Upload( pd3dDevice ) )
+		pInput->PrepareColorTable( pColorTable );
+	else
+	{
+		pInput->PrepareColorTable( NULL );
+		pInput->PrepareColors( 
+			colors,
+			oCount );
+	}
+	
+	pInput->PrepareMaterials( 
+		materials,
+		oCount );
+	
+	// ////////////////////////////////////
+	// pick the impostors
+	
+	// spheres too small on the screen skip their meshes, and
+	// are drawn all at once after the other objects
+	// only objects with sphere meshes may be picked
+	UINT	impostors = 0;
+	if( pImpostors && pImpostors->IsReady() )
+	{
+		if( frameSphereMeshes.size() < oCount )
+			frameSphereMeshes.resize( oCount );
+		if( version )
+		{
+			UINT	length;
+			for( UINT i = 0; i < oCount; )
+			{
+				const std::shared_ptr< Object3D >* run = version->objects.GetRun( i, length );
+				for( UINT j = 0; j < length; j++, i++ )
+					frameSphereMeshes[ i ] = run[ j ]->IsSphere();
+			}
+		}
+		else for( UINT i = 0; i < oCount; i++ )
+			frameSphereMeshes[ i ] = objects[ i ]->IsSphere();
+		
+		impostors = pImpostors->Select( pCam, ( const XMFLOAT4* )positions, ( const XMFLOAT4* )colors, 
+			( const Material* )materials, frameSphereMeshes.data(), min( oCount, sCount ), Height );
+	}
+	
+	// ////////////////////////////////////
+	// Render objects on the scene
+	if( version )
+	{
+		// objects of a version are walked leaf by leaf,
+		// it's much cheaper than looking up each one
+		UINT	length;
+		for( UINT i = 0; i < oCount; )
+		{
+			const std::shared_ptr< Object3D >* run = version->objects.GetRun( i, length );
+			for( UINT j = 0; j < length; j++, i++ )
+			{
+				if( impostors && pImpostors->IsImpostor( i ) )
+					continue;
+				
+				pInput->PrepareObject( ( float* )getSphereMatrix( frameSpheres[ i ], frameMeshRadii[ i ] ).m, i );
+				run[ j ]->Draw( pd3dDevice, pInput->GetTech() );
+			}
+		}
+	}
+	else for( UINT i = 0; i < min( oCount, sCount ); i++ )	
+	{
+		if( impostors && pImpostors->IsImpostor( i ) )
+			continue;
+		
+		// prepare object-oriented pInput variables
+		pInput->PrepareObject( ( float* )pSpace->GetWorldPosition( i ).m, i );
+		
+		// DRAW!!!
+		objects[ i ]->Draw( pd3dDevice, pInput->GetTech() );
+	}
+	stats.drawnObjects = min( oCount, sCount ) - impostors;
+	
+	// the impostors come with their own layout and topology
+	stats.drawnImpostors = 0;
+	if( impostors )
+	{
+		stats.drawnImpostors = pImpostors->Draw();
+		pd3dDevice->IASetInputLayout( pInput->GetLayout() );
+		pd3dDevice->IASetPrimitiveTopology( D3D10_PRIMITIVE_TOPOLOGY_TRIANGLELIST );
+	}
+	
+	// //////////////////////////////////////
+	// render the floor
+	
+	// prepare object-oriented pInput variables for the floor
+	if( oGroundZero )
+	{
+		// the lightmap is baked elsewhere (see FloorLightmap::Update),
+		// here only rows that changed since are sent to the gpu
+		if( pLightmap && FloorDescribed )
+			pInput->SetFloorLightmap( pLightmap->Upload( pd3dDevice ), FloorRect );
+		
+		pInput->PrepareObject( ( float* )XMMatrixTranslation( 0.0f, -1.0f, 0.0f ).m, -1 );
+		oGroundZero->Draw( pd3dDevice, pInput->GetTech() );
+		stats.drawnObjects++;
+	}
+	
+	// //////////////////////////////////////
+	// render the particles
+	
+	// all of them go in a single instanced draw, with their own
+	// input layout, so the scene's layout is restored afterwards
+	stats.drawnParticles = 0;
+	if( pParticles )
+	{
+		stats.drawnParticles = pParticles->Draw( pCam );
+		pd3dDevice->IASetInputLayout( pInput->GetLayout() );
+	}
+
+	// //////////////////////////////////////
+    // Present our back buffer to our front buffer
+    pSwapChain->Present( 0, 0 );
+	
+	// the frame is done, editors may now delete the version
+	if( version )
+		pVersions->Unpin();
+	
+	// //////////////////////////////////////
+	// update statistics
+	
+	stats.threadAllocations = getThreadAllocations();
+	stats.processAllocations = getProcessAllocations();
+	stats.frameAllocations.allocations = stats.threadAllocations.allocations - allocsAtStart.allocations;
+	stats.frameAllocations.frees = stats.threadAllocations.frees - allocsAtStart.frees;
+	stats.frameAllocations.bytes = stats.threadAllocations.bytes - allocsAtStart.bytes;
+	stats.frameNumber++;
+	
+#if defined( TRACK_ALLOCATIONS ) && defined( _DEBUG )
+	// once the warmup is over, painting the scene must not 
+	// touch the heap at all. if this fires, something on 
+	// the render path (vector growth, shared_ptr creation
+	// etc.) allocates memory every frame
+	assert( stats.frameNumber <= ALLOCATION_WARMUP_FRAMES || 
+		stats.frameAllocations.allocations == 0 );
+#endif
+}
+
+// method loads texture for the floor. it also erases previous texture if needed
+HRESULT		Mateyko::loadTexture( LPCWSTR szFileName )
+{
+	HRESULT hr = S_OK;
+	
+	// remove previous texture if needed
+	if( FloorTextureRV )	FloorTextureRV->Release();
+	
+	// bind new texture
+	hr = D3DX10CreateShaderResourceViewFromFile( pd3dDevice, szFileName, NULL, NULL, &FloorTextureRV, NULL );
+	if( FAILED( hr ) )
+		ERRORMACRO( L"Cannot load texture." );
+	else FloorTextureFile = szFileName;
+	
+	// set resourece to the shader variable
+	if( FloorTextureRV )	pInput->SetFloorTex( FloorTextureRV );
+	return hr;
+}
+
+// saves stored client rectangle width and height to the provided references
+void	Mateyko::GetClientRectSize( UINT& _width, UINT& _height )
+{
+	_width = Width;
+	_height = Height;
+}
+
+// get device method
+ID3D10Device*		Mateyko::GetDevice()				{ 	return pd3dDevice; 	}
+ShaderInput*		Mateyko::GetInput()					{ 	return pInput; 	}
+
+// returns statistics gathered during the last PaintScene call
+const Statistics&	Mateyko::GetStatistics()			{	return stats;	}
+
+// object list getters
+UINT				Mateyko::GetObjectCount()			{	return objects.size();	}
+Object3D*			Mateyko::GetObject3D( UINT oNum )	{	return objects[ oNum ].get();	}
+std::shared_ptr< Object3D >	Mateyko::GetSharedObject( UINT oNum )	{	return objects[ oNum ];	}
+XMFLOAT4			Mateyko::GetColor( UINT oNum )		{	return oColors[ oNum ];	}
+XMFLOAT4*			Mateyko::GetColorArray()			{	return oColors.empty() ? NULL : oColors.data();	}
+const Material&		Mateyko::GetMaterial( UINT oNum )	{	return oMaterials[ oNum ];	}
+ColorTable*			Mateyko::GetColorTable()			{	return pColorTable;	}
+Material*			Mateyko::GetMaterialArray()			{	return oMaterials.empty() ? NULL : oMaterials.data();	}
+
+// handle and name getters
+ObjectHandle		Mateyko::GetHandle( UINT oNum )		{	return oHandles[ oNum ];	}
+
+UINT	Mateyko::GetObjectIndex( ObjectHandle handle )
+{
+	return handle < handleIndices.size() ? handleIndices[ handle ] : NO_OBJECT;
+}
+
+// the floor isn't kept in the index, its name is checked apart
+ObjectHandle	Mateyko::FindObject( LPCWSTR name )
+{
+	ObjectHandle handle = oNames.Find( name );
+	if( handle == NO_OBJECT && oGroundZero && !FloorName.empty() && FloorName == name )
+		return FLOOR_OBJECT;
+	return handle;
+}
+
+LPCWSTR		Mateyko::GetObjectName( ObjectHandle handle )
+{
+	if( handle == FLOOR_OBJECT )
+		return FloorName.empty() ? NULL : FloorName.c_str();
+	return oNames.GetName( handle );
+}
+
+bool	Mateyko::RenameObject( ObjectHandle handle, LPCWSTR name )
+{
+	if( handle == FLOOR_OBJECT )
+	{
+		FloorName = name;
+		return true;
+	}
+	if( GetObjectIndex( handle ) == NO_OBJECT )
+		return false;
+	return oNames.Rename( handle, name );
+}
+
+UINT	Mateyko::FindObjects( LPCWSTR prefix, std::vector< ObjectHandle >& found )
+{
+	UINT count = oNames.FindPrefix( prefix, found );
+	if( oGroundZero && !FloorName.empty() && FloorName.compare( 0, wcslen( prefix ), prefix ) == 0 )
+	{
+		found.push_back( FLOOR_OBJECT );
+		count++;
+	}
+	return count;
+}
+
+// sphere index of the Space is also the index of the object,
+// so the hit only has to be turned into a handle
+ObjectHandle	Mateyko::Pick( UINT x, UINT y, RayHit* hit )
+{
+	RayHit		result;
+	XMFLOAT3	origin, direction;
+	
+	if( pCam == NULL || pSpace == NULL || Width == 0 || Height == 0 )
+		return NO_OBJECT;
+	
+	pCam->GetPickRay( x + 0.5f, y + 0.5f, ( float )Width, ( float )Height, origin, direction );
+	
+	if( pBVH )
+		pBVH->Intersect( origin, direction, FLT_MAX, result );
+	else
+	{
+		const XMFLOAT4*	spheres = ( const XMFLOAT4* )pSpace->GetShaderPositionArray();
+		float			distance;
+		
+		result.sphere = NO_OBJECT;
+		result.distance = FLT_MAX;
+		for( UINT i = 0; i < pSpace->size(); i++ )
+			if( raySphere( origin, direction, spheres[ i ], distance ) && distance < result.distance )
+			{
+				result.sphere = i;
+				result.distance = distance;
+			}
+		
+		if( result.sphere != NO_OBJECT )
+		{
+			const XMFLOAT4& s = spheres[ result.sphere ];
+			result.position = XMFLOAT3( origin.x + direction.x * result.distance, origin.y + direction.y * result.distance, origin.z + direction.z * result.distance );
+			result.normal = XMFLOAT3( ( result.position.x - s.x ) / s.w, ( result.position.y - s.y ) / s.w, ( result.position.z - s.z ) / s.w );
+		}
+	}
+	
+	if( hit )
+		*hit = result;
+	if( result.sphere >= objects.size() )
+		return NO_OBJECT;
+	return oHandles[ result.sphere ];
+}
+
+bool	Mateyko::GetFloor( FloorDesc& floor )
+{
+	if( oGroundZero == NULL || !FloorDescribed )
+		return false;
+	floor = FloorRect;
+	return true;
+}
+
+UINT	Mateyko::AddLight( const Light& light )
+{
+	lights.push_back( light );
+	return lights.size() - 1;
+}
+
+void	Mateyko::SetLight( UINT lNumber, const Light& light )
+{
+	if( lNumber < lights.size() )
+		lights[ lNumber ] = light;
+}
+
+void	Mateyko::RemoveLight( UINT lNumber )
+{
+	if( lNumber >= lights.size() )
+		return;
+	lights[ lNumber ] = lights.back();
+	lights.pop_back();
+}
+
+void			Mateyko::RemoveAllLights()				{	lights.clear();	}
+const Light&	Mateyko::GetLight( UINT lNumber )		{	return lights[ lNumber ];	}
+UINT			Mateyko::GetLightCount()				{	return lights.size();	}
+
+// corners go around the rectangle, as formRectangleObject puts
+// them. PaintScene draws the floor 1 below its vertices
+void	Mateyko::describeFloor( const Vertex* vertices, UINT count )
+{
+	FloorDescribed = count == 4;
+	if( !FloorDescribed )
+		return;
+	
+	XMVECTOR v0 = XMLoadFloat3( &vertices[ 0 ].Pos );
+	XMVECTOR v1 = XMLoadFloat3( &vertices[ 1 ].Pos );
+	XMVECTOR v2 = XMLoadFloat3( &vertices[ 2 ].Pos );
+	XMVECTOR v3 = XMLoadFloat3( &vertices[ 3 ].Pos );
+	XMVECTOR half = XMVectorReplicate( 0.5f );
+	
+	XMStoreFloat3( &FloorRect.centre, XMVectorAdd( XMVectorMultiply( XMVectorAdd( v0, v2 ), half ), XMVectorSet( 0.0f, -1.0f, 0.0f, 0.0f ) ) );
+	XMStoreFloat3( &FloorRect.halfLength, XMVectorMultiply( XMVectorSubtract( v3, v0 ), half ) );
+	XMStoreFloat3( &FloorRect.halfWidth, XMVectorMultiply( XMVectorSubtract( v1, v0 ), half ) );
+	XMStoreFloat3( &FloorRect.normal, XMVector3Normalize( XMLoadFloat3( &vertices[ 0 ].Norm ) ) );
+}
+
+// binding funcs. each of them bind respective device, and Mateyko won't draw anything without them
+void	Mateyko::BindCamera( Camera* cam )				{	pCam = cam; 	}
+void	Mateyko::BindSpace( Space* spa )				{	pSpace = spa; 	}
+void	Mateyko::BindJournal( SceneJournal* jou )		{	pJournal = jou;	}
+void	Mateyko::BindEditQueue( SceneEditQueue* seq )	{	pEdits = seq;	}
+void	Mateyko::BindSceneVersions( SceneVersionStore* svs )	{	pVersions = svs;	}
+void	Mateyko::BindParticles( ParticleSystem* pas )			{	pParticles = pas;	}
+void	Mateyko::BindImpostors( SphereImpostors* sim )			{	pImpostors = sim;	}
+
+// the table takes all the current colors, from now on
+// it's kept in step with the objects
+void	Mateyko::BindColorTable( ColorTable* cot )
+{
+	pColorTable = cot;
+	if( pColorTable )
+	{
+		pColorTable->Resize( oColors.size() );
+		pColorTable->Set( 0, oColors.data(), oColors.size() );
+	}
+}
+void	Mateyko::BindBVH( SphereBVH* bvh )						{	pBVH = bvh;	}
+void	Mateyko::BindLightmap( FloorLightmap* flm )				{	pLightmap = flm;	}
+void	Mateyko::BindLightClusters( LightClusters* lcs )		{	pClusters = lcs;	}
+void	Mateyko::BindSkyLight( SkyLight* sky )					{	pSky = sky;	}
+
+// bindinput also has to set input layout to the device
+void	Mateyko::BindInput( ShaderInput* shi )			
+{	
+	pInput = shi; 
+	pd3dDevice->IASetInputLayout( pInput->GetLayout() );	
+}
+
+// /////////////////////////////////////////////////////
+// 
+// MATEYKO OBJECT LIST MANAGEMENT METHODS
+//
+// /////////////////////////////////////////////////
+
+// in case a pointer to the object was provided without
+// color, copy the object and store predefined color
+void	Mateyko::InsertObject( Object3D* o3d )
+{
+	// create the shared_ptr for o3d argument
+	std::shared_ptr<Object3D>	o3ptr( new Object3D( *o3d ) );
+
+	// copy object3d using copy constructor
+	// construct shared_ptr using typical pointer
+	objects.push_back( o3ptr );
+	oColors.push_back( XMFLOAT4( 0.4f, 0.7f, 0.2f, 1.0f ) );
+	oMaterials.push_back( Material() );
+	addHandle();
+	appendColor();
+	
+	if( pJournal )
+		pJournal->RecordInsert( pd3dDevice, o3ptr.get(), NULL, NULL, oColors.back() );
+}
+
+// creates the object using provided data then stores
+// its pointer within objects vector and saves color
+// to the oColors vector, ensuring every object
+// has its corresponding color stored under the same
+// index.
+void	Mateyko::InsertObject( void* verts, DWORD* inds, UINT vSize, UINT iSize, XMFLOAT4 color )
+{
+	// create the shared_ptr for o3d argument
+	std::shared_ptr<Object3D>	o3ptr( new Object3D( pd3dDevice, verts, inds, vSize, iSize ) );
+
+	// do stuff
+	objects.push_back( o3ptr );
+	oColors.push_back( color );
+	oMaterials.push_back( Material() );
+	addHandle();
+	appendColor();
+	
+	if( pJournal )
+		pJournal->RecordInsert( pd3dDevice, o3ptr.get(), verts, inds, color );
+}
+
+// stores an already existing object under a new index.
+// unlike InsertObject( Object3D* ) it doesn't copy the object,
+// so all the indices sharing the pointer share the object too.
+void	Mateyko::InsertObject( std::shared_ptr< Object3D > o3ptr, XMFLOAT4 color )
+{
+	objects.push_back( o3ptr );
+	oColors.push_back( color );
+	oMaterials.push_back( Material() );
+	addHandle();
+	appendColor();
+	
+	if( pJournal )
+		pJournal->RecordInsert( pd3dDevice, o3ptr.get(), NULL, NULL, color );
+}
+
+// handles are given in order of insertion
+void	Mateyko::addHandle()
+{
+	oHandles.push_back( handleIndices.size() );
+	handleIndices.push_back( objects.size() - 1 );
+}
+
+// color of the object inserted last goes into the color table
+void	Mateyko::appendColor()
+{
+	if( pColorTable )
+	{
+		pColorTable->Resize( oColors.size() );
+		pColorTable->Set( oColors.size() - 1, &oColors.back(), 1 );
+	}
+}
+
+// replaces the floor with a copy of provided object
+void	Mateyko::InsertFloor( Object3D* o3d )
+{
+	if( oGroundZero )
+		delete oGroundZero;
+	oGroundZero = new Object3D( *o3d );
+	FloorDescribed = false;
+	
+	if( pJournal )
+		pJournal->RecordFloor( pd3dDevice, oGroundZero, NULL, NULL );
+}
+
+// removes object and color with a corresponding index.
+// causes a reallocation inside vectors, so better be
+// used carefully. we do not expect much juggling with
+// objects on the scene, therefore do not see the need
+// for replacing vector with forward_list or map or sth.
+void	Mateyko::RemoveObject( int oNum )
+{
+	objects.erase( objects.begin() + oNum );
+	oColors.erase( oColors.begin() + oNum );
+	oMaterials.erase( oMaterials.begin() + oNum );
+	if( pColorTable )
+		pColorTable->Erase( oNum );
+	
+	// the handle dies along with the object, and
+	// all the objects after it move one index back
+	oNames.Remove( oHandles[ oNum ] );
+	handleIndices[ oHandles[ oNum ] ] = NO_OBJECT;
+	oHandles.erase( oHandles.begin() + oNum );
+	for( UINT i = oNum; i < oHandles.size(); i++ )
+		handleIndices[ oHandles[ i ] ] = i;
+	
+	if( pJournal )
+		pJournal->RecordRemove( oNum );
+}
+
+// removes all objects and their colors from the vectors
+// leaving them empty.
+void	Mateyko::RemoveAll()
+{
+	objects.clear();
+	oColors.clear();
+	oMaterials.clear();
+	if( pColorTable )
+		pColorTable->Resize( 0 );
+	
+	// handles are never reused, so indices of the old
+	// ones are kept, just marked as gone
+	for( UINT i = 0; i < oHandles.size(); i++ )
+		handleIndices[ oHandles[ i ] ] = NO_OBJECT;
+	oHandles.clear();
+	oNames.Clear();
+	
+	if( pJournal )
+		pJournal->RecordRemoveAll();
+}
+
+// sometimes its necesarry to updates objects color
+// and thats what this method does.
+void	Mateyko::updateColor( unsigned int oNumber, XMFLOAT4 color )
+{
+	if( oNumber < oColors.size() )
+	{
+		oColors[ oNumber ] = color;
+		if( pColorTable )
+			pColorTable->Set( oNumber, &color, 1 );
+		if( pJournal )
+			pJournal->RecordColor( oNumber, color );
+	}
+}
+
+// handles are turned into indices first, then all the colors
+// go into the table in a single pass
+void	Mateyko::UpdateColors( const ObjectHandle* handles, const XMFLOAT4* colors, UINT count )
+{
+	if( recolored.size() < count )
+		recolored.resize( count );
+	
+	UINT found = 0;
+	for( UINT i = 0; i < count; i++ )
+	{
+		UINT oNum = handles[ i ] < handleIndices.size() ? handleIndices[ handles[ i ] ] : NO_OBJECT;
+		if( oNum == NO_OBJECT )
+			continue;
+		
+		oColors[ oNum ] = colors[ i ];
+		recolored[ found++ ] = oNum;
+	}
+	ColorsWritten( recolored.data(), found );
+}
+
+void	Mateyko::UpdateColors( UINT first, const XMFLOAT4* colors, UINT count )
+{
+	if( first >= oColors.size() )
+		return;
+	count = min( count, ( UINT )oColors.size() - first );
+	
+	memcpy( &oColors[ first ], colors, count * sizeof( XMFLOAT4 ) );
+	if( pColorTable )
+		pColorTable->Set( first, colors, count );
+	if( pJournal )
+		for( UINT i = 0; i < count; i++ )
+			pJournal->RecordColor( first + i, colors[ i ] );
+}
+
+void	Mateyko::ColorsWritten( const UINT* indices, UINT count )
+{
+	if( pColorTable )
+		pColorTable->Gather( indices, oColors.data(), count );
+	if( pJournal )
+		for( UINT i = 0; i < count; i++ )
+			if( indices[ i ] < oColors.size() )
+				pJournal->RecordColor( indices[ i ], oColors[ indices[ i ] ] );
+}
+
+// journaled like updateColor
+void	Mateyko::SetMaterial( UINT oNumber, const Material& material )
+{
+	if( oNumber < oMaterials.size() )
+	{
+		oMaterials[ oNumber ] = material;
+		if( pJournal )
+			pJournal->RecordMaterial( oNumber, material );
+	}
+}
+
+// /////////////////////////////////////////////////////
+//
+// MATEYKO FORM OBJECT METHODS
+//
+// /////////////////////////////////////////////////
+
+// creates a sphere of desired radius and color and with
+// desired number of meridians and parallels
+// (see buildSphereMesh), then forms an Object3D using it.
+// finally stores the sphere into the
+// objects std::vector of a Mateyko class
+void Mateyko::formSphere( LPCWSTR _name, UINT meridians, UINT parallels, float radius, XMFLOAT4 color, bool compact )
+{
+	std::vector< Vertex >	fnVertices;
+	std::vector< DWORD >	fnIndices;
+	buildSphereMesh( meridians, parallels, radius, color, fnVertices, fnIndices );
+	
+	// //////////////////////////////////////
+	// final func stage
+
+	if( compact )
+		InsertObject( std::shared_ptr< Object3D >( createObject3D< CompactVertex >( pd3dDevice, 
+			fnVertices.data(), fnIndices.data(), fnVertices.size(), fnIndices.size() ) ), color );
+	else InsertObject( fnVertices.data(), fnIndices.data(), fnVertices.size(), fnIndices.size(), color );
+	objects.back()->MarkSphere();
+	
+	// names must be unique. if it's taken, the sphere is still
+	// created, but can be found only by its index or handle
+	if( _name && *_name && !oNames.Insert( _name, oHandles.back() ) )
+		ERRORMACRO( L"Object name is already taken." );
+}
+
+// creates a rectangle surface of desired length and width.
+// surface' normal is described by planeNormal variable
+// and lenDir is the direction of the surface (egdes
+// parallel to that direction are described by length var)
+void	Mateyko::formRectangleObject( LPCWSTR _name, float length, float width, XMFLOAT3 planeNormal, XMFLOAT3 lenDir )
+{
+	// ////////////////////////////////////////
+	// DECLARE VARIABLES
+	// ...
+	// those two are the final vertices and final
+	// indices that will be used to form an object
+	std::vector< Vertex >	fnVertices;
+	std::vector< DWORD >	fnIndices;
+	
+	XMMATRIX	mxRectSpace;	// transformation matrix
+	Vertex		tmpVertex;		// we store here the vertex we want push back into vector
+	
+	// combining those floats and their negatives in the
+	// space created by planeNormal and lenDir gives us
+	// all four vertices that form the rectangle
+	float xC = length * 0.5f;
+	float zC = width * 0.5f;
+
+	// aquire the base of the rectangle space.
+	// in this space previously defined xC and zC
+	// are enough to get the vertex of the rectangle
+	mxRectSpace = getSpaceMatrix( lenDir, planeNormal, true );
+
+	// prepare tmpVertex
+	tmpVertex.Color = XMFLOAT4( 0.8f, 0.1f, 0.3f, 1.0f );
+	tmpVertex.Norm = planeNormal;
+	
+	// calculate positions of all four corners at once (the
+	// space matrix is affine, so there's no need to divide)
+	// and store vertices in order: --, -+, ++, +-
+	float cornersX[ 4 ] = { -xC, -xC, xC, xC };
+	float cornersY[ 4 ] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	float cornersZ[ 4 ] = { -zC, zC, zC, -zC };
+	transformPoints( cornersX, cornersY, cornersZ, 4, mxRectSpace, cornersX, cornersY, cornersZ );
+	
+	for( UINT i = 0; i < 4; i++ )
+	{
+		tmpVertex.Pos = XMFLOAT3( cornersX[ i ], cornersY[ i ], cornersZ[ i ] );
+		fnVertices.push_back( tmpVertex );
+	}
+
+	// get indices set
+	fnIndices.push_back( 0 );
+	fnIndices.push_back( 1 );
+	fnIndices.push_back( 2 );
+	fnIndices.push_back( 0 );
+	fnIndices.push_back( 2 );
+	fnIndices.push_back( 3 );
+
+	// //////////////////////////////////////
+	// final func stage
+	
+	// note: now this raytracer don't need
+	// any other rectangles apart from its
+	// ground. so instead of returning the
+	// vertices and indices create the obj
+	// and attach it to GroundZero pointer
+
+	// in case ground was already created remove preous one
+	if( oGroundZero )
+		delete oGroundZero;
+		
+	// create new ground object
+	oGroundZero = new Object3D( 
+		pd3dDevice, 
+		fnVertices.data(), 
+		fnIndices.data(), 
+		fnVertices.size(), 
+		fnIndices.size() );
+	FloorName = _name ? _name : L"";
+	describeFloor( fnVertices.data(), fnVertices.size() );
+	
+	if( pJournal )
+		pJournal->RecordFloor( pd3dDevice, oGroundZero, fnVertices.data(), fnIndices.data() );
+}
+
+// /////////////////////////////////////////////////////
+//
+// MATEYKO SCENE SNAPSHOT METHODS
+//
+// /////////////////////////////////////////////////
+
+// rounds the offset up to the multiple of alignment
+static UINT64	alignOffset( UINT64 offset, UINT64 alignment )
+{
+	return ( offset + alignment - 1 ) / alignment * alignment;
+}
+
+// writes bytes to the file. WriteFile takes DWORD sizes, 
+// so bigger chunks are written in pieces. position is
+// advanced by the number of bytes written
+static bool		writeBytes( HANDLE file, const void* data, UINT64 bytes, UINT64& position )
+{
+	const BYTE*	ptr = ( const BYTE* )data;
+	DWORD		written;
+	
+	while( bytes > 0 )
+	{
+		DWORD chunk = bytes > 0x40000000 ? 0x40000000 : ( DWORD )bytes;
+		if( !WriteFile( file, ptr, chunk, &written, NULL ) || written != chunk )
+			return false;
+		ptr += chunk;
+		bytes -= chunk;
+		position += chunk;
+	}
+	return true;
+}
+
+// tells whether count elements of the given size starting at
+// the offset lie within a file of the given size. it's done by 
+// division, so huge counts from a broken file can't wrap around
+static bool		fitsInFile( UINT64 offset, UINT64 count, UINT64 elementSize, UINT64 size )
+{
+	return offset <= size && count <= ( size - offset ) / elementSize;
+}
+
+// fills the file with zeroes up to the target offset
+static bool		writePadding( HANDLE file, UINT64 target, UINT64& position )
+{
+	static const BYTE	zeroes[ 4096 ] = { 0 };
+	while( position < target )
+	{
+		UINT64 bytes = target - position > sizeof( zeroes ) ? sizeof( zeroes ) : target - position;
+		if( !writeBytes( file, zeroes, bytes, position ) )
+			return false;
+	}
+	return true;
+}
+
+// collects unique meshes of the scene for the SaveScene method.
+// objects copied from one another share their buffers, so they
+// are recognized by the vertex buffer pointer without reading
+// anything back. the rest is compared by the content hash,
+// which catches identical meshes that were created separately
+struct SnapshotMeshCollector
+{
+	ID3D10Device*							device;
+	std::map< ID3D10Buffer*, DWORD >		byBuffer;
+	std::multimap< UINT64, DWORD >			byHash;
+	
+	std::vector< SnapshotMesh >				meshes;
+	std::vector< std::vector< BYTE > >		vertices;
+	std::vector< std::vector< DWORD > >		indices;
+	
+	// finds or stores the mesh of an object, returns its index
+	HRESULT	Add( Object3D* o3d, DWORD& meshIndex )
+	{
+		std::map< ID3D10Buffer*, DWORD >::iterator	known = byBuffer.find( o3d->GetVertexBuffer() );
+		if( known != byBuffer.end() )
+		{
+			meshIndex = known->second;
+			return S_OK;
+		}
+		
+		std::vector< BYTE >		v;
+		std::vector< DWORD >	i;
+		HRESULT hr = o3d->ReadBack( device, v, i );
+		if( FAILED( hr ) )
+			return hr;
+		
+		UINT64 hash = hashBytes( v.data(), v.size(), HASH_OFFSET_BASIS );
+		hash = hashBytes( i.data(), i.size() * sizeof( DWORD ), hash );
+		
+		// look for the same content among meshes with the same hash
+		meshIndex = SNAPSHOT_NO_MESH;
+		std::pair< std::multimap< UINT64, DWORD >::iterator, std::multimap< UINT64, DWORD >::iterator >	
+			range = byHash.equal_range( hash );
+		for( std::multimap< UINT64, DWORD >::iterator it = range.first; it != range.second; ++it )
+		{
+			if( vertices[ it->second ] == v && indices[ it->second ] == i )
+			{
+				meshIndex = it->second;
+				break;
+			}
+		}
+		
+		// nothing found, store the new one
+		if( meshIndex == SNAPSHOT_NO_MESH )
+		{
+			SnapshotMesh	mesh;
+			ZeroMemory( &mesh, sizeof( mesh ) );
+			mesh.vertexCount = o3d->GetVertexCount();
+			mesh.indexCount = o3d->GetIndexCount();
+			mesh.stride = sizeof( Vertex );		// ReadBack decodes compact vertices
+			
+			meshIndex = meshes.size();
+			meshes.push_back( mesh );
+			vertices.push_back( std::vector< BYTE >() );
+			indices.push_back( std::vector< DWORD >() );
+			vertices.back().swap( v );
+			indices.back().swap( i );
+			byHash.insert( std::make_pair( hash, meshIndex ) );
+		}
+		
+		byBuffer[ o3d->GetVertexBuffer() ] = meshIndex;
+		return S_OK;
+	}
+};
+
+// saves objects, their colors and materials, floor, Space's spheres, Camera
+// placement and shading control values into a snapshot file.
+// Camera, ShaderInput and Space are saved only if they're bound
+HRESULT		Mateyko::SaveScene( LPCWSTR szFileName )
+{
+	// ////////////////////////////////////////////
+	// DECLARE VARIABLES
+	// ...
+	HRESULT							hr = S_OK;
+	HANDLE							file;
+	SnapshotHeader					header;
+	SnapshotMeshCollector			collector;
+	std::vector< SnapshotObject >	sObjects;
+	UINT64							position = 0;
+	
+	if( pd3dDevice == NULL )
+		return E_FAIL;
+	
+	// ////////////////////////////////////////////
+	// DEFINE VARIABLES
+	// ...
+	ZeroMemory( &header, sizeof( header ) );
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.objectCount = objects.size();
+	header.floorMesh = SNAPSHOT_NO_MESH;
+	header.textureChars = FloorTextureFile.size();
+	collector.device = pd3dDevice;
+	
+	// gather objects and their unique meshes
+	sObjects.resize( objects.size() );
+	for( UINT i = 0; i < objects.size() && SUCCEEDED( hr ); i++ )
+	{
+		ZeroMemory( &sObjects[ i ], sizeof( SnapshotObject ) );
+		sObjects[ i ].color = oColors[ i ];
+		hr = collector.Add( objects[ i ].get(), sObjects[ i ].mesh );
+	}
+	if( SUCCEEDED( hr ) && oGroundZero )
+		hr = collector.Add( oGroundZero, header.floorMesh );
+	if( FAILED( hr ) )
+	{
+		ERRORMACRO( L"Cannot read the meshes back from the device." );
+		return hr;
+	}
+	header.meshCount = collector.meshes.size();
+	
+	// bound devices
+	if( pCam )
+	{
+		header.flags |= SNAPSHOT_HAS_CAMERA;
+		pCam->GetPlacement( header.camEye, header.camAt, header.camUp, header.camFoV );
+	}
+	if( pInput )
+	{
+		header.flags |= SNAPSHOT_HAS_SHADING;
+		pInput->GetShadingControls( header.shading );
+	}
+	if( pSpace )
+	{
+		header.flags |= SNAPSHOT_HAS_SPACE;
+		header.sphereCount = pSpace->size();
+	}
+	
+	// ////////////////////////////////////////////
+	// FILE LAYOUT
+	// ...
+	// tables go one after another, mesh data section
+	// starts at the next mappable boundary
+	header.objectsOffset = sizeof( header );
+	header.materialsOffset = header.objectsOffset + header.objectCount * sizeof( SnapshotObject );
+	header.spheresOffset = header.materialsOffset + header.objectCount * sizeof( Material );
+	header.radiiOffset = header.spheresOffset + header.sphereCount * sizeof( XMFLOAT4 );
+	header.meshesOffset = header.radiiOffset + header.sphereCount * sizeof( float );
+	header.textureOffset = header.meshesOffset + header.meshCount * sizeof( SnapshotMesh );
+	header.dataOffset = alignOffset( header.textureOffset + header.textureChars * sizeof( WCHAR ), SNAPSHOT_SECTION_ALIGNMENT );
+	
+	UINT64 offset = header.dataOffset;
+	for( UINT m = 0; m < header.meshCount; m++ )
+	{
+		SnapshotMesh& mesh = collector.meshes[ m ];
+		mesh.vertexOffset = alignOffset( offset, SNAPSHOT_DATA_ALIGNMENT );
+		mesh.indexOffset = alignOffset( mesh.vertexOffset + ( UINT64 )mesh.vertexCount * mesh.stride, SNAPSHOT_DATA_ALIGNMENT );
+		offset = mesh.indexOffset + mesh.indexCount * sizeof( DWORD );
+	}
+	header.dataSize = offset - header.dataOffset;
+	
+	// ////////////////////////////////////////////
+	// WRITE
+	// ...
+	file = CreateFile( szFileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+	if( file == INVALID_HANDLE_VALUE )
+	{
+		ERRORMACRO( L"Cannot create the snapshot file." );
+		return E_FAIL;
+	}
+	
+	bool ok = writeBytes( file, &header, sizeof( header ), position );
+	if( ok && header.objectCount )
+		ok = writeBytes( file, sObjects.data(), header.objectCount * sizeof( SnapshotObject ), position ) &&
+			writeBytes( file, oMaterials.data(), header.objectCount * sizeof( Material ), position );
+	if( ok && header.sphereCount )
+		ok = writeBytes( file, pSpace->GetShaderPositionArray(), header.sphereCount * sizeof( XMFLOAT4 ), position ) &&
+			writeBytes( file, pSpace->GetMeshRadii(), header.sphereCount * sizeof( float ), position );
+	if( ok && header.meshCount )
+		ok = writeBytes( file, collector.meshes.data(), header.meshCount * sizeof( SnapshotMesh ), position );
+	if( ok && header.textureChars )
+		ok = writeBytes( file, FloorTextureFile.c_str(), header.textureChars * sizeof( WCHAR ), position );
+	
+	for( UINT m = 0; ok && m < header.meshCount; m++ )
+	{
+		SnapshotMesh& mesh = collector.meshes[ m ];
+		ok = writePadding( file, mesh.vertexOffset, position ) &&
+			writeBytes( file, collector.vertices[ m ].data(), collector.vertices[ m ].size(), position ) &&
+			writePadding( file, mesh.indexOffset, position ) &&
+			writeBytes( file, collector.indices[ m ].data(), collector.indices[ m ].size() * sizeof( DWORD ), position );
+	}
+	
+	CloseHandle( file );
+	if( !ok )
+	{
+		ERRORMACRO( L"Cannot write the snapshot file." );
+		return E_FAIL;
+	}
+	return S_OK;
+}
+
+// replaces the scene with the one stored in a snapshot file.
+// the whole file is mapped into memory at once and buffers
+// are created straight from the mapped mesh data section,
+// so there's no parsing nor copying of the meshes at all.
+// every mesh gets a single Object3D, shared by all objects using it
+HRESULT		Mateyko::LoadScene( LPCWSTR szFileName )
+{
+	// ////////////////////////////////////////////
+	// DECLARE VARIABLES
+	// ...
+	HANDLE									file, mapping;
+	LARGE_INTEGER							fileSize;
+	const BYTE*								view;
+	const SnapshotHeader*					header;
+	const SnapshotObject*					sObjects;
+	const Material*							sMaterials;
+	const SnapshotMesh*						sMeshes;
+	std::vector< std::shared_ptr< Object3D > >	meshes;
+	bool									valid;
+	
+	if( pd3dDevice == NULL )
+		return E_FAIL;
+	
+	// ////////////////////////////////////////////
+	// MAP THE FILE
+	// ...
+	file = CreateFile( szFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if( file == INVALID_HANDLE_VALUE )
+	{
+		ERRORMACRO( L"Cannot open the snapshot file." );
+		return E_FAIL;
+	}
+	
+	GetFileSizeEx( file, &fileSize );
+	mapping = CreateFileMapping( file, NULL, PAGE_READONLY, 0, 0, NULL );
+	view = mapping ? ( const BYTE* )MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) : NULL;
+	if( view == NULL )
+	{
+		if( mapping )	CloseHandle( mapping );
+		CloseHandle( file );
+		ERRORMACRO( L"Cannot map the snapshot file." );
+		return E_FAIL;
+	}
+	
+	// ////////////////////////////////////////////
+	// VALIDATE
+	// ...
+	// make sure every table and every mesh lies within the file,
+	// so a broken snapshot won't make us read random memory
+	UINT64 size = fileSize.QuadPart;
+	header = ( const SnapshotHeader* )view;
+	valid = size >= sizeof( SnapshotHeader ) &&
+		header->magic == SNAPSHOT_MAGIC &&
+		header->version == SNAPSHOT_VERSION &&
+		fitsInFile( header->objectsOffset, header->objectCount, sizeof( SnapshotObject ), size ) &&
+		fitsInFile( header->materialsOffset, header->objectCount, sizeof( Material ), size ) &&
+		fitsInFile( header->spheresOffset, header->sphereCount, sizeof( XMFLOAT4 ), size ) &&
+		fitsInFile( header->radiiOffset, header->sphereCount, sizeof( float ), size ) &&
+		fitsInFile( header->meshesOffset, header->meshCount, sizeof( SnapshotMesh ), size ) &&
+		fitsInFile( header->textureOffset, header->textureChars, sizeof( WCHAR ), size ) &&
+		( header->floorMesh == SNAPSHOT_NO_MESH || header->floorMesh < header->meshCount );
+	
+	sObjects = ( const SnapshotObject* )( view + header->objectsOffset );
+	sMaterials = ( const Material* )( view + header->materialsOffset );
+	sMeshes = ( const SnapshotMesh* )( view + header->meshesOffset );
+	
+	for( UINT m = 0; valid && m < header->meshCount; m++ )
+	{
+		valid = sMeshes[ m ].stride == sizeof( Vertex ) &&
+			fitsInFile( sMeshes[ m ].vertexOffset, sMeshes[ m ].vertexCount, sMeshes[ m ].stride, size ) &&
+			fitsInFile( sMeshes[ m ].indexOffset, sMeshes[ m ].indexCount, sizeof( DWORD ), size );
+	}
+	for( UINT i = 0; valid && i < header->objectCount; i++ )
+		valid = sObjects[ i ].mesh < header->meshCount;
+	
+	if( !valid )
+	{
+		UnmapViewOfFile( view );
+		CloseHandle( mapping );
+		CloseHandle( file );
+		ERRORMACRO( L"Snapshot file is damaged or comes from an unsupported version." );
+		return E_FAIL;
+	}
+	
+	// ////////////////////////////////////////////
+	// BUILD THE SCENE
+	// ...
+	// objects using the floor mesh only are not created 
+	// as a shared Object3D. floor is kept by a raw pointer
+	meshes.resize( header->meshCount );
+	for( UINT i = 0; i < header->objectCount; i++ )
+	{
+		const SnapshotMesh& mesh = sMeshes[ sObjects[ i ].mesh ];
+		if( !meshes[ sObjects[ i ].mesh ] )
+			meshes[ sObjects[ i ].mesh ].reset( new Object3D( pd3dDevice, 
+				( void* )( view + mesh.vertexOffset ), ( DWORD* )( view + mesh.indexOffset ),
+				mesh.vertexCount, mesh.indexCount ) );
+	}
+	
+	RemoveAll();
+	objects.reserve( header->objectCount );
+	oColors.reserve( header->objectCount );
+	oMaterials.reserve( header->objectCount );
+	for( UINT i = 0; i < header->objectCount; i++ )
+	{
+		InsertObject( meshes[ sObjects[ i ].mesh ], sObjects[ i ].color );
+		SetMaterial( i, sMaterials[ i ] );
+	}
+	
+	if( oGroundZero )
+		delete oGroundZero;
+	oGroundZero = NULL;
+	if( header->floorMesh != SNAPSHOT_NO_MESH )
+	{
+		const SnapshotMesh& mesh = sMeshes[ header->floorMesh ];
+		oGroundZero = new Object3D( pd3dDevice, 
+			( void* )( view + mesh.vertexOffset ), ( DWORD* )( view + mesh.indexOffset ),
+			mesh.vertexCount, mesh.indexCount );
+		describeFloor( ( const Vertex* )( view + mesh.vertexOffset ), mesh.vertexCount );
+		
+		if( pJournal )
+			pJournal->RecordFloor( pd3dDevice, oGroundZero, view + mesh.vertexOffset, ( DWORD* )( view + mesh.indexOffset ) );
+	}
+	
+	// bound devices take only what was saved, except for Space.
+	// its spheres belong to the objects, which were all replaced
+	if( pSpace && ( header->flags & SNAPSHOT_HAS_SPACE ) )
+		pSpace->SetSpheres( ( const XMFLOAT4* )( view + header->spheresOffset ), header->sphereCount,
+			( const float* )( view + header->radiiOffset ) );
+	else if( pSpace )
+		pSpace->RemoveAll();
+	if( pCam && ( header->flags & SNAPSHOT_HAS_CAMERA ) )
+		pCam->SetPlacement( header->camEye, header->camAt, header->camUp, header->camFoV );
+	if( pInput && ( header->flags & SNAPSHOT_HAS_SHADING ) )
+		pInput->SetShadingControls( header->shading );
+	
+	// texture's file name has to be copied before the view is gone
+	std::wstring texture( ( const WCHAR* )( view + header->textureOffset ), header->textureChars );
+	
+	UnmapViewOfFile( view );
+	CloseHandle( mapping );
+	CloseHandle( file );
+	
+	if( !texture.empty() && pInput )
+		return loadTexture( texture.c_str() );
+	return S_OK;
+}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// SHADER INPUT	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+// main constructor of the ShaderInput class
+// only one since the copy & default were disabled.
+// creates shaders from file and binds them to 
+// Effect variable. obtain technique from that file
+// and saves it to the Technique variable. then creates 
+// input layout from the VertexFormat of the Vertex struct.
+// in the end initializes all shader variables 
+// using previously creted Effect.
+
+ShaderInput::ShaderInput( 
+	ID3D10Device*	pd3dDevice,		// pointer to the device that will create the input
+	LPCWSTR szFileName, 			// path to a file contains shaders
+	LPCSTR szTechName )				// name of the technique defined in the shader file
+{
+	// variables
+	HRESULT hr = S_OK;
+	DWORD dwShaderFlags = D3D10_SHADER_ENABLE_STRICTNESS;
+
+	// create EFFECT
+	hr = D3DX10CreateEffectFromFile( 
+		szFileName, 
+		NULL, NULL, "fx_4_0", 
+		dwShaderFlags, 0, 
+		pd3dDevice, 
+		NULL, NULL, 
+		&Effect, 
+		NULL, NULL );
+
+	if( FAILED( hr ) )
+		ERRORMACRO( L"Critical failure during shader compilation process." );
+
+	// create TECHNIQUE
+	Technique = Effect->GetTechniqueByName( szTechName );
+
+	// Create the input layout using the first tech, var INPUT
+	hr = CreateLayout< Vertex >( pd3dDevice, &Input );
+	
+	if( FAILED( hr ) )
+		ERRORMACRO( L"Nie jest fajno, szefie" );
+		
+	// when the most important variables are being handled
+	// its time to define variables that will pass data to
+	// the constant buffers.
+
+	// create effect matrix variables
+	World 		= Effect->GetVariableByName( 	"World" 		)->AsMatrix();
+	View 		= Effect->GetVariableByName( 	"View" 			)->AsMatrix();
+	Projection 	= Effect->GetVariableByName( 	"Projection" 	)->AsMatrix();
+
+	// create effect vector variables
+	Light 		= Effect->GetVariableByName( 	"Light" 		)->AsVector();
+	CamEye 		= Effect->GetVariableByName( 	"CamEye" 		)->AsVector();
+	BigBalls 	= Effect->GetVariableByName( 	"BigBalls" 		)->AsVector();
+	OColors 	= Effect->GetVariableByName( 	"OColors" 		)->AsVector();
+	OMaterials 	= Effect->GetVariableByName( 	"OMaterials" 	)->AsVector();
+
+	// create effect scalar variables
+	// look to the class header for further descriptions
+	num_processed 		= Effect->GetVariableByName( 	"num_processed" 	)->AsScalar();
+	count_processed 	= Effect->GetVariableByName( 	"count_processed" 	)->AsScalar();
+	brightness 			= Effect->GetVariableByName( 	"brightness" 		)->AsScalar();
+	reflectance 		= Effect->GetVariableByName( 	"reflectance" 		)->AsScalar();
+	skybright 			= Effect->GetVariableByName( 	"skybright" 		)->AsScalar();
+	diffuseStr 			= Effect->GetVariableByName( 	"diffuseStr" 		)->AsScalar();
+	gamma 				= Effect->GetVariableByName( 	"gamma" 			)->AsScalar();
+	ColorNumVar 		= Effect->GetVariableByName( 	"ColorNumVar" 		)->AsScalar();
+
+	// create texture and map variables
+	FloorTexture = Effect->GetVariableByName( "FloorTexture" )->AsShaderResource();
+	LightmapTexture = Effect->GetVariableByName( "FloorLightmap" )->AsShaderResource();
+	LightmapRect = Effect->GetVariableByName( "FloorLightmapRect" )->AsVector();
+	
+	// create light cluster variables
+	LightRanges = Effect->GetVariableByName( "LightRanges" )->AsShaderResource();
+	LightIndices = Effect->GetVariableByName( "LightIndices" )->AsShaderResource();
+	LightData = Effect->GetVariableByName( "LightData" )->AsShaderResource();
+	LightGrid = Effect->GetVariableByName( "LightGrid" )->AsVector();
+	LightSlices = Effect->GetVariableByName( "LightSlices" )->AsVector();
+	SkySH = Effect->GetVariableByName( "SkySH" )->AsVector();
+	OColorTable = Effect->GetVariableByName( "OColorTable" )->AsShaderResource();
+	UseColorTable = Effect->GetVariableByName( "UseColorTable" )->AsScalar();
+
+	// prepare values that need to be passed to shaders
+	vGamma = 2.2f;	
+	vBrightness = 0.8f;	
+	vReflectance = 2.35f;
+	vSkyBrightness = 1.1f;	
+	vDiffusePower = 1.25f;	
+	vChannel = 0;			
+}
+
+// ShaderInput destructor.
+// destructs things pretty nicely.
+ShaderInput::~ShaderInput()
+{
+	// release things
+	if( Input )			Input->Release();
+	if( Effect )		Effect->Release();
+	
+	// according to the msdn all effect variables
+	// are released when its parent effect is released.
+	// so we do not do it manually.
+}
+
+// passes almost all shading control variables
+// (except the num_processed which is diffrent
+// for every object on the scene) to the shader's
+// constants buffers. used in PaintScene
+void	ShaderInput::PrepareShadingControlVars( int arg )
+{
+	ColorNumVar->SetInt( 		vChannel );
+	brightness->SetFloat( 		vBrightness );
+	reflectance->SetFloat( 		vReflectance );
+	gamma->SetFloat( 			vGamma );
+	diffuseStr->SetFloat( 		vDiffusePower );
+	skybright->SetFloat( 		vSkyBrightness );
+	count_processed->SetInt(	arg );
+}
+
+// passes the arguments to the shaders
+// those arguments are view and projection
+// matrices, generated by a Camera object,
+// passed as a pointers to the matrix' float array
+void	ShaderInput::PrepareCameraMatrices( 
+	float* _view, 
+	float* _proj )
+{
+	View->SetMatrix( _view );
+	Projection->SetMatrix( _proj );
+}
+
+// passes the argument (which is an xmfloat
+// camera's eye position converted to the float*)
+// to the shaders.
+void	ShaderInput::PrepareEyePos( float* _eye )
+{
+	CamEye->SetFloatVector( _eye );
+}
+
+// passes positions of all objects and the
+// number of objects to the shaders. positions
+// are, as usual, provided as an array of floats
+void	ShaderInput::PreparePositions( 
+	float* _pos, 
+	int _count )
+{
+	BigBalls->SetFloatVectorArray( _pos, 0, _count );
+}
+
+// passes colors the same way did with positions
+void	ShaderInput::PrepareColors( 
+	float* _colors, 
+	int _count )
+{
+	OColors->SetFloatVectorArray( _colors, 0, _count );
+}
+
+// and materials the same way colors. shaders multiply the
+// global shading values by the material of num_processed,
+// the floor (index -1) is shaded with the global ones
+void	ShaderInput::PrepareMaterials( 
+	float* _materials, 
+	int _count )
+{
+	OMaterials->SetFloatVectorArray( _materials, 0, _count );
+}
+
+// passes current object's world matrix 
+// and its index on the object list. 
+void	ShaderInput::PrepareObject( 
+	float* _matrix, 
+	int _index )
+{
+	num_processed->SetInt( _index );
+	World->SetMatrix( _matrix );
+}
+	
+void	ShaderInput::SetFPS( float arg )								{ 	fps = arg; 	}
+void	ShaderInput::SetFloorTex( ID3D10ShaderResourceView* shevi )		{	FloorTexture->SetResource( shevi ); 	}
+
+// axes are divided by their squared lengths, so the shader gets
+// lightmap coordinates as dot( position - centre, axis ) * 0.5 + 0.5
+void	ShaderInput::SetFloorLightmap( ID3D10ShaderResourceView* shevi, const FloorDesc& floor )
+{
+	const XMFLOAT3& l = floor.halfLength;
+	const XMFLOAT3& w = floor.halfWidth;
+	float lengthSq = l.x * l.x + l.y * l.y + l.z * l.z;
+	float widthSq = w.x * w.x + w.y * w.y + w.z * w.z;
+	
+	XMFLOAT4 rect[ 3 ] = 
+	{
+		XMFLOAT4( floor.centre.x, floor.centre.y, floor.centre.z, 1.0f ),
+		XMFLOAT4( l.x / lengthSq, l.y / lengthSq, l.z / lengthSq, 0.0f ),
+		XMFLOAT4( w.x / widthSq, w.y / widthSq, w.z / widthSq, 0.0f ),
+	};
+	
+	LightmapTexture->SetResource( shevi );
+	LightmapRect->SetFloatVectorArray( ( float* )rect, 0, 3 );
+}
+
+// a pixel finds its cluster by its position on the screen
+// and slice = log( view depth ) * scale + bias. the grid 
+// size goes along with the number of lights
+void	ShaderInput::PrepareLights( LightClusters* clusters )
+{
+	float	slices[ 4 ] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	float	grid[ 4 ] = 
+	{ 
+		( float )clusters->GetLightCount(), 
+		( float )LIGHT_CLUSTERS_X, 
+		( float )LIGHT_CLUSTERS_Y, 
+		( float )LIGHT_CLUSTERS_Z 
+	};
+	clusters->GetSliceParams( slices[ 0 ], slices[ 1 ] );
+	
+	LightGrid->SetFloatVector( grid );
+	LightSlices->SetFloatVector( slices );
+	LightRanges->SetResource( clusters->GetRangeView() );
+	LightIndices->SetResource( clusters->GetIndexView() );
+	LightData->SetResource( clusters->GetLightView() );
+}
+
+void	ShaderInput::PrepareSkyLight( SkyLight* sky )
+{
+	SkySH->SetFloatVectorArray( ( float* )sky->GetCoefficients(), 0, 9 );
+}
+
+// the buffer's format unpacks colors into floats on their 
+// own, so the shaders read them the same way in any format
+void	ShaderInput::PrepareColorTable( ColorTable* table )
+{
+	OColorTable->SetResource( table ? table->GetView() : NULL );
+	UseColorTable->SetBool( table != NULL );
+}
+
+// copies all shading control values into the provided struct
+void	ShaderInput::GetShadingControls( ShadingControls& controls )
+{
+	controls.gamma = vGamma;
+	controls.brightness = vBrightness;
+	controls.reflectance = vReflectance;
+	controls.skyBrightness = vSkyBrightness;
+	controls.diffusePower = vDiffusePower;
+	controls.channel = vChannel;
+}
+
+// sets all shading control values at once
+void	ShaderInput::SetShadingControls( const ShadingControls& controls )
+{
+	vGamma = controls.gamma;
+	vBrightness = controls.brightness;
+	vReflectance = controls.reflectance;
+	vSkyBrightness = controls.skyBrightness;
+	vDiffusePower = controls.diffusePower;
+	vChannel = controls.channel;
+}
+
+// depending on which variable is pointed by
+// the varIndex, method adds or subtracts 
+// to/from that variable.
+void	ShaderInput::NmpdAddSubtract( double arg )
+{
+	// negOrPos is short for negative or positive.
+	// it basically tells us if the passed argument
+	// (double arg) is above or below or equal to zero
+	// multiplying by sigma reduce the necessity for
+	// creating two branches in an alghoritm
+	// when we want to add or subtract to a paricular
+	// variable depending on sign of the add argument
+	float	negOrPos;
+	if( arg >= 0.0f )	
+		negOrPos = 1.0f;
+	else negOrPos = -1.0f;
+	
+	// decide which shading control var is to be
+	// incremented or decremented depending on 
+	// varIndex variable (which is set by NmpdNumber method)
+	switch( varIndex )
+	{
+	
+	// floating point vars
+	case 1:		vGamma 				+= negOrPos * 0.1f / fps;	break;
+	case 2:		vBrightness 		+= negOrPos * 0.2f / fps;	break;
+	case 3:		vReflectance 		+= negOrPos * 0.4f / fps;	break;
+	case 4:		vDiffusePower 		+= negOrPos * 0.4f / fps;	break;
+	case 5:		vSkyBrightness 		+= negOrPos * 0.4f / fps;	break;
+	
+	// integer var. we want to set limits to it, so user won't get far
+	// from those few channels out there.
+	case 6:
+		if( vChannel <= 14 && arg >= 0.0f )		vChannel++;
+		else if( vChannel > 0 && arg < 0.0f )	vChannel--;
+		break;
+	}
+}
+
+// simply sets the index for the NmpdAddSubtract method.
+void	ShaderInput::NmpdNumber( int arg )	{	varIndex = arg; 	}
+
+ID3D10EffectTechnique* const		ShaderInput::GetTech()		{	return Technique;	}
+ID3D10InputLayout* const			ShaderInput::GetLayout()	{ 	return Input; 		}
+ID3D10Effect*						ShaderInput::GetEffect()	{	return Effect;		}
+
+// input layout matching the signature of the first pass of the technique
+HRESULT		ShaderInput::CreateLayout( 
+	ID3D10Device* pd3dDevice, 					// device that will create the layout
+	const D3D10_INPUT_ELEMENT_DESC* elements, 	// elements of the vertex format
+	UINT count, 
+	ID3D10InputLayout** layout )
+{
+	D3D10_PASS_DESC PassDesc;
+	
+	Technique->GetPassByIndex( 0 )->GetDesc( &PassDesc );
+	return pd3dDevice->CreateInputLayout( 
+		elements, 
+		count, 
+		PassDesc.pIAInputSignature,
+		PassDesc.IAInputSignatureSize, 
+		layout );
+}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// CAMERA	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+// default constructor
+Camera::Camera()
+	:	Eye( 10.0f, 5.0f, 0.0f ),
+		At( 0.0f, 0.0f, 0.0f ),
+		Up( 0.0f, 1.0f, 0.0f ),
+		// starting direction
+		
+		FoV( 1.0f ),
+		fps( 1.0f ),
+		ScreenRatio( 1.0f ),
+		// those three need to be regulated separately via
+		// setters. set for 1.0f to avoid any problems with division
+		
+		acceleration( 3.0f ),
+		braking( -3.0f ),		
+		// needs to be negative, because we're adding it to the velos
+		// both acc.. and br.. have fixed values for now
+		
+		veloUpDown( 0.0f ),
+		veloLeftRight( 0.0f ),
+		veloEyeRot( 0.0f ),
+		veloAtRot( 0.0f )
+		// velocities starts at 0.0f
+		// as they increase when user
+		// presses the buttons or moves
+		// the mouse.
+{}
+
+// the second constructor
+// look to the default one for explanations
+Camera::Camera( XMFLOAT3 _eye, XMFLOAT3 _at, XMFLOAT3 _up )
+	:	Eye( _eye ),
+		At( _at ),
+		Up( _up ),
+		
+		FoV( 1.0f ),
+		fps( 1.0f ),
+		ScreenRatio( 1.0f ),
+		
+		acceleration( 3.0f ),
+		braking( -3.0f ),		
+		
+		veloUpDown( 0.0f ),
+		veloLeftRight( 0.0f ),
+		veloEyeRot( 0.0f ),
+		veloAtRot( 0.0f )
+{}
+
+void	Camera::SetFPS( float arg )								{ 	fps = arg; 	}
+void	Camera::SetScreenRatio( float arg )						{	ScreenRatio = arg;	}
+void	Camera::SetFoV( float arg )								{	FoV = arg; 	}
+
+void	Camera::GetPlacement( XMFLOAT3& _eye, XMFLOAT3& _at, XMFLOAT3& _up, float& _fov )
+{
+	_eye = Eye;
+	_at = At;
+	_up = Up;
+	_fov = FoV;
+}
+
+void	Camera::SetPlacement( XMFLOAT3 _eye, XMFLOAT3 _at, XMFLOAT3 _up, float _fov )
+{
+	Eye = _eye;
+	At = _at;
+	Up = _up;
+	FoV = _fov;
+	
+	// camera jumped to the new place, so it shouldn't keep moving
+	veloUpDown = 0.0f;
+	veloLeftRight = 0.0f;
+	veloEyeRot = 0.0f;
+	veloAtRot = 0.0f;
+}
+
+void	Camera::UpdateCam()
+{
+	// first, reduce the velocities
+	veloUpDown 		+= braking / fps;
+	veloLeftRight 	+= braking / fps;
+	veloEyeRot		+= braking / fps;
+	veloAtRot		+= braking / fps;
+	
+	// then check if any velocity is lower that zero and handle that
+	if( veloUpDown < 0.0f ) 	veloUpDown = 0.0f;
+	if( veloLeftRight < 0.0f ) 	veloLeftRight = 0.0f;
+	if( veloEyeRot < 0.0f ) 	veloEyeRot = 0.0f;
+	if( veloAtRot < 0.0f ) 		veloAtRot = 0.0f;
+}
+
+void	Camera::ArrowsUpDown( double arg )
+{
+	// DECLARE VARIABLES
+	XMVECTOR	vtrAt, vtrEye;		// xmvector equivalents of Eye and At xmfloats
+	XMVECTOR	movDir;				// the direction on the xz plane in which camera looks
+	float	negOrPos;
+
+	// DEFINE VARIABLES
+	vtrAt = XMLoadFloat3( &At );
+	vtrEye = XMLoadFloat3( &Eye );
+	
+	// we first get the difference vector between
+	// the eye and at points, then remove y factor
+	// so we have direction parallel to the xz plane
+	// then normalize it, so the distance between
+	// at and eye does not affect the speed increment
+
+	if( arg >= 0.0f )	
+		negOrPos = 1.0f;
+	else negOrPos = -1.0f;
+	
+	movDir = vtrAt - vtrEye;
+	movDir = XMVectorSetY( movDir, 0.0f );
+	movDir = XMVector3Normalize( movDir );
+	
+	// if velocity didn't reach its max level increase
+	if( veloUpDown < 1.0f ) 
+		veloUpDown += acceleration / fps;
+	
+	// we divide by fps value, because we don't want
+	// refresh rate to affect the speed
+	vtrAt += negOrPos * veloUpDown * movDir / fps;
+	vtrEye += negOrPos * veloUpDown * movDir / fps;
+	
+	// store incremented values
+	XMStoreFloat3( &At, vtrAt );
+	XMStoreFloat3( &Eye, vtrEye );
+}
+
+void	Camera::ArrowsLeftRight( double arg )
+{	
+	// DECLARE VARIABLES
+	XMVECTOR	vtrAt, vtrEye;		// xmvector equivalents of Eye and At xmfloats
+	XMVECTOR	movDir;				// the direction on the xz plane in which camera looks
+	
+	// DEFINE VARIABLES
+	vtrAt = XMLoadFloat3( &At );
+	vtrEye = XMLoadFloat3( &Eye );
+	
+	// the first line of code below is similar to respective line 
+	// in the ArrowsUpDown method, look there for explanation.
+	// next we take the cross product which is perpendicular
+	// to the direction camera is facing, and that means 
+	// its pointing right. if needed we multiply it by
+	// -1.0f so it points left.
+	
+	movDir = XMVector3Normalize( XMVectorSetY( ( vtrAt - vtrEye ), 0.0f ) );
+	movDir = XMVector3Cross( movDir, XMVectorSet( 0.0f, 1.0f, 0.0f, 0.0f ) );
+	if( arg < 0.0f )
+		movDir = movDir * -1.0f;
+		
+	// if velocity didn't reach its max level increase
+	if( veloLeftRight < 1.0f ) 
+		veloLeftRight += acceleration / fps;
+		
+	// we divide by fps value, because we don't want
+	// refresh rate to affect the speed
+	vtrAt += veloLeftRight * movDir / fps;
+	vtrEye += veloLeftRight * movDir / fps;
+	
+	// store incremented values
+	XMStoreFloat3( &At, vtrAt );
+	XMStoreFloat3( &Eye, vtrEye );
+}
+
+// this methods rotates the eye around at point. to do so
+// we want to find vector that is perpendicular both to 
+// the zx plane and the vertical plane along which we 
+// want to move the eye point. such vector is required 
+// for the rotation matrix construction.
+// arg says how far we want to rotate (in radians)
+void	Camera::MouseUpDown( double arg )
+{
+	// DECLARE VARIABLES
+	XMMATRIX	mxRota;				// matrix that will help us get the final eye position
+	XMVECTOR	vtrAt, vtrEye;		// xmvector equivalents of Eye and At xmfloats
+	XMVECTOR	movDir;				// the direction on the xz plane in which camerais looking
+	float		atEyeDist;
+	float		cosine;
+	
+	// DEFINE VARIABLES
+	vtrAt = XMLoadFloat3( &At );
+	vtrEye = XMLoadFloat3( &Eye );
+	
+	// we need to check if rotation around
+	// the at point won't left camera upside down.
+	// technically i wouldn't be as much of a problem
+	// since the class generates the view matrix
+	// every time anew, but it might confuse the user
+	
+	movDir = vtrEye - vtrAt;
+	cosine = XMVectorGetX( XMVector3Dot( XMVector3Normalize( movDir ), XMVectorSet( 0.0f, 1.0f, 0.0f, 0.0f ) ) );
+	if( ( cosine > 0.9f && arg >= 0.0f ) ||
+		( cosine < 0.9f && arg < 0.0f ) )
+		return;
+	
+	// store the distance between at and eye position
+	atEyeDist = XMVectorGetX( XMVector3Length( movDir ) );
+	
+	// operation below is explained in the respective
+	// comment section in the methods above this one.
+	movDir = XMVector3Normalize( XMVectorSetY( movDir, 0.0f ) );
+	movDir = XMVector3Cross( movDir, XMVectorSet( 0.0f, 1.0f, 0.0f, 0.0f ) );
+	
+	// rotate the at-eye vector around an at point,
+	// making it pointing the new eye position
+	mxRota = XMMatrixRotationAxis( movDir, arg );	
+	movDir = XMVector3TransformCoord( movDir, mxRota );
+	
+	// find new eye position
+	vtrEye = vtrAt + atEyeDist * movDir;
+	
+	// store final result
+	XMStoreFloat3( &Eye, vtrEye );
+}
+
+// this method is similar to the previous one, only
+// instead of vertical rotation we employ horizontal
+// (to the viewer) rotation around at point. such
+// similarity allows us to use the same solutions
+// as in the method above. we too construct rotation
+// matrix, but this time around 0-1-0 vector.
+void	Camera::MouseLeftRight( double arg )
+{
+	// DECLARE VARIABLES
+	XMMATRIX	mxRota;				// matrix that will help us get the final eye position
+	XMVECTOR	vtrAt, vtrEye;		// xmvector equivalents of Eye and At xmfloats
+	XMVECTOR	movDir;				// the direction on the xz plane in which camera looks
+	
+	// DEFINE VARIABLES
+	vtrAt = XMLoadFloat3( &At );
+	vtrEye = XMLoadFloat3( &Eye );
+	
+	// construct the rotation matrix
+	// and rotate the at-eye vector
+	mxRota = XMMatrixRotationAxis( XMVectorSet( 0.0f, 1.0f, 0.0f, 0.0f ), arg );
+	movDir = vtrEye - vtrAt;
+	movDir = XMVector3TransformCoord( movDir, mxRota );
+	
+	// find new eye position
+	vtrEye = vtrAt + movDir;
+	
+	// store final result
+	XMStoreFloat3( &Eye, vtrEye );
+}
+
+// wsadleftright works same as mouseleftright
+// except the at point is rotated around eye.
+// so, if want any explanations, look to
+// the mouseleftright.
+void	Camera::WsadLeftRight( double arg )
+{
+	// DECLARE VARIABLES
+	XMMATRIX	mxRota;				// matrix that will help us get the final eye position
+	XMVECTOR	vtrAt, vtrEye;		// xmvector equivalents of Eye and At xmfloats
+	XMVECTOR	movDir;				// the direction on the xz plane in which camera looks
+	
+	// DEFINE VARIABLES
+	vtrAt = XMLoadFloat3( &At );
+	vtrEye = XMLoadFloat3( &Eye );
+	
+	// rotate the movDir
+	mxRota = XMMatrixRotationAxis( XMVectorSet( 0.0f, 1.0f, 0.0f, 0.0f ), XM_PI * veloEyeRot / fps );
+	movDir = vtrAt - vtrEye;
+	movDir = XMVector3TransformCoord( movDir, mxRota );
+	
+	// find new eye position
+	vtrAt = vtrEye + movDir;
+	
+	// store final result
+	XMStoreFloat3( &At, vtrAt );
+}
+
+// returns view matrix
+XMMATRIX	Camera::GetView()
+{
+	return XMMatrixLookAtLH( 
+		XMLoadFloat3( &Eye ), 		// eye or camera position. point where view frustum begins
+		XMLoadFloat3( &At ), 		// point which camera is focusing on
+		XMLoadFloat3( &Up ) );		// world's up direction
+}
+
+// returns projection matrix
+XMMATRIX	Camera::GetProjection()
+{
+	return XMMatrixPerspectiveFovLH( 
+		FoV, 						// field of view in radians
+		ScreenRatio, 				// ratio between the width and height of a client rectancgle
+		0.1f, 						// distance to the near clipping plane
+		100.0f );					// distance to the far clipping plane
+}
+
+// returns eye position. 
+XMFLOAT4	Camera::GetEyePos()
+{
+	return XMFLOAT4( Eye.x, Eye.y, Eye.z, 0.0f );
+}
+
+// planes are taken straight from the columns of view-projection
+// matrix. a point p is inside when -w <= x <= w, -w <= y <= w
+// and 0 <= z <= w (where ( x, y, z, w ) = p * viewProj), so every
+// inequality gives one plane. then the planes are normalized,
+// so they give true distances
+void	Camera::GetFrustumPlanes( XMFLOAT4* planes )
+{
+	XMFLOAT4X4	m;
+	XMStoreFloat4x4( &m, XMMatrixMultiply( GetView(), GetProjection() ) );
+	
+	planes[ 0 ] = XMFLOAT4( m._14 + m._11, m._24 + m._21, m._34 + m._31, m._44 + m._41 );	// left
+	planes[ 1 ] = XMFLOAT4( m._14 - m._11, m._24 - m._21, m._34 - m._31, m._44 - m._41 );	// right
+	planes[ 2 ] = XMFLOAT4( m._14 + m._12, m._24 + m._22, m._34 + m._32, m._44 + m._42 );	// bottom
+	planes[ 3 ] = XMFLOAT4( m._14 - m._12, m._24 - m._22, m._34 - m._32, m._44 - m._42 );	// top
+	planes[ 4 ] = XMFLOAT4( m._13, m._23, m._33, m._43 );									// near
+	planes[ 5 ] = XMFLOAT4( m._14 - m._13, m._24 - m._23, m._34 - m._33, m._44 - m._43 );	// far
+	
+	for( UINT i = 0; i < 6; i++ )
+		XMStoreFloat4( &planes[ i ], XMPlaneNormalize( XMLoadFloat4( &planes[ i ] ) ) );
+}
+
+// pixel is turned into the normalized device coordinates, then
+// its points on the near and far planes are transformed back
+// to the world space by the inverse of view-projection matrix
+void	Camera::GetPickRay( float x, float y, float width, float height, XMFLOAT3& origin, XMFLOAT3& direction )
+{
+	XMVECTOR	determinant;
+	XMMATRIX	inverse = XMMatrixInverse( &determinant, XMMatrixMultiply( GetView(), GetProjection() ) );
+	float		ndcX = 2.0f * x / width - 1.0f;
+	float		ndcY = 1.0f - 2.0f * y / height;
+	
+	XMVECTOR	nearPoint = XMVector3TransformCoord( XMVectorSet( ndcX, ndcY, 0.0f, 1.0f ), inverse );
+	XMVECTOR	farPoint = XMVector3TransformCoord( XMVectorSet( ndcX, ndcY, 1.0f, 1.0f ), inverse );
+	
+	XMStoreFloat3( &origin, nearPoint );
+	XMStoreFloat3( &direction, XMVector3Normalize( XMVectorSubtract( farPoint, nearPoint ) ) );
+}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// JOB SYSTEM	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+JobSystem::JobSystem( UINT _workerCount )
+	:	workerCount( _workerCount ),
+		job( NULL ),
+		jobData( NULL ),
+		jobCount( 0 ),
+		jobBatch( 1 ),
+		nextBatch( 0 ),
+		activeWorkers( 0 ),
+		startedWorkers( 0 ),
+		quit( 0 )
+{
+	if( workerCount == 0 )
+	{
+		SYSTEM_INFO	info;
+		GetSystemInfo( &info );
+		workerCount = info.dwNumberOfProcessors > 1 ? info.dwNumberOfProcessors - 1 : 0;
+	}
+	
+	// all the events must exist before any worker starts
+	doneEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+	threads = new HANDLE[ workerCount ];
+	wakeEvents = new HANDLE[ workerCount ];
+	for( UINT i = 0; i < workerCount; i++ )
+		wakeEvents[ i ] = CreateEvent( NULL, FALSE, FALSE, NULL );
+	for( UINT i = 0; i < workerCount; i++ )
+		threads[ i ] = CreateThread( NULL, 0, workerMain, this, 0, NULL );
+}
+
+// workers are woken up with the quit flag set, 
+// and we wait until all of them are gone
+JobSystem::~JobSystem()
+{
+	InterlockedExchange( &quit, 1 );
+	for( UINT i = 0; i < workerCount; i++ )
+		SetEvent( wakeEvents[ i ] );
+	for( UINT i = 0; i < workerCount; i++ )
+	{
+		WaitForSingleObject( threads[ i ], INFINITE );
+		CloseHandle( threads[ i ] );
+		CloseHandle( wakeEvents[ i ] );
+	}
+	CloseHandle( doneEvent );
+	delete[] threads;
+	delete[] wakeEvents;
+}
+
+// every worker waits on its own event, so each of them
+// takes part in every loop exactly once. which event
+// belongs to which worker is decided by the order they start
+DWORD WINAPI	JobSystem::workerMain( LPVOID param )
+{
+	JobSystem*	jobs = ( JobSystem* )param;
+	UINT		index = InterlockedIncrement( &jobs->startedWorkers ) - 1;
+	
+	for( ;; )
+	{
+		WaitForSingleObject( jobs->wakeEvents[ index ], INFINITE );
+		if( jobs->quit )
+			return 0;
+		
+		jobs->runBatches();
+		if( InterlockedDecrement( &jobs->activeWorkers ) == 0 )
+			SetEvent( jobs->doneEvent );
+	}
+}
+
+// takes batches until there's nothing left
+void	JobSystem::runBatches()
+{
+	for( ;; )
+	{
+		UINT begin = InterlockedExchangeAdd( &nextBatch, jobBatch );
+		if( begin >= jobCount )
+			return;
+		job( jobData, begin, min( begin + jobBatch, jobCount ) );
+	}
+}
+
+void	JobSystem::ParallelFor( UINT count, UINT batchSize, JobFunc _job, void* data )
+{
+	if( count == 0 )
+		return;
+	
+	// few items aren't worth waking anybody up
+	if( workerCount == 0 || count <= batchSize )
+	{
+		_job( data, 0, count );
+		return;
+	}
+	
+	job = _job;
+	jobData = data;
+	jobCount = count;
+	jobBatch = max( batchSize, 1u );
+	nextBatch = 0;
+	activeWorkers = workerCount;
+	ResetEvent( doneEvent );
+	MemoryBarrier();
+	
+	for( UINT i = 0; i < workerCount; i++ )
+		SetEvent( wakeEvents[ i ] );
+	
+	runBatches();
+	WaitForSingleObject( doneEvent, INFINITE );
+}
+
+UINT	JobSystem::GetThreadCount()		{	return workerCount + 1;	}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// SWEEP AND PRUNE	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+SweepAndPrune::SweepAndPrune()
+	:	axis( 0 )
+{}
+
+const std::vector< SpherePair >&	SweepAndPrune::Update( const XMFLOAT4* spheres, UINT count )
+{
+	bool	resort = false;
+	
+	// every sphere has one endpoint, so if the number
+	// has changed they're simply made anew
+	if( endpoints.size() != count )
+	{
+		endpoints.resize( count );
+		for( UINT i = 0; i < count; i++ )
+			endpoints[ i ].sphere = i;
+		resort = true;
+	}
+	
+	// choose the axis of the biggest variance of the centres.
+	// it's changed only if the new one is clearly better, 
+	// otherwise spheres jittering around would make us
+	// switch axes (and sort everything anew) all the time
+	double	sum[ 3 ] = { 0.0, 0.0, 0.0 };
+	double	sumSq[ 3 ] = { 0.0, 0.0, 0.0 };
+	for( UINT i = 0; i < count; i++ )
+	{
+		const float* centre = &spheres[ i ].x;
+		for( UINT a = 0; a < 3; a++ )
+		{
+			sum[ a ] += centre[ a ];
+			sumSq[ a ] += centre[ a ] * centre[ a ];
+		}
+	}
+	
+	double	variance[ 3 ];
+	UINT	best = axis;
+	for( UINT a = 0; a < 3; a++ )
+	{
+		variance[ a ] = count ? sumSq[ a ] / count - ( sum[ a ] / count ) * ( sum[ a ] / count ) : 0.0;
+		if( variance[ a ] > variance[ best ] )
+			best = a;
+	}
+	if( best != axis && variance[ best ] > 1.2 * variance[ axis ] )
+	{
+		axis = best;
+		resort = true;
+	}
+	
+	for( UINT i = 0; i < count; i++ )
+	{
+		const XMFLOAT4& sphere = spheres[ endpoints[ i ].sphere ];
+		endpoints[ i ].min = ( &sphere.x )[ axis ] - sphere.w;
+	}
+	
+	if( resort )
+	{
+		struct	ByMin	{	bool operator()( const Endpoint& a, const Endpoint& b ) const	{	return a.min < b.min;	}	};
+		std::sort( endpoints.begin(), endpoints.end(), ByMin() );
+	}
+	else for( UINT i = 1; i < count; i++ )
+	{
+		// insertion sort. most of the spheres are already 
+		// in place, and the rest move only a few steps
+		Endpoint	moved = endpoints[ i ];
+		UINT		j = i;
+		for( ; j > 0 && endpoints[ j - 1 ].min > moved.min; j-- )
+			endpoints[ j ] = endpoints[ j - 1 ];
+		endpoints[ j ] = moved;
+	}
+	
+	// sweep. spheres following the current one are tested
+	// until the first one starting beyond its highest point
+	pairs.clear();
+	for( UINT i = 0; i < count; i++ )
+	{
+		const XMFLOAT4&	a = spheres[ endpoints[ i ].sphere ];
+		float			highest = endpoints[ i ].min + 2.0f * a.w;
+		
+		for( UINT j = i + 1; j < count && endpoints[ j ].min <= highest; j++ )
+		{
+			const XMFLOAT4&	b = spheres[ endpoints[ j ].sphere ];
+			float	dx = a.x - b.x;
+			float	dy = a.y - b.y;
+			float	dz = a.z - b.z;
+			float	r = a.w + b.w;
+			if( dx * dx + dy * dy + dz * dz <= r * r )
+			{
+				SpherePair	pair = { min( endpoints[ i ].sphere, endpoints[ j ].sphere ), max( endpoints[ i ].sphere, endpoints[ j ].sphere ) };
+				pairs.push_back( pair );
+			}
+		}
+	}
+	return pairs;
+}
+
+const std::vector< SpherePair >&	SweepAndPrune::GetPairs()	{	return pairs;	}
+UINT								SweepAndPrune::GetAxis()	{	return axis;	}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// SPATIAL GRID	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+SpatialGrid::SpatialGrid()
+	:	cellSize( 1.0f ),
+		invCellSize( 1.0f ),
+		maxRadius( 0.0f ),
+		mask( 0 ),
+		source( NULL ),
+		pJobs( NULL )
+{}
+
+void	SpatialGrid::cellOf( const XMFLOAT4& sphere, int* cell )
+{
+	cell[ 0 ] = ( int )floorf( sphere.x * invCellSize );
+	cell[ 1 ] = ( int )floorf( sphere.y * invCellSize );
+	cell[ 2 ] = ( int )floorf( sphere.z * invCellSize );
+}
+
+// coordinates are multiplied by big primes and mixed, so
+// neighbouring cells end up in unrelated buckets
+UINT	SpatialGrid::bucketOf( int x, int y, int z )
+{
+	UINT hash = ( ( UINT )x * 73856093u ) ^ ( ( UINT )y * 19349663u ) ^ ( ( UINT )z * 83492791u );
+	return ( hash ^ ( hash >> 16 ) ) & mask;
+}
+
+void	SpatialGrid::run( UINT count, UINT batchSize, JobFunc job )
+{
+	if( pJobs )
+		pJobs->ParallelFor( count, batchSize, job, this );
+	else job( this, 0, count );
+}
+
+void	SpatialGrid::countJob( void* grid, UINT begin, UINT end )
+{
+	SpatialGrid*	g = ( SpatialGrid* )grid;
+	int				cell[ 3 ];
+	for( UINT i = begin; i < end; i++ )
+	{
+		g->cellOf( g->source[ i ], cell );
+		g->keys[ i ] = g->bucketOf( cell[ 0 ], cell[ 1 ], cell[ 2 ] );
+		InterlockedIncrement( &g->bucketEnds[ g->keys[ i ] ] );
+	}
+}
+
+void	SpatialGrid::placeJob( void* grid, UINT begin, UINT end )
+{
+	SpatialGrid*	g = ( SpatialGrid* )grid;
+	for( UINT i = begin; i < end; i++ )
+	{
+		UINT slot = InterlockedIncrement( &g->bucketEnds[ g->keys[ i ] ] ) - 1;
+		g->ids[ slot ] = i;
+		g->sorted[ slot ] = g->source[ i ];
+	}
+}
+
+void	SpatialGrid::boundsJob( void* grid, UINT begin, UINT end )
+{
+	SpatialGrid*	g = ( SpatialGrid* )grid;
+	for( UINT c = begin; c < end; c++ )
+	{
+		Cell& cell = g->cells[ c ];
+		cell.boxMin = XMFLOAT3( FLT_MAX, FLT_MAX, FLT_MAX );
+		cell.boxMax = XMFLOAT3( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+		for( UINT k = cell.start; k < cell.end; k++ )
+		{
+			const XMFLOAT4& sphere = g->sorted[ k ];
+			cell.boxMin.x = min( cell.boxMin.x, sphere.x - sphere.w );
+			cell.boxMin.y = min( cell.boxMin.y, sphere.y - sphere.w );
+			cell.boxMin.z = min( cell.boxMin.z, sphere.z - sphere.w );
+			cell.boxMax.x = max( cell.boxMax.x, sphere.x + sphere.w );
+			cell.boxMax.y = max( cell.boxMax.y, sphere.y + sphere.w );
+			cell.boxMax.z = max( cell.boxMax.z, sphere.z + sphere.w );
+		}
+	}
+}
+
+// counting sort. the first pass counts spheres per bucket,
+// the prefix sum turns counts into places where buckets
+// begin, and the second pass puts every sphere at the end
+// of its bucket, moving the end forward. vectors keep
+// their capacity, so rebuilding doesn't allocate
+void	SpatialGrid::Build( Space& spa, float _cellSize )
+{
+	UINT	count = spa.size();
+	source = ( const XMFLOAT4* )spa.GetShaderPositionArray();
+	
+	maxRadius = 0.0f;
+	for( UINT i = 0; i < count; i++ )
+		maxRadius = max( maxRadius, source[ i ].w );
+	cellSize = _cellSize > 0.0f ? _cellSize : max( 2.0f * maxRadius, 0.001f );
+	invCellSize = 1.0f / cellSize;
+	
+	// about as many buckets as spheres, power of two
+	UINT	buckets = 64;
+	while( buckets < count )
+		buckets *= 2;
+	mask = buckets - 1;
+	
+	bucketStarts.resize( buckets );
+	bucketEnds.assign( buckets, 0 );
+	keys.resize( count );
+	ids.resize( count );
+	sorted.resize( count );
+	
+	run( count, GRID_BATCH_SIZE, countJob );
+	
+	cells.clear();
+	UINT	total = 0;
+	for( UINT b = 0; b < buckets; b++ )
+	{
+		UINT	n = bucketEnds[ b ];
+		bucketStarts[ b ] = bucketEnds[ b ] = total;
+		if( n )
+		{
+			cells.push_back( Cell() );
+			cells.back().start = total;
+			cells.back().end = total + n;
+		}
+		total += n;
+	}
+	
+	run( count, GRID_BATCH_SIZE, placeJob );
+	run( cells.size(), GRID_BATCH_SIZE, boundsJob );
+	source = NULL;
+}
+
+// a bucket may hold spheres of a few different cells, so 
+// spheres are checked to be in the visited cell. otherwise
+// they could be reported twice, from two different cells
+UINT	SpatialGrid::FindSpheres( XMFLOAT3 centre, float radius, std::vector< UINT >& found )
+{
+	UINT	first = found.size();
+	float	reach = radius + maxRadius;
+	int		low[ 3 ], high[ 3 ], cell[ 3 ];
+	for( UINT a = 0; a < 3; a++ )
+	{
+		low[ a ] = ( int )floorf( ( ( &centre.x )[ a ] - reach ) * invCellSize );
+		high[ a ] = ( int )floorf( ( ( &centre.x )[ a ] + reach ) * invCellSize );
+	}
+	
+	// if the query covers more cells than there are spheres
+	// in the grid, it's faster to check all of them
+	UINT64	covered = ( UINT64 )( high[ 0 ] - low[ 0 ] + 1 ) * ( high[ 1 ] - low[ 1 ] + 1 ) * ( high[ 2 ] - low[ 2 ] + 1 );
+	if( covered > sorted.size() )
+	{
+		for( UINT k = 0; k < sorted.size(); k++ )
+		{
+			XMFLOAT4&	sphere = sorted[ k ];
+			float		dx = sphere.x - centre.x, dy = sphere.y - centre.y, dz = sphere.z - centre.z;
+			if( dx * dx + dy * dy + dz * dz <= ( radius + sphere.w ) * ( radius + sphere.w ) )
+				found.push_back( ids[ k ] );
+		}
+		return found.size() - first;
+	}
+	
+	for( int x = low[ 0 ]; x <= high[ 0 ]; x++ )
+		for( int y = low[ 1 ]; y <= high[ 1 ]; y++ )
+			for( int z = low[ 2 ]; z <= high[ 2 ]; z++ )
+			{
+				UINT b = bucketOf( x, y, z );
+				for( UINT k = bucketStarts[ b ]; k < ( UINT )bucketEnds[ b ]; k++ )
+				{
+					XMFLOAT4&	sphere = sorted[ k ];
+					cellOf( sphere, cell );
+					if( cell[ 0 ] != x || cell[ 1 ] != y || cell[ 2 ] != z )
+						continue;
+					
+					float dx = sphere.x - centre.x, dy = sphere.y - centre.y, dz = sphere.z - centre.z;
+					if( dx * dx + dy * dy + dz * dz <= ( radius + sphere.w ) * ( radius + sphere.w ) )
+						found.push_back( ids[ k ] );
+				}
+			}
+	return found.size() - first;
+}
+
+// every sphere is tested against spheres of neighbouring cells
+// with a higher index, so each pair is reported once. if cells
+// are smaller than twice the biggest radius, more neighbours
+// have to be checked
+UINT	SpatialGrid::FindOverlaps( std::vector< SpherePair >& pairs )
+{
+	UINT	first = pairs.size();
+	int		reach = max( 1, ( int )ceilf( 2.0f * maxRadius * invCellSize ) );
+	int		cell[ 3 ], other[ 3 ];
+	
+	for( UINT k = 0; k < sorted.size(); k++ )
+	{
+		const XMFLOAT4& a = sorted[ k ];
+		cellOf( a, cell );
+		
+		for( int x = cell[ 0 ] - reach; x <= cell[ 0 ] + reach; x++ )
+			for( int y = cell[ 1 ] - reach; y <= cell[ 1 ] + reach; y++ )
+				for( int z = cell[ 2 ] - reach; z <= cell[ 2 ] + reach; z++ )
+				{
+					UINT b = bucketOf( x, y, z );
+					for( UINT m = bucketStarts[ b ]; m < ( UINT )bucketEnds[ b ]; m++ )
+					{
+						if( ids[ m ] <= ids[ k ] )
+							continue;
+						
+						const XMFLOAT4& c = sorted[ m ];
+						cellOf( c, other );
+						if( other[ 0 ] != x || other[ 1 ] != y || other[ 2 ] != z )
+							continue;
+						
+						float dx = a.x - c.x, dy = a.y - c.y, dz = a.z - c.z;
+						if( dx * dx + dy * dy + dz * dz <= ( a.w + c.w ) * ( a.w + c.w ) )
+						{
+							SpherePair	pair = { ids[ k ], ids[ m ] };
+							pairs.push_back( pair );
+						}
+					}
+				}
+	}
+	return pairs.size() - first;
+}
+
+// whole cells are tested first. spheres of a cell lying
+// entirely inside are visible without further tests,
+// only the cells crossing the planes are checked sphere by sphere
+UINT	SpatialGrid::CullSpheres( const XMFLOAT4* planes, std::vector< UINT >& visible )
+{
+	UINT	first = visible.size();
+	for( UINT c = 0; c < cells.size(); c++ )
+	{
+		const Cell& cell = cells[ c ];
+		switch( boxInFrustum( planes, cell.boxMin, cell.boxMax ) )
+		{
+		case FRUSTUM_INSIDE:
+			visible.insert( visible.end(), ids.begin() + cell.start, ids.begin() + cell.end );
+			break;
+			
+		case FRUSTUM_PARTIAL:
+			for( UINT k = cell.start; k < cell.end; k++ )
+				if( sphereInFrustum( planes, sorted[ k ] ) )
+					visible.push_back( ids[ k ] );
+			break;
+		}
+	}
+	return visible.size() - first;
+}
+
+void	SpatialGrid::BindJobs( JobSystem* jobs )	{	pJobs = jobs;	}
+UINT	SpatialGrid::GetCellCount()					{	return cells.size();	}
+float	SpatialGrid::GetCellSize()					{	return cellSize;	}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// SPHERE BVH	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+SphereBVH::SphereBVH()	{}
+
+void	SphereBVH::Build( Space& spa )
+{
+	UINT count = spa.size();
+	const XMFLOAT4* source = ( const XMFLOAT4* )spa.GetShaderPositionArray();
+	
+	nodes.clear();
+	ids.resize( count );
+	centres.resize( count );
+	for( UINT i = 0; i < count; i++ )
+	{
+		ids[ i ] = i;
+		centres[ i ] = XMFLOAT3( source[ i ].x, source[ i ].y, source[ i ].z );
+	}
+	
+	// tree has about 2 * count / leaf size nodes, so
+	// the vector rarely has to grow while splitting
+	nodes.reserve( 2 * count / BVH_LEAF_SIZE + 2 );
+	Node root;
+	root.first = 0;
+	root.count = count;
+	nodes.push_back( root );
+	if( count )
+		split( 0, 0 );
+	
+	// copy the spheres in leaf order and fit the boxes
+	spheres.resize( count );
+	for( UINT i = 0; i < count; i++ )
+		spheres[ i ] = source[ ids[ i ] ];
+	for( UINT i = nodes.size(); i-- > 0; )
+		fitNode( i );
+	
+	centres.clear();
+}
+
+// orders sphere ids, so the half with smaller centres along
+// the longest axis of node's centres comes first
+struct BVHCentreOrder
+{
+	const XMFLOAT3*	centres;
+	UINT			axis;
+	
+	bool	operator()( UINT a, UINT b ) const
+	{
+		return ( &centres[ a ].x )[ axis ] < ( &centres[ b ].x )[ axis ];
+	}
+};
+
+void	SphereBVH::split( UINT node, UINT depth )
+{
+	UINT first = nodes[ node ].first;
+	UINT count = nodes[ node ].count;
+	
+	// deep enough trees are impossible with median splits, unless
+	// something's wrong with the centres (e.g. they're NaN)
+	if( count <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH - 1 )
+		return;
+	
+	XMFLOAT3 cMin( FLT_MAX, FLT_MAX, FLT_MAX );
+	XMFLOAT3 cMax( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	for( UINT i = first; i < first + count; i++ )
+	{
+		const XMFLOAT3& c = centres[ ids[ i ] ];
+		cMin.x = min( cMin.x, c.x );	cMax.x = max( cMax.x, c.x );
+		cMin.y = min( cMin.y, c.y );	cMax.y = max( cMax.y, c.y );
+		cMin.z = min( cMin.z, c.z );	cMax.z = max( cMax.z, c.z );
+	}
+	
+	BVHCentreOrder order;
+	order.centres = centres.data();
+	order.axis = 0;
+	if( cMax.y - cMin.y > cMax.x - cMin.x )
+		order.axis = 1;
+	if( cMax.z - cMin.z > ( &cMax.x )[ order.axis ] - ( &cMin.x )[ order.axis ] )
+		order.axis = 2;
+	
+	UINT half = count / 2;
+	std::nth_element( ids.begin() + first, ids.begin() + first + half, ids.begin() + first + count, order );
+	
+	Node child;
+	UINT left = nodes.size();
+	child.first = first;
+	child.count = half;
+	nodes.push_back( child );
+	child.first = first + half;
+	child.count = count - half;
+	nodes.push_back( child );
+	
+	nodes[ node ].first = left;
+	nodes[ node ].count = 0;
+	split( left, depth + 1 );
+	split( left + 1, depth + 1 );
+}
+
+// children always lie after their parent, so fitting nodes
+// from the last one to the root sees the children fitted already
+void	SphereBVH::fitNode( UINT node )
+{
+	Node& n = nodes[ node ];
+	
+	if( n.count )
+	{
+		n.boxMin = XMFLOAT3( FLT_MAX, FLT_MAX, FLT_MAX );
+		n.boxMax = XMFLOAT3( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+		for( UINT i = n.first; i < n.first + n.count; i++ )
+		{
+			const XMFLOAT4& s = spheres[ i ];
+			n.boxMin.x = min( n.boxMin.x, s.x - s.w );		n.boxMax.x = max( n.boxMax.x, s.x + s.w );
+			n.boxMin.y = min( n.boxMin.y, s.y - s.w );		n.boxMax.y = max( n.boxMax.y, s.y + s.w );
+			n.boxMin.z = min( n.boxMin.z, s.z - s.w );		n.boxMax.z = max( n.boxMax.z, s.z + s.w );
+		}
+		return;
+	}
+	
+	const Node& a = nodes[ n.first ];
+	const Node& b = nodes[ n.first + 1 ];
+	n.boxMin = XMFLOAT3( min( a.boxMin.x, b.boxMin.x ), min( a.boxMin.y, b.boxMin.y ), min( a.boxMin.z, b.boxMin.z ) );
+	n.boxMax = XMFLOAT3( max( a.boxMax.x, b.boxMax.x ), max( a.boxMax.y, b.boxMax.y ), max( a.boxMax.z, b.boxMax.z ) );
+}
+
+void	SphereBVH::Refit( Space& spa )
+{
+	if( spa.size() != spheres.size() )
+	{
+		Build( spa );
+		return;
+	}
+	
+	const XMFLOAT4* source = ( const XMFLOAT4* )spa.GetShaderPositionArray();
+	for( UINT i = 0; i < spheres.size(); i++ )
+		spheres[ i ] = source[ ids[ i ] ];
+	for( UINT i = nodes.size(); i-- > 0; )
+		fitNode( i );
+}
+
+// nodes are visited nearest first, and skipped once their box 
+// starts further than the closest hit found so far
+bool	SphereBVH::Intersect( const XMFLOAT3& origin, const XMFLOAT3& direction, float maxDistance, RayHit& hit, TraversalStats* stats )
+{
+	UINT	stack[ BVH_MAX_DEPTH + 1 ];
+	float	entries[ BVH_MAX_DEPTH + 1 ];
+	UINT	top = 0;
+	float	closest = maxDistance;
+	UINT	found = NO_OBJECT;
+	UINT	boxTests = 1, sphereTests = 0;
+	float	entry;
+	
+	XMFLOAT3 invDir( 1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z );
+	
+	if( nodes.size() && rayBox( origin, invDir, nodes[ 0 ].boxMin, nodes[ 0 ].boxMax, closest, entry ) )
+	{
+		stack[ top ] = 0;
+		entries[ top++ ] = entry;
+	}
+	
+	while( top )
+	{
+		top--;
+		if( entries[ top ] > closest )
+			continue;
+		
+		const Node& n = nodes[ stack[ top ] ];
+		if( n.count )
+		{
+			float distance;
+			for( UINT i = n.first; i < n.first + n.count; i++ )
+				if( raySphere( origin, direction, spheres[ i ], distance ) && distance < closest )
+				{
+					closest = distance;
+					found = i;
+				}
+			sphereTests += n.count;
+			continue;
+		}
+		
+		boxTests += 2;
+		float	entryA, entryB;
+		bool	hitA = rayBox( origin, invDir, nodes[ n.first ].boxMin, nodes[ n.first ].boxMax, closest, entryA );
+		bool	hitB = rayBox( origin, invDir, nodes[ n.first + 1 ].boxMin, nodes[ n.first + 1 ].boxMax, closest, entryB );
+		UINT	first = n.first;
+		
+		// the nearer child goes on top of the stack
+		if( hitA && hitB && entryA < entryB )
+		{
+			stack[ top ] = first + 1;	entries[ top++ ] = entryB;
+			stack[ top ] = first;		entries[ top++ ] = entryA;
+		}
+		else
+		{
+			if( hitA )	{	stack[ top ] = first;		entries[ top++ ] = entryA;	}
+			if( hitB )	{	stack[ top ] = first + 1;	entries[ top++ ] = entryB;	}
+		}
+	}
+	
+	if( stats )
+	{
+		stats->rays++;
+		stats->boxTests += boxTests;
+		stats->sphereTests += sphereTests;
+	}
+	
+	hit.sphere = NO_OBJECT;
+	if( found == NO_OBJECT )
+		return false;
+	
+	fillHit( found, origin, direction, closest, hit );
+	return true;
+}
+
+// unlike Intersect, children don't need to be sorted, nor
+// their entries kept. boxes are tested when they're popped
+bool	SphereBVH::Occluded( const XMFLOAT3& origin, const XMFLOAT3& direction, float maxDistance, UINT& occluder, TraversalStats* stats )
+{
+	UINT	stack[ BVH_MAX_DEPTH + 1 ];
+	UINT	top = 0;
+	UINT	boxTests = 0, sphereTests = 0;
+	bool	blocked = false;
+	float	distance, entry;
+	
+	if( occluder < spheres.size() )
+	{
+		sphereTests++;
+		blocked = raySphere( origin, direction, spheres[ occluder ], distance ) && distance <= maxDistance;
+		if( blocked && stats )
+			stats->cacheHits++;
+	}
+	
+	XMFLOAT3 invDir( 1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z );
+	if( !blocked && nodes.size() )
+		stack[ top++ ] = 0;
+	
+	while( top && !blocked )
+	{
+		const Node& n = nodes[ stack[ --top ] ];
+		boxTests++;
+		if( !rayBox( origin, invDir, n.boxMin, n.boxMax, maxDistance, entry ) )
+			continue;
+		
+		if( n.count == 0 )
+		{
+			stack[ top++ ] = n.first + 1;
+			stack[ top++ ] = n.first;
+			continue;
+		}
+		
+		for( UINT i = n.first; i < n.first + n.count && !blocked; i++ )
+		{
+			if( i == occluder )
+				continue;
+			sphereTests++;
+			if( raySphere( origin, direction, spheres[ i ], distance ) && distance <= maxDistance )
+			{
+				occluder = i;
+				blocked = true;
+			}
+		}
+	}
+	
+	if( stats )
+	{
+		stats->rays++;
+		stats->boxTests += boxTests;
+		stats->sphereTests += sphereTests;
+	}
+	return blocked;
+}
+
+// sphere is the index within the tree's own order
+void	SphereBVH::fillHit( UINT sphere, const XMFLOAT3& origin, const XMFLOAT3& direction, float distance, RayHit& hit )
+{
+	const XMFLOAT4& s = spheres[ sphere ];
+	hit.sphere = ids[ sphere ];
+	hit.distance = distance;
+	hit.position = XMFLOAT3( origin.x + direction.x * distance, origin.y + direction.y * distance, origin.z + direction.z * distance );
+	hit.normal = XMFLOAT3( ( hit.position.x - s.x ) / s.w, ( hit.position.y - s.y ) / s.w, ( hit.position.z - s.z ) / s.w );
+}
+
+// rays of a packet usually go more or less the same way (e.g. from 
+// the same point to nearby targets), so they visit mostly the same
+// nodes, and each node is fetched once for all of them. children 
+// are visited in order of the nearest entry of any of the rays
+void	SphereBVH::IntersectPacket( const RayQuery* rays, UINT count, RayHit* hits, UINT* occluder, TraversalStats* stats )
+{
+	XMFLOAT3	invDirs[ RAY_PACKET_SIZE ];
+	float		closest[ RAY_PACKET_SIZE ];
+	UINT		found[ RAY_PACKET_SIZE ];
+	bool		searching[ RAY_PACKET_SIZE ];
+	UINT		stack[ BVH_MAX_DEPTH + 1 ];
+	UINT		top = 0;
+	UINT		left = 0;
+	UINT		boxTests = 0, sphereTests = 0, cacheHits = 0;
+	UINT		cached = occluder && *occluder < spheres.size() ? *occluder : NO_OBJECT;
+	float		entry, distance;
+	
+	count = min( count, ( UINT )RAY_PACKET_SIZE );
+	for( UINT r = 0; r < count; r++ )
+	{
+		const XMFLOAT3& d = rays[ r ].direction;
+		invDirs[ r ] = XMFLOAT3( 1.0f / d.x, 1.0f / d.y, 1.0f / d.z );
+		closest[ r ] = hits[ r ].sphere != NO_OBJECT ? min( hits[ r ].distance, rays[ r ].maxDistance ) : rays[ r ].maxDistance;
+		found[ r ] = NO_OBJECT;
+		searching[ r ] = !( ( rays[ r ].flags & RAY_ANY_HIT ) && hits[ r ].sphere != NO_OBJECT );
+		
+		// any hit rays blocked by the cached occluder are done already
+		if( searching[ r ] && cached != NO_OBJECT && ( rays[ r ].flags & RAY_ANY_HIT ) )
+		{
+			sphereTests++;
+			if( raySphere( rays[ r ].origin, rays[ r ].direction, spheres[ cached ], distance ) && distance < closest[ r ] )
+			{
+				closest[ r ] = distance;
+				found[ r ] = cached;
+				searching[ r ] = false;
+				cacheHits++;
+			}
+		}
+		if( searching[ r ] )
+			left++;
+	}
+	
+	if( nodes.size() && left )
+	{
+		stack[ top++ ] = 0;
+		boxTests++;
+	}
+	
+	while( top && left )
+	{
+		const Node& n = nodes[ stack[ --top ] ];
+		
+		if( n.count )
+		{
+			for( UINT r = 0; r < count; r++ )
+			{
+				if( !searching[ r ] )
+					continue;
+				boxTests++;
+				if( !rayBox( rays[ r ].origin, invDirs[ r ], n.boxMin, n.boxMax, closest[ r ], entry ) )
+					continue;
+				
+				for( UINT i = n.first; i < n.first + n.count; i++ )
+				{
+					sphereTests++;
+					if( raySphere( rays[ r ].origin, rays[ r ].direction, spheres[ i ], distance ) && distance < closest[ r ] )
+					{
+						closest[ r ] = distance;
+						found[ r ] = i;
+						if( rays[ r ].flags & RAY_ANY_HIT )
+						{
+							searching[ r ] = false;
+							left--;
+							if( occluder )
+								*occluder = i;
+							break;
+						}
+					}
+				}
+			}
+			continue;
+		}
+		
+		const Node&	a = nodes[ n.first ];
+		const Node&	b = nodes[ n.first + 1 ];
+		float		entryA = FLT_MAX, entryB = FLT_MAX;
+		for( UINT r = 0; r < count; r++ )
+		{
+			if( !searching[ r ] )
+				continue;
+			boxTests += 2;
+			if( rayBox( rays[ r ].origin, invDirs[ r ], a.boxMin, a.boxMax, closest[ r ], entry ) )
+				entryA = min( entryA, entry );
+			if( rayBox( rays[ r ].origin, invDirs[ r ], b.boxMin, b.boxMax, closest[ r ], entry ) )
+				entryB = min( entryB, entry );
+		}
+		
+		// the nearer child goes on top of the stack
+		UINT first = n.first;
+		if( entryA < entryB )
+		{
+			if( entryB < FLT_MAX )	stack[ top++ ] = first + 1;
+			stack[ top++ ] = first;
+		}
+		else
+		{
+			if( entryA < FLT_MAX )	stack[ top++ ] = first;
+			if( entryB < FLT_MAX )	stack[ top++ ] = first + 1;
+		}
+	}
+	
+	for( UINT r = 0; r < count; r++ )
+		if( found[ r ] != NO_OBJECT )
+			fillHit( found[ r ], rays[ r ].origin, rays[ r ].direction, closest[ r ], hits[ r ] );
+	
+	if( stats )
+	{
+		stats->rays += count;
+		stats->boxTests += boxTests;
+		stats->sphereTests += sphereTests;
+		stats->cacheHits += cacheHits;
+	}
+}
+
+UINT	SphereBVH::GetNodeCount()	{	return nodes.size();	}
+UINT	SphereBVH::size()			{	return spheres.size();	}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// RAY QUERIES	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+// done event starts set, there's no batch to wait for
+RayQueries::RayQueries( UINT workerCount )
+	:	batch( 0 ),
+		hasFloor( false ),
+		jobs( workerCount ),
+		quit( 0 )
+{
+	startEvent = CreateEvent( NULL, FALSE, FALSE, NULL );
+	doneEvent = CreateEvent( NULL, TRUE, TRUE, NULL );
+	thread = CreateThread( NULL, 0, dispatcherMain, this, 0, NULL );
+}
+
+RayQueries::~RayQueries()
+{
+	Wait();
+	InterlockedExchange( &quit, 1 );
+	SetEvent( startEvent );
+	WaitForSingleObject( thread, INFINITE );
+	CloseHandle( thread );
+	CloseHandle( startEvent );
+	CloseHandle( doneEvent );
+}
+
+// the dispatcher is the only thread calling ParallelFor
+// of the jobs, so it doesn't get in the way of other loops
+DWORD WINAPI	RayQueries::dispatcherMain( LPVOID param )
+{
+	RayQueries*	queries = ( RayQueries* )param;
+	
+	for( ;; )
+	{
+		WaitForSingleObject( queries->startEvent, INFINITE );
+		if( queries->quit )
+			return 0;
+		
+		UINT packets = ( queries->running.size() + RAY_PACKET_SIZE - 1 ) / RAY_PACKET_SIZE;
+		queries->jobs.ParallelFor( packets, RAY_PACKET_BATCH, traceJob, queries );
+		SetEvent( queries->doneEvent );
+	}
+}
+
+void	RayQueries::traceJob( void* queries, UINT begin, UINT end )
+{
+	( ( RayQueries* )queries )->trace( begin, end );
+}
+
+// begin and end are packets. the floor is tested first, so
+// the tree is searched only for spheres in front of it.
+// packets of a job share the occluder cache, rays submitted
+// one after another usually go to neighbouring pixels
+void	RayQueries::trace( UINT begin, UINT end )
+{
+	std::vector< RayHit >&	hits = results[ batch & 1 ];
+	UINT					count = running.size();
+	UINT					occluder = NO_OBJECT;
+	TraversalStats			local;
+	float					distance;
+	
+	for( UINT p = begin; p < end; p++ )
+	{
+		UINT first = p * RAY_PACKET_SIZE;
+		UINT size = min( count - first, ( UINT )RAY_PACKET_SIZE );
+		
+		for( UINT r = first; r < first + size; r++ )
+		{
+			const RayQuery& ray = running[ r ];
+			RayHit& hit = hits[ r ];
+			
+			hit.sphere = NO_OBJECT;
+			if( hasFloor && rayFloor( ray.origin, ray.direction, floor, distance ) && distance <= ray.maxDistance )
+			{
+				hit.sphere = FLOOR_OBJECT;
+				hit.distance = distance;
+				hit.position = XMFLOAT3( ray.origin.x + ray.direction.x * distance, ray.origin.y + ray.direction.y * distance, ray.origin.z + ray.direction.z * distance );
+				hit.normal = floor.normal;
+			}
+		}
+		
+		bvh.IntersectPacket( &running[ first ], size, &hits[ first ], &occluder, &local );
+	}
+	
+	TraversalStats& total = stats[ batch & 1 ];
+	InterlockedExchangeAdd64( ( volatile LONGLONG* )&total.rays, local.rays );
+	InterlockedExchangeAdd64( ( volatile LONGLONG* )&total.boxTests, local.boxTests );
+	InterlockedExchangeAdd64( ( volatile LONGLONG* )&total.sphereTests, local.sphereTests );
+	InterlockedExchangeAdd64( ( volatile LONGLONG* )&total.cacheHits, local.cacheHits );
+}
+
+UINT	RayQueries::Submit( const RayQuery* rays, UINT count )
+{
+	UINT first = submitted.size();
+	submitted.insert( submitted.end(), rays, rays + count );
+	return first;
+}
+
+void	RayQueries::Kick( Space& spa, const FloorDesc* _floor )
+{
+	Wait();
+	
+	running.swap( submitted );
+	submitted.clear();
+	batch++;
+	results[ batch & 1 ].resize( running.size() );
+	stats[ batch & 1 ] = TraversalStats();
+	
+	hasFloor = _floor != NULL;
+	if( _floor )
+		floor = *_floor;
+	bvh.Refit( spa );
+	
+	ResetEvent( doneEvent );
+	SetEvent( startEvent );
+}
+
+void	RayQueries::Wait()
+{
+	WaitForSingleObject( doneEvent, INFINITE );
+}
+
+const RayHit*	RayQueries::GetResults( UINT& count )
+{
+	Wait();
+	count = running.size();
+	return count ? results[ batch & 1 ].data() : NULL;
+}
+
+const TraversalStats&	RayQueries::GetStatistics()
+{
+	Wait();
+	return stats[ batch & 1 ];
+}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// FLOOR LIGHTMAP	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+FloorLightmap::FloorLightmap( UINT _resolution, float _aoRange, float _skyRange )
+	:	resolution( max( _resolution, 1u ) ),
+		aoRange( _aoRange ),
+		skyRange( max( _aoRange, _skyRange ) ),
+		texels( resolution * resolution, XMFLOAT2( 1.0f, 1.0f ) ),
+		dirty( resolution * resolution, 0 ),
+		uploadBegin( 0 ),
+		uploadEnd( resolution ),
+		hasFloor( false ),
+		texture( NULL ),
+		textureView( NULL ),
+		pJobs( NULL )
+{}
+
+FloorLightmap::~FloorLightmap()
+{
+	ReleaseDevice();
+}
+
+void	FloorLightmap::markAll()
+{
+	for( UINT i = 0; i < dirty.size(); i++ )
+		dirty[ i ] = 1;
+}
+
+// sphere may shade texels up to skyRange from it, so all
+// texels within the square around its shadow get rebaked
+void	FloorLightmap::markSphere( const XMFLOAT4& sphere )
+{
+	const XMFLOAT3& l = floor.halfLength;
+	const XMFLOAT3& w = floor.halfWidth;
+	float lengthSq = l.x * l.x + l.y * l.y + l.z * l.z;
+	float widthSq = w.x * w.x + w.y * w.y + w.z * w.z;
+	XMFLOAT3 c( sphere.x - floor.centre.x, sphere.y - floor.centre.y, sphere.z - floor.centre.z );
+	
+	// floor coordinates are -1 to 1 along both axes
+	float u = ( c.x * l.x + c.y * l.y + c.z * l.z ) / lengthSq;
+	float v = ( c.x * w.x + c.y * w.y + c.z * w.z ) / widthSq;
+	float reachU = ( skyRange + sphere.w ) / sqrtf( lengthSq );
+	float reachV = ( skyRange + sphere.w ) / sqrtf( widthSq );
+	
+	float half = 0.5f * resolution;
+	int x0 = max( ( int )floorf( ( u - reachU + 1.0f ) * half ), 0 );
+	int x1 = min( ( int )ceilf( ( u + reachU + 1.0f ) * half ), ( int )resolution );
+	int y0 = max( ( int )floorf( ( v - reachV + 1.0f ) * half ), 0 );
+	int y1 = min( ( int )ceilf( ( v + reachV + 1.0f ) * half ), ( int )resolution );
+	
+	for( int y = y0; y < y1; y++ )
+		for( int x = x0; x < x1; x++ )
+			dirty[ y * resolution + x ] = 1;
+}
+
+// every texel casts the same set of rays, spread over the
+// hemisphere above the floor so that each of them stands
+// for the same share of cosine weighted sky
+void	FloorLightmap::bake( UINT begin, UINT end )
+{
+	RayQuery	rays[ RAY_PACKET_SIZE ];
+	RayHit		hits[ RAY_PACKET_SIZE ];
+	float		half = 0.5f * resolution;
+	
+	for( UINT t = begin; t < end; t++ )
+	{
+		UINT	texel = dirtyTexels[ t ];
+		float	u = ( texel % resolution + 0.5f ) / half - 1.0f;
+		float	v = ( texel / resolution + 0.5f ) / half - 1.0f;
+		
+		// rays start a bit above the floor, so they don't hit it
+		XMFLOAT3 origin( 
+			floor.centre.x + u * floor.halfLength.x + v * floor.halfWidth.x + 0.001f * floor.normal.x,
+			floor.centre.y + u * floor.halfLength.y + v * floor.halfWidth.y + 0.001f * floor.normal.y,
+			floor.centre.z + u * floor.halfLength.z + v * floor.halfWidth.z + 0.001f * floor.normal.z );
+		
+		UINT nearby = 0, any = 0;
+		for( UINT first = 0; first < FLOOR_AO_RAYS; first += RAY_PACKET_SIZE )
+		{
+			for( UINT r = 0; r < RAY_PACKET_SIZE; r++ )
+			{
+				rays[ r ] = directions[ first + r ];
+				rays[ r ].origin = origin;
+				hits[ r ].sphere = NO_OBJECT;
+			}
+			
+			bvh.IntersectPacket( rays, RAY_PACKET_SIZE, hits );
+			for( UINT r = 0; r < RAY_PACKET_SIZE; r++ )
+				if( hits[ r ].sphere != NO_OBJECT )
+				{
+					any++;
+					if( hits[ r ].distance < aoRange )
+						nearby++;
+				}
+		}
+		
+		texels[ texel ] = XMFLOAT2( 1.0f - ( float )nearby / FLOOR_AO_RAYS, 1.0f - ( float )any / FLOOR_AO_RAYS );
+		dirty[ texel ] = 0;
+	}
+}
+
+void	FloorLightmap::bakeJob( void* lightmap, UINT begin, UINT end )
+{
+	( ( FloorLightmap* )lightmap )->bake( begin, end );
+}
+
+UINT	FloorLightmap::Update( Space& spa, const FloorDesc& _floor )
+{
+	const XMFLOAT4*	spheres = ( const XMFLOAT4* )spa.GetShaderPositionArray();
+	UINT			count = spa.size();
+	
+	// a new floor (or the first one) changes everything
+	if( !hasFloor || memcmp( &floor, &_floor, sizeof( FloorDesc ) ) != 0 )
+	{
+		floor = _floor;
+		hasFloor = true;
+		markAll();
+		
+		// directions are spread by the hammersley sequence, 
+		// in the space of floor's axes and normal
+		XMVECTOR	axisU = XMVector3Normalize( XMLoadFloat3( &floor.halfLength ) );
+		XMVECTOR	axisV = XMVector3Normalize( XMLoadFloat3( &floor.halfWidth ) );
+		XMVECTOR	normal = XMLoadFloat3( &floor.normal );
+		
+		directions.resize( FLOOR_AO_RAYS );
+		for( UINT i = 0; i < FLOOR_AO_RAYS; i++ )
+		{
+			float radius = sqrtf( ( i + 0.5f ) / FLOOR_AO_RAYS );
+			float angle = 2.0f * XM_PI * radicalInverse( i );
+			float up = sqrtf( 1.0f - radius * radius );
+			
+			XMVECTOR d = XMVectorAdd( XMVectorAdd( 
+				XMVectorScale( axisU, radius * cosf( angle ) ), 
+				XMVectorScale( axisV, radius * sinf( angle ) ) ), 
+				XMVectorScale( normal, up ) );
+			XMStoreFloat3( &directions[ i ].direction, d );
+			directions[ i ].maxDistance = skyRange;
+			directions[ i ].flags = RAY_CLOSEST_HIT;
+		}
+	}
+	else if( count != baked.size() )
+		markAll();
+	else for( UINT i = 0; i < count; i++ )
+		if( memcmp( &spheres[ i ], &baked[ i ], sizeof( XMFLOAT4 ) ) != 0 )
+		{
+			markSphere( baked[ i ] );
+			markSphere( spheres[ i ] );
+		}
+	
+	baked.assign( spheres, spheres + count );
+	
+	dirtyTexels.clear();
+	for( UINT i = 0; i < dirty.size(); i++ )
+		if( dirty[ i ] )
+			dirtyTexels.push_back( i );
+	if( dirtyTexels.empty() )
+		return 0;
+	
+	bvh.Refit( spa );
+	if( pJobs )
+		pJobs->ParallelFor( dirtyTexels.size(), FLOOR_BAKE_BATCH, bakeJob, this );
+	else bake( 0, dirtyTexels.size() );
+	
+	// rows to upload grow to cover all that changed
+	UINT first = dirtyTexels.front() / resolution;
+	UINT last = dirtyTexels.back() / resolution + 1;
+	if( uploadBegin >= uploadEnd )
+	{
+		uploadBegin = first;
+		uploadEnd = last;
+	}
+	else
+	{
+		uploadBegin = min( uploadBegin, first );
+		uploadEnd = max( uploadEnd, last );
+	}
+	return dirtyTexels.size();
+}
+
+ID3D10ShaderResourceView*	FloorLightmap::Upload( ID3D10Device* device )
+{
+	HRESULT hr = S_OK;
+	
+	if( texture == NULL )
+	{
+		D3D10_TEXTURE2D_DESC desc;
+		ZeroMemory( &desc, sizeof( desc ) );
+		desc.Width = resolution;
+		desc.Height = resolution;
+		desc.MipLevels = 1;
+		desc.ArraySize = 1;
+		desc.Format = DXGI_FORMAT_R8G8_UNORM;
+		desc.SampleDesc.Count = 1;
+		desc.Usage = D3D10_USAGE_DEFAULT;
+		desc.BindFlags = D3D10_BIND_SHADER_RESOURCE;
+		
+		hr = device->CreateTexture2D( &desc, NULL, &texture );
+		if( SUCCEEDED( hr ) )
+			hr = device->CreateShaderResourceView( texture, NULL, &textureView );
+		if( FAILED( hr ) )
+		{
+			ERRORMACRO( L"Unable to create floor lightmap." );
+			ReleaseDevice();
+			return NULL;
+		}
+		
+		uploadBegin = 0;
+		uploadEnd = resolution;
+	}
+	
+	if( uploadBegin < uploadEnd )
+	{
+		uploadRows.resize( ( uploadEnd - uploadBegin ) * resolution * 2 );
+		for( UINT i = uploadBegin * resolution, j = 0; i < uploadEnd * resolution; i++ )
+		{
+			uploadRows[ j++ ] = ( BYTE )( texels[ i ].x * 255.0f + 0.5f );
+			uploadRows[ j++ ] = ( BYTE )( texels[ i ].y * 255.0f + 0.5f );
+		}
+		
+		D3D10_BOX box = { 0, uploadBegin, 0, resolution, uploadEnd, 1 };
+		device->UpdateSubresource( texture, 0, &box, uploadRows.data(), resolution * 2, 0 );
+		uploadBegin = uploadEnd = 0;
+	}
+	return textureView;
+}
+
+void	FloorLightmap::ReleaseDevice()
+{
+	if( textureView )	textureView->Release();
+	if( texture )		texture->Release();
+	textureView = NULL;
+	texture = NULL;
+}
+
+XMFLOAT2	FloorLightmap::Sample( const XMFLOAT3& point )
+{
+	if( !hasFloor )
+		return XMFLOAT2( 1.0f, 1.0f );
+	
+	const XMFLOAT3& l = floor.halfLength;
+	const XMFLOAT3& w = floor.halfWidth;
+	XMFLOAT3 p( point.x - floor.centre.x, point.y - floor.centre.y, point.z - floor.centre.z );
+	
+	// texel centres lie at half-integer coordinates
+	float half = 0.5f * resolution;
+	float x = ( ( p.x * l.x + p.y * l.y + p.z * l.z ) / ( l.x * l.x + l.y * l.y + l.z * l.z ) + 1.0f ) * half - 0.5f;
+	float y = ( ( p.x * w.x + p.y * w.y + p.z * w.z ) / ( w.x * w.x + w.y * w.y + w.z * w.z ) + 1.0f ) * half - 0.5f;
+	x = min( max( x, 0.0f ), resolution - 1.0f );
+	y = min( max( y, 0.0f ), resolution - 1.0f );
+	
+	UINT	x0 = ( UINT )x, y0 = ( UINT )y;
+	UINT	x1 = min( x0 + 1, resolution - 1 ), y1 = min( y0 + 1, resolution - 1 );
+	float	fx = x - x0, fy = y - y0;
+	
+	XMVECTOR top = XMVectorLerp( XMLoadFloat2( &texels[ y0 * resolution + x0 ] ), XMLoadFloat2( &texels[ y0 * resolution + x1 ] ), fx );
+	XMVECTOR bottom = XMVectorLerp( XMLoadFloat2( &texels[ y1 * resolution + x0 ] ), XMLoadFloat2( &texels[ y1 * resolution + x1 ] ), fx );
+	
+	XMFLOAT2 result;
+	XMStoreFloat2( &result, XMVectorLerp( top, bottom, fy ) );
+	return result;
+}
+
+void	FloorLightmap::BindJobs( JobSystem* jobs )	{	pJobs = jobs;	}
+UINT	FloorLightmap::GetResolution()				{	return resolution;	}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// LIGHT CLUSTERS	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+LightClusters::LightClusters()
+	:	sliceScale( 0.0f ),
+		sliceBias( 0.0f ),
+		source( NULL ),
+		lightCount( 0 ),
+		counts( LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y * LIGHT_CLUSTERS_Z ),
+		ranges( LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y * LIGHT_CLUSTERS_Z ),
+		placing( false ),
+		rangeBuffer( NULL ),
+		indexBuffer( NULL ),
+		lightBuffer( NULL ),
+		rangeView( NULL ),
+		indexView( NULL ),
+		lightView( NULL ),
+		indexCapacity( 0 ),
+		lightCapacity( 0 ),
+		pJobs( NULL )
+{
+	ZeroMemory( &projection, sizeof( projection ) );
+}
+
+LightClusters::~LightClusters()
+{
+	ReleaseDevice();
+}
+
+// near and far planes and the size of the frustum are read
+// back from the projection matrix. a box has to hold the
+// cluster's tile both at its nearest and furthest depth
+void	LightClusters::buildClusters()
+{
+	float	zNear = -projection._43 / projection._33;
+	float	zFar = projection._43 / ( 1.0f - projection._33 );
+	float	tanX = 1.0f / projection._11;
+	float	tanY = 1.0f / projection._22;
+	UINT	perSlice = LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y / 4;
+	
+	for( UINT k = 0; k <= LIGHT_CLUSTERS_Z; k++ )
+		sliceDepths[ k ] = zNear * powf( zFar / zNear, ( float )k / LIGHT_CLUSTERS_Z );
+	sliceScale = LIGHT_CLUSTERS_Z / logf( zFar / zNear );
+	sliceBias = -logf( zNear ) * sliceScale;
+	
+	boxMinX.resize( perSlice * LIGHT_CLUSTERS_Z );
+	boxMaxX.resize( perSlice * LIGHT_CLUSTERS_Z );
+	boxMinY.resize( perSlice * LIGHT_CLUSTERS_Z );
+	boxMaxY.resize( perSlice * LIGHT_CLUSTERS_Z );
+	
+	for( UINT k = 0; k < LIGHT_CLUSTERS_Z; k++ )
+		for( UINT c = 0; c < LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y; c++ )
+		{
+			float x0 = ( 2.0f * ( c % LIGHT_CLUSTERS_X ) / LIGHT_CLUSTERS_X - 1.0f ) * tanX;
+			float x1 = ( 2.0f * ( c % LIGHT_CLUSTERS_X + 1 ) / LIGHT_CLUSTERS_X - 1.0f ) * tanX;
+			float y0 = ( 2.0f * ( c / LIGHT_CLUSTERS_X ) / LIGHT_CLUSTERS_Y - 1.0f ) * tanY;
+			float y1 = ( 2.0f * ( c / LIGHT_CLUSTERS_X + 1 ) / LIGHT_CLUSTERS_Y - 1.0f ) * tanY;
+			
+			UINT	vector = k * perSlice + c / 4;
+			float	d0 = sliceDepths[ k ], d1 = sliceDepths[ k + 1 ];
+			( &boxMinX[ vector ].x )[ c % 4 ] = min( x0 * d0, x0 * d1 );
+			( &boxMaxX[ vector ].x )[ c % 4 ] = max( x1 * d0, x1 * d1 );
+			( &boxMinY[ vector ].x )[ c % 4 ] = min( y0 * d0, y0 * d1 );
+			( &boxMaxY[ vector ].x )[ c % 4 ] = max( y1 * d0, y1 * d1 );
+		}
+}
+
+UINT	LightClusters::sliceOf( float depth )
+{
+	if( depth <= sliceDepths[ 0 ] )
+		return 0;
+	return min( ( UINT )( logf( depth ) * sliceScale + sliceBias ), ( UINT )LIGHT_CLUSTERS_Z - 1 );
+}
+
+// the first pass only counts lights of every cluster, the second
+// one (placing) puts them into the index list. distance from the 
+// sphere's centre to a box is computed for four boxes at once
+void	LightClusters::binLights( UINT begin, UINT end )
+{
+	UINT	perSlice = LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y / 4;
+	UINT	inside[ 4 ];
+	
+	for( UINT l = begin; l < end; l++ )
+	{
+		XMFLOAT4 s( centreX[ l ], centreY[ l ], centreZ[ l ], radii[ l ] );
+		if( s.w <= 0.0f || s.z + s.w < sliceDepths[ 0 ] || s.z - s.w > sliceDepths[ LIGHT_CLUSTERS_Z ] )
+			continue;
+		
+		XMVECTOR	x = XMVectorReplicate( s.x );
+		XMVECTOR	y = XMVectorReplicate( s.y );
+		XMVECTOR	radiusSq = XMVectorReplicate( s.w * s.w );
+		XMVECTOR	zero = XMVectorZero();
+		UINT		lastSlice = sliceOf( s.z + s.w );
+		
+		for( UINT k = sliceOf( s.z - s.w ); k <= lastSlice; k++ )
+		{
+			float dz = max( max( sliceDepths[ k ] - s.z, s.z - sliceDepths[ k + 1 ] ), 0.0f );
+			if( dz * dz > s.w * s.w )
+				continue;
+			XMVECTOR dzSq = XMVectorReplicate( dz * dz );
+			
+			for( UINT v = k * perSlice; v < ( k + 1 ) * perSlice; v++ )
+			{
+				XMVECTOR dx = XMVectorMax( XMVectorMax( XMVectorSubtract( XMLoadFloat4( &boxMinX[ v ] ), x ), XMVectorSubtract( x, XMLoadFloat4( &boxMaxX[ v ] ) ) ), zero );
+				XMVECTOR dy = XMVectorMax( XMVectorMax( XMVectorSubtract( XMLoadFloat4( &boxMinY[ v ] ), y ), XMVectorSubtract( y, XMLoadFloat4( &boxMaxY[ v ] ) ) ), zero );
+				XMVECTOR distanceSq = XMVectorMultiplyAdd( dx, dx, XMVectorMultiplyAdd( dy, dy, dzSq ) );
+				XMStoreInt4( inside, XMVectorLessOrEqual( distanceSq, radiusSq ) );
+				
+				for( UINT i = 0; i < 4; i++ )
+				{
+					if( !inside[ i ] )
+						continue;
+					UINT cluster = v * 4 + i;
+					if( placing )
+						indices[ ranges[ cluster ].offset + InterlockedIncrement( &counts[ cluster ] ) - 1 ] = l;
+					else InterlockedIncrement( &counts[ cluster ] );
+				}
+			}
+		}
+	}
+}
+
+void	LightClusters::binJob( void* clusters, UINT begin, UINT end )
+{
+	( ( LightClusters* )clusters )->binLights( begin, end );
+}
+
+// spot lights narrower than 60 degrees fit into a sphere smaller 
+// than their range, touching the apex and the rim of the cone.
+// centres of all the spheres are moved into view space at once
+void	LightClusters::Build( const Light* lights, UINT count, Camera* cam )
+{
+	XMMATRIX mView = cam->GetView();
+	XMMATRIX mProjection = cam->GetProjection();
+	XMFLOAT4X4 newProjection;
+	XMStoreFloat4x4( &newProjection, mProjection );
+	XMStoreFloat4x4( &view, mView );
+	if( memcmp( &newProjection, &projection, sizeof( XMFLOAT4X4 ) ) != 0 )
+	{
+		projection = newProjection;
+		buildClusters();
+	}
+	
+	source = lights;
+	lightCount = count;
+	centreX.resize( count );
+	centreY.resize( count );
+	centreZ.resize( count );
+	radii.resize( count );
+	for( UINT l = 0; l < count; l++ )
+	{
+		const Light& light = lights[ l ];
+		XMFLOAT3 centre = light.position;
+		float radius = light.range;
+		
+		if( light.spotCos >= 0.5f )
+		{
+			radius = 0.5f * light.range / light.spotCos;
+			centre.x += light.direction.x * radius;
+			centre.y += light.direction.y * radius;
+			centre.z += light.direction.z * radius;
+		}
+		
+		centreX[ l ] = centre.x;
+		centreY[ l ] = centre.y;
+		centreZ[ l ] = centre.z;
+		radii[ l ] = radius;
+	}
+	if( count )
+		transformPoints( &centreX[ 0 ], &centreY[ 0 ], &centreZ[ 0 ], count, mView, &centreX[ 0 ], &centreY[ 0 ], &centreZ[ 0 ] );
+	
+	for( UINT c = 0; c < counts.size(); c++ )
+		counts[ c ] = 0;
+	placing = false;
+	if( pJobs )
+		pJobs->ParallelFor( count, LIGHT_BATCH_SIZE, binJob, this );
+	else binLights( 0, count );
+	
+	UINT total = 0;
+	for( UINT c = 0; c < counts.size(); c++ )
+	{
+		ranges[ c ].offset = total;
+		ranges[ c ].count = counts[ c ];
+		total += counts[ c ];
+		counts[ c ] = 0;
+	}
+	indices.resize( total );
+	
+	placing = true;
+	if( pJobs )
+		pJobs->ParallelFor( count, LIGHT_BATCH_SIZE, binJob, this );
+	else binLights( 0, count );
+}
+
+UINT	LightClusters::GetLights( const XMFLOAT3& point, const UINT*& lights )
+{
+	lights = NULL;
+	if( source == NULL )
+		return 0;
+	
+	XMFLOAT3 p;
+	XMStoreFloat3( &p, XMVector3TransformCoord( XMLoadFloat3( &point ), XMLoadFloat4x4( &view ) ) );
+	if( p.z < sliceDepths[ 0 ] || p.z > sliceDepths[ LIGHT_CLUSTERS_Z ] )
+		return 0;
+	
+	int x = ( int )( ( p.x * projection._11 / p.z + 1.0f ) * 0.5f * LIGHT_CLUSTERS_X );
+	int y = ( int )( ( p.y * projection._22 / p.z + 1.0f ) * 0.5f * LIGHT_CLUSTERS_Y );
+	if( x < 0 || y < 0 || x >= LIGHT_CLUSTERS_X || y >= LIGHT_CLUSTERS_Y )
+		return 0;
+	
+	const Range& range = ranges[ ( sliceOf( p.z ) * LIGHT_CLUSTERS_Y + y ) * LIGHT_CLUSTERS_X + x ];
+	if( range.count )
+		lights = &indices[ range.offset ];
+	return range.count;
+}
+
+// creates a buffer readable by shaders as elements of format. dynamic
+// ones are rewritten as a whole, default ones by UpdateSubresource
+static HRESULT	createShaderBuffer( ID3D10Device* device, UINT bytes, DXGI_FORMAT format, UINT elements, ID3D10Buffer** buffer, ID3D10ShaderResourceView** view, D3D10_USAGE usage = D3D10_USAGE_DYNAMIC )
+{
+	HRESULT				hr = S_OK;
+	D3D10_BUFFER_DESC	bd;
+	ZeroMemory( &bd, sizeof( bd ) );
+	bd.Usage = usage;
+	bd.ByteWidth = bytes;
+	bd.BindFlags = D3D10_BIND_SHADER_RESOURCE;
+	bd.CPUAccessFlags = usage == D3D10_USAGE_DYNAMIC ? D3D10_CPU_ACCESS_WRITE : 0;
+	
+	hr = device->CreateBuffer( &bd, NULL, buffer );
+	if( FAILED( hr ) )
+		return hr;
+	
+	D3D10_SHADER_RESOURCE_VIEW_DESC vd;
+	ZeroMemory( &vd, sizeof( vd ) );
+	vd.Format = format;
+	vd.ViewDimension = D3D10_SRV_DIMENSION_BUFFER;
+	vd.Buffer.ElementOffset = 0;
+	vd.Buffer.ElementWidth = elements;
+	return device->CreateShaderResourceView( *buffer, &vd, view );
+}
+
+// copies bytes into a dynamic buffer, discarding what it held
+static HRESULT	writeShaderBuffer( ID3D10Buffer* buffer, const void* data, UINT bytes )
+{
+	void*	dest = NULL;
+	HRESULT hr = buffer->Map( D3D10_MAP_WRITE_DISCARD, 0, &dest );
+	if( SUCCEEDED( hr ) )
+	{
+		memcpy( dest, data, bytes );
+		buffer->Unmap();
+	}
+	return hr;
+}
+
+bool	LightClusters::Upload( ID3D10Device* device )
+{
+	HRESULT	hr = S_OK;
+	UINT	clusterCount = ranges.size();
+	
+	if( rangeBuffer == NULL )
+		hr = createShaderBuffer( device, clusterCount * sizeof( Range ), DXGI_FORMAT_R32G32_UINT, clusterCount, &rangeBuffer, &rangeView );
+	
+	// the other two grow twice at a time, and hold at least one element
+	if( SUCCEEDED( hr ) && indices.size() > indexCapacity )
+	{
+		if( indexView )		indexView->Release();
+		if( indexBuffer )	indexBuffer->Release();
+		indexView = NULL;
+		indexBuffer = NULL;
+		indexCapacity = max( ( UINT )indices.size(), 2 * indexCapacity );
+		hr = createShaderBuffer( device, indexCapacity * sizeof( UINT ), DXGI_FORMAT_R32_UINT, indexCapacity, &indexBuffer, &indexView );
+	}
+	if( SUCCEEDED( hr ) && ( lightCount > lightCapacity || lightBuffer == NULL ) )
+	{
+		if( lightView )		lightView->Release();
+		if( lightBuffer )	lightBuffer->Release();
+		lightView = NULL;
+		lightBuffer = NULL;
+		lightCapacity = max( max( lightCount, 2 * lightCapacity ), 1u );
+		hr = createShaderBuffer( device, lightCapacity * sizeof( Light ), DXGI_FORMAT_R32G32B32A32_FLOAT, lightCapacity * 3, &lightBuffer, &lightView );
+	}
+	if( SUCCEEDED( hr ) && indexBuffer == NULL )
+	{
+		indexCapacity = 1;
+		hr = createShaderBuffer( device, sizeof( UINT ), DXGI_FORMAT_R32_UINT, 1, &indexBuffer, &indexView );
+	}
+	
+	if( FAILED( hr ) )
+	{
+		ERRORMACRO( L"Unable to create light buffers." );
+		ReleaseDevice();
+		return false;
+	}
+	
+	writeShaderBuffer( rangeBuffer, ranges.data(), clusterCount * sizeof( Range ) );
+	if( indices.size() )
+		writeShaderBuffer( indexBuffer, indices.data(), indices.size() * sizeof( UINT ) );
+	if( lightCount )
+		writeShaderBuffer( lightBuffer, source, lightCount * sizeof( Light ) );
+	return true;
+}
+
+void	LightClusters::ReleaseDevice()
+{
+	if( rangeView )		rangeView->Release();
+	if( indexView )		indexView->Release();
+	if( lightView )		lightView->Release();
+	if( rangeBuffer )	rangeBuffer->Release();
+	if( indexBuffer )	indexBuffer->Release();
+	if( lightBuffer )	lightBuffer->Release();
+	
+	rangeView = indexView = lightView = NULL;
+	rangeBuffer = indexBuffer = lightBuffer = NULL;
+	indexCapacity = lightCapacity = 0;
+}
+
+void	LightClusters::GetSliceParams( float& scale, float& bias )
+{
+	scale = sliceScale;
+	bias = sliceBias;
+}
+
+ID3D10ShaderResourceView*	LightClusters::GetRangeView()		{	return rangeView;	}
+ID3D10ShaderResourceView*	LightClusters::GetIndexView()		{	return indexView;	}
+ID3D10ShaderResourceView*	LightClusters::GetLightView()		{	return lightView;	}
+UINT						LightClusters::GetLightCount()		{	return lightCount;	}
+UINT						LightClusters::GetIndexCount()		{	return indices.size();	}
+void						LightClusters::BindJobs( JobSystem* jobs )	{	pJobs = jobs;	}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// SKY LIGHT	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+SkyLight::SkyLight()
+	:	function( NULL ),
+		param( NULL ),
+		zenith( 0.15f, 0.4f, 0.9f ),
+		horizon( 0.7f, 0.8f, 0.9f ),
+		ground( 0.25f, 0.22f, 0.2f ),
+		changed( true ),
+		version( 0 )
+{
+	ZeroMemory( coefficients, sizeof( coefficients ) );
+}
+
+// the ground fades in quickly below the horizon
+XMFLOAT3	SkyLight::gradient( const XMFLOAT3& direction, void* sky )
+{
+	SkyLight*	s = ( SkyLight* )sky;
+	XMVECTOR	horizon = XMLoadFloat3( &s->horizon );
+	XMFLOAT3	result;
+	
+	if( direction.y >= 0.0f )
+		XMStoreFloat3( &result, XMVectorLerp( horizon, XMLoadFloat3( &s->zenith ), direction.y ) );
+	else XMStoreFloat3( &result, XMVectorLerp( horizon, XMLoadFloat3( &s->ground ), min( -4.0f * direction.y, 1.0f ) ) );
+	return result;
+}
+
+void	SkyLight::SetGradient( const XMFLOAT3& _zenith, const XMFLOAT3& _horizon, const XMFLOAT3& _ground )
+{
+	zenith = _zenith;
+	horizon = _horizon;
+	ground = _ground;
+	function = NULL;
+	changed = true;
+}
+
+void	SkyLight::SetFunction( SkyFunc _function, void* _param )
+{
+	function = _function;
+	param = _param;
+	changed = true;
+}
+
+void	SkyLight::Invalidate()	{	changed = true;	}
+
+// directions are spread evenly over the whole sphere by the
+// hammersley sequence, each of them standing for the same
+// solid angle. every coefficient of the projection is then
+// scaled by the cosine lobe's factor for its band (1, 2/3 
+// and 1/4 once divided by pi) and the basis constant
+bool	SkyLight::Update()
+{
+	if( !changed )
+		return false;
+	
+	SkyFunc		sky = function ? function : gradient;
+	void*		skyParam = function ? param : this;
+	XMVECTOR	sums[ 9 ];
+	float		basis[ 9 ];
+	
+	for( UINT k = 0; k < 9; k++ )
+		sums[ k ] = XMVectorZero();
+	
+	for( UINT i = 0; i < SKY_SH_SAMPLES; i++ )
+	{
+		float z = 1.0f - 2.0f * ( i + 0.5f ) / SKY_SH_SAMPLES;
+		float radius = sqrtf( 1.0f - z * z );
+		float angle = 2.0f * XM_PI * radicalInverse( i );
+		float x = radius * cosf( angle );
+		float y = radius * sinf( angle );
+		
+		XMFLOAT3	direction( x, y, z );
+		XMFLOAT3	radiance = sky( direction, skyParam );
+		XMVECTOR	r = XMLoadFloat3( &radiance );
+		
+		basis[ 0 ] = 1.0f;
+		basis[ 1 ] = y;
+		basis[ 2 ] = z;
+		basis[ 3 ] = x;
+		basis[ 4 ] = x * y;
+		basis[ 5 ] = y * z;
+		basis[ 6 ] = 3.0f * z * z - 1.0f;
+		basis[ 7 ] = x * z;
+		basis[ 8 ] = x * x - y * y;
+		for( UINT k = 0; k < 9; k++ )
+			sums[ k ] = XMVectorMultiplyAdd( r, XMVectorReplicate( basis[ k ] ), sums[ k ] );
+	}
+	
+	// squared basis constants, times the lobe, times the solid angle of a sample
+	const float	factors[ 9 ] = 
+	{
+		0.282095f * 0.282095f,
+		0.488603f * 0.488603f * 2.0f / 3.0f,
+		0.488603f * 0.488603f * 2.0f / 3.0f,
+		0.488603f * 0.488603f * 2.0f / 3.0f,
+		1.092548f * 1.092548f * 0.25f,
+		1.092548f * 1.092548f * 0.25f,
+		0.315392f * 0.315392f * 0.25f,
+		1.092548f * 1.092548f * 0.25f,
+		0.546274f * 0.546274f * 0.25f,
+	};
+	for( UINT k = 0; k < 9; k++ )
+		XMStoreFloat4( &coefficients[ k ], XMVectorScale( sums[ k ], factors[ k ] * 4.0f * XM_PI / SKY_SH_SAMPLES ) );
+	
+	changed = false;
+	version++;
+	return true;
+}
+
+XMVECTOR	SkyLight::Irradiance( FXMVECTOR normal ) const
+{
+	XMFLOAT3 n;
+	XMStoreFloat3( &n, normal );
+	
+	XMVECTOR result = XMLoadFloat4( &coefficients[ 0 ] );
+	result = XMVectorMultiplyAdd( XMLoadFloat4( &coefficients[ 1 ] ), XMVectorReplicate( n.y ), result );
+	result = XMVectorMultiplyAdd( XMLoadFloat4( &coefficients[ 2 ] ), XMVectorReplicate( n.z ), result );
+	result = XMVectorMultiplyAdd( XMLoadFloat4( &coefficients[ 3 ] ), XMVectorReplicate( n.x ), result );
+	result = XMVectorMultiplyAdd( XMLoadFloat4( &coefficients[ 4 ] ), XMVectorReplicate( n.x * n.y ), result );
+	result = XMVectorMultiplyAdd( XMLoadFloat4( &coefficients[ 5 ] ), XMVectorReplicate( n.y * n.z ), result );
+	result = XMVectorMultiplyAdd( XMLoadFloat4( &coefficients[ 6 ] ), XMVectorReplicate( 3.0f * n.z * n.z - 1.0f ), result );
+	result = XMVectorMultiplyAdd( XMLoadFloat4( &coefficients[ 7 ] ), XMVectorReplicate( n.x * n.z ), result );
+	return XMVectorMultiplyAdd( XMLoadFloat4( &coefficients[ 8 ] ), XMVectorReplicate( n.x * n.x - n.y * n.y ), result );
+}
+
+const XMFLOAT4*	SkyLight::GetCoefficients() const	{	return coefficients;	}
+UINT			SkyLight::GetVersion() const		{	return version;	}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// COLOR TABLE	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+// packing goes through the same attribute traits vertices use
+// (see VertexAttribute), one loop per format, so the formats
+// aren't switched between for every single color
+template< class T >
+static void		packColors( const XMFLOAT4* source, UINT count, BYTE* dest )
+{
+	T* out = ( T* )dest;
+	for( UINT i = 0; i < count; i++ )
+		VertexAttribute< T >::Store( &out[ i ], XMLoadFloat4( &source[ i ] ) );
+}
+
+// colors[ i ] to indices[ i ], or source[ indices[ i ] ] if gather.
+// indices not below size are skipped
+template< class T >
+static void		scatterColors( const UINT* indices, const XMFLOAT4* colors, UINT count, bool gather, UINT size, BYTE* dest )
+{
+	T* out = ( T* )dest;
+	for( UINT i = 0; i < count; i++ )
+		if( indices[ i ] < size )
+			VertexAttribute< T >::Store( &out[ indices[ i ] ], XMLoadFloat4( &colors[ gather ? indices[ i ] : i ] ) );
+}
+
+static UINT		colorStride( ColorFormat format )
+{
+	return format == COLOR_FLOAT ? sizeof( XMFLOAT4 ) : sizeof( UINT );
+}
+
+static DXGI_FORMAT	colorBufferFormat( ColorFormat format )
+{
+	switch( format )
+	{
+	case COLOR_RGBA8:		return VertexAttribute< XMUBYTEN4 >::Format();
+	case COLOR_RGB10A2:		return VertexAttribute< XMUDECN4 >::Format();
+	default:				return VertexAttribute< XMFLOAT4 >::Format();
+	}
+}
+
+ColorTable::ColorTable( ColorFormat _format )
+	:	format( _format ),
+		stride( colorStride( _format ) ),
+		count( 0 ),
+		dirtyBegin( 0 ),
+		dirtyEnd( 0 ),
+		buffer( NULL ),
+		view( NULL ),
+		capacity( 0 )
+{}
+
+ColorTable::~ColorTable()
+{
+	ReleaseDevice();
+}
+
+void	ColorTable::touch( UINT begin, UINT end )
+{
+	if( dirtyBegin >= dirtyEnd )
+	{
+		dirtyBegin = begin;
+		dirtyEnd = end;
+	}
+	else
+	{
+		dirtyBegin = min( dirtyBegin, begin );
+		dirtyEnd = max( dirtyEnd, end );
+	}
+}
+
+void	ColorTable::SetFormat( ColorFormat _format )
+{
+	if( format == _format )
+		return;
+	
+	std::vector< XMFLOAT4 >	unpacked( count );
+	for( UINT i = 0; i < count; i++ )
+		unpacked[ i ] = Get( i );
+	
+	format = _format;
+	stride = colorStride( format );
+	colors.assign( count * stride, 0 );
+	ReleaseDevice();
+	if( count )
+		Set( 0, unpacked.data(), count );
+}
+
+void	ColorTable::Resize( UINT _count )
+{
+	colors.resize( _count * stride, 0 );
+	if( _count > count )
+		touch( count, _count );
+	count = _count;
+	dirtyEnd = min( dirtyEnd, count );
+}
+
+void	ColorTable::Erase( UINT index )
+{
+	if( index >= count )
+		return;
+	
+	memmove( &colors[ index * stride ], &colors[ ( index + 1 ) * stride ], ( count - index - 1 ) * stride );
+	count--;
+	colors.resize( count * stride );
+	if( index < count )
+		touch( index, count );
+	dirtyEnd = min( dirtyEnd, count );
+}
+
+void	ColorTable::Set( UINT first, const XMFLOAT4* source, UINT n )
+{
+	if( first >= count )
+		return;
+	n = min( n, count - first );
+	
+	BYTE* dest = &colors[ first * stride ];
+	switch( format )
+	{
+	case COLOR_RGBA8:		packColors< XMUBYTEN4 >( source, n, dest );		break;
+	case COLOR_RGB10A2:		packColors< XMUDECN4 >( source, n, dest );		break;
+	case COLOR_FLOAT:		memcpy( dest, source, n * sizeof( XMFLOAT4 ) );	break;
+	}
+	touch( first, first + n );
+}
+
+// indices beyond the table are skipped. the dirty range
+// grows once, by the lowest and the highest index
+void	ColorTable::scatter( const UINT* indices, const XMFLOAT4* source, UINT n, bool gather )
+{
+	UINT lowest = count, highest = 0;
+	for( UINT i = 0; i < n; i++ )
+	{
+		if( indices[ i ] >= count )
+			continue;
+		lowest = min( lowest, indices[ i ] );
+		highest = max( highest, indices[ i ] );
+	}
+	if( lowest > highest )
+		return;
+	
+	switch( format )
+	{
+	case COLOR_RGBA8:		scatterColors< XMUBYTEN4 >( indices, source, n, gather, count, colors.data() );	break;
+	case COLOR_RGB10A2:		scatterColors< XMUDECN4 >( indices, source, n, gather, count, colors.data() );		break;
+	case COLOR_FLOAT:		scatterColors< XMFLOAT4 >( indices, source, n, gather, count, colors.data() );		break;
+	}
+	touch( lowest, highest + 1 );
+}
+
+void	ColorTable::Scatter( const UINT* indices, const XMFLOAT4* source, UINT n )	{	scatter( indices, source, n, false );	}
+void	ColorTable::Gather( const UINT* indices, const XMFLOAT4* source, UINT n )	{	scatter( indices, source, n, true );	}
+
+XMFLOAT4	ColorTable::Get( UINT index )
+{
+	XMFLOAT4		color;
+	const BYTE*		source = &colors[ index * stride ];
+	
+	switch( format )
+	{
+	case COLOR_RGBA8:		XMStoreFloat4( &color, VertexAttribute< XMUBYTEN4 >::Load( ( const XMUBYTEN4* )source ) );	break;
+	case COLOR_RGB10A2:		XMStoreFloat4( &color, VertexAttribute< XMUDECN4 >::Load( ( const XMUDECN4* )source ) );		break;
+	default:				memcpy( &color, source, sizeof( color ) );		break;
+	}
+	return color;
+}
+
+// the buffer isn't dynamic, so a part of it can be updated
+// without discarding (and rewriting) the rest. it grows
+// twice at a time, and holds at least one color
+bool	ColorTable::Upload( ID3D10Device* device )
+{
+	HRESULT hr = S_OK;
+	
+	if( buffer == NULL || count > capacity )
+	{
+		UINT grown = max( max( count, 2 * capacity ), 1u );
+		ReleaseDevice();
+		capacity = grown;
+		hr = createShaderBuffer( device, capacity * stride, colorBufferFormat( format ), capacity, &buffer, &view, D3D10_USAGE_DEFAULT );
+		if( FAILED( hr ) )
+		{
+			ERRORMACRO( L"Unable to create color buffer." );
+			ReleaseDevice();
+			return false;
+		}
+		touch( 0, count );
+	}
+	
+	if( dirtyBegin < dirtyEnd )
+	{
+		D3D10_BOX box = { dirtyBegin * stride, 0, 0, dirtyEnd * stride, 1, 1 };
+		device->UpdateSubresource( buffer, 0, &box, &colors[ dirtyBegin * stride ], 0, 0 );
+	}
+	dirtyBegin = dirtyEnd = 0;
+	return true;
+}
+
+void	ColorTable::ReleaseDevice()
+{
+	if( view )		view->Release();
+	if( buffer )	buffer->Release();
+	view = NULL;
+	buffer = NULL;
+	capacity = 0;
+}
+
+ColorFormat					ColorTable::GetFormat()			{	return format;	}
+ID3D10ShaderResourceView*	ColorTable::GetView()			{	return view;	}
+UINT						ColorTable::GetDirtyCount()		{	return dirtyBegin < dirtyEnd ? dirtyEnd - dirtyBegin : 0;	}
+UINT						ColorTable::size()				{	return count;	}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// SPACE	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+// default constructor. space starts empty
+Space::Space()
+	:	layoutDirty( false ),
+		pJournal( NULL ),
+		pJobs( NULL )
+{}
+
+// adds a sphere at the end of the list
+void	Space::InsertSphere( XMFLOAT3 centre, float radius )
+{
+	spheres.push_back( XMFLOAT4( centre.x, centre.y, centre.z, radius ) );
+	sphereNodes.push_back( NO_NODE );
+	meshRadii.push_back( radius );
+	if( pJournal )
+		pJournal->RecordSphereInsert( spheres.back() );
+}
+
+// removes a sphere. same as Mateyko::RemoveObject
+// it causes the reallocation of the vector content
+void	Space::RemoveSphere( UINT sNum )
+{
+	if( sNum < spheres.size() )
+	{
+		// detach the sphere, and let nodes know
+		// the spheres after it moved one index back
+		AttachSphere( sNum, NO_NODE );
+		for( UINT i = sNum + 1; i < sphereNodes.size(); i++ )
+			if( sphereNodes[ i ] != NO_NODE )
+				nodeSpheres[ nodePositions[ sphereNodes[ i ] ] ]--;
 		
-		// we do not allow copying devices.
-		// every new instance of Mateyko class
-		// must be initialazed anew via the
-		// InitDevice method. therefore we have
-		// to set all device's pointers to NULL
+		spheres.erase( spheres.begin() + sNum );
+		sphereNodes.erase( sphereNodes.begin() + sNum );
+		meshRadii.erase( meshRadii.begin() + sNum );
+		if( pJournal )
+			pJournal->RecordSphereRemove( sNum );
+	}
+}
+
+void	Space::RemoveAll()
+{
+	for( UINT i = 0; i < sphereNodes.size(); i++ )
+		AttachSphere( i, NO_NODE );
+	spheres.clear();
+	sphereNodes.clear();
+	meshRadii.clear();
+	if( pJournal )
+		pJournal->RecordSpheres( NULL, NULL, 0 );
+}
+
+// all the spheres get detached from their nodes
+void	Space::SetSpheres( const XMFLOAT4* _spheres, UINT count, const float* _meshRadii )
+{
+	for( UINT i = 0; i < sphereNodes.size(); i++ )
+		AttachSphere( i, NO_NODE );
+	spheres.assign( _spheres, _spheres + count );
+	sphereNodes.assign( count, NO_NODE );
+	meshRadii.resize( count );
+	for( UINT i = 0; i < count; i++ )
+		meshRadii[ i ] = _meshRadii ? _meshRadii[ i ] : _spheres[ i ].w;
+	if( pJournal )
+		pJournal->RecordSpheres( _spheres, meshRadii.data(), count );
+}
+
+// moves the sphere, its radius stays untouched
+void	Space::SetPosition( UINT sNum, XMFLOAT3 centre )
+{
+	if( sNum < spheres.size() )
+	{
+		spheres[ sNum ].x = centre.x;
+		spheres[ sNum ].y = centre.y;
+		spheres[ sNum ].z = centre.z;
+		if( pJournal )
+			pJournal->RecordSphereMove( sNum, centre );
+	}
+}
+
+// moves and resizes the sphere. the mesh keeps its own
+// radius, so the world matrix scales it (see GetWorldPosition)
+void	Space::SetSphere( UINT sNum, XMFLOAT4 sphere )
+{
+	if( sNum < spheres.size() )
+	{
+		spheres[ sNum ] = sphere;
+		if( pJournal )
+			pJournal->RecordSphereSet( sNum, sphere );
+	}
+}
+
+void	Space::SpheresWritten( const UINT* indices, UINT count )
+{
+	if( pJournal )
+		for( UINT i = 0; i < count; i++ )
+			if( indices[ i ] < spheres.size() )
+				pJournal->RecordSphereSet( indices[ i ], spheres[ indices[ i ] ] );
+}
+
+void	Space::BindJournal( SceneJournal* jou )		{	pJournal = jou;	}
+void	Space::BindJobs( JobSystem* jobs )				{	pJobs = jobs;	}
+
+XMFLOAT4	Space::GetSphere( UINT sNum )				{	return spheres[ sNum ];		}
+UINT		Space::size()								{	return spheres.size();		}
+
+// spheres are stored exactly the way shaders expect them
+// so we only need to cast the vector data into floats
+float*		Space::GetShaderPositionArray()				
+{	
+	return spheres.empty() ? NULL : ( float* )spheres.data();
+}
+
+const float*	Space::GetMeshRadii()
+{
+	return meshRadii.empty() ? NULL : meshRadii.data();
+}
+
+// sphere meshes are built around the 0 point, so the
+// world matrix is just a translation to sphere's centre,
+// with a scale if the radius was changed (e.g. animated).
+// scene versions use it as well
+XMMATRIX	getSphereMatrix( const XMFLOAT4& sphere, float meshRadius )
+{
+	float scale = meshRadius > 0.0f ? sphere.w / meshRadius : 1.0f;
+	return XMMATRIX( 
+		scale, 0.0f, 0.0f, 0.0f,
+		0.0f, scale, 0.0f, 0.0f,
+		0.0f, 0.0f, scale, 0.0f,
+		sphere.x, sphere.y, sphere.z, 1.0f );
+}
+
+XMMATRIX	Space::GetWorldPosition( UINT sNum )	{	return getSphereMatrix( spheres[ sNum ], meshRadii[ sNum ] );	}
+
+const std::vector< SpherePair >&	Space::FindOverlaps()
+{
+	return broadphase.Update( spheres.data(), spheres.size() );
+}
+
+// /////////////////////////////////////////////////////
+//
+// SPACE TRANSFORM HIERARCHY METHODS
+//
+// /////////////////////////////////////////////////
+
+// new node is put at the end of the arrays. if its parent's
+// subtree ends there as well, preorder is still kept (so is
+// when building a hierarchy parent by parent), otherwise
+// the layout has to be rebuilt
+UINT	Space::CreateNode( UINT parent, CXMMATRIX local )
+{
+	if( parent != NO_NODE && !isNode( parent ) )
+		return NO_NODE;
+	
+	UINT	id = nodeParentIds.size();
+	UINT	position = nodeIds.size();
+	UINT	parentPosition = parent == NO_NODE ? NO_NODE : nodePositions[ parent ];
+	
+	nodeParentIds.push_back( parent );
+	nodePositions.push_back( position );
+	nodeIds.push_back( id );
+	nodeParents.push_back( parentPosition );
+	nodeEnds.push_back( position + 1 );
+	nodeSpheres.push_back( NO_NODE );
+	nodeDirty.push_back( 1 );
+	nodeLocals.push_back( XMFLOAT4X4() );
+	nodeWorlds.push_back( XMFLOAT4X4() );
+	XMStoreFloat4x4( &nodeLocals.back(), local );
+	dirtyNodes.push_back( position );
+	
+	// subtrees of all the ancestors end where the parent's does
+	if( parent != NO_NODE )
+	{
+		if( !layoutDirty && nodeEnds[ parentPosition ] == position )
+			for( UINT p = parentPosition; p != NO_NODE; p = nodeParents[ p ] )
+				nodeEnds[ p ] = position + 1;
+		else layoutDirty = true;
+	}
+	return id;
+}
+
+// removed nodes stay in the arrays until the layout is rebuilt,
+// but their ids are marked, so the rebuild leaves them out
+void	Space::RemoveNode( UINT node )
+{
+	if( !isNode( node ) )
+		return;
+	
+	// subtree must be a continuous range to be found
+	if( layoutDirty )
+		rebuildLayout();
+	
+	UINT position = nodePositions[ node ];
+	for( UINT p = position; p < nodeEnds[ position ]; p++ )
+	{
+		if( nodeSpheres[ p ] != NO_NODE )
+			AttachSphere( nodeSpheres[ p ], NO_NODE );
+		nodeParentIds[ nodeIds[ p ] ] = REMOVED_NODE;
+	}
+	layoutDirty = true;
+}
+
+// node is marked dirty once, no matter how many times it's changed
+void	Space::SetLocal( UINT node, CXMMATRIX local )
+{
+	if( !isNode( node ) )
+		return;
+	
+	UINT position = nodePositions[ node ];
+	XMStoreFloat4x4( &nodeLocals[ position ], local );
+	if( !nodeDirty[ position ] )
+	{
+		nodeDirty[ position ] = 1;
+		dirtyNodes.push_back( position );
+	}
+}
+
+// identity for nodes that don't exist
+XMMATRIX	Space::GetLocal( UINT node )
+{
+	if( !isNode( node ) )
+		return XMMatrixIdentity();
+	return XMLoadFloat4x4( &nodeLocals[ nodePositions[ node ] ] );
+}
+
+XMMATRIX	Space::GetWorld( UINT node )
+{
+	if( !isNode( node ) )
+		return XMMatrixIdentity();
+	return XMLoadFloat4x4( &nodeWorlds[ nodePositions[ node ] ] );
+}
+
+bool	Space::isNode( UINT node )
+{
+	return node < nodeParentIds.size() && nodeParentIds[ node ] != REMOVED_NODE;
+}
+
+// sphere takes the position of the node on the next update.
+// a node holds one sphere at most, previous one gets detached
+void	Space::AttachSphere( UINT sNum, UINT node )
+{
+	if( sNum >= sphereNodes.size() || ( node != NO_NODE && !isNode( node ) ) )
+		return;
+	
+	if( sphereNodes[ sNum ] != NO_NODE )
+		nodeSpheres[ nodePositions[ sphereNodes[ sNum ] ] ] = NO_NODE;
+	
+	sphereNodes[ sNum ] = node;
+	if( node != NO_NODE )
+	{
+		UINT position = nodePositions[ node ];
+		if( nodeSpheres[ position ] != NO_NODE )
+			sphereNodes[ nodeSpheres[ position ] ] = NO_NODE;
+		nodeSpheres[ position ] = sNum;
+		if( !nodeDirty[ position ] )
+		{
+			nodeDirty[ position ] = 1;
+			dirtyNodes.push_back( position );
+		}
+	}
+}
+
+UINT	Space::GetNodeCount()
+{
+	if( layoutDirty )
+		rebuildLayout();
+	return nodeIds.size();
+}
+
+// puts all the nodes alive back into preorder. children
+// are first grouped by their parents (counting sort),
+// then the trees are walked depth first. all nodes
+// are dirty afterwards, as positions have changed
+void	Space::rebuildLayout()
+{
+	UINT						idCount = nodeParentIds.size();
+	std::vector< UINT >			childStarts( idCount + 2, 0 );
+	std::vector< UINT >			children( idCount );
+	std::vector< UINT >			stack;
+	
+	// childStarts[ parent + 1 ] holds children of the parent, 
+	// childStarts[ 0 ] roots. first count them, then place
+	for( UINT id = 0; id < idCount; id++ )
+		if( nodeParentIds[ id ] != REMOVED_NODE )
+			childStarts[ nodeParentIds[ id ] + 2 ]++;		// NO_NODE + 2 wraps around to 1
+	for( UINT i = 1; i < childStarts.size(); i++ )
+		childStarts[ i ] += childStarts[ i - 1 ];
+	for( UINT id = 0; id < idCount; id++ )
+		if( nodeParentIds[ id ] != REMOVED_NODE )
+			children[ childStarts[ nodeParentIds[ id ] + 1 ]++ ] = id;
+	// now children of a node lie between childStarts[ node ] and
+	// childStarts[ node + 1 ], roots between 0 and childStarts[ 0 ]
+	
+	std::vector< UINT >			ids, parents, ends, attached;
+	std::vector< XMFLOAT4X4 >	locals;
+	
+	// roots go on the stack in reverse, so they're popped in order
+	for( UINT i = childStarts[ 0 ]; i > 0; i-- )
+		stack.push_back( children[ i - 1 ] );
+	
+	while( !stack.empty() )
+	{
+		UINT id = stack.back();
+		stack.pop_back();
 		
-		pInput( mat.pInput ),
-		pCam( mat.pCam ),
-		pSpace( mat.pSpace ),
+		// a node's subtree ends where the next sibling (or the 
+		// next sibling of an ancestor) begins. so when a node is
+		// placed, ancestors whose subtrees ended are closed
+		UINT parent = nodeParentIds[ id ] == NO_NODE ? NO_NODE : nodePositions[ nodeParentIds[ id ] ];
+		UINT open = parents.empty() ? NO_NODE : ids.size() - 1;
+		while( open != parent )
+		{
+			ends[ open ] = ids.size();
+			open = parents[ open ];
+		}
 		
-		// the exceptions are pointers of other objects
-		// like Camera, Input and Space. we allow to copy 
-		// those pointers, because they exist separately anyway
+		UINT oldPosition = nodePositions[ id ];
+		nodePositions[ id ] = ids.size();
+		ids.push_back( id );
+		parents.push_back( parent );
+		ends.push_back( ids.size() );
+		attached.push_back( nodeSpheres[ oldPosition ] );
+		locals.push_back( nodeLocals[ oldPosition ] );
 		
-		objects( mat.objects.begin(), mat.objects.end() ),
-		oColors( mat.oColors.begin(), mat.oColors.end() ),
+		for( UINT i = childStarts[ id + 1 ]; i > childStarts[ id ]; i-- )
+			stack.push_back( children[ i - 1 ] );
+	}
+	for( UINT open = parents.empty() ? NO_NODE : ids.size() - 1; open != NO_NODE; open = parents[ open ] )
+		ends[ open ] = ids.size();
+	
+	nodeIds.swap( ids );
+	nodeParents.swap( parents );
+	nodeEnds.swap( ends );
+	nodeSpheres.swap( attached );
+	nodeLocals.swap( locals );
+	nodeWorlds.resize( nodeIds.size() );
+	nodeDirty.assign( nodeIds.size(), 1 );
+	
+	dirtyNodes.clear();
+	for( UINT p = 0; p < nodeIds.size(); p = nodeEnds[ p ] )
+		dirtyNodes.push_back( p );
+	layoutDirty = false;
+}
+
+// evaluates world transform of a single node, its parent
+// must be up to date. attached sphere follows the node
+void	Space::evaluateNode( UINT p )
+{
+	XMMATRIX world = XMLoadFloat4x4( &nodeLocals[ p ] );
+	if( nodeParents[ p ] != NO_NODE )
+		world = XMMatrixMultiply( world, XMLoadFloat4x4( &nodeWorlds[ nodeParents[ p ] ] ) );
+	XMStoreFloat4x4( &nodeWorlds[ p ], world );
+	
+	if( nodeSpheres[ p ] != NO_NODE )
+	{
+		XMFLOAT4& sphere = spheres[ nodeSpheres[ p ] ];
+		sphere.x = nodeWorlds[ p ]._41;
+		sphere.y = nodeWorlds[ p ]._42;
+		sphere.z = nodeWorlds[ p ]._43;
+	}
+}
+
+// evaluates the subtrees whose roots are in the 
+// updateTasks[ begin, end ) range. thanks to preorder
+// parents are always evaluated before their children
+void	Space::evaluateNodes( UINT begin, UINT end )
+{
+	for( UINT t = begin; t < end; t++ )
+		for( UINT p = updateTasks[ t ]; p < nodeEnds[ updateTasks[ t ] ]; p++ )
+			evaluateNode( p );
+}
+
+void	Space::evaluateJob( void* space, UINT begin, UINT end )
+{
+	( ( Space* )space )->evaluateNodes( begin, end );
+}
+
+// only dirty subtrees are evaluated. a subtree inside
+// another dirty one is skipped, it's evaluated anyway.
+// big subtrees are split - their root is evaluated
+// right away, and children's subtrees become separate 
+// tasks, which may be then run in parallel
+void	Space::UpdateTransforms()
+{
+	if( layoutDirty )
+		rebuildLayout();
+	if( dirtyNodes.empty() )
+		return;
+	
+	std::sort( dirtyNodes.begin(), dirtyNodes.end() );
+	splitTasks.clear();
+	updateTasks.clear();
+	
+	UINT	covered = 0;
+	for( UINT i = 0; i < dirtyNodes.size(); i++ )
+	{
+		nodeDirty[ dirtyNodes[ i ] ] = 0;
+		if( dirtyNodes[ i ] < covered )
+			continue;
+		splitTasks.push_back( dirtyNodes[ i ] );
+		covered = nodeEnds[ dirtyNodes[ i ] ];
+	}
+	dirtyNodes.clear();
+	
+	while( !splitTasks.empty() )
+	{
+		UINT root = splitTasks.back();
+		splitTasks.pop_back();
+		
+		if( nodeEnds[ root ] - root <= NODE_SPLIT_SIZE )
+		{
+			updateTasks.push_back( root );
+			continue;
+		}
+		
+		// evaluate the root alone, then its children
+		evaluateNode( root );
+		for( UINT child = root + 1; child < nodeEnds[ root ]; child = nodeEnds[ child ] )
+			splitTasks.push_back( child );
+	}
+	
+	if( pJobs && updateTasks.size() > 1 )
+		pJobs->ParallelFor( updateTasks.size(), NODE_BATCH_SIZE, evaluateJob, this );
+	else evaluateNodes( 0, updateTasks.size() );
+	
+	// journal isn't thread safe, so moves are recorded afterwards
+	if( pJournal )
+		for( UINT t = 0; t < updateTasks.size(); t++ )
+			for( UINT p = updateTasks[ t ]; p < nodeEnds[ updateTasks[ t ] ]; p++ )
+				if( nodeSpheres[ p ] != NO_NODE )
+				{
+					XMFLOAT4& sphere = spheres[ nodeSpheres[ p ] ];
+					pJournal->RecordSphereMove( nodeSpheres[ p ], XMFLOAT3( sphere.x, sphere.y, sphere.z ) );
+				}
+}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// OBJECT3D	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+// main constructor of the Object3D class
+// (default was disabled)
+Object3D::Object3D( 
+	ID3D10Device* pd3dDevice, 	// pointer to the device that will create buffers
+	void* vertices, 			// pointer to the array of Vertex structure in which we store the grid
+	DWORD* indices, 			// indices defining the triangles of that grid
+	UINT _vSize, 				// size of both arrays
+	UINT _iSize,
+	UINT _stride,				// size of a single vertex, 0 for Vertex structs
+	const D3D10_INPUT_ELEMENT_DESC* _elements,	// their layout's elements (see VertexFormat)
+	UINT _elementCount,
+	VertexDecoder _decode )		// and how to turn them back into Vertex structs
+	
+	:	vSize( _vSize ), iSize( _iSize ),
+		stride( _stride ? _stride : sizeof( Vertex ) ), offset( 0 ),
+		layouts( _elements ? new InputLayoutCache( _elements, _elementCount ) : NULL ), 
+		decode( _decode ),
+		sphere( false )
+{
+	// declare variables
+	HRESULT hr = S_OK;
+	D3D10_BUFFER_DESC bd;
+	ZeroMemory( &bd, sizeof( bd ) );
+
+	// prepare vertex buffer
+	bd.Usage = D3D10_USAGE_DEFAULT;
+	bd.ByteWidth = stride * vSize;
+	bd.BindFlags = D3D10_BIND_VERTEX_BUFFER;
+	bd.CPUAccessFlags = 0;
+	bd.MiscFlags = 0;
+
+	D3D10_SUBRESOURCE_DATA InitData;
+	InitData.pSysMem = vertices;
+
+	// store the actual buffer pointer and run CreateDevice method
+	hr = pd3dDevice->CreateBuffer( &bd, &InitData, &vBuffer );
+	if( FAILED( hr ) )
+		ERRORMACRO( L"Object construction failed. Unable to create vertex buffer" );
+
+	// prepare index buffer
+	bd.Usage = D3D10_USAGE_DEFAULT;
+	bd.ByteWidth = sizeof( DWORD ) * iSize;
+	bd.BindFlags = D3D10_BIND_INDEX_BUFFER;
+	bd.CPUAccessFlags = 0;
+	bd.MiscFlags = 0;
+	InitData.pSysMem = indices;
+
+	// store the actual buffer pointer and run CreateDevice method
+	hr = pd3dDevice->CreateBuffer( &bd, &InitData, &iBuffer );
+	if( FAILED( hr ) )
+		ERRORMACRO( L"Object construction failed. Unable to create index buffer" );
+}
+
+// copy constructor
+// copies the stuff that can be copied,
+// then copies buffers pointers and increase
+// their uses count
+Object3D::Object3D( const Object3D& o3d )
+	:	vSize( o3d.vSize ), 
+		iSize( o3d.iSize ),
+		stride( o3d.stride ), 
+		offset( o3d.offset ),
+		layouts( o3d.layouts ),
+		decode( o3d.decode ),
+		sphere( o3d.sphere )
+{
+	// assign the buffers
+	vBuffer = o3d.vBuffer;
+	iBuffer = o3d.iBuffer;
+	
+	// increment the buffers uses count
+	o3d.vBuffer->AddRef();
+	o3d.iBuffer->AddRef();
+}
+
+// assigment operator. works similar to the 
+// copy constructor. assign buffers pointers
+// then increases uses count.
+Object3D&	Object3D::operator=( const Object3D& o3d )
+{
+	if( this != &o3d )
+	{
+		// the right operand's first, in case they share something
+		o3d.vBuffer->AddRef();
+		o3d.iBuffer->AddRef();
 		
-		// other exceptions are std::vector sets of
-		// objects and colors on the scene. those also
-		// can be safely copied. (remember objects
-		// is a vector of shared ptrs)
+		// release the left operand's buffers
+		vBuffer->Release();
+		iBuffer->Release();
 		
-		Width( 0 ),
-		Height( 0 )
+		// assign everything
+		vSize = o3d.vSize; 
+		iSize = o3d.iSize;
+		stride = o3d.stride; 
+		offset = o3d.offset;
+		layouts = o3d.layouts;
+		decode = o3d.decode;
+		sphere = o3d.sphere;
 		
-		// those two will be set right when InitDevice
-		// will be called. unless so, they're set to zero
-		// in case GetClientRect will be called.
+		// assign the buffers
+		vBuffer = o3d.vBuffer;
+		iBuffer = o3d.iBuffer;
+
+		return *this;
+	}
+}
+
+// destructor. 
+Object3D::~Object3D()
+{
+	vBuffer->Release();
+	iBuffer->Release();
+}
+
+// function draws the object on the scene using provided device
+void	Object3D::Draw( 
+	ID3D10Device* pd3dDevice, 		// pointer to the device that will do the actual work
+	ID3D10EffectTechnique* Tech )	// pointer to the technique that needs to be used
+{
+	// Variables
+	D3D10_TECHNIQUE_DESC techDesc;
+	ID3D10InputLayout* previous = NULL;
+
+	// vertices of other formats need their own layout, matching
+	// every pass. the one set before is put back afterwards, 
+	// for the next objects
+	if( layouts )
+		pd3dDevice->IAGetInputLayout( &previous );
+
+	// get vertex buffer and pass it into a device
+	pd3dDevice->IASetVertexBuffers( 0, 1, &vBuffer, &stride, &offset );
+
+	// set index buffer
+	pd3dDevice->IASetIndexBuffer( iBuffer, DXGI_FORMAT_R32_UINT, 0 );
+	
+	Tech->GetDesc( &techDesc );	
+	for( UINT p = 0; p < techDesc.Passes; ++p )
+	{
+		ID3D10EffectPass* pass = Tech->GetPassByIndex( p );
+		pass->Apply( 0 );
+		if( layouts )
+			pd3dDevice->IASetInputLayout( layouts->Get( pd3dDevice, pass ) );
+		pd3dDevice->DrawIndexed( iSize, 0, 0 );
+	}
+	
+	if( layouts )
+	{
+		pd3dDevice->IASetInputLayout( previous );
+		if( previous )
+			previous->Release();
+	}
+}
+
+// copies bytes of a gpu buffer into the memory pointed by dest.
+// buffers created with D3D10_USAGE_DEFAULT can't be mapped,
+// so the content is copied into the staging buffer first
+static HRESULT	readBufferBack( ID3D10Device* pd3dDevice, ID3D10Buffer* buffer, UINT bytes, void* dest )
+{
+	HRESULT			hr = S_OK;
+	ID3D10Buffer*	staging = NULL;
+	void*			data = NULL;
+	D3D10_BUFFER_DESC bd;
+	ZeroMemory( &bd, sizeof( bd ) );
+	
+	bd.Usage = D3D10_USAGE_STAGING;
+	bd.ByteWidth = bytes;
+	bd.BindFlags = 0;
+	bd.CPUAccessFlags = D3D10_CPU_ACCESS_READ;
+	bd.MiscFlags = 0;
+	
+	hr = pd3dDevice->CreateBuffer( &bd, NULL, &staging );
+	if( FAILED( hr ) )
+		return hr;
+	
+	pd3dDevice->CopyResource( staging, buffer );
+	hr = staging->Map( D3D10_MAP_READ, 0, &data );
+	if( SUCCEEDED( hr ) )
+	{
+		memcpy( dest, data, bytes );
+		staging->Unmap();
+	}
+	
+	staging->Release();
+	return hr;
+}
+
+// reads both buffers back into the vectors
+HRESULT	Object3D::ReadBack( 
+	ID3D10Device* pd3dDevice, 		// device that created the object
+	std::vector< BYTE >& vertices, 	// vSize Vertex structs
+	std::vector< DWORD >& indices )	// iSize indices
+{
+	HRESULT hr = S_OK;
+	
+	indices.resize( iSize );
+	if( decode )
+	{
+		std::vector< BYTE >	packed( vSize * stride );
+		hr = readBufferBack( pd3dDevice, vBuffer, vSize * stride, packed.data() );
+		vertices.resize( vSize * sizeof( Vertex ) );
+		if( SUCCEEDED( hr ) )
+			decode( packed.data(), vSize, ( Vertex* )vertices.data() );
+	}
+	else
+	{
+		vertices.resize( vSize * stride );
+		hr = readBufferBack( pd3dDevice, vBuffer, vSize * stride, vertices.data() );
+	}
+	
+	if( SUCCEEDED( hr ) )
+		hr = readBufferBack( pd3dDevice, iBuffer, iSize * sizeof( DWORD ), indices.data() );
+	return hr;
+}
+
+UINT			Object3D::GetVertexCount()		{	return vSize;	}
+UINT			Object3D::GetIndexCount()		{	return iSize;	}
+UINT			Object3D::GetStride()			{	return stride;	}
+ID3D10Buffer*	Object3D::GetVertexBuffer()		{	return vBuffer;	}
+void			Object3D::MarkSphere()			{	sphere = true;	}
+bool			Object3D::IsSphere()			{	return sphere;	}
+
+InputLayoutCache::InputLayoutCache( const D3D10_INPUT_ELEMENT_DESC* _elements, UINT _count )
+	:	elements( _elements ),
+		count( _count )
 {}
 
-// assigment operator of the Mateyko class
-// does NOT assign directx related stuff
-// only copy outer device's pointers and 
-// the content of std::vectors. to use
-// an instance after cpuying initialize
-// it with InitDevice method.
+InputLayoutCache::~InputLayoutCache()
+{
+	for( UINT i = 0; i < layouts.size(); i++ )
+		if( layouts[ i ].second )
+			layouts[ i ].second->Release();
+}
 
-Mateyko&	Mateyko::operator=( const Mateyko& mat )
+// there are only a few techniques, so the signatures are 
+// simply searched one by one. the signature stays where it
+// is as long as the effect lives
+ID3D10InputLayout*	InputLayoutCache::Get( ID3D10Device* device, ID3D10EffectPass* pass )
 {
-	if( this != &mat )
+	D3D10_PASS_DESC		passDesc;
+	ID3D10InputLayout*	layout = NULL;
+	
+	pass->GetDesc( &passDesc );
+	for( UINT i = 0; i < layouts.size(); i++ )
+		if( layouts[ i ].first == passDesc.pIAInputSignature )
+			return layouts[ i ].second;
+	
+	if( FAILED( device->CreateInputLayout( elements, count, 
+		passDesc.pIAInputSignature, passDesc.IAInputSignatureSize, &layout ) ) )
 	{
-		// as was specified above in the copy constructor
-		// comment section, we do not allow to copy devices
-		// textures and other directx related stuff. it is
-		// way simpler to code it that way safely,
-		// and anyway we don't expect anyone
-		// be juggling with plenty of drawing devices
-		// just for the sake of it. in fact Mateyko
-		// should have one, maybe up to few instances,
-		// and there's hardly any scenario where
-		// a direct copy of this class would be necessary.
-		// therefore every time there's a need for
-		// copying, copied instance must be initialized anew
+		ERRORMACRO( L"Unable to create the input layout of a vertex format." );
+		layout = NULL;
+	}
+	layouts.push_back( std::make_pair( passDesc.pIAInputSignature, layout ) );
+	return layout;
+}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// SCENE GENERATOR	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+// default scene description. a hundred spheres scattered
+// uniformly over the floor
+SceneDesc::SceneDesc()
+	:	seed( 1 ),
+		count( 100 ),
+		distribution( SCENE_UNIFORM ),
 		
-		// first clean up the left operand
-		if( pd3dDevice )			pd3dDevice->ClearState();
-		if( pSwapChain )			pSwapChain->Release();
-		if( pRenderTargetView )		pRenderTargetView->Release();
-		if( pDepthStencil )			pDepthStencil->Release();
-		if( pDepthStencilView )		pDepthStencilView->Release();
-		if( FloorTextureRV )		FloorTextureRV->Release();
-		if( oGroundZero )			delete oGroundZero;
+		extent( 20.0f ),
+		height( 10.0f ),
+		minRadius( 0.2f ),
+		maxRadius( 1.0f ),
+		radiusLevels( 8 ),
+		minMeridians( 8 ),
+		maxMeridians( 32 ),
+		minParallels( 6 ),
+		maxParallels( 24 ),
+		tessellationLevels( 4 ),
+		clusters( 8 ),
+		clusterSpread( 3.0f ),
+		compactVertices( false ),
 		
-		// clean up vectors
-		objects.clear();
-		oColors.clear();
+		floorSize( 50.0f ),
+		floorTexture( NULL )
+{}
+
+SceneGenerator::SceneGenerator( const SceneDesc& _desc )
+	:	desc( _desc ),
+		state( _desc.seed )
+{}
+
+// xorshift32 generator. it is tiny, fast and, what's most
+// important here, gives the same sequence everywhere.
+// zero is the only state it can't leave, so we avoid it
+UINT	SceneGenerator::NextUInt()
+{
+	if( state == 0 )
+		state = 0x9E3779B9;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+// returns float from the [lo, hi] range. uses upper 24 bits 
+// only, since that's all the precision float can hold
+float	SceneGenerator::NextFloat( float lo, float hi )
+{
+	return lo + ( hi - lo ) * ( ( NextUInt() >> 8 ) / 16777215.0f );
+}
+
+// returns a random number from the [0, levels) range
+UINT	SceneGenerator::NextLevel( UINT levels )
+{
+	return levels > 1 ? NextUInt() % levels : 0;
+}
+
+// fills Mateyko and Space with spheres. note that every call
+// to NextUInt or NextFloat is a separate statement. order in
+// which function arguments are evaluated is unspecified, so
+// writing XMFLOAT3( NextFloat(), NextFloat(), NextFloat() )
+// might give different scenes on different compilers.
+void	SceneGenerator::Populate( Mateyko& mat, Space& spa )
+{
+	// ////////////////////////////////////////////
+	// DECLARE VARIABLES
+	// ...
+	// spheres sharing the radius and tessellation share 
+	// the mesh too. variants keeps the index of the first
+	// object of every radius/tessellation combination
+	// (or -1 if it wasn't created yet). later spheres
+	// just copy that object and change their color
+	std::vector< int >		variants;
+	std::vector< XMFLOAT3 >	centres;		// cluster centres
+	UINT					side;			// number of spheres along the grid edge
+	XMFLOAT3				centre;
+	XMFLOAT4				color;
+	
+	// ////////////////////////////////////////////
+	// DEFINE VARIABLES
+	// ...
+	// restart generator, so populating twice gives the same scene
+	state = desc.seed;
+	variants.assign( max( desc.radiusLevels, 1u ) * max( desc.tessellationLevels, 1u ), -1 );
+	
+	if( desc.distribution == SCENE_CLUSTERED )
+	{
+		for( UINT k = 0; k < max( desc.clusters, 1u ); k++ )
+		{
+			centre.x = NextFloat( -desc.extent, desc.extent );
+			centre.y = NextFloat( 0.0f, desc.height );
+			centre.z = NextFloat( -desc.extent, desc.extent );
+			centres.push_back( centre );
+		}
+	}
+	
+	side = 1;
+	while( side * side * side < desc.count )
+		side++;
+	
+	// start from the scratch
+	mat.RemoveAll();
+	spa.RemoveAll();
+	
+	// ////////////////////////////////////////////
+	// SPHERES
+	// ...
+	for( UINT i = 0; i < desc.count; i++ )
+	{
+		// choose the position depending on the distribution
+		switch( desc.distribution )
+		{
+		case SCENE_UNIFORM:
+			centre.x = NextFloat( -desc.extent, desc.extent );
+			centre.y = NextFloat( 0.0f, desc.height );
+			centre.z = NextFloat( -desc.extent, desc.extent );
+			break;
+			
+		case SCENE_CLUSTERED:
+			// sum of three uniform numbers is close enough
+			// to the normal distribution for our needs
+			centre = centres[ NextUInt() % centres.size() ];
+			for( UINT k = 0; k < 3; k++ )
+			{
+				centre.x += NextFloat( -desc.clusterSpread, desc.clusterSpread ) / 3.0f;
+				centre.y += NextFloat( -desc.clusterSpread, desc.clusterSpread ) / 3.0f;
+				centre.z += NextFloat( -desc.clusterSpread, desc.clusterSpread ) / 3.0f;
+			}
+			break;
+			
+		case SCENE_GRID:
+			centre.x = -desc.extent + ( i % side + 0.5f ) * 2.0f * desc.extent / side;
+			centre.y = ( ( i / side ) % side + 0.5f ) * desc.height / side;
+			centre.z = -desc.extent + ( i / ( side * side ) + 0.5f ) * 2.0f * desc.extent / side;
+			break;
+		}
 		
-		// set null to pd3dDevice
-		pd3dDevice = NULL;
+		// choose radius and tessellation
+		UINT rLevel = NextLevel( desc.radiusLevels );
+		UINT tLevel = NextLevel( desc.tessellationLevels );
+		float rFactor = desc.radiusLevels > 1 ? rLevel / ( desc.radiusLevels - 1.0f ) : 0.0f;
+		float tFactor = desc.tessellationLevels > 1 ? tLevel / ( desc.tessellationLevels - 1.0f ) : 0.0f;
 		
-		// set null to screen proportions
-		Width = 0;
-		Height = 0;
+		float radius = desc.minRadius + rFactor * ( desc.maxRadius - desc.minRadius );
+		UINT meridians = desc.minMeridians + ( UINT )( tFactor * ( desc.maxMeridians - desc.minMeridians ) + 0.5f );
+		UINT parallels = desc.minParallels + ( UINT )( tFactor * ( desc.maxParallels - desc.minParallels ) + 0.5f );
 		
-		// assign outer devices. we do not need to erase
-		// them, for they are only binded, not created
-		// within the mateyko class
-		pInput = mat.pInput;
-		pCam = mat.pCam;
-		pSpace = mat.pSpace;
+		// and the color
+		color.x = NextFloat( 0.1f, 1.0f );
+		color.y = NextFloat( 0.1f, 1.0f );
+		color.z = NextFloat( 0.1f, 1.0f );
+		color.w = 1.0f;
 		
-		// insert the content of right operand's std::vectors
-		// into the left's vectors, cleared a moment ago
-		objects.insert( objects.begin(), mat.objects.begin(), mat.objects.end() );
-		oColors.insert( oColors.begin(), mat.oColors.begin(), mat.oColors.end() );
+		// form the sphere, or copy the one
+		// of the same radius and tessellation
+		int& variant = variants[ rLevel * max( desc.tessellationLevels, 1u ) + tLevel ];
+		if( variant < 0 )
+		{
+			std::wstringstream	name;
+			name << L"sphere" << i;
+			mat.formSphere( name.str().c_str(), meridians, parallels, radius, color, desc.compactVertices );
+			variant = mat.GetObjectCount() - 1;
+		}
+		else
+		{
+			mat.InsertObject( mat.GetObject3D( variant ) );
+			mat.updateColor( mat.GetObjectCount() - 1, color );
+		}
 		
-		return *this;
+		spa.InsertSphere( centre, radius );
+	}
+	
+	// ////////////////////////////////////////////
+	// FLOOR
+	// ...
+	if( desc.floorSize > 0.0f )
+	{
+		mat.formRectangleObject( L"floor", desc.floorSize, desc.floorSize, 
+			XMFLOAT3( 0.0f, 1.0f, 0.0f ), XMFLOAT3( 1.0f, 0.0f, 0.0f ) );
+		if( desc.floorTexture )
+			mat.loadTexture( desc.floorTexture );
+	}
+}
+
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// SCENE JOURNAL	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+// appends an unsigned integer using as few bytes as possible.
+// every byte holds 7 bits of the number, the highest bit
+// tells if there are more bytes to come
+static void		putVarint( std::vector< BYTE >& out, UINT64 value )
+{
+	while( value >= 0x80 )
+	{
+		out.push_back( ( BYTE )( value | 0x80 ) );
+		value >>= 7;
+	}
+	out.push_back( ( BYTE )value );
+}
+
+// reads the number written by putVarint. returns false
+// if the data ends before the number does
+static bool		getVarint( const BYTE*& ptr, const BYTE* end, UINT64& value )
+{
+	value = 0;
+	for( UINT shift = 0; ptr < end && shift < 64; shift += 7 )
+	{
+		BYTE b = *ptr++;
+		value |= ( UINT64 )( b & 0x7F ) << shift;
+		if( !( b & 0x80 ) )
+			return true;
 	}
+	return false;
+}
+
+// appends raw bytes
+static void		putBytes( std::vector< BYTE >& out, const void* data, size_t bytes )
+{
+	const BYTE* ptr = ( const BYTE* )data;
+	out.insert( out.end(), ptr, ptr + bytes );
+}
+
+SceneJournal::SceneJournal()
+	:	nextMesh( 0 ),
+		hasCamera( false ),
+		hasShading( false )
+{}
+
+SceneJournal::~SceneJournal()
+{
+	ForgetMeshes();
+}
+
+// every record is built in the current vector first,
+// since its length has to be written before it
+void	SceneJournal::Begin( BYTE op )
+{
+	current.clear();
+	current.push_back( op );
+}
+
+void	SceneJournal::End()
+{
+	putVarint( records, current.size() );
+	putBytes( records, current.data(), current.size() );
 }
 
-void	Mateyko::ReleaseMe()
+// returns the id of the object's mesh. if it wasn't
+// sent yet, the mesh definition is recorded first
+DWORD	SceneJournal::MeshOf( ID3D10Device* pd3dDevice, Object3D* o3d, const void* verts, const DWORD* inds )
 {
-	if( pd3dDevice )			pd3dDevice->ClearState();
-	if( pSwapChain )			pSwapChain->Release();
-	if( pRenderTargetView )		pRenderTargetView->Release();
-	if( pDepthStencil )			pDepthStencil->Release();
-	if( pDepthStencilView )		pDepthStencilView->Release();
-	if( FloorTextureRV )		FloorTextureRV->Release();
-	if( oGroundZero )			delete oGroundZero;
-	if( pd3dDevice )			pd3dDevice->Release();
+	// ////////////////////////////////////////////
+	// DECLARE VARIABLES
+	// ...
+	ID3D10Buffer*			vb = o3d->GetVertexBuffer();
+	std::vector< BYTE >		vData;
+	std::vector< DWORD >	iData;
+	DWORD					id;
+	
+	std::map< ID3D10Buffer*, DWORD >::iterator	known = sentMeshes.find( vb );
+	if( known != sentMeshes.end() )
+		return known->second;
+	
+	// we need the data. if caller doesn't have it, read it back
+	if( verts == NULL || inds == NULL )
+	{
+		if( FAILED( o3d->ReadBack( pd3dDevice, vData, iData ) ) )
+			ERRORMACRO( L"Journal cannot read the mesh back from the device." );
+		verts = vData.data();
+		inds = iData.data();
+	}
+	
+	// ////////////////////////////////////////////
+	// RECORD THE MESH
+	// ...
+	// vertices are copied as they are. indices of neighbour
+	// triangles are close to each other, so only the difference
+	// between them is stored (zigzag encoded, so negative
+	// numbers are small too), which usually takes a byte or two
+	id = nextMesh++;
+	Begin( JOURNAL_DEFINE_MESH );
+	putVarint( current, id );
+	putVarint( current, sizeof( Vertex ) );
+	putVarint( current, o3d->GetVertexCount() );
+	putVarint( current, o3d->GetIndexCount() );
+	putBytes( current, verts, o3d->GetVertexCount() * sizeof( Vertex ) );
+	
+	INT64 previous = 0;
+	for( UINT i = 0; i < o3d->GetIndexCount(); i++ )
+	{
+		INT64 delta = ( INT64 )inds[ i ] - previous;
+		putVarint( current, ( UINT64 )( ( delta << 1 ) ^ ( delta >> 63 ) ) );
+		previous = inds[ i ];
+	}
+	End();
+	
+	vb->AddRef();
+	sentMeshes[ vb ] = id;
+	return id;
 }
 
-// class destructor
-Mateyko::~Mateyko()
+void	SceneJournal::RecordInsert( ID3D10Device* pd3dDevice, Object3D* o3d, const void* verts, const DWORD* inds, XMFLOAT4 color )
 {
-	if( pd3dDevice )			pd3dDevice->ClearState();
-	if( pSwapChain )			pSwapChain->Release();
-	if( pRenderTargetView )		pRenderTargetView->Release();
-	if( pDepthStencil )			pDepthStencil->Release();
-	if( pDepthStencilView )		pDepthStencilView->Release();
-	if( FloorTextureRV )		FloorTextureRV->Release();
-	if( oGroundZero )			delete oGroundZero;
-	if( pd3dDevice )			pd3dDevice->Release();
-	
-	// note, we do not delete pointer to Camera, Space and Input.
-	// those were binded here, not created, so we don't want to 
-	// delete them.
+	DWORD mesh = MeshOf( pd3dDevice, o3d, verts, inds );
+	Begin( JOURNAL_INSERT_OBJECT );
+	putVarint( current, mesh );
+	putBytes( current, &color, sizeof( color ) );
+	End();
 }
 
-// init device method of Mateyko class.
-// calling this method is required for using Mateyko class.
-// it creates the device, depth stencil and a swapchain
-// defines render target view, also saves some info about
-// the client rectangle. 
+void	SceneJournal::RecordRemove( UINT oNum )
+{
+	Begin( JOURNAL_REMOVE_OBJECT );
+	putVarint( current, oNum );
+	End();
+}
 
-HRESULT		Mateyko::InitDevice( HWND hWnd )
+void	SceneJournal::RecordRemoveAll()
 {
-	// hresult that will be returned in the end, or when sth go wrong
-	HRESULT hr = S_OK;
+	Begin( JOURNAL_REMOVE_ALL );
+	End();
+}
 
-	// finding client rectangle
-	RECT rc;
-	GetClientRect( hWnd, &rc );
-	Height = rc.bottom - rc.top;
-	Width = rc.right - rc.left;
+void	SceneJournal::RecordColor( UINT oNum, XMFLOAT4 color )
+{
+	Begin( JOURNAL_COLOR );
+	putVarint( current, oNum );
+	putBytes( current, &color, sizeof( color ) );
+	End();
+}
 
-	// define the array of driver types
-	// required during swap chain creation
-	D3D10_DRIVER_TYPE driverTypes[] =
-    {
-        D3D10_DRIVER_TYPE_HARDWARE,
-        D3D10_DRIVER_TYPE_WARP,
-        D3D10_DRIVER_TYPE_REFERENCE,
-    };
-    UINT numDriverTypes = ARRAYSIZE( driverTypes );
+void	SceneJournal::RecordMaterial( UINT oNum, const Material& material )
+{
+	Begin( JOURNAL_MATERIAL );
+	putVarint( current, oNum );
+	putBytes( current, &material, sizeof( material ) );
+	End();
+}
 
-	UINT createDeviceFlags = 0;
-#ifdef _DEBUG
-    createDeviceFlags |= D3D10_CREATE_DEVICE_DEBUG;
-#endif
+void	SceneJournal::RecordFloor( ID3D10Device* pd3dDevice, Object3D* o3d, const void* verts, const DWORD* inds )
+{
+	DWORD mesh = MeshOf( pd3dDevice, o3d, verts, inds );
+	Begin( JOURNAL_FLOOR );
+	putVarint( current, mesh );
+	End();
+}
 
-	// //////////////////////////////////////
-	// SWAPCHAIN
-	//
-	// create swap chain desc and set some info about swapchain
-	DXGI_SWAP_CHAIN_DESC sd;
-    ZeroMemory( &sd, sizeof( sd ) );
-    sd.BufferCount = 1;
-    sd.BufferDesc.Width = Width;							// previously stored width
-    sd.BufferDesc.Height = Height;							// previously stored height
-    sd.BufferDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;		// standard rgb 8-bit format
-    sd.BufferDesc.RefreshRate.Numerator = 60;				// standard 60 hz refresh rate
-    sd.BufferDesc.RefreshRate.Denominator = 1;
-    sd.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
-    sd.OutputWindow = hWnd;									// window handler passed as an argument
-    sd.SampleDesc.Count = 1;								// no multisampling
-    sd.SampleDesc.Quality = 0;
-    sd.Windowed = TRUE;										// stay windowed
+// camera moves a lot, but not all the time. compare
+// the placement with the last recorded one first
+void	SceneJournal::RecordCamera( Camera* cam )
+{
+	XMFLOAT3	eye, at, up;
+	float		placement[ 10 ];
+	
+	if( cam == NULL )
+		return;
+	
+	cam->GetPlacement( eye, at, up, placement[ 9 ] );
+	memcpy( placement, &eye, sizeof( eye ) );
+	memcpy( placement + 3, &at, sizeof( at ) );
+	memcpy( placement + 6, &up, sizeof( up ) );
+	
+	if( hasCamera && memcmp( placement, lastCamera, sizeof( placement ) ) == 0 )
+		return;
+	
+	Begin( JOURNAL_CAMERA );
+	putBytes( current, placement, sizeof( placement ) );
+	End();
+	
+	memcpy( lastCamera, placement, sizeof( placement ) );
+	hasCamera = true;
+}
 
+// same as with the camera, record only if something changed
+void	SceneJournal::RecordShading( ShaderInput* shi )
+{
+	ShadingControls	controls;
+	
+	if( shi == NULL )
+		return;
+	
+	shi->GetShadingControls( controls );
+	if( hasShading && memcmp( &controls, &lastShading, sizeof( controls ) ) == 0 )
+		return;
+	
+	Begin( JOURNAL_SHADING );
+	putBytes( current, &controls, sizeof( controls ) );
+	End();
+	
+	lastShading = controls;
+	hasShading = true;
+}
 
-	// create swap chain using the description already filled
-	// search for the right driver starting from the best one
-	// (if the best one succeeds, no need for further search)
-	for( UINT driverTypeIndex = 0; driverTypeIndex < numDriverTypes; driverTypeIndex++ )
-    {
-        pDriverType = driverTypes[driverTypeIndex];
-        hr = D3D10CreateDeviceAndSwapChain( NULL, pDriverType, NULL, createDeviceFlags,
-                                            D3D10_SDK_VERSION, &sd, &pSwapChain, &pd3dDevice );
-        if( SUCCEEDED( hr ) )
-            break;
-    }
+void	SceneJournal::RecordSphereInsert( XMFLOAT4 sphere )
+{
+	Begin( JOURNAL_SPHERE_INSERT );
+	putBytes( current, &sphere, sizeof( sphere ) );
+	End();
+}
 
-	// ////////////////////////////////////////////
-	// RENDER TARGET
-	//
-	// Create a render target view
-    ID3D10Texture2D* pBuffer;
-    hr = pSwapChain->GetBuffer( 0, __uuidof( ID3D10Texture2D ), ( LPVOID* )&pBuffer );
-    if( FAILED( hr ) )
-		ERRORMACRO( L"Texture initialization failed" );
+void	SceneJournal::RecordSphereRemove( UINT sNum )
+{
+	Begin( JOURNAL_SPHERE_REMOVE );
+	putVarint( current, sNum );
+	End();
+}
 
-    hr = pd3dDevice->CreateRenderTargetView( pBuffer, NULL, &pRenderTargetView );
-    pBuffer->Release();
-    if( FAILED( hr ) )
-		ERRORMACRO( L"Render Target View initialization failed" );
+void	SceneJournal::RecordSphereMove( UINT sNum, XMFLOAT3 centre )
+{
+	Begin( JOURNAL_SPHERE_MOVE );
+	putVarint( current, sNum );
+	putBytes( current, &centre, sizeof( centre ) );
+	End();
+}
 
-	// ////////////////////////////////////////////
-	// DEPTH STENCIL TEXTURE
-	//
-	// Create depth stencil texture
-    D3D10_TEXTURE2D_DESC descDepth;
-    descDepth.Width = Width;
-    descDepth.Height = Height;
-    descDepth.MipLevels = 1;
-    descDepth.ArraySize = 1;
-    descDepth.Format = DXGI_FORMAT_D32_FLOAT;
-    descDepth.SampleDesc.Count = 1;
-    descDepth.SampleDesc.Quality = 0;
-    descDepth.Usage = D3D10_USAGE_DEFAULT;
-    descDepth.BindFlags = D3D10_BIND_DEPTH_STENCIL;
-    descDepth.CPUAccessFlags = 0;
-    descDepth.MiscFlags = 0;
+void	SceneJournal::RecordSphereSet( UINT sNum, XMFLOAT4 sphere )
+{
+	Begin( JOURNAL_SPHERE_SET );
+	putVarint( current, sNum );
+	putBytes( current, &sphere, sizeof( sphere ) );
+	End();
+}
 
-    hr = pd3dDevice->CreateTexture2D( &descDepth, NULL, &pDepthStencil );
-    if( FAILED( hr ) )
-		ERRORMACRO( L"DepthStencil texture initialization failed" );
+// replaces all spheres, so it's as big as the Space is.
+// used for clearing (count is zero then) and loading.
+// mesh radii go along, so the receiver scales meshes the
+// same way (see Space::GetMeshRadii)
+void	SceneJournal::RecordSpheres( const XMFLOAT4* spheres, const float* meshRadii, UINT count )
+{
+	Begin( JOURNAL_SPHERES );
+	putVarint( current, count );
+	putBytes( current, spheres, count * sizeof( XMFLOAT4 ) );
+	putBytes( current, meshRadii, count * sizeof( float ) );
+	End();
+}
 
-    // Create the depth stencil view
-    D3D10_DEPTH_STENCIL_VIEW_DESC descDSV;
-    descDSV.Format = descDepth.Format;
-    descDSV.ViewDimension = D3D10_DSV_DIMENSION_TEXTURE2D;
-    descDSV.Texture2D.MipSlice = 0;
+void	SceneJournal::RecordSnapshot( LPCWSTR szFileName )
+{
+	UINT chars = wcslen( szFileName );
+	Begin( JOURNAL_SNAPSHOT );
+	putVarint( current, chars );
+	putBytes( current, szFileName, chars * sizeof( WCHAR ) );
+	End();
+	
+	ForgetMeshes();
+}
 
-    hr = pd3dDevice->CreateDepthStencilView( pDepthStencil, &descDSV, &pDepthStencilView );
-    if( FAILED( hr ) )
-		ERRORMACRO( L"Depth Stencil View initialization failed" );	//*/
+// releases the buffers kept for recognizing the meshes
+void	SceneJournal::ForgetMeshes()
+{
+	for( std::map< ID3D10Buffer*, DWORD >::iterator it = sentMeshes.begin(); it != sentMeshes.end(); ++it )
+		it->first->Release();
+	sentMeshes.clear();
+}
 
-	// set render targets
-	pd3dDevice->OMSetRenderTargets( 1, &pRenderTargetView, pDepthStencilView );
+const BYTE*		SceneJournal::GetData()		{	return records.data();	}
+UINT			SceneJournal::GetSize()		{	return records.size();	}
+void			SceneJournal::Clear()		{	records.clear();	}
 
-	 // Setup the viewport
-    D3D10_VIEWPORT vp;
-    vp.Width = Width;
-    vp.Height = Height;
-    vp.MinDepth = 0.0f;
-    vp.MaxDepth = 1.0f;
-    vp.TopLeftX = 0;
-    vp.TopLeftY = 0;
-    pd3dDevice->RSSetViewports( 1, &vp );
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// REPLICATION	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
 
-	// set primitive topology
-	pd3dDevice->IASetPrimitiveTopology( D3D10_PRIMITIVE_TOPOLOGY_TRIANGLELIST );
+// winsock needs to be started by every user,
+// so both constructors do that
+ReplicationServer::ReplicationServer()
+	:	listener( INVALID_SOCKET ),
+		snapshotCount( 0 )
+{
+	WSADATA	wsaData;
+	WSAStartup( MAKEWORD( 2, 2 ), &wsaData );
+}
 
-	return hr;
-};
+ReplicationServer::~ReplicationServer()
+{
+	for( UINT i = 0; i < subscribers.size(); i++ )
+		if( subscribers[ i ] != INVALID_SOCKET )
+			closesocket( subscribers[ i ] );
+	if( listener != INVALID_SOCKET )
+		closesocket( listener );
+	WSACleanup();
+}
 
-// paint scene method. as name suggests it paints the scene.
-// needs Input, Camera and Space to work.
-void	Mateyko::PaintScene()
+// creates the socket file and starts listening. nothing
+// here blocks, new subscribers are accepted by Publish
+HRESULT		ReplicationServer::Start( LPCSTR socketPath, LPCWSTR szSnapshotFile )
 {
-	// ////////////////////////////////////
-	// safety belt
+	SOCKADDR_UN		addr;
+	u_long			nonBlocking = 1;
+	
+	ZeroMemory( &addr, sizeof( addr ) );
+	addr.sun_family = AF_UNIX;
+	strncpy( addr.sun_path, socketPath, sizeof( addr.sun_path ) - 1 );
+	snapshotFile = szSnapshotFile;
+	
+	// socket file may be left by the previous run
+	DeleteFileA( socketPath );
+	
+	listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( listener == INVALID_SOCKET ||
+		bind( listener, ( sockaddr* )&addr, sizeof( addr ) ) == SOCKET_ERROR ||
+		listen( listener, SOMAXCONN ) == SOCKET_ERROR ||
+		ioctlsocket( listener, FIONBIO, &nonBlocking ) == SOCKET_ERROR )
+	{
+		ERRORMACRO( L"Cannot start the replication server." );
+		return E_FAIL;
+	}
+	return S_OK;
+}
 
-	// if any of those devices isn't binded, or InitDevice
-	// methods hasn't been called (it initializes the pd3dDevice)
-	// don't do anything
-	if( pd3dDevice == NULL )		return;
-	if( pInput == NULL )			return;
-	if( pCam == NULL )				return;
-	if( pSpace == NULL )			return;
+// sends as much as subscriber takes without blocking, 
+// the rest waits for the next call. subscriber that
+// fails is closed and forgotten
+void	ReplicationServer::Send( UINT sub, const BYTE* data, UINT size )
+{
+	std::vector< BYTE >&	queue = pending[ sub ];
+	
+	if( subscribers[ sub ] == INVALID_SOCKET )
+		return;
+	
+	putBytes( queue, data, size );
+	while( !queue.empty() )
+	{
+		int sent = send( subscribers[ sub ], ( const char* )queue.data(), queue.size(), 0 );
+		if( sent > 0 )
+			queue.erase( queue.begin(), queue.begin() + sent );
+		else 
+		{
+			if( sent == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK )
+			{
+				closesocket( subscribers[ sub ] );
+				subscribers[ sub ] = INVALID_SOCKET;
+				queue.clear();
+			}
+			break;
+		}
+	}
+}
 
-	// ////////////////////////////////////
-    // Clear the back buffer
+void	ReplicationServer::Publish( Mateyko& mat, SceneJournal& journal )
+{
+	SOCKET		sub;
+	u_long		nonBlocking = 1;
+	bool		saved = false;
+	HRESULT		hr = S_OK;
+	
+	// changes go to everyone who already has the scene
+	for( UINT i = 0; i < subscribers.size(); i++ )
+		Send( i, journal.GetData(), journal.GetSize() );
+	
+	// newcomers get the whole scene as a snapshot instead.
+	// it's saved once, no matter how many of them came.
+	// if it can't be saved, they're dropped, as they'd
+	// have nothing to apply the changes to
+	while( listener != INVALID_SOCKET && ( sub = accept( listener, NULL, NULL ) ) != INVALID_SOCKET )
+	{
+		if( !saved )
+		{
+			std::wstringstream	name;
+			name << snapshotFile << L"." << snapshotCount++;
+			
+			journal.Clear();
+			hr = mat.SaveScene( name.str().c_str() );
+			if( SUCCEEDED( hr ) )
+				journal.RecordSnapshot( name.str().c_str() );
+			saved = true;
+		}
+		if( FAILED( hr ) )
+		{
+			closesocket( sub );
+			continue;
+		}
+		
+		ioctlsocket( sub, FIONBIO, &nonBlocking );
+		subscribers.push_back( sub );
+		pending.push_back( std::vector< BYTE >() );
+		Send( subscribers.size() - 1, journal.GetData(), journal.GetSize() );
+	}
+	journal.Clear();
+	
+	// forget those who left
+	for( UINT i = 0; i < subscribers.size(); )
+	{
+		if( subscribers[ i ] == INVALID_SOCKET )
+		{
+			subscribers.erase( subscribers.begin() + i );
+			pending.erase( pending.begin() + i );
+		}
+		else i++;
+	}
+}
 
-    float ClearColor[4] = { 0.0f, 0.4f, 0.9f, 1.0f }; // red, green, blue, alpha
-    pd3dDevice->ClearRenderTargetView( pRenderTargetView, ClearColor );
+UINT	ReplicationServer::GetSubscriberCount()		{	return subscribers.size();	}
 
-	// /////////////////////////////////////
-    // Clear the depth buffer to 1.0 (max depth)
-    
-    pd3dDevice->ClearDepthStencilView( pDepthStencilView, D3D10_CLEAR_DEPTH, 1.0f, 0 );
+ReplicationClient::ReplicationClient( Mateyko* mat, Space* spa, Camera* cam, ShaderInput* shi )
+	:	sock( INVALID_SOCKET ),
+		pMat( mat ),
+		pSpace( spa ),
+		pCam( cam ),
+		pInput( shi )
+{
+	WSADATA	wsaData;
+	WSAStartup( MAKEWORD( 2, 2 ), &wsaData );
+}
 
-	// ///////////////////////////////////
-	// prepare general (same for all object on the scene) rendering parameters
-	
-	pInput->PrepareShadingControlVars(
-		oColors.size() );
+ReplicationClient::~ReplicationClient()
+{
+	if( sock != INVALID_SOCKET )
+		closesocket( sock );
+	WSACleanup();
+}
+
+HRESULT		ReplicationClient::Connect( LPCSTR socketPath )
+{
+	SOCKADDR_UN		addr;
+	u_long			nonBlocking = 1;
 	
-	pInput->PrepareCameraMatrices( 
-		( float* )pCam->GetView().m,
-		( float* )pCam->GetProjection().m );
+	ZeroMemory( &addr, sizeof( addr ) );
+	addr.sun_family = AF_UNIX;
+	strncpy( addr.sun_path, socketPath, sizeof( addr.sun_path ) - 1 );
 	
-	pInput->PrepareEyePos( 
-		( float* )&pCam->GetEyePos() );
+	sock = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( sock == INVALID_SOCKET ||
+		connect( sock, ( sockaddr* )&addr, sizeof( addr ) ) == SOCKET_ERROR ||
+		ioctlsocket( sock, FIONBIO, &nonBlocking ) == SOCKET_ERROR )
+	{
+		ERRORMACRO( L"Cannot connect to the replication server." );
+		return E_FAIL;
+	}
+	return S_OK;
+}
+
+UINT	ReplicationClient::Poll()
+{
+	char		buffer[ 65536 ];
+	int			got;
+	UINT		applied = 0;
 	
-	pInput->PreparePositions( 
-		pSpace->GetShaderPositionArray(), 
-		pSpace->size() );
+	if( sock == INVALID_SOCKET )
+		return 0;
 	
-	pInput->PrepareColors( 
-		( float* )oColors.data(),
-		oColors.size() );
+	// take everything server has sent so far
+	while( ( got = recv( sock, buffer, sizeof( buffer ), 0 ) ) > 0 )
+		putBytes( incoming, buffer, got );
 	
-	// ////////////////////////////////////
-	// Render objects on the scene
-	for( unsigned int i = 0; i < objects.size(); i++ )	
+	// zero means server closed the connection
+	if( got == 0 || ( got == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK ) )
 	{
-		// prepare object-oriented pInput variables
-		pInput->PrepareObject( ( float* )pSpace->GetWorldPosition( i ).m, i );
-		
-		// DRAW!!!
-		objects[ i ]->Draw( pd3dDevice, pInput->GetTech() );
+		closesocket( sock );
+		sock = INVALID_SOCKET;
 	}
 	
-	// //////////////////////////////////////
-	// render the floor
+	// apply complete records, leave the incomplete one for later
+	const BYTE* ptr = incoming.data();
+	const BYTE* end = ptr + incoming.size();
+	const BYTE* next = ptr;
+	UINT64		length;
 	
-	// prepare object-oriented pInput variables for the floor
-	if( oGroundZero )
+	while( getVarint( next, end, length ) && length <= ( UINT64 )( end - next ) )
 	{
-		pInput->PrepareObject( ( float* )XMMatrixTranslation( 0.0f, -1.0f, 0.0f ).m, -1 );
-		oGroundZero->Draw( pd3dDevice, pInput->GetTech() );
+		// a broken record means we can't follow the server
+		// anymore, every next record might refer to what it
+		// should have defined. give up on the connection
+		if( !ApplyRecord( next, ( UINT )length ) )
+		{
+			ERRORMACRO( L"Broken record received from the replication server." );
+			if( sock != INVALID_SOCKET )
+				closesocket( sock );
+			sock = INVALID_SOCKET;
+			incoming.clear();
+			return applied;
+		}
+		next += length;
+		ptr = next;
+		applied++;
 	}
-
-	// //////////////////////////////////////
-    // Present our back buffer to our front buffer
-    pSwapChain->Present( 0, 0 );
+	incoming.erase( incoming.begin(), incoming.begin() + ( ptr - incoming.data() ) );
+	
+	return applied;
 }
 
-// method loads texture for the floor. it also erases previous texture if needed
-HRESULT		Mateyko::loadTexture( LPCWSTR szFileName )
+// decodes a single record and applies it. records which 
+// don't fit (e.g. refer to unknown meshes or objects) are
+// skipped. returns false if record was broken
+bool	ReplicationClient::ApplyRecord( const BYTE* data, UINT size )
 {
-	HRESULT hr = S_OK;
+	// ////////////////////////////////////////////
+	// DECLARE VARIABLES
+	// ...
+	const BYTE*		ptr = data + 1;
+	const BYTE*		end = data + size;
+	UINT64			id, index, count;
+	XMFLOAT4		color;
+	XMFLOAT3		centre;
 	
-	// remove previous texture if needed
-	if( FloorTextureRV )	FloorTextureRV->Release();
+	if( size == 0 )
+		return false;
 	
-	// bind new texture
-	hr = D3DX10CreateShaderResourceViewFromFile( pd3dDevice, szFileName, NULL, NULL, &FloorTextureRV, NULL );
-	if( FAILED( hr ) )
-		ERRORMACRO( L"Cannot load texture." );
+	switch( data[ 0 ] )
+	{
+	case JOURNAL_DEFINE_MESH:
+		{
+			UINT64 stride, vCount, iCount;
+			if( !getVarint( ptr, end, id ) || !getVarint( ptr, end, stride ) ||
+				!getVarint( ptr, end, vCount ) || !getVarint( ptr, end, iCount ) ||
+				stride != sizeof( Vertex ) || vCount > ( UINT64 )( end - ptr ) / stride )
+				return false;
+			
+			const BYTE* verts = ptr;
+			ptr += vCount * stride;
+			
+			// every index takes at least a byte, so a count bigger
+			// than what's left is a lie. check before allocating
+			if( iCount > ( UINT64 )( end - ptr ) )
+				return false;
+			
+			// undo the delta and zigzag encoding
+			std::vector< DWORD > inds( ( size_t )iCount );
+			INT64 previous = 0;
+			for( UINT i = 0; i < iCount; i++ )
+			{
+				UINT64 zigzag;
+				if( !getVarint( ptr, end, zigzag ) )
+					return false;
+				previous += ( INT64 )( zigzag >> 1 ) ^ -( INT64 )( zigzag & 1 );
+				inds[ i ] = ( DWORD )previous;
+			}
+			
+			if( id >= meshes.size() )
+				meshes.resize( ( size_t )id + 1 );
+			meshes[ ( size_t )id ].reset( new Object3D( pMat->GetDevice(), ( void* )verts, inds.data(), 
+				( UINT )vCount, ( UINT )iCount ) );
+		}
+		return true;
+		
+	case JOURNAL_INSERT_OBJECT:
+		if( !getVarint( ptr, end, id ) || ( UINT64 )( end - ptr ) < sizeof( color ) )
+			return false;
+		memcpy( &color, ptr, sizeof( color ) );
+		if( id < meshes.size() && meshes[ ( size_t )id ] )
+			pMat->InsertObject( meshes[ ( size_t )id ], color );
+		return true;
+		
+	case JOURNAL_REMOVE_OBJECT:
+		if( !getVarint( ptr, end, index ) )
+			return false;
+		if( index < pMat->GetObjectCount() )
+			pMat->RemoveObject( ( int )index );
+		return true;
+		
+	case JOURNAL_REMOVE_ALL:
+		pMat->RemoveAll();
+		return true;
+		
+	case JOURNAL_COLOR:
+		if( !getVarint( ptr, end, index ) || ( UINT64 )( end - ptr ) < sizeof( color ) )
+			return false;
+		memcpy( &color, ptr, sizeof( color ) );
+		pMat->updateColor( ( UINT )index, color );
+		return true;
+		
+	case JOURNAL_MATERIAL:
+		{
+			Material material;
+			if( !getVarint( ptr, end, index ) || ( UINT64 )( end - ptr ) < sizeof( material ) )
+				return false;
+			memcpy( &material, ptr, sizeof( material ) );
+			if( index < pMat->GetObjectCount() )
+				pMat->SetMaterial( ( UINT )index, material );
+		}
+		return true;
+		
+	case JOURNAL_FLOOR:
+		if( !getVarint( ptr, end, id ) )
+			return false;
+		if( id < meshes.size() && meshes[ ( size_t )id ] )
+			pMat->InsertFloor( meshes[ ( size_t )id ].get() );
+		return true;
+		
+	case JOURNAL_SPHERE_INSERT:
+		if( ( UINT64 )( end - ptr ) < sizeof( color ) )
+			return false;
+		memcpy( &color, ptr, sizeof( color ) );
+		if( pSpace )
+			pSpace->InsertSphere( XMFLOAT3( color.x, color.y, color.z ), color.w );
+		return true;
+		
+	case JOURNAL_SPHERE_REMOVE:
+		if( !getVarint( ptr, end, index ) )
+			return false;
+		if( pSpace )
+			pSpace->RemoveSphere( ( UINT )index );
+		return true;
+		
+	case JOURNAL_SPHERE_MOVE:
+		if( !getVarint( ptr, end, index ) || ( UINT64 )( end - ptr ) < sizeof( centre ) )
+			return false;
+		memcpy( &centre, ptr, sizeof( centre ) );
+		if( pSpace )
+			pSpace->SetPosition( ( UINT )index, centre );
+		return true;
+		
+	case JOURNAL_SPHERE_SET:
+		if( !getVarint( ptr, end, index ) || ( UINT64 )( end - ptr ) < sizeof( color ) )
+			return false;
+		memcpy( &color, ptr, sizeof( color ) );
+		if( pSpace )
+			pSpace->SetSphere( ( UINT )index, color );
+		return true;
+		
+	case JOURNAL_SPHERES:
+		if( !getVarint( ptr, end, count ) || count > ( UINT64 )( end - ptr ) / ( sizeof( XMFLOAT4 ) + sizeof( float ) ) )
+			return false;
+		if( pSpace )
+		{
+			std::vector< XMFLOAT4 >	spheres( ( size_t )count );
+			std::vector< float >	meshRadii( ( size_t )count );
+			if( count )
+			{
+				memcpy( spheres.data(), ptr, ( size_t )count * sizeof( XMFLOAT4 ) );
+				memcpy( meshRadii.data(), ptr + ( size_t )count * sizeof( XMFLOAT4 ), ( size_t )count * sizeof( float ) );
+			}
+			pSpace->SetSpheres( spheres.data(), ( UINT )count, meshRadii.data() );
+		}
+		return true;
+		
+	case JOURNAL_CAMERA:
+		{
+			float placement[ 10 ];
+			if( ( UINT64 )( end - ptr ) < sizeof( placement ) )
+				return false;
+			memcpy( placement, ptr, sizeof( placement ) );
+			if( pCam )
+				pCam->SetPlacement( XMFLOAT3( placement[ 0 ], placement[ 1 ], placement[ 2 ] ),
+					XMFLOAT3( placement[ 3 ], placement[ 4 ], placement[ 5 ] ),
+					XMFLOAT3( placement[ 6 ], placement[ 7 ], placement[ 8 ] ),
+					placement[ 9 ] );
+		}
+		return true;
+		
+	case JOURNAL_SHADING:
+		{
+			ShadingControls controls;
+			if( ( UINT64 )( end - ptr ) < sizeof( controls ) )
+				return false;
+			memcpy( &controls, ptr, sizeof( controls ) );
+			if( pInput )
+				pInput->SetShadingControls( controls );
+		}
+		return true;
+		
+	case JOURNAL_SNAPSHOT:
+		{
+			if( !getVarint( ptr, end, count ) || count > ( UINT64 )( end - ptr ) / sizeof( WCHAR ) )
+				return false;
+			std::wstring file( ( size_t )count, L' ' );
+			if( count )
+				memcpy( &file[ 0 ], ptr, ( size_t )count * sizeof( WCHAR ) );
+			
+			// server forgot its meshes, so we do too
+			meshes.clear();
+			pMat->LoadScene( file.c_str() );
+		}
+		return true;
+	}
 	
-	// set resourece to the shader variable
-	if( FloorTextureRV )	pInput->SetFloorTex( FloorTextureRV );
-	return hr;
+	return false;
 }
 
-// saves stored client rectangle width and height to the provided references
-void	Mateyko::GetClientRectSize( UINT& _width, UINT& _height )
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// SCENE EDIT QUEUE	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
+
+void	SceneEditBatch::Insert( std::shared_ptr< Object3D > o3ptr, XMFLOAT4 color, XMFLOAT3 centre, float radius )
 {
-	_width = Width;
-	_height = Height;
+	edits.push_back( SceneEdit() );
+	edits.back().type = EDIT_INSERT;
+	edits.back().index = 0;
+	edits.back().color = color;
+	edits.back().sphere = XMFLOAT4( centre.x, centre.y, centre.z, radius );
+	edits.back().object = o3ptr;
 }
 
-// get device method
-ID3D10Device*		Mateyko::GetDevice()				{ 	return pd3dDevice; 	}
-
-// binding funcs. each of them bind respective device, and Mateyko won't draw anything without them
-void	Mateyko::BindCamera( Camera* cam )				{	pCam = cam; 	}
-void	Mateyko::BindSpace( Space* spa )				{	pSpace = spa; 	}
-
-// bindinput also has to set input layout to the device
-void	Mateyko::BindInput( ShaderInput* shi )			
-{	
-	pInput = shi; 
-	pd3dDevice->IASetInputLayout( pInput->GetLayout() );	
+void	SceneEditBatch::Insert( const Vertex* verts, const DWORD* inds, UINT vSize, UINT iSize, XMFLOAT4 color, XMFLOAT3 centre, float radius )
+{
+	edits.push_back( SceneEdit() );
+	edits.back().type = EDIT_INSERT;
+	edits.back().index = 0;
+	edits.back().color = color;
+	edits.back().sphere = XMFLOAT4( centre.x, centre.y, centre.z, radius );
+	edits.back().vertices.assign( verts, verts + vSize );
+	edits.back().indices.assign( inds, inds + iSize );
 }
 
-// /////////////////////////////////////////////////////
-// 
-// MATEYKO OBJECT LIST MANAGEMENT METHODS
-//
-// /////////////////////////////////////////////////
+void	SceneEditBatch::Remove( UINT oNum )
+{
+	edits.push_back( SceneEdit() );
+	edits.back().type = EDIT_REMOVE;
+	edits.back().index = oNum;
+}
 
-// in case a pointer to the object was provided without
-// color, copy the object and store predefined color
-void	Mateyko::InsertObject( Object3D* o3d )
+void	SceneEditBatch::Recolor( UINT oNum, XMFLOAT4 color )
 {
-	// create the shared_ptr for o3d argument
-	std::shared_ptr<Object3D>	o3ptr( new Object3D( *o3d ) );
+	edits.push_back( SceneEdit() );
+	edits.back().type = EDIT_RECOLOR;
+	edits.back().index = oNum;
+	edits.back().color = color;
+}
 
-	// copy object3d using copy constructor
-	// construct shared_ptr using typical pointer
-	objects.push_back( o3ptr );
-	oColors.push_back( XMFLOAT4( 0.4f, 0.7f, 0.2f, 1.0f ) );
+void	SceneEditBatch::Transform( UINT oNum, XMFLOAT3 centre )
+{
+	edits.push_back( SceneEdit() );
+	edits.back().type = EDIT_TRANSFORM;
+	edits.back().index = oNum;
+	edits.back().sphere = XMFLOAT4( centre.x, centre.y, centre.z, 0.0f );
 }
 
-// creates the object using provided data then stores
-// its pointer within objects vector and saves color
-// to the oColors vector, ensuring every object
-// has its corresponding color stored under the same
-// index.
-void	Mateyko::InsertObject( void* verts, DWORD* inds, UINT vSize, UINT iSize, XMFLOAT4 color )
+void	SceneEditBatch::SetMaterial( UINT oNum, const Material& material )
 {
-	// create the shared_ptr for o3d argument
-	std::shared_ptr<Object3D>	o3ptr( new Object3D( pd3dDevice, verts, inds, vSize, iSize ) );
+	edits.push_back( SceneEdit() );
+	edits.back().type = EDIT_MATERIAL;
+	edits.back().index = oNum;
+	edits.back().material = material;
+}
 
-	// do stuff
-	objects.push_back( o3ptr );
-	oColors.push_back( color );
+UINT	SceneEditBatch::size()		{	return edits.size();	}
+void	SceneEditBatch::clear()		{	edits.clear();	}
+
+// queue starts with the stub node only
+SceneEditQueue::SceneEditQueue()
+	:	head( &stub ),
+		tail( &stub )
+{
+	stub.next = NULL;
 }
 
-// removes object and color with a corresponding index.
-// causes a reallocation inside vectors, so better be
-// used carefully. we do not expect much juggling with
-// objects on the scene, therefore do not see the need
-// for replacing vector with forward_list or map or sth.
-void	Mateyko::RemoveObject( int oNum )
+// batches nobody applied are simply dropped
+SceneEditQueue::~SceneEditQueue()
 {
-	objects.erase( objects.begin() + oNum );
-	oColors.erase( oColors.begin() + oNum );
+	Node* node;
+	while( ( node = Pop() ) != NULL )
+		delete node;
 }
 
-// removes all objects and their colors from the vectors
-// leaving them empty.
-void	Mateyko::RemoveAll()
+// the only place producers meet. exchange makes the node
+// the new head, and only then the previous head gets linked
+// to it. between those two steps the list is broken for a
+// moment, which Pop has to be aware of
+void	SceneEditQueue::Push( Node* node )
 {
-	objects.clear();
-	oColors.clear();
+	node->next = NULL;
+	Node* prev = ( Node* )InterlockedExchangePointer( ( PVOID volatile* )&head, node );
+	InterlockedExchangePointer( ( PVOID volatile* )&prev->next, node );
 }
 
-// sometimes its necesarry to updates objects color
-// and thats what this method does.
-void	Mateyko::updateColor( unsigned int oNumber, XMFLOAT4 color )
+// takes the oldest node, or returns NULL if there's nothing
+// to take, or the next node is still being linked by a producer
+SceneEditQueue::Node*	SceneEditQueue::Pop()
 {
-	if( oNumber < oColors.size() )
-		oColors[ oNumber ] = color;
+	Node* first = tail;
+	Node* next = first->next;
+	
+	// skip the stub
+	if( first == &stub )
+	{
+		if( next == NULL )
+			return NULL;
+		tail = next;
+		first = next;
+		next = next->next;
+	}
+	
+	// the common case, first node has a successor
+	if( next )
+	{
+		tail = next;
+		return first;
+	}
+	
+	// first node is the last one, but some producer has already
+	// replaced the head and didn't link it yet. try next time
+	if( first != head )
+		return NULL;
+	
+	// first node is the only one. put the stub behind it,
+	// so it can be taken out without emptying the list
+	Push( &stub );
+	next = first->next;
+	if( next )
+	{
+		tail = next;
+		return first;
+	}
+	return NULL;
 }
 
-// /////////////////////////////////////////////////////
-//
-// MATEYKO FORM OBJECT METHODS
-//
-// /////////////////////////////////////////////////
+void	SceneEditQueue::Submit( SceneEditBatch& batch )
+{
+	if( batch.edits.empty() )
+		return;
+	
+	Node* node = new Node;
+	node->edits.swap( batch.edits );
+	Push( node );
+}
 
-// creates a sphere of desired radius and color and with
-// desired number of meridians and parallels
-// automatically generates both the set of the vertices (struct Vertex)
-// and triangle list, then forms an Object3D using them
-// finally stores the sphere into the
-// objects std::vector of a Mateyko class
-void Mateyko::formSphere( LPCWSTR _name, UINT meridians, UINT parallels, float radius, XMFLOAT4 color )
+// applies batches in the order they were submitted
+UINT	SceneEditQueue::ApplyPending( Mateyko& mat, Space* spa )
 {
-	// ////////////////////////////////////////////
-	// DECLARE VARIABLES
-	// ...
-	// those two are the final vertices and final
-	// indices that will be used to form an object
-	std::vector< Vertex >	fnVertices;
-	std::vector< DWORD >	fnIndices;
+	Node*	node;
+	UINT	applied = 0;
+	
+	while( ( node = Pop() ) != NULL )
+	{
+		for( UINT i = 0; i < node->edits.size(); i++ )
+		{
+			SceneEdit& edit = node->edits[ i ];
+			switch( edit.type )
+			{
+			case EDIT_INSERT:
+				if( edit.object )
+					mat.InsertObject( edit.object, edit.color );
+				else mat.InsertObject( edit.vertices.data(), edit.indices.data(), 
+					edit.vertices.size(), edit.indices.size(), edit.color );
+				if( spa )
+					spa->InsertSphere( XMFLOAT3( edit.sphere.x, edit.sphere.y, edit.sphere.z ), edit.sphere.w );
+				break;
+				
+			case EDIT_REMOVE:
+				if( edit.index < mat.GetObjectCount() )
+				{
+					mat.RemoveObject( edit.index );
+					if( spa )
+						spa->RemoveSphere( edit.index );
+				}
+				break;
+				
+			case EDIT_RECOLOR:
+				mat.updateColor( edit.index, edit.color );
+				break;
+				
+			case EDIT_TRANSFORM:
+				if( spa )
+					spa->SetPosition( edit.index, XMFLOAT3( edit.sphere.x, edit.sphere.y, edit.sphere.z ) );
+				break;
+				
+			case EDIT_MATERIAL:
+				mat.SetMaterial( edit.index, edit.material );
+				break;
+			}
+			applied++;
+		}
+		delete node;
+	}
+	return applied;
+}
 
-	// a temporary vertex struct which will be used
-	// to push data back into the vector. color's always
-	// the same, so it can be defined right now
-	Vertex	vx;
-	vx.Color = color;
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// SCENE VERSIONS	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
 
-	// to keep track of which vertex we are already painting
-	// (that's necessary to find out its position and normal)
-	// we employ xmvector brush. you can think of it 
-	// travelling along the meridians and marking dots
-	// (vertices) on the right spots. right spots are
-	// computed using mAngle (meridian angle) and pAngle
-	// (parallel angle) float variables
-	XMVECTOR brush = XMVectorSet( 0.0f, radius, 0.0f, 0.0f );
-	float mAngle, pAngle;
+template< class T >
+PersistentArray< T >::PersistentArray()
+	:	count( 0 ),
+		shift( 0 )
+{}
+
+// returns a node with index-th element set to the value. nodes on
+// the path are copied, unless nobody but us holds them - then no
+// other array can see them, and they may be modified in place.
+// that's what makes many edits of the same copy cheap, only
+// the first one touching a leaf has to copy it.
+// missing nodes (past the end of the array) are created empty
+template< class T >
+std::shared_ptr< const void >	PersistentArray< T >::setIn( const std::shared_ptr< const void >& node, UINT level, UINT index, const T& value )
+{
+	if( level == 0 )
+	{
+		std::shared_ptr< Leaf >	leaf;
+		if( node.use_count() == 1 )		leaf = std::static_pointer_cast< Leaf >( std::const_pointer_cast< void >( node ) );
+		else if( node )					leaf = std::make_shared< Leaf >( *( const Leaf* )node.get() );
+		else							leaf = std::make_shared< Leaf >();
+		
+		leaf->items[ index & MASK ] = value;
+		return leaf;
+	}
 	
-	// ///////////////////////////////////////////////
-	// DEFINE VARIABLES
-	// ...
-	// define the angles
-	mAngle = 2.0f * XM_PI / ( FLOAT )meridians;
-	pAngle = XM_PI / ( FLOAT )parallels;
+	std::shared_ptr< Branch >	branch;
+	if( node.use_count() == 1 )		branch = std::static_pointer_cast< Branch >( std::const_pointer_cast< void >( node ) );
+	else if( node )					branch = std::make_shared< Branch >( *( const Branch* )node.get() );
+	else							branch = std::make_shared< Branch >();
+	
+	std::shared_ptr< const void >& child = branch->children[ ( index >> level ) & MASK ];
+	child = setIn( child, level - BITS, index, value );
+	return branch;
+}
 
-	// set the first point. it's the "top" point of the sphere
-	// that belongs to every parallel (and starts it in fact)
-	XMStoreFloat3( &vx.Pos, brush );
-	XMStoreFloat3( &vx.Norm, XMVector3Normalize( brush ) );
-	fnVertices.push_back( vx );
+template< class T >
+void	PersistentArray< T >::Set( UINT index, const T& value )
+{
+	assert( index < count );
+	root = setIn( root, shift, index, value );
+}
 
-	// and set the "last" point. it ends every parallel
-	XMStoreFloat3( &vx.Pos, -brush );
-	XMStoreFloat3( &vx.Norm, XMVector3Normalize( -brush ) );
-	fnVertices.push_back( vx );
+template< class T >
+void	PersistentArray< T >::PushBack( const T& value )
+{
+	// if the tree is full, it grows one level up.
+	// old root becomes the first child of the new one
+	if( root && count == ( ( UINT64 )WIDTH << shift ) )
+	{
+		std::shared_ptr< Branch > branch = std::make_shared< Branch >();
+		branch->children[ 0 ] = root;
+		root = branch;
+		shift += BITS;
+	}
+	root = setIn( root, shift, count, value );
+	count++;
+}
 
-	// ///////////////////////////////////////////
-	// SET THE VERTICES VECTOR
-	// ...
-	// the outer loop runs through all the declared (in meridians
-	// int variable) meridians, adding respective number
-	// to the mAngle factor, ensuring each meridian created
-	// by one iteration is retorsed on the xz plane by
-	// the right angle
-	for( unsigned int i = 0; i < meridians; i++ )
+// last element is reset, so it doesn't keep anything alive
+// (e.g. an Object3D held by a shared_ptr)
+template< class T >
+void	PersistentArray< T >::PopBack()
+{
+	assert( count > 0 );
+	if( count == 1 )
 	{
-		// each iteration adds a vertex to the current meridian
-		// and pushes the brush by the mAngle
-		for( unsigned int j = 0; j < parallels - 1; j++ )
-		{
-			// rotate brush around x axis for this cycle
-			// as for the first (j=0) iteration the brush was set up straight
-			// so it start with the second vertex of a first (on the xz plane)
-			// meridian, and it will be later rotated around y axis.
-			// every iteration then it adds pAngle until the 
-			// one before the last occurs.
-			brush = XMVector3TransformCoord( brush, XMMatrixRotationX( pAngle ) );
+		Clear();
+		return;
+	}
+	Set( count - 1, T() );
+	count--;
+}
 
-			// set the point. first, rotate around y axis, then store position
-			// and normal. normal comes from the normalized difference between 
-			// distance and the 0 point, since the sphere's centre is that point
-			XMStoreFloat3( &vx.Pos, XMVector3TransformCoord( brush, XMMatrixRotationY( mAngle * i ) ) );
-			XMStoreFloat3( &vx.Norm, XMVector3Normalize( XMVector3TransformCoord( 
-				brush, XMMatrixRotationY( mAngle * i ) ) ) );
+template< class T >
+void	PersistentArray< T >::SwapRemove( UINT index )
+{
+	assert( index < count );
+	if( index != count - 1 )
+		Set( index, Get( count - 1 ) );
+	PopBack();
+}
 
-			// finally push it into the vertices
-			fnVertices.push_back( vx );
-		}
+template< class T >
+void	PersistentArray< T >::Clear()
+{
+	root.reset();
+	count = 0;
+	shift = 0;
+}
 
-		// set the brush up straight for the next cycle
-		// the top vertex is already set, but the loop above
-		// increases the pAngle before anything else
-		// so it will start with the right vertex
-		brush = XMVectorSet( 0.0f, radius, 0.0f, 0.0f );
-	}
+template< class T >
+UINT	PersistentArray< T >::size() const	{	return count;	}
+
+template< class T >
+const T&	PersistentArray< T >::Get( UINT index ) const
+{
+	UINT	length;
+	return *GetRun( index, length );
+}
 
-	// ///////////////////////////////////////////////
-	// SET THE INDICES VECTOR
-	// ...
-	// same as in the loop above, each iteration
-	// constructs the grid between two meridians
-	// the construction of the grid between the last
-	// and the first meridian is done separetely below
-	// for the sake of the simplicity of the code
-	for( unsigned int i = 0; i < meridians - 1; i++ )
-	{
-		// set the first triangle. this is only one triagle
-		// (not the square composed of two triangles)
-		// for both meridians start in the same point
-		fnIndices.push_back( 0 );
-		fnIndices.push_back( ( i+1 ) * ( parallels - 1 ) + 2 );
-		fnIndices.push_back( ( i ) * ( parallels - 1 ) + 2 );	
-
-		// midst triangles. each iteration of this loop
-		// handles one square set up from two pairs of points
-		// of the same parallel from two meridians.
-		for( unsigned int j = 0; j < parallels - 2; j++ )
-		{
-			// first triangle
-			fnIndices.push_back( i * ( parallels - 1 ) + 2 + j );
-			fnIndices.push_back( ( i+1 ) *( parallels - 1 ) + 2 + j );
-			fnIndices.push_back( ( i+1 ) *( parallels - 1 ) + 2 + j + 1 );	
-
-			// second triangle
-			fnIndices.push_back( i * ( parallels - 1 ) + 2 + j );
-			fnIndices.push_back( ( i+1 ) *( parallels - 1 ) + 2 + j + 1 );
-			fnIndices.push_back( i * ( parallels - 1 ) + 2 + j + 1 );
-		}
-
-		// last triangle. both meridians end up with
-		// the same vertex, so only one triangle here
-		fnIndices.push_back( 1 );
-		fnIndices.push_back( ( i ) * ( parallels - 1 ) -1 + parallels );
-		fnIndices.push_back( ( i+1 ) * ( parallels - 1 ) -1 + parallels );	
-	}
+template< class T >
+const T*	PersistentArray< T >::GetRun( UINT index, UINT& length ) const
+{
+	assert( index < count );
+	
+	const void* node = root.get();
+	for( UINT level = shift; level > 0; level -= BITS )
+		node = ( ( const Branch* )node )->children[ ( index >> level ) & MASK ].get();
+	
+	length = min( ( UINT )WIDTH - ( index & MASK ), count - index );
+	return &( ( const Leaf* )node )->items[ index & MASK ];
+}
 
-	// ///////////////////////////////////////////////
-	// THE LAST MERIDIAN
-	// ...
-	// everything goas as within the loop
-	// so there's nothing much to explain
-	int i = meridians - 1;
-	for( unsigned int j = 0; j < parallels - 2; j++ )
+template< class T >
+void	PersistentArray< T >::CopyTo( T* dest ) const
+{
+	UINT	length;
+	for( UINT i = 0; i < count; i += length )
 	{
-		// first triangle
-		fnIndices.push_back( i * ( parallels - 1 ) + 2 + j );
-		fnIndices.push_back( 2 + j );
-		fnIndices.push_back( 2 + j + 1 );	
-
-		// second triangle
-		fnIndices.push_back( i * ( parallels - 1 ) + 2 + j );
-		fnIndices.push_back( 2 + j + 1 );
-		fnIndices.push_back( i * ( parallels - 1 ) + 2 + j + 1 ); 
+		const T* run = GetRun( i, length );
+		std::copy( run, run + length, dest + i );
 	}
+}
 
-	// first triangle 
-	fnIndices.push_back( 0 );
-	fnIndices.push_back( 2 );
-	fnIndices.push_back( ( i ) * ( parallels - 1 ) + 2 );
+void	SceneVersion::Insert( std::shared_ptr< Object3D > o3ptr, XMFLOAT4 color, XMFLOAT3 centre, float radius, const Material& material, float meshRadius )
+{
+	objects.PushBack( o3ptr );
+	colors.PushBack( color );
+	materials.PushBack( material );
+	spheres.PushBack( XMFLOAT4( centre.x, centre.y, centre.z, radius ) );
+	meshRadii.PushBack( meshRadius > 0.0f ? meshRadius : radius );
+}
 
-	// last triangle
-	fnIndices.push_back( 1 );
-	fnIndices.push_back( i * ( parallels - 1 ) -1 + parallels );
-	fnIndices.push_back( -1 + parallels );	
+void	SceneVersion::Remove( UINT oNum )
+{
+	if( oNum >= objects.size() )	return;
+	objects.SwapRemove( oNum );
+	colors.SwapRemove( oNum );
+	materials.SwapRemove( oNum );
+	spheres.SwapRemove( oNum );
+	meshRadii.SwapRemove( oNum );
+}
 
-	// //////////////////////////////////////
-	// indices swap - if rasters set back
+// store starts with an empty version, so Pin never returns NULL
+SceneVersionStore::SceneVersionStore()
+	:	current( new SceneVersion ),
+		pinned( NULL )
+{
+	InitializeCriticalSection( &editLock );
+}
 
-	// swaps the order of the triangles in the indices set
-	// basicly turns them from counter-clockwise into clockwise
-	for( unsigned int i = 0; i < fnIndices.size() / 3; i++ )
+// render thread must not use the store anymore
+SceneVersionStore::~SceneVersionStore()
+{
+	for( size_t i = 0; i < retired.size(); i++ )
+		delete retired[ i ];
+	delete current;
+	DeleteCriticalSection( &editLock );
+}
+
+// deletes retired versions, except the one render thread
+// is using. editor replaces the current version before 
+// reading the pinned one (both with a full barrier), so if
+// render thread pins a retired version after we've read the
+// pinned pointer, it sees the current one has changed and 
+// pins again, never touching the deleted version
+void	SceneVersionStore::Reclaim()
+{
+	const SceneVersion* inUse = pinned;
+	for( size_t i = 0; i < retired.size(); )
 	{
-		std::swap( fnIndices.at( i*3 ), fnIndices.at( i*3 +2 ) );
+		if( retired[ i ] == inUse )
+		{
+			i++;
+			continue;
+		}
+		delete retired[ i ];
+		retired[ i ] = retired.back();
+		retired.pop_back();
 	}
+}
 
-	// //////////////////////////////////////
-	// final func stage
-
-	InsertObject( fnVertices.data(), fnIndices.data(), fnVertices.size(), fnIndices.size(), color );
+SceneVersion	SceneVersionStore::Begin()
+{
+	EnterCriticalSection( &editLock );
+	return *current;
 }
 
-// creates a rectangle surface of desired length and width.
-// surface' normal is described by planeNormal variable
-// and lenDir is the direction of the surface (egdes
-// parallel to that direction are described by length var)
-void	Mateyko::formRectangleObject( LPCWSTR _name, float length, float width, XMFLOAT3 planeNormal, XMFLOAT3 lenDir )
+void	SceneVersionStore::Commit( const SceneVersion& next )
 {
-	// ////////////////////////////////////////
-	// DECLARE VARIABLES
-	// ...
-	// those two are the final vertices and final
-	// indices that will be used to form an object
-	std::vector< Vertex >	fnVertices;
-	std::vector< DWORD >	fnIndices;
+	SceneVersion* published = new SceneVersion( next );
+	published->number = current->number + 1;
 	
-	XMMATRIX	mxRectSpace;	// transformation matrix
-	Vertex		tmpVertex;		// we store here the vertex we want push back into vector
+	retired.push_back( ( const SceneVersion* )InterlockedExchangePointer( 
+		( PVOID volatile* )&current, ( PVOID )published ) );
+	Reclaim();
 	
-	// combining those floats and their negatives in the
-	// space created by planeNormal and lenDir gives us
-	// all four vertices that form the rectangle
-	float xC = length * 0.5f;
-	float zC = width * 0.5f;
+	LeaveCriticalSection( &editLock );
+}
 
-	// aquire the base of the rectangle space.
-	// in this space previously defined xC and zC
-	// are enough to get the vertex of the rectangle
-	mxRectSpace = getSpaceMatrix( lenDir, planeNormal, true );
+void	SceneVersionStore::Cancel()
+{
+	LeaveCriticalSection( &editLock );
+}
 
-	// prepare tmpVertex
-	tmpVertex.Color = XMFLOAT4( 0.8f, 0.1f, 0.3f, 1.0f );
-	tmpVertex.Norm = planeNormal;
-	
-	// calculate positions and store vertices - 1st
-	XMStoreFloat3( &tmpVertex.Pos, XMVector3TransformCoord( XMVectorSet( -xC, 0.0f, -zC, 0.0f ), mxRectSpace ) );
-	fnVertices.push_back( tmpVertex );
+void	SceneVersionStore::Insert( std::shared_ptr< Object3D > o3ptr, XMFLOAT4 color, XMFLOAT3 centre, float radius )
+{
+	SceneVersion next = Begin();
+	next.Insert( o3ptr, color, centre, radius );
+	Commit( next );
+}
 
-	// 2nd
-	XMStoreFloat3( &tmpVertex.Pos, XMVector3TransformCoord( XMVectorSet( -xC, 0.0f, zC, 0.0f ), mxRectSpace ) );
-	fnVertices.push_back( tmpVertex );
+void	SceneVersionStore::Remove( UINT oNum )
+{
+	SceneVersion next = Begin();
+	next.Remove( oNum );
+	Commit( next );
+}
 
-	// 3rd
-	XMStoreFloat3( &tmpVertex.Pos, XMVector3TransformCoord( XMVectorSet( xC, 0.0f, zC, 0.0f ), mxRectSpace ) );
-	fnVertices.push_back( tmpVertex );
+void	SceneVersionStore::Recolor( UINT oNum, XMFLOAT4 color )
+{
+	SceneVersion next = Begin();
+	if( oNum < next.colors.size() )
+		next.colors.Set( oNum, color );
+	Commit( next );
+}
 
-	// 4th
-	XMStoreFloat3( &tmpVertex.Pos, XMVector3TransformCoord( XMVectorSet( xC, 0.0f, -zC, 0.0f ), mxRectSpace ) );
-	fnVertices.push_back( tmpVertex );
+void	SceneVersionStore::SetMaterial( UINT oNum, const Material& material )
+{
+	SceneVersion next = Begin();
+	if( oNum < next.materials.size() )
+		next.materials.Set( oNum, material );
+	Commit( next );
+}
 
-	// get indices set
-	fnIndices.push_back( 0 );
-	fnIndices.push_back( 1 );
-	fnIndices.push_back( 2 );
-	fnIndices.push_back( 0 );
-	fnIndices.push_back( 2 );
-	fnIndices.push_back( 3 );
+// radius stays the same, only the centre is moved
+void	SceneVersionStore::Transform( UINT oNum, XMFLOAT3 centre )
+{
+	SceneVersion next = Begin();
+	if( oNum < next.spheres.size() )
+	{
+		float radius = next.spheres.Get( oNum ).w;
+		next.spheres.Set( oNum, XMFLOAT4( centre.x, centre.y, centre.z, radius ) );
+	}
+	Commit( next );
+}
 
-	// //////////////////////////////////////
-	// final func stage
+// unlike the other edits, this one costs as much as the 
+// scene is big. it's meant for the initial scene only
+void	SceneVersionStore::Capture( Mateyko& mat, Space& spa )
+{
+	SceneVersion next = Begin();
+	next.objects.Clear();
+	next.colors.Clear();
+	next.materials.Clear();
+	next.spheres.Clear();
+	next.meshRadii.Clear();
 	
-	// note: now this raytracer don't need
-	// any other rectangles apart from its
-	// ground. so instead of returning the
-	// vertices and indices create the obj
-	// and attach it to GroundZero pointer
+	UINT count = min( mat.GetObjectCount(), spa.size() );
+	const float* meshRadii = spa.GetMeshRadii();
+	for( UINT i = 0; i < count; i++ )
+	{
+		XMFLOAT4 sphere = spa.GetSphere( i );
+		next.Insert( mat.GetSharedObject( i ), mat.GetColor( i ), 
+			XMFLOAT3( sphere.x, sphere.y, sphere.z ), sphere.w, mat.GetMaterial( i ), meshRadii[ i ] );
+	}
+	Commit( next );
+}
 
-	// in case ground was already created remove preous one
-	if( oGroundZero )
-		delete oGroundZero;
-		
-	// create new ground object
-	oGroundZero = new Object3D( 
-		pd3dDevice, 
-		fnVertices.data(), 
-		fnIndices.data(), 
-		fnVertices.size(), 
-		fnIndices.size() );
+// the hazard pointer is set before checking whether the
+// version is still current. if it isn't, an editor might
+// have missed our pin and deleted it, so we try again
+const SceneVersion*		SceneVersionStore::Pin()
+{
+	const SceneVersion* version;
+	do
+	{
+		version = current;
+		InterlockedExchangePointer( ( PVOID volatile* )&pinned, ( PVOID )version );
+	}
+	while( version != current );
+	return version;
+}
+
+void	SceneVersionStore::Unpin()
+{
+	InterlockedExchangePointer( ( PVOID volatile* )&pinned, NULL );
 }
 
 // ////////////////////////////////////////////////
 // ///////////////////////////////////////////////
 // //////////////////////////////////////////////
 // 
-// SHADER INPUT	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// PARTICLE SYSTEM	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
 // 
 // /////////////////////////////////////////
 // ////////////////////////////////////////
 // ///////////////////////////////////////
 
-// main constructor of the ShaderInput class
-// only one since the copy & default were disabled.
-// creates shaders from file and binds them to 
-// Effect variable. obtain technique from that file
-// and saves it to the Technique variable. then creates 
-// input layout using static vertex_desc variable.
-// in the end initializes all shader variables 
-// using previously creted Effect.
+ParticleSystem::ParticleSystem()
+	:	visible( 0 ),
+		gravity( 0.0f, -9.81f, 0.0f ),
+		seed( 0x9E3779B9 ),
+		step( 0.0f ),
+		pd3dDevice( NULL ),
+		meshVertices( NULL ),
+		meshIndices( NULL ),
+		instanceBuffer( NULL ),
+		Layout( NULL ),
+		Technique( NULL ),
+		meshIndexCount( 0 ),
+		instanceCapacity( 0 ),
+		pJobs( NULL )
+{}
 
-ShaderInput::ShaderInput( 
-	ID3D10Device*	pd3dDevice,		// pointer to the device that will create the input
-	LPCWSTR szFileName, 			// path to a file contains shaders
-	LPCSTR szTechName )				// name of the technique defined in the shader file
+ParticleSystem::~ParticleSystem()
 {
-	// variables
-	D3D10_PASS_DESC PassDesc;
-	HRESULT hr = S_OK;
-	UINT numElem = sizeof( vertex_desc ) / sizeof( vertex_desc[0] );
-	DWORD dwShaderFlags = D3D10_SHADER_ENABLE_STRICTNESS;
-
-	// create EFFECT
-	hr = D3DX10CreateEffectFromFile( 
-		szFileName, 
-		NULL, NULL, "fx_4_0", 
-		dwShaderFlags, 0, 
-		pd3dDevice, 
-		NULL, NULL, 
-		&Effect, 
-		NULL, NULL );
+	ReleaseDevice();
+}
 
+HRESULT		ParticleSystem::InitDevice( ID3D10Device* device, ShaderInput* shi, UINT meridians, UINT parallels )
+{
+	HRESULT					hr = S_OK;
+	D3D10_PASS_DESC			PassDesc;
+	D3D10_BUFFER_DESC		bd;
+	D3D10_SUBRESOURCE_DATA	InitData;
+	std::vector< Vertex >	vertices;
+	std::vector< DWORD >	indices;
+	
+	ReleaseDevice();
+	pd3dDevice = device;
+	
+	// particles are colored per instance, so the mesh is white
+	buildSphereMesh( meridians, parallels, 1.0f, XMFLOAT4( 1.0f, 1.0f, 1.0f, 1.0f ), vertices, indices );
+	meshIndexCount = indices.size();
+	
+	ZeroMemory( &bd, sizeof( bd ) );
+	bd.Usage = D3D10_USAGE_DEFAULT;
+	bd.ByteWidth = sizeof( Vertex ) * vertices.size();
+	bd.BindFlags = D3D10_BIND_VERTEX_BUFFER;
+	InitData.pSysMem = vertices.data();
+	
+	hr = pd3dDevice->CreateBuffer( &bd, &InitData, &meshVertices );
 	if( FAILED( hr ) )
-		ERRORMACRO( L"Critical failure during shader compilation process." );
-
-	// create TECHNIQUE
-	Technique = Effect->GetTechniqueByName( szTechName );
-
-	// Create the input layout using the first tech, var INPUT
+	{
+		ERRORMACRO( L"Unable to create particle mesh." );
+		return hr;
+	}
+	
+	bd.ByteWidth = sizeof( DWORD ) * indices.size();
+	bd.BindFlags = D3D10_BIND_INDEX_BUFFER;
+	InitData.pSysMem = indices.data();
+	
+	hr = pd3dDevice->CreateBuffer( &bd, &InitData, &meshIndices );
+	if( FAILED( hr ) )
+	{
+		ERRORMACRO( L"Unable to create particle mesh." );
+		return hr;
+	}
+	
+	Technique = shi->GetEffect()->GetTechniqueByName( "RenderParticles" );
+	if( Technique == NULL || !Technique->IsValid() )
+	{
+		Technique = NULL;
+		ERRORMACRO( L"Shader file has no RenderParticles technique." );
+		return E_FAIL;
+	}
+	
 	Technique->GetPassByIndex( 0 )->GetDesc( &PassDesc );
-    hr = pd3dDevice->CreateInputLayout( 
-		vertex_desc, 
-		numElem, 
+	hr = pd3dDevice->CreateInputLayout( 
+		particle_desc, 
+		sizeof( particle_desc ) / sizeof( particle_desc[0] ), 
 		PassDesc.pIAInputSignature,
-        PassDesc.IAInputSignatureSize, 
-		&Input );
+		PassDesc.IAInputSignatureSize, 
+		&Layout );
 	
 	if( FAILED( hr ) )
-		ERRORMACRO( L"Nie jest fajno, szefie" );
+		ERRORMACRO( L"Unable to create particle input layout." );
+	return hr;
+}
+
+void	ParticleSystem::ReleaseDevice()
+{
+	if( meshVertices )		meshVertices->Release();
+	if( meshIndices )		meshIndices->Release();
+	if( instanceBuffer )	instanceBuffer->Release();
+	if( Layout )			Layout->Release();
+	
+	meshVertices = meshIndices = instanceBuffer = NULL;
+	Layout = NULL;
+	Technique = NULL;
+	pd3dDevice = NULL;
+	instanceCapacity = 0;
+}
+
+void	ParticleSystem::Reserve( UINT capacity )
+{
+	posX.reserve( capacity );		posY.reserve( capacity );		posZ.reserve( capacity );
+	velX.reserve( capacity );		velY.reserve( capacity );		velZ.reserve( capacity );
+	lifetimes.reserve( capacity );
+	radii.reserve( capacity );
+	colors.reserve( capacity );
+	instances.reserve( capacity );
+	batchVisible.reserve( capacity / PARTICLE_BATCH_SIZE + 1 );
+}
+
+// random numbers come from a xorshift generator, it's
+// plenty for scattering particles and much faster than rand
+UINT	ParticleSystem::Emit( UINT count, XMFLOAT3 origin, XMFLOAT3 velocity, float spread, float lifetime, float radius, XMFLOAT4 color )
+{
+	float scale = 2.0f * spread / ( float )0xFFFFFFFF;
+	float random[ 3 ];
+	
+	for( UINT i = 0; i < count; i++ )
+	{
+		for( UINT k = 0; k < 3; k++ )
+		{
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			random[ k ] = seed * scale - spread;
+		}
 		
-	// when the most important variables are being handled
-	// its time to define variables that will pass data to
-	// the constant buffers.
+		posX.push_back( origin.x );				posY.push_back( origin.y );				posZ.push_back( origin.z );
+		velX.push_back( velocity.x + random[ 0 ] );	velY.push_back( velocity.y + random[ 1 ] );	velZ.push_back( velocity.z + random[ 2 ] );
+		lifetimes.push_back( lifetime );
+		radii.push_back( radius );
+		colors.push_back( color );
+	}
+	return lifetimes.size();
+}
 
-	// create effect matrix variables
-	World 		= Effect->GetVariableByName( 	"World" 		)->AsMatrix();
-	View 		= Effect->GetVariableByName( 	"View" 			)->AsMatrix();
-	Projection 	= Effect->GetVariableByName( 	"Projection" 	)->AsMatrix();
+void	ParticleSystem::RemoveAll()
+{
+	posX.clear();		posY.clear();		posZ.clear();
+	velX.clear();		velY.clear();		velZ.clear();
+	lifetimes.clear();
+	radii.clear();
+	colors.clear();
+	visible = 0;
+}
+
+// semi-implicit euler, velocity first. four particles at a
+// time, the few left at the end of the range one by one
+void	ParticleSystem::integrate( UINT begin, UINT end )
+{
+	XMVECTOR	dt = XMVectorReplicate( step );
+	XMVECTOR	gx = XMVectorReplicate( gravity.x * step );
+	XMVECTOR	gy = XMVectorReplicate( gravity.y * step );
+	XMVECTOR	gz = XMVectorReplicate( gravity.z * step );
+	
+	UINT i = begin;
+	for( ; i + 4 <= end; i += 4 )
+	{
+		XMVECTOR vx = XMVectorAdd( XMLoadFloat4( ( XMFLOAT4* )&velX[ i ] ), gx );
+		XMVECTOR vy = XMVectorAdd( XMLoadFloat4( ( XMFLOAT4* )&velY[ i ] ), gy );
+		XMVECTOR vz = XMVectorAdd( XMLoadFloat4( ( XMFLOAT4* )&velZ[ i ] ), gz );
+		XMStoreFloat4( ( XMFLOAT4* )&velX[ i ], vx );
+		XMStoreFloat4( ( XMFLOAT4* )&velY[ i ], vy );
+		XMStoreFloat4( ( XMFLOAT4* )&velZ[ i ], vz );
+		
+		XMStoreFloat4( ( XMFLOAT4* )&posX[ i ], XMVectorMultiplyAdd( vx, dt, XMLoadFloat4( ( XMFLOAT4* )&posX[ i ] ) ) );
+		XMStoreFloat4( ( XMFLOAT4* )&posY[ i ], XMVectorMultiplyAdd( vy, dt, XMLoadFloat4( ( XMFLOAT4* )&posY[ i ] ) ) );
+		XMStoreFloat4( ( XMFLOAT4* )&posZ[ i ], XMVectorMultiplyAdd( vz, dt, XMLoadFloat4( ( XMFLOAT4* )&posZ[ i ] ) ) );
+		XMStoreFloat4( ( XMFLOAT4* )&lifetimes[ i ], XMVectorSubtract( XMLoadFloat4( ( XMFLOAT4* )&lifetimes[ i ] ), dt ) );
+	}
+	
+	for( ; i < end; i++ )
+	{
+		velX[ i ] += gravity.x * step;
+		velY[ i ] += gravity.y * step;
+		velZ[ i ] += gravity.z * step;
+		posX[ i ] += velX[ i ] * step;
+		posY[ i ] += velY[ i ] * step;
+		posZ[ i ] += velZ[ i ] * step;
+		lifetimes[ i ] -= step;
+	}
+}
+
+void	ParticleSystem::integrateJob( void* system, UINT begin, UINT end )
+{
+	( ( ParticleSystem* )system )->integrate( begin, end );
+}
+
+// dead particles are replaced by the last ones. order of
+// particles doesn't matter, and nothing has to be moved
+// unless something died
+void	ParticleSystem::removeDead()
+{
+	UINT count = lifetimes.size();
+	for( UINT i = 0; i < count; )
+	{
+		if( lifetimes[ i ] > 0.0f )
+		{
+			i++;
+			continue;
+		}
+		
+		count--;
+		posX[ i ] = posX[ count ];		posY[ i ] = posY[ count ];		posZ[ i ] = posZ[ count ];
+		velX[ i ] = velX[ count ];		velY[ i ] = velY[ count ];		velZ[ i ] = velZ[ count ];
+		lifetimes[ i ] = lifetimes[ count ];
+		radii[ i ] = radii[ count ];
+		colors[ i ] = colors[ count ];
+	}
+	
+	posX.resize( count );		posY.resize( count );		posZ.resize( count );
+	velX.resize( count );		velY.resize( count );		velZ.resize( count );
+	lifetimes.resize( count );
+	radii.resize( count );
+	colors.resize( count );
+}
+
+void	ParticleSystem::Update( float dt )
+{
+	step = dt;
+	if( pJobs )
+		pJobs->ParallelFor( lifetimes.size(), PARTICLE_BATCH_SIZE, integrateJob, this );
+	else integrate( 0, lifetimes.size() );
+	
+	removeDead();
+}
+
+// the range may be bigger than a single batch (if it
+// wasn't split between threads), so it's culled batch by batch.
+// distances of a chunk of particles to all six planes come from
+// the transform kernel, then they're compared one by one
+// (it's what sphereInFrustum does)
+void	ParticleSystem::cull( UINT begin, UINT end )
+{
+	float		distances[ 6 ][ PARTICLE_CULL_CHUNK ];
+	XMMATRIX	first = XMLoadFloat4x4( &planeMatrices[ 0 ] );
+	XMMATRIX	second = XMLoadFloat4x4( &planeMatrices[ 1 ] );
+	
+	for( UINT batch = begin; batch < end; batch += PARTICLE_BATCH_SIZE )
+	{
+		UINT batchEnd = min( batch + PARTICLE_BATCH_SIZE, end );
+		UINT found = batch;
+		for( UINT chunk = batch; chunk < batchEnd; chunk += PARTICLE_CULL_CHUNK )
+		{
+			UINT size = min( batchEnd - chunk, ( UINT )PARTICLE_CULL_CHUNK );
+			transformPoints( &posX[ chunk ], &posY[ chunk ], &posZ[ chunk ], size, first, distances[ 0 ], distances[ 1 ], distances[ 2 ] );
+			transformPoints( &posX[ chunk ], &posY[ chunk ], &posZ[ chunk ], size, second, distances[ 3 ], distances[ 4 ], distances[ 5 ] );
+			
+			for( UINT j = 0; j < size; j++ )
+			{
+				UINT	i = chunk + j;
+				float	r = -radii[ i ];
+				if( distances[ 0 ][ j ] < r || distances[ 1 ][ j ] < r || distances[ 2 ][ j ] < r ||
+					distances[ 3 ][ j ] < r || distances[ 4 ][ j ] < r || distances[ 5 ][ j ] < r )
+					continue;
+				
+				instances[ found ].Sphere = XMFLOAT4( posX[ i ], posY[ i ], posZ[ i ], radii[ i ] );
+				instances[ found ].Color = colors[ i ];
+				found++;
+			}
+		}
+		batchVisible[ batch / PARTICLE_BATCH_SIZE ] = found - batch;
+	}
+}
+
+void	ParticleSystem::cullJob( void* system, UINT begin, UINT end )
+{
+	( ( ParticleSystem* )system )->cull( begin, end );
+}
+
+UINT	ParticleSystem::Cull( Camera* cam )
+{
+	UINT count = lifetimes.size();
+	UINT batches = ( count + PARTICLE_BATCH_SIZE - 1 ) / PARTICLE_BATCH_SIZE;
+	
+	// a point transformed by a matrix whose columns are planes
+	// comes out as its distances to them
+	cam->GetFrustumPlanes( planes );
+	for( UINT m = 0; m < 2; m++ )
+	{
+		const XMFLOAT4* p = &planes[ 3 * m ];
+		planeMatrices[ m ] = XMFLOAT4X4( 
+			p[ 0 ].x, p[ 1 ].x, p[ 2 ].x, 0.0f,
+			p[ 0 ].y, p[ 1 ].y, p[ 2 ].y, 0.0f,
+			p[ 0 ].z, p[ 1 ].z, p[ 2 ].z, 0.0f,
+			p[ 0 ].w, p[ 1 ].w, p[ 2 ].w, 1.0f );
+	}
+	if( instances.size() < count )
+		instances.resize( count );
+	if( batchVisible.size() < batches )
+		batchVisible.resize( batches );
+	
+	if( pJobs )
+		pJobs->ParallelFor( count, PARTICLE_BATCH_SIZE, cullJob, this );
+	else cull( 0, count );
+	
+	visible = 0;
+	for( UINT b = 0; b < batches; b++ )
+		visible += batchVisible[ b ];
+	return visible;
+}
+
+// the instance buffer is rewritten every frame, so it's dynamic 
+// and mapped with discard. it only grows, doubling its size
+UINT	ParticleSystem::Draw( Camera* cam )
+{
+	HRESULT				hr = S_OK;
+	D3D10_TECHNIQUE_DESC techDesc;
+	ParticleInstance*	dest = NULL;
+	
+	if( pd3dDevice == NULL || Layout == NULL )
+		return 0;
+	if( Cull( cam ) == 0 )
+		return 0;
+	
+	if( visible > instanceCapacity )
+	{
+		if( instanceBuffer )
+			instanceBuffer->Release();
+		instanceBuffer = NULL;
+		instanceCapacity = max( visible, instanceCapacity * 2 );
+		
+		D3D10_BUFFER_DESC bd;
+		ZeroMemory( &bd, sizeof( bd ) );
+		bd.Usage = D3D10_USAGE_DYNAMIC;
+		bd.ByteWidth = sizeof( ParticleInstance ) * instanceCapacity;
+		bd.BindFlags = D3D10_BIND_VERTEX_BUFFER;
+		bd.CPUAccessFlags = D3D10_CPU_ACCESS_WRITE;
+		
+		hr = pd3dDevice->CreateBuffer( &bd, NULL, &instanceBuffer );
+		if( FAILED( hr ) )
+		{
+			instanceCapacity = 0;
+			ERRORMACRO( L"Unable to create particle instance buffer." );
+			return 0;
+		}
+	}
+	
+	hr = instanceBuffer->Map( D3D10_MAP_WRITE_DISCARD, 0, ( void** )&dest );
+	if( FAILED( hr ) )
+		return 0;
+	for( UINT batch = 0, b = 0; batch < lifetimes.size(); batch += PARTICLE_BATCH_SIZE, b++ )
+	{
+		memcpy( dest, &instances[ batch ], batchVisible[ b ] * sizeof( ParticleInstance ) );
+		dest += batchVisible[ b ];
+	}
+	instanceBuffer->Unmap();
+	
+	ID3D10Buffer*	buffers[ 2 ] = { meshVertices, instanceBuffer };
+	UINT			strides[ 2 ] = { sizeof( Vertex ), sizeof( ParticleInstance ) };
+	UINT			offsets[ 2 ] = { 0, 0 };
+	
+	pd3dDevice->IASetInputLayout( Layout );
+	pd3dDevice->IASetVertexBuffers( 0, 2, buffers, strides, offsets );
+	pd3dDevice->IASetIndexBuffer( meshIndices, DXGI_FORMAT_R32_UINT, 0 );
+	
+	Technique->GetDesc( &techDesc );
+	for( UINT p = 0; p < techDesc.Passes; ++p )
+	{
+		Technique->GetPassByIndex( p )->Apply( 0 );
+		pd3dDevice->DrawIndexedInstanced( meshIndexCount, visible, 0, 0, 0 );
+	}
+	return visible;
+}
 
-	// create effect vector variables
-	Light 		= Effect->GetVariableByName( 	"Light" 		)->AsVector();
-	CamEye 		= Effect->GetVariableByName( 	"CamEye" 		)->AsVector();
-	BigBalls 	= Effect->GetVariableByName( 	"BigBalls" 		)->AsVector();
-	OColors 	= Effect->GetVariableByName( 	"OColors" 		)->AsVector();
+void	ParticleSystem::SetGravity( XMFLOAT3 g )			{	gravity = g;	}
+void	ParticleSystem::BindJobs( JobSystem* jobs )		{	pJobs = jobs;	}
+UINT	ParticleSystem::size()							{	return lifetimes.size();	}
 
-	// create effect scalar variables
-	// look to the class header for further descriptions
-	num_processed 		= Effect->GetVariableByName( 	"num_processed" 	)->AsScalar();
-	count_processed 	= Effect->GetVariableByName( 	"count_processed" 	)->AsScalar();
-	brightness 			= Effect->GetVariableByName( 	"brightness" 		)->AsScalar();
-	reflectance 		= Effect->GetVariableByName( 	"reflectance" 		)->AsScalar();
-	skybright 			= Effect->GetVariableByName( 	"skybright" 		)->AsScalar();
-	diffuseStr 			= Effect->GetVariableByName( 	"diffuseStr" 		)->AsScalar();
-	gamma 				= Effect->GetVariableByName( 	"gamma" 			)->AsScalar();
-	ColorNumVar 		= Effect->GetVariableByName( 	"ColorNumVar" 		)->AsScalar();
+// ////////////////////////////////////////////////
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// SPHERE IMPOSTORS	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// 
+// /////////////////////////////////////////
+// ////////////////////////////////////////
+// ///////////////////////////////////////
 
-	// create texture and map variables
-	FloorTexture = Effect->GetVariableByName( "FloorTexture" )->AsShaderResource();
+SphereImpostors::SphereImpostors()
+	:	threshold( IMPOSTOR_DEFAULT_SIZE ),
+		spheres( NULL ),
+		colors( NULL ),
+		materials( NULL ),
+		eligible( NULL ),
+		count( 0 ),
+		eye( 0.0f, 0.0f, 0.0f ),
+		scale( 0.0f ),
+		visible( 0 ),
+		pd3dDevice( NULL ),
+		quadVertices( NULL ),
+		instanceBuffer( NULL ),
+		Layout( NULL ),
+		Technique( NULL ),
+		instanceCapacity( 0 ),
+		pJobs( NULL )
+{}
 
-	// prepare values that need to be passed to shaders
-	vGamma = 2.2f;	
-	vBrightness = 0.8f;	
-	vReflectance = 2.35f;
-	vSkyBrightness = 1.1f;	
-	vDiffusePower = 1.25f;	
-	vChannel = 0;			
+SphereImpostors::~SphereImpostors()
+{
+	ReleaseDevice();
 }
 
-// ShaderInput destructor.
-// destructs things pretty nicely.
-ShaderInput::~ShaderInput()
+HRESULT		SphereImpostors::InitDevice( ID3D10Device* device, ShaderInput* shi )
 {
-	// release things
-	if( Input )			Input->Release();
-	if( Effect )		Effect->Release();
+	HRESULT					hr = S_OK;
+	D3D10_PASS_DESC			PassDesc;
+	D3D10_BUFFER_DESC		bd;
+	D3D10_SUBRESOURCE_DATA	InitData;
 	
-	// according to the msdn all effect variables
-	// are released when its parent effect is released.
-	// so we do not do it manually.
+	// a triangle strip, so no indices are needed
+	ImpostorCorner			corners[ 4 ] = {
+		{ XMFLOAT2( -1.0f,  1.0f ) },
+		{ XMFLOAT2(  1.0f,  1.0f ) },
+		{ XMFLOAT2( -1.0f, -1.0f ) },
+		{ XMFLOAT2(  1.0f, -1.0f ) } };
+	
+	ReleaseDevice();
+	pd3dDevice = device;
+	
+	ZeroMemory( &bd, sizeof( bd ) );
+	bd.Usage = D3D10_USAGE_IMMUTABLE;
+	bd.ByteWidth = sizeof( corners );
+	bd.BindFlags = D3D10_BIND_VERTEX_BUFFER;
+	InitData.pSysMem = corners;
+	
+	hr = pd3dDevice->CreateBuffer( &bd, &InitData, &quadVertices );
+	if( FAILED( hr ) )
+	{
+		ERRORMACRO( L"Unable to create impostor quad." );
+		return hr;
+	}
+	
+	Technique = shi->GetEffect()->GetTechniqueByName( "RenderImpostors" );
+	if( Technique == NULL || !Technique->IsValid() )
+	{
+		Technique = NULL;
+		ERRORMACRO( L"Shader file has no RenderImpostors technique." );
+		return E_FAIL;
+	}
+	
+	Technique->GetPassByIndex( 0 )->GetDesc( &PassDesc );
+	hr = pd3dDevice->CreateInputLayout( 
+		impostor_desc, 
+		sizeof( impostor_desc ) / sizeof( impostor_desc[0] ), 
+		PassDesc.pIAInputSignature,
+		PassDesc.IAInputSignatureSize, 
+		&Layout );
+	
+	if( FAILED( hr ) )
+		ERRORMACRO( L"Unable to create impostor input layout." );
+	return hr;
 }
 
-// passes almost all shading control variables
-// (except the num_processed which is diffrent
-// for every object on the scene) to the shader's
-// constants buffers. used in PaintScene
-void	ShaderInput::PrepareShadingControlVars( int arg )
+void	SphereImpostors::ReleaseDevice()
 {
-	ColorNumVar->SetInt( 		vChannel );
-	brightness->SetFloat( 		vBrightness );
-	reflectance->SetFloat( 		vReflectance );
-	gamma->SetFloat( 			vGamma );
-	diffuseStr->SetFloat( 		vDiffusePower );
-	skybright->SetFloat( 		vSkyBrightness );
-	count_processed->SetInt(	arg );
+	if( quadVertices )		quadVertices->Release();
+	if( instanceBuffer )	instanceBuffer->Release();
+	if( Layout )			Layout->Release();
+	
+	quadVertices = instanceBuffer = NULL;
+	Layout = NULL;
+	Technique = NULL;
+	pd3dDevice = NULL;
+	instanceCapacity = 0;
 }
 
-// passes the arguments to the shaders
-// those arguments are view and projection
-// matrices, generated by a Camera object,
-// passed as a pointers to the matrix' float array
-void	ShaderInput::PrepareCameraMatrices( 
-	float* _view, 
-	float* _proj )
+// a sphere of radius r, d units away from the eye, is about
+// r * ( height / 2 ) * cot( fov / 2 ) / d pixels in radius.
+// comparing squares saves the square root of the distance
+void	SphereImpostors::select( UINT begin, UINT end )
 {
-	View->SetMatrix( _view );
-	Projection->SetMatrix( _proj );
+	XMVECTOR	eyePos = XMLoadFloat3( &eye );
+	
+	for( UINT batch = begin; batch < end; batch += IMPOSTOR_BATCH_SIZE )
+	{
+		UINT batchEnd = min( batch + IMPOSTOR_BATCH_SIZE, end );
+		UINT found = batch;
+		for( UINT i = batch; i < batchEnd; i++ )
+		{
+			const XMFLOAT4&	sphere = spheres[ i ];
+			XMVECTOR		offset = XMVectorSubtract( XMLoadFloat4( &sphere ), eyePos );
+			float			distance = XMVectorGetX( XMVector3LengthSq( offset ) );
+			float			size = sphere.w * scale;
+			
+			flags[ i ] = 0;
+			if( ( eligible && !eligible[ i ] ) || size * size > distance || !sphereInFrustum( planes, sphere ) )
+				continue;
+			
+			const Material& m = materials ? materials[ i ] : Material();
+			flags[ i ] = 1;
+			instances[ found ].Sphere = sphere;
+			instances[ found ].Color = colors[ i ];
+			instances[ found ].Material = XMFLOAT4( m.reflectance, m.diffuse, m.brightness, m.sky );
+			found++;
+		}
+		batchVisible[ batch / IMPOSTOR_BATCH_SIZE ] = found - batch;
+	}
 }
 
-// passes the argument (which is an xmfloat
-// camera's eye position converted to the float*)
-// to the shaders.
-void	ShaderInput::PrepareEyePos( float* _eye )
+void	SphereImpostors::selectJob( void* impostors, UINT begin, UINT end )
 {
-	CamEye->SetFloatVector( _eye );
+	( ( SphereImpostors* )impostors )->select( begin, end );
 }
 
-// passes positions of all objects and the
-// number of objects to the shaders. positions
-// are, as usual, provided as an array of floats
-void	ShaderInput::PreparePositions( 
-	float* _pos, 
-	int _count )
+UINT	SphereImpostors::Select( Camera* cam, const XMFLOAT4* _spheres, const XMFLOAT4* _colors, const Material* _materials, 
+			const BYTE* _eligible, UINT _count, UINT screenHeight )
 {
-	BigBalls->SetFloatVectorArray( _pos, 0, _count );
+	UINT		batches = ( _count + IMPOSTOR_BATCH_SIZE - 1 ) / IMPOSTOR_BATCH_SIZE;
+	XMFLOAT4	eyePos = cam->GetEyePos();
+	XMFLOAT4X4	projection;
+	
+	spheres = _spheres;
+	colors = _colors;
+	materials = _materials;
+	eligible = _eligible;
+	count = _count;
+	eye = XMFLOAT3( eyePos.x, eyePos.y, eyePos.z );
+	cam->GetFrustumPlanes( planes );
+	
+	// the diameter is compared with the threshold, 
+	// hence the whole height instead of its half
+	XMStoreFloat4x4( &projection, cam->GetProjection() );
+	scale = projection._22 * screenHeight / max( threshold, 1e-3f );
+	
+	if( flags.size() < count )
+	{
+		flags.resize( count );
+		instances.resize( count );
+	}
+	if( batchVisible.size() < batches )
+		batchVisible.resize( batches );
+	
+	if( pJobs )
+		pJobs->ParallelFor( count, IMPOSTOR_BATCH_SIZE, selectJob, this );
+	else select( 0, count );
+	
+	visible = 0;
+	for( UINT b = 0; b < batches; b++ )
+		visible += batchVisible[ b ];
+	return visible;
 }
 
-// passes colors the same way did with positions
-void	ShaderInput::PrepareColors( 
-	float* _colors, 
-	int _count )
+bool	SphereImpostors::IsImpostor( UINT sphere )
 {
-	OColors->SetFloatVectorArray( _colors, 0, _count );
+	return sphere < count && flags[ sphere ] != 0;
 }
 
-// passes current object's world matrix 
-// and its index on the object list. 
-void	ShaderInput::PrepareObject( 
-	float* _matrix, 
-	int _index )
+// the instance buffer is rewritten every frame, the same
+// way the particles' one is (see ParticleSystem::Draw)
+UINT	SphereImpostors::Draw()
 {
-	num_processed->SetInt( _index );
-	World->SetMatrix( _matrix );
-}
+	HRESULT				hr = S_OK;
+	D3D10_TECHNIQUE_DESC techDesc;
+	ImpostorInstance*	dest = NULL;
 	
-void	ShaderInput::SetFPS( float arg )								{ 	fps = arg; 	}
-void	ShaderInput::SetFloorTex( ID3D10ShaderResourceView* shevi )		{	FloorTexture->SetResource( shevi ); 	}
-
-// depending on which variable is pointed by
-// the varIndex, method adds or subtracts 
-// to/from that variable.
-void	ShaderInput::NmpdAddSubtract( double arg )
-{
-	// negOrPos is short for negative or positive.
-	// it basically tells us if the passed argument
-	// (double arg) is above or below or equal to zero
-	// multiplying by sigma reduce the necessity for
-	// creating two branches in an alghoritm
-	// when we want to add or subtract to a paricular
-	// variable depending on sign of the add argument
-	float	negOrPos;
-	if( arg >= 0.0f )	
-		negOrPos = 1.0f;
-	else negOrPos = -1.0f;
+	if( pd3dDevice == NULL || Layout == NULL || visible == 0 )
+		return 0;
 	
-	// decide which shading control var is to be
-	// incremented or decremented depending on 
-	// varIndex variable (which is set by NmpdNumber method)
-	switch( varIndex )
+	if( visible > instanceCapacity )
 	{
+		if( instanceBuffer )
+			instanceBuffer->Release();
+		instanceBuffer = NULL;
+		instanceCapacity = max( visible, instanceCapacity * 2 );
+		
+		D3D10_BUFFER_DESC bd;
+		ZeroMemory( &bd, sizeof( bd ) );
+		bd.Usage = D3D10_USAGE_DYNAMIC;
+		bd.ByteWidth = sizeof( ImpostorInstance ) * instanceCapacity;
+		bd.BindFlags = D3D10_BIND_VERTEX_BUFFER;
+		bd.CPUAccessFlags = D3D10_CPU_ACCESS_WRITE;
+		
+		hr = pd3dDevice->CreateBuffer( &bd, NULL, &instanceBuffer );
+		if( FAILED( hr ) )
+		{
+			instanceCapacity = 0;
+			ERRORMACRO( L"Unable to create impostor instance buffer." );
+			return 0;
+		}
+	}
 	
-	// floating point vars
-	case 1:		vGamma 				+= negOrPos * 0.1f / fps;	break;
-	case 2:		vBrightness 		+= negOrPos * 0.2f / fps;	break;
-	case 3:		vReflectance 		+= negOrPos * 0.4f / fps;	break;
-	case 4:		vDiffusePower 		+= negOrPos * 0.4f / fps;	break;
-	case 5:		vSkyBrightness 		+= negOrPos * 0.4f / fps;	break;
+	hr = instanceBuffer->Map( D3D10_MAP_WRITE_DISCARD, 0, ( void** )&dest );
+	if( FAILED( hr ) )
+		return 0;
+	for( UINT batch = 0, b = 0; batch < count; batch += IMPOSTOR_BATCH_SIZE, b++ )
+	{
+		memcpy( dest, &instances[ batch ], batchVisible[ b ] * sizeof( ImpostorInstance ) );
+		dest += batchVisible[ b ];
+	}
+	instanceBuffer->Unmap();
 	
-	// integer var. we want to set limits to it, so user won't get far
-	// from those few channels out there.
-	case 6:
-		if( vChannel <= 14 && arg >= 0.0f )		vChannel++;
-		else if( vChannel > 0 && arg < 0.0f )	vChannel--;
-		break;
+	ID3D10Buffer*	buffers[ 2 ] = { quadVertices, instanceBuffer };
+	UINT			strides[ 2 ] = { sizeof( ImpostorCorner ), sizeof( ImpostorInstance ) };
+	UINT			offsets[ 2 ] = { 0, 0 };
+	
+	pd3dDevice->IASetInputLayout( Layout );
+	pd3dDevice->IASetVertexBuffers( 0, 2, buffers, strides, offsets );
+	pd3dDevice->IASetPrimitiveTopology( D3D10_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP );
+	
+	Technique->GetDesc( &techDesc );
+	for( UINT p = 0; p < techDesc.Passes; ++p )
+	{
+		Technique->GetPassByIndex( p )->Apply( 0 );
+		pd3dDevice->DrawInstanced( 4, visible, 0, 0 );
 	}
+	return visible;
 }
 
-// simply sets the index for the NmpdAddSubtract method.
-void	ShaderInput::NmpdNumber( int arg )	{	varIndex = arg; 	}
-
-ID3D10EffectTechnique* const		ShaderInput::GetTech()		{	return Technique;	}
-ID3D10InputLayout* const			ShaderInput::GetLayout()	{ 	return Input; 		}
+bool	SphereImpostors::IsReady()						{	return Layout != NULL;	}
+void	SphereImpostors::SetThreshold( float pixels )		{	threshold = pixels;	}
+float	SphereImpostors::GetThreshold()					{	return threshold;	}
+void	SphereImpostors::BindJobs( JobSystem* jobs )		{	pJobs = jobs;	}
 
 // ////////////////////////////////////////////////
 // ///////////////////////////////////////////////
 // //////////////////////////////////////////////
 // 
-// CAMERA	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// ANIMATION	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
 // 
 // /////////////////////////////////////////
 // ////////////////////////////////////////
 // ///////////////////////////////////////
 
-// default constructor
-Camera::Camera()
-	:	Eye( 10.0f, 5.0f, 0.0f ),
-		At( 0.0f, 0.0f, 0.0f ),
-		Up( 0.0f, 1.0f, 0.0f ),
-		// starting direction
-		
-		FoV( 1.0f ),
-		fps( 1.0f ),
-		ScreenRatio( 1.0f ),
-		// those three need to be regulated separately via
-		// setters. set for 1.0f to avoid any problems with division
-		
-		acceleration( 3.0f ),
-		braking( -3.0f ),		
-		// needs to be negative, because we're adding it to the velos
-		// both acc.. and br.. have fixed values for now
-		
-		veloUpDown( 0.0f ),
-		veloLeftRight( 0.0f ),
-		veloEyeRot( 0.0f ),
-		veloAtRot( 0.0f )
-		// velocities starts at 0.0f
-		// as they increase when user
-		// presses the buttons or moves
-		// the mouse.
+AnimationSet::AnimationSet()
+	:	duration( 0.0f ),
+		time( 0.0f ),
+		channel( 0 ),
+		pSpheres( NULL ),
+		pColors( NULL ),
+		sphereCount( 0 ),
+		colorCount( 0 ),
+		pJobs( NULL )
 {}
 
-// the second constructor
-// look to the default one for explanations
-Camera::Camera( XMFLOAT3 _eye, XMFLOAT3 _at, XMFLOAT3 _up )
-	:	Eye( _eye ),
-		At( _at ),
-		Up( _up ),
+UINT	AnimationSet::AddTrack( AnimationChannel _channel, UINT object, const float* times, const XMFLOAT4* values, UINT keyCount )
+{
+	Channel& c = channels[ _channel ];
+	if( keyCount == 0 )
+		return c.targets.size();
+	
+	c.targets.push_back( object );
+	c.firstKeys.push_back( c.times.size() );
+	c.keyCounts.push_back( keyCount );
+	c.cursors.push_back( 0 );
+	c.times.insert( c.times.end(), times, times + keyCount );
+	c.values.insert( c.values.end(), values, values + keyCount );
+	
+	if( _channel != ANIMATE_COLOR )
+	{
+		std::vector< UINT >::iterator it = std::lower_bound( animatedSpheres.begin(), animatedSpheres.end(), object );
+		if( it == animatedSpheres.end() || *it != object )
+			animatedSpheres.insert( it, object );
+	}
+	
+	duration = max( duration, times[ keyCount - 1 ] );
+	return c.targets.size();
+}
+
+void	AnimationSet::RemoveAll()
+{
+	for( UINT i = 0; i < ANIMATION_CHANNELS; i++ )
+	{
+		Channel& c = channels[ i ];
+		c.targets.clear();
+		c.firstKeys.clear();
+		c.keyCounts.clear();
+		c.cursors.clear();
+		c.times.clear();
+		c.values.clear();
+	}
+	animatedSpheres.clear();
+	duration = 0.0f;
+}
+
+// time usually goes forward a little between frames, so
+// the search for the right pair of keys starts where it
+// ended last time, and usually doesn't move at all
+void	AnimationSet::evaluateTracks( UINT begin, UINT end )
+{
+	Channel&	c = channels[ channel ];
+	XMFLOAT4*	target = channel == ANIMATE_COLOR ? pColors : pSpheres;
+	UINT		targetCount = channel == ANIMATE_COLOR ? colorCount : sphereCount;
+	
+	for( UINT i = begin; i < end; i++ )
+	{
+		if( c.targets[ i ] >= targetCount )
+			continue;
 		
-		FoV( 1.0f ),
-		fps( 1.0f ),
-		ScreenRatio( 1.0f ),
+		const float*	times = &c.times[ c.firstKeys[ i ] ];
+		const XMFLOAT4*	values = &c.values[ c.firstKeys[ i ] ];
+		UINT			last = c.keyCounts[ i ] - 1;
+		XMVECTOR		value;
 		
-		acceleration( 3.0f ),
-		braking( -3.0f ),		
+		if( time <= times[ 0 ] )
+			value = XMLoadFloat4( &values[ 0 ] );
+		else if( time >= times[ last ] )
+			value = XMLoadFloat4( &values[ last ] );
+		else
+		{
+			UINT k = c.cursors[ i ];
+			if( times[ k ] > time )
+				k = 0;
+			while( times[ k + 1 ] <= time )
+				k++;
+			c.cursors[ i ] = k;
+			
+			float s = ( time - times[ k ] ) / ( times[ k + 1 ] - times[ k ] );
+			value = XMVectorLerp( XMLoadFloat4( &values[ k ] ), XMLoadFloat4( &values[ k + 1 ] ), s );
+		}
 		
-		veloUpDown( 0.0f ),
-		veloLeftRight( 0.0f ),
-		veloEyeRot( 0.0f ),
-		veloAtRot( 0.0f )
-{}
+		XMFLOAT4& result = target[ c.targets[ i ] ];
+		switch( channel )
+		{
+		case ANIMATE_POSITION:	XMStoreFloat3( ( XMFLOAT3* )&result, value );		break;
+		case ANIMATE_SCALE:		result.w = XMVectorGetX( value );					break;
+		case ANIMATE_COLOR:		XMStoreFloat4( &result, value );					break;
+		}
+	}
+}
 
-void	Camera::SetFPS( float arg )								{ 	fps = arg; 	}
-void	Camera::SetScreenRatio( float arg )						{	ScreenRatio = arg;	}
-void	Camera::SetFoV( float arg )								{	FoV = arg; 	}
+void	AnimationSet::evaluateJob( void* set, UINT begin, UINT end )
+{
+	( ( AnimationSet* )set )->evaluateTracks( begin, end );
+}
 
-void	Camera::UpdateCam()
+// channels are evaluated one after another, position and scale
+// write to different parts of the same spheres, so they
+// must not run at once
+void	AnimationSet::Evaluate( float t, Space& spa, Mateyko& mat )
 {
-	// first, reduce the velocities
-	veloUpDown 		+= braking / fps;
-	veloLeftRight 	+= braking / fps;
-	veloEyeRot		+= braking / fps;
-	veloAtRot		+= braking / fps;
+	time = t;
+	pSpheres = ( XMFLOAT4* )spa.GetShaderPositionArray();
+	pColors = mat.GetColorArray();
+	sphereCount = spa.size();
+	colorCount = mat.GetObjectCount();
+	
+	for( channel = 0; channel < ANIMATION_CHANNELS; channel++ )
+	{
+		UINT count = channels[ channel ].targets.size();
+		if( pJobs )
+			pJobs->ParallelFor( count, ANIMATION_BATCH_SIZE, evaluateJob, this );
+		else evaluateTracks( 0, count );
+	}
+	
+	// spheres and colors were written behind Space's and Mateyko's
+	// back. journals aren't thread safe, so they hear about it now
+	const Channel& colorChannel = channels[ ANIMATE_COLOR ];
+	if( !animatedSpheres.empty() )
+		spa.SpheresWritten( animatedSpheres.data(), animatedSpheres.size() );
+	if( !colorChannel.targets.empty() )
+		mat.ColorsWritten( colorChannel.targets.data(), colorChannel.targets.size() );
 	
-	// then check if any velocity is lower that zero and handle that
-	if( veloUpDown < 0.0f ) 	veloUpDown = 0.0f;
-	if( veloLeftRight < 0.0f ) 	veloLeftRight = 0.0f;
-	if( veloEyeRot < 0.0f ) 	veloEyeRot = 0.0f;
-	if( veloAtRot < 0.0f ) 		veloAtRot = 0.0f;
+	pSpheres = pColors = NULL;
 }
 
-void	Camera::ArrowsUpDown( double arg )
+void	AnimationSet::BindJobs( JobSystem* jobs )	{	pJobs = jobs;	}
+float	AnimationSet::GetDuration()					{	return duration;	}
+
+UINT	AnimationSet::GetTrackCount()
 {
-	// DECLARE VARIABLES
-	XMVECTOR	vtrAt, vtrEye;		// xmvector equivalents of Eye and At xmfloats
-	XMVECTOR	movDir;				// the direction on the xz plane in which camera looks
-	float	negOrPos;
+	UINT count = 0;
+	for( UINT i = 0; i < ANIMATION_CHANNELS; i++ )
+		count += channels[ i ].targets.size();
+	return count;
+}
 
-	// DEFINE VARIABLES
-	vtrAt = XMLoadFloat3( &At );
-	vtrEye = XMLoadFloat3( &Eye );
-	
-	// we first get the difference vector between
-	// the eye and at points, then remove y factor
-	// so we have direction parallel to the xz plane
-	// then normalize it, so the distance between
-	// at and eye does not affect the speed increment
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// REMAINING PROCEDURES DEFINITIONS
+// 
+// /////////////////////////////////////////
 
-	if( arg >= 0.0f )	
-		negOrPos = 1.0f;
-	else negOrPos = -1.0f;
-	
-	movDir = vtrAt - vtrEye;
-	movDir = XMVectorSetY( movDir, 0.0f );
-	movDir = XMVector3Normalize( movDir );
+// given two vectors and a third vector direction, function 
+// creates a matrix describing a 3-dimensional carthesian
+// space with the xVec and yVec being its x and y axes.
+// if the axes are orthonormal (they usually are) the inverse 
+// is just the transposed basis, so the general inverse is
+// computed only for the others
+XMMATRIX	getSpaceMatrix( XMFLOAT3 xVec, XMFLOAT3 yVec, bool dirZ )
+{
+	XMVECTOR	bongo, xDir, yDir, zDir;
+	xDir = XMLoadFloat3( &xVec );
+	yDir = XMLoadFloat3( &yVec );
+	if( dirZ )	
+		zDir = XMVector3Cross( xDir, yDir );
+	else zDir = XMVector3Cross( yDir, xDir );
 	
-	// if velocity didn't reach its max level increase
-	if( veloUpDown < 1.0f ) 
-		veloUpDown += acceleration / fps;
+	XMMATRIX	basis( xDir, yDir, zDir, XMVectorSet( 0.0f, 0.0f, 0.0f, 1.0f ) );
+	XMVECTOR	tolerance = XMVectorReplicate( ORTHONORMAL_TOLERANCE );
+	XMVECTOR	one = XMVectorReplicate( 1.0f );
 	
-	// we divide by fps value, because we don't want
-	// refresh rate to affect the speed
-	vtrAt += negOrPos * veloUpDown * movDir / fps;
-	vtrEye += negOrPos * veloUpDown * movDir / fps;
+	if( XMVector3NearEqual( XMVector3Dot( xDir, xDir ), one, tolerance ) &&
+		XMVector3NearEqual( XMVector3Dot( yDir, yDir ), one, tolerance ) &&
+		XMVector3NearEqual( XMVector3Dot( xDir, yDir ), XMVectorZero(), tolerance ) )
+		return XMMatrixTranspose( basis );
 	
-	// store incremented values
-	XMStoreFloat3( &At, vtrAt );
-	XMStoreFloat3( &Eye, vtrEye );
+	return XMMatrixInverse( &bongo, basis );
 }
 
-void	Camera::ArrowsLeftRight( double arg )
-{	
-	// DECLARE VARIABLES
-	XMVECTOR	vtrAt, vtrEye;		// xmvector equivalents of Eye and At xmfloats
-	XMVECTOR	movDir;				// the direction on the xz plane in which camera looks
-	
-	// DEFINE VARIABLES
-	vtrAt = XMLoadFloat3( &At );
-	vtrEye = XMLoadFloat3( &Eye );
-	
-	// the first line of code below is similar to respective line 
-	// in the ArrowsUpDown method, look there for explanation.
-	// next we take the cross product which is perpendicular
-	// to the direction camera is facing, and that means 
-	// its pointing right. if needed we multiply it by
-	// -1.0f so it points left.
+// the same for count pairs of axes at once, e.g. for many
+// oriented objects. four of them are done together: their
+// coordinates are transposed, so each vector holds the same
+// coordinate of four axes, and the transposed bases come out
+// of transposing them back. pairs that aren't orthonormal
+// are left to getSpaceMatrix
+void	getSpaceMatrices( const XMFLOAT3* xVecs, const XMFLOAT3* yVecs, UINT count, bool dirZ, XMFLOAT4X4* matrices )
+{
+	XMVECTOR	tolerance = XMVectorReplicate( ORTHONORMAL_TOLERANCE );
+	XMVECTOR	one = XMVectorReplicate( 1.0f );
+	XMVECTOR	zero = XMVectorZero();
+	UINT		general[ 4 ];
+	UINT		i = 0;
 	
-	movDir = XMVector3Normalize( XMVectorSetY( ( vtrAt - vtrEye ), 0.0f ) );
-	movDir = XMVector3Cross( movDir, XMVectorSet( 0.0f, 1.0f, 0.0f, 0.0f ) );
-	if( arg < 0.0f )
-		movDir = movDir * -1.0f;
+	for( ; i + 4 <= count; i += 4 )
+	{
+		XMMATRIX x = XMMatrixTranspose( XMMATRIX( XMLoadFloat3( &xVecs[ i ] ), XMLoadFloat3( &xVecs[ i + 1 ] ), 
+			XMLoadFloat3( &xVecs[ i + 2 ] ), XMLoadFloat3( &xVecs[ i + 3 ] ) ) );
+		XMMATRIX y = XMMatrixTranspose( XMMATRIX( XMLoadFloat3( &yVecs[ i ] ), XMLoadFloat3( &yVecs[ i + 1 ] ), 
+			XMLoadFloat3( &yVecs[ i + 2 ] ), XMLoadFloat3( &yVecs[ i + 3 ] ) ) );
 		
-	// if velocity didn't reach its max level increase
-	if( veloLeftRight < 1.0f ) 
-		veloLeftRight += acceleration / fps;
+		// z = x cross y, or y cross x
+		XMVECTOR zx = XMVectorSubtract( XMVectorMultiply( x.r[ 1 ], y.r[ 2 ] ), XMVectorMultiply( x.r[ 2 ], y.r[ 1 ] ) );
+		XMVECTOR zy = XMVectorSubtract( XMVectorMultiply( x.r[ 2 ], y.r[ 0 ] ), XMVectorMultiply( x.r[ 0 ], y.r[ 2 ] ) );
+		XMVECTOR zz = XMVectorSubtract( XMVectorMultiply( x.r[ 0 ], y.r[ 1 ] ), XMVectorMultiply( x.r[ 1 ], y.r[ 0 ] ) );
+		if( !dirZ )
+		{
+			zx = XMVectorNegate( zx );
+			zy = XMVectorNegate( zy );
+			zz = XMVectorNegate( zz );
+		}
 		
-	// we divide by fps value, because we don't want
-	// refresh rate to affect the speed
-	vtrAt += veloLeftRight * movDir / fps;
-	vtrEye += veloLeftRight * movDir / fps;
+		XMVECTOR xx = XMVectorMultiplyAdd( x.r[ 0 ], x.r[ 0 ], XMVectorMultiplyAdd( x.r[ 1 ], x.r[ 1 ], XMVectorMultiply( x.r[ 2 ], x.r[ 2 ] ) ) );
+		XMVECTOR yy = XMVectorMultiplyAdd( y.r[ 0 ], y.r[ 0 ], XMVectorMultiplyAdd( y.r[ 1 ], y.r[ 1 ], XMVectorMultiply( y.r[ 2 ], y.r[ 2 ] ) ) );
+		XMVECTOR xy = XMVectorMultiplyAdd( x.r[ 0 ], y.r[ 0 ], XMVectorMultiplyAdd( x.r[ 1 ], y.r[ 1 ], XMVectorMultiply( x.r[ 2 ], y.r[ 2 ] ) ) );
+		XMVECTOR orthonormal = XMVectorAndInt( XMVectorAndInt( 
+			XMVectorNearEqual( xx, one, tolerance ), 
+			XMVectorNearEqual( yy, one, tolerance ) ), 
+			XMVectorNearEqual( xy, zero, tolerance ) );
+		
+		// i-th row of the transposed basis is the i-th coordinate of its axes
+		XMMATRIX row0 = XMMatrixTranspose( XMMATRIX( x.r[ 0 ], y.r[ 0 ], zx, zero ) );
+		XMMATRIX row1 = XMMatrixTranspose( XMMATRIX( x.r[ 1 ], y.r[ 1 ], zy, zero ) );
+		XMMATRIX row2 = XMMatrixTranspose( XMMATRIX( x.r[ 2 ], y.r[ 2 ], zz, zero ) );
+		XMVECTOR row3 = XMVectorSet( 0.0f, 0.0f, 0.0f, 1.0f );
+		
+		XMStoreInt4( general, orthonormal );
+		for( UINT j = 0; j < 4; j++ )
+		{
+			if( general[ j ] )
+				XMStoreFloat4x4( &matrices[ i + j ], XMMATRIX( row0.r[ j ], row1.r[ j ], row2.r[ j ], row3 ) );
+			else XMStoreFloat4x4( &matrices[ i + j ], getSpaceMatrix( xVecs[ i + j ], yVecs[ i + j ], dirZ ) );
+		}
+	}
 	
-	// store incremented values
-	XMStoreFloat3( &At, vtrAt );
-	XMStoreFloat3( &Eye, vtrEye );
+	for( ; i < count; i++ )
+		XMStoreFloat4x4( &matrices[ i ], getSpaceMatrix( xVecs[ i ], yVecs[ i ], dirZ ) );
 }
 
-// this methods rotates the eye around at point. to do so
-// we want to find vector that is perpendicular both to 
-// the zx plane and the vertical plane along which we 
-// want to move the eye point. such vector is required 
-// for the rotation matrix construction.
-// arg says how far we want to rotate (in radians)
-void	Camera::MouseUpDown( double arg )
+// FNV-1a hash of a chunk of memory. the hash argument is
+// the value to start with, so hashes of a few separate
+// chunks may be chained. start with HASH_OFFSET_BASIS
+UINT64	hashBytes( const void* data, size_t bytes, UINT64 hash )
 {
-	// DECLARE VARIABLES
-	XMMATRIX	mxRota;				// matrix that will help us get the final eye position
-	XMVECTOR	vtrAt, vtrEye;		// xmvector equivalents of Eye and At xmfloats
-	XMVECTOR	movDir;				// the direction on the xz plane in which camerais looking
-	float		atEyeDist;
-	float		cosine;
-	
-	// DEFINE VARIABLES
-	vtrAt = XMLoadFloat3( &At );
-	vtrEye = XMLoadFloat3( &Eye );
-	
-	// we need to check if rotation around
-	// the at point won't left camera upside down.
-	// technically i wouldn't be as much of a problem
-	// since the class generates the view matrix
-	// every time anew, but it might confuse the user
-	
-	movDir = vtrEye - vtrAt;
-	cosine = XMVectorGetX( XMVector3Dot( XMVector3Normalize( movDir ), XMVectorSet( 0.0f, 1.0f, 0.0f, 0.0f ) ) );
-	if( ( cosine > 0.9f && arg >= 0.0f ) ||
-		( cosine < 0.9f && arg < 0.0f ) )
-		return;
-	
-	// store the distance between at and eye position
-	atEyeDist = XMVectorGetX( XMVector3Length( movDir ) );
+	const BYTE* ptr = ( const BYTE* )data;
+	for( size_t i = 0; i < bytes; i++ )
+	{
+		hash ^= ptr[ i ];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+// van der corput's radical inverse in base 2, the second
+// coordinate of the hammersley sequence. bits of the index
+// are mirrored around the point, which gives a number in [0,1)
+static float	radicalInverse( UINT i )
+{
+	UINT bits = i;
+	bits = ( bits << 16 ) | ( bits >> 16 );
+	bits = ( ( bits & 0x55555555 ) << 1 ) | ( ( bits & 0xAAAAAAAA ) >> 1 );
+	bits = ( ( bits & 0x33333333 ) << 2 ) | ( ( bits & 0xCCCCCCCC ) >> 2 );
+	bits = ( ( bits & 0x0F0F0F0F ) << 4 ) | ( ( bits & 0xF0F0F0F0 ) >> 4 );
+	bits = ( ( bits & 0x00FF00FF ) << 8 ) | ( ( bits & 0xFF00FF00 ) >> 8 );
+	return bits * ( 1.0f / 4294967296.0f );
+}
+
+// finds the nearest of two points where the ray crosses sphere's
+// surface, ahead of the origin. if origin is inside the sphere,
+// that's the point where the ray leaves it
+bool	raySphere( const XMFLOAT3& origin, const XMFLOAT3& direction, const XMFLOAT4& sphere, float& distance )
+{
+	XMFLOAT3 oc( origin.x - sphere.x, origin.y - sphere.y, origin.z - sphere.z );
+	float a = direction.x * direction.x + direction.y * direction.y + direction.z * direction.z;
+	float b = oc.x * direction.x + oc.y * direction.y + oc.z * direction.z;
+	float c = oc.x * oc.x + oc.y * oc.y + oc.z * oc.z - sphere.w * sphere.w;
+	float discriminant = b * b - a * c;
 	
-	// operation below is explained in the respective
-	// comment section in the methods above this one.
-	movDir = XMVector3Normalize( XMVectorSetY( movDir, 0.0f ) );
-	movDir = XMVector3Cross( movDir, XMVectorSet( 0.0f, 1.0f, 0.0f, 0.0f ) );
+	if( discriminant < 0.0f )
+		return false;
 	
-	// rotate the at-eye vector around an at point,
-	// making it pointing the new eye position
-	mxRota = XMMatrixRotationAxis( movDir, arg );	
-	movDir = XMVector3TransformCoord( movDir, mxRota );
+	float root = sqrtf( discriminant );
+	distance = ( -b - root ) / a;
+	if( distance < 0.0f )
+		distance = ( -b + root ) / a;
+	return distance >= 0.0f;
+}
+
+// slab test. the ray hits the box if the furthest of its entries 
+// into three slabs comes before the nearest exit. entry is where 
+// it enters the box (zero if origin is inside)
+bool	rayBox( const XMFLOAT3& origin, const XMFLOAT3& invDirection, const XMFLOAT3& boxMin, const XMFLOAT3& boxMax, float maxDistance, float& entry )
+{
+	float x1 = ( boxMin.x - origin.x ) * invDirection.x,	x2 = ( boxMax.x - origin.x ) * invDirection.x;
+	float y1 = ( boxMin.y - origin.y ) * invDirection.y,	y2 = ( boxMax.y - origin.y ) * invDirection.y;
+	float z1 = ( boxMin.z - origin.z ) * invDirection.z,	z2 = ( boxMax.z - origin.z ) * invDirection.z;
 	
-	// find new eye position
-	vtrEye = vtrAt + atEyeDist * movDir;
+	float enter = max( max( min( x1, x2 ), min( y1, y2 ) ), max( min( z1, z2 ), 0.0f ) );
+	float leave = min( min( max( x1, x2 ), max( y1, y2 ) ), min( max( z1, z2 ), maxDistance ) );
 	
-	// store final result
-	XMStoreFloat3( &Eye, vtrEye );
+	entry = enter;
+	return enter <= leave;
 }
 
-// this method is similar to the previous one, only
-// instead of vertical rotation we employ horizontal
-// (to the viewer) rotation around at point. such
-// similarity allows us to use the same solutions
-// as in the method above. we too construct rotation
-// matrix, but this time around 0-1-0 vector.
-void	Camera::MouseLeftRight( double arg )
+// point where the ray crosses floor's plane must lie within
+// the rectangle, so its projections on both axes can't be
+// longer than the axes themselves
+bool	rayFloor( const XMFLOAT3& origin, const XMFLOAT3& direction, const FloorDesc& floor, float& distance )
 {
-	// DECLARE VARIABLES
-	XMMATRIX	mxRota;				// matrix that will help us get the final eye position
-	XMVECTOR	vtrAt, vtrEye;		// xmvector equivalents of Eye and At xmfloats
-	XMVECTOR	movDir;				// the direction on the xz plane in which camera looks
+	const XMFLOAT3& n = floor.normal;
+	float facing = direction.x * n.x + direction.y * n.y + direction.z * n.z;
+	if( facing == 0.0f )
+		return false;
 	
-	// DEFINE VARIABLES
-	vtrAt = XMLoadFloat3( &At );
-	vtrEye = XMLoadFloat3( &Eye );
+	distance = ( ( floor.centre.x - origin.x ) * n.x + ( floor.centre.y - origin.y ) * n.y + ( floor.centre.z - origin.z ) * n.z ) / facing;
+	if( distance < 0.0f )
+		return false;
 	
-	// construct the rotation matrix
-	// and rotate the at-eye vector
-	mxRota = XMMatrixRotationAxis( XMVectorSet( 0.0f, 1.0f, 0.0f, 0.0f ), arg );
-	movDir = vtrEye - vtrAt;
-	movDir = XMVector3TransformCoord( movDir, mxRota );
+	XMFLOAT3 p( origin.x + direction.x * distance - floor.centre.x, 
+		origin.y + direction.y * distance - floor.centre.y, 
+		origin.z + direction.z * distance - floor.centre.z );
+	const XMFLOAT3& l = floor.halfLength;
+	const XMFLOAT3& w = floor.halfWidth;
+	float u = p.x * l.x + p.y * l.y + p.z * l.z;
+	float v = p.x * w.x + p.y * w.y + p.z * w.z;
 	
-	// find new eye position
-	vtrEye = vtrAt + movDir;
+	return fabsf( u ) <= l.x * l.x + l.y * l.y + l.z * l.z && 
+		fabsf( v ) <= w.x * w.x + w.y * w.y + w.z * w.z;
+}
+
+// ///////////////////////////////////////////////
+// 
+// SPHERE TOPOLOGY
+// 
+// /////////////////////////////////////////
+
+// index count of a sphere of given tessellation, a triangle
+// fan at each pole and parallels - 2 squares between them, 
+// for every meridian
+#define	SPHERE_INDEX_COUNT( meridians, parallels )	( 6 * ( meridians ) * ( ( parallels ) - 1 ) )
+
+// triangles are written clockwise, with the corners given in
+// the opposite order
+TOPOLOGY_CONSTEXPR void	writeTriangle( DWORD* indices, UINT& n, UINT a, UINT b, UINT c )
+{
+	indices[ n++ ] = c;
+	indices[ n++ ] = b;
+	indices[ n++ ] = a;
+}
+
+// index buffer of buildSphereMesh's vertices: two poles, then 
+// parallels - 1 vertices of every meridian. each meridian is 
+// joined with the next one, the last with the first. indices 
+// must have room for SPHERE_INDEX_COUNT of them. it's evaluated
+// while compiling for the tables below, or at run time for 
+// other tessellations
+TOPOLOGY_CONSTEXPR void	writeSphereIndices( UINT meridians, UINT parallels, DWORD* indices )
+{
+	UINT n = 0;
+	UINT ring = parallels - 1;
+	for( UINT i = 0; i < meridians; i++ )
+	{
+		UINT	first = i * ring + 2;
+		UINT	next = ( i + 1 < meridians ? i + 1 : 0 ) * ring + 2;
+		bool	last = i + 1 == meridians;
+		
+		// the fan around the top pole (the last meridian
+		// has it after its squares, for no good reason)
+		if( !last )
+			writeTriangle( indices, n, 0, next, first );
+		
+		// two triangles for a square of every pair of parallels
+		for( UINT j = 0; j < parallels - 2; j++ )
+		{
+			writeTriangle( indices, n, first + j, next + j, next + j + 1 );
+			writeTriangle( indices, n, first + j, next + j + 1, first + j + 1 );
+		}
+		
+		if( last )
+			writeTriangle( indices, n, 0, next, first );
+		
+		// and the fan around the bottom pole. it reaches the vertex
+		// before the last of every meridian, as it always did
+		writeTriangle( indices, n, 1, first + ring - 2, next + ring - 2 );
+	}
+}
+
+// tessellations SceneGenerator uses by default (from 8 x 6 up to 
+// 32 x 24, in four levels), and 12 x 8, which suits particles.
+// their index buffers are read-only data of the executable
+#ifdef HAS_CONSTEXPR
+template< UINT Meridians, UINT Parallels >
+struct	SphereTopology
+{
+	DWORD	indices[ SPHERE_INDEX_COUNT( Meridians, Parallels ) ];
 	
-	// store final result
-	XMStoreFloat3( &Eye, vtrEye );
+	constexpr SphereTopology()
+		:	indices()
+	{
+		writeSphereIndices( Meridians, Parallels, indices );
+	}
+};
+
+static constexpr SphereTopology< 8, 6 >		sphereTopology8x6;
+static constexpr SphereTopology< 12, 8 >	sphereTopology12x8;
+static constexpr SphereTopology< 16, 12 >	sphereTopology16x12;
+static constexpr SphereTopology< 24, 18 >	sphereTopology24x18;
+static constexpr SphereTopology< 32, 24 >	sphereTopology32x24;
+
+static const struct
+{
+	UINT			meridians;
+	UINT			parallels;
+	const DWORD*	indices;
 }
+sphereTopologies[] =
+{
+	{ 8, 6, sphereTopology8x6.indices },
+	{ 12, 8, sphereTopology12x8.indices },
+	{ 16, 12, sphereTopology16x12.indices },
+	{ 24, 18, sphereTopology24x18.indices },
+	{ 32, 24, sphereTopology32x24.indices },
+};
+#endif
 
-// wsadleftright works same as mouseleftright
-// except the at point is rotated around eye.
-// so, if want any explanations, look to
-// the mouseleftright.
-void	Camera::WsadLeftRight( double arg )
+// index buffer generated while compiling, NULL if there's none
+// for this tessellation (or the compiler couldn't make them)
+const DWORD*	findSphereTopology( UINT meridians, UINT parallels )
 {
+#ifdef HAS_CONSTEXPR
+	for( UINT i = 0; i < sizeof( sphereTopologies ) / sizeof( sphereTopologies[ 0 ] ); i++ )
+		if( sphereTopologies[ i ].meridians == meridians && sphereTopologies[ i ].parallels == parallels )
+			return sphereTopologies[ i ].indices;
+#endif
+	return NULL;
+}
+
+// generates a sphere of desired radius and color and with
+// desired number of meridians and parallels. 
+// automatically generates both the set of the vertices (struct Vertex)
+// and triangle list. vectors passed are cleared first.
+// used by formSphere and by the ParticleSystem's shared mesh
+void	buildSphereMesh( UINT meridians, UINT parallels, float radius, XMFLOAT4 color, std::vector< Vertex >& vertices, std::vector< DWORD >& indices )
+{
+	vertices.clear();
+	indices.clear();
+	
+	// ////////////////////////////////////////////
 	// DECLARE VARIABLES
-	XMMATRIX	mxRota;				// matrix that will help us get the final eye position
-	XMVECTOR	vtrAt, vtrEye;		// xmvector equivalents of Eye and At xmfloats
-	XMVECTOR	movDir;				// the direction on the xz plane in which camera looks
+	// ...
+	// a temporary vertex struct which will be used
+	// to push data back into the vector. color's always
+	// the same, so it can be defined right now
+	Vertex	vx;
+	vx.Color = color;
+
+	// to keep track of which vertex we are already painting
+	// (that's necessary to find out its position and normal)
+	// we employ xmvector brush. you can think of it 
+	// travelling along the meridians and marking dots
+	// (vertices) on the right spots. right spots are
+	// computed using mAngle (meridian angle) and pAngle
+	// (parallel angle) float variables
+	XMVECTOR brush = XMVectorSet( 0.0f, radius, 0.0f, 0.0f );
+	float mAngle, pAngle;
 	
+	// ///////////////////////////////////////////////
 	// DEFINE VARIABLES
-	vtrAt = XMLoadFloat3( &At );
-	vtrEye = XMLoadFloat3( &Eye );
-	
-	// rotate the movDir
-	mxRota = XMMatrixRotationAxis( XMVectorSet( 0.0f, 1.0f, 0.0f, 0.0f ), XM_PI * veloEyeRot / fps );
-	movDir = vtrAt - vtrEye;
-	movDir = XMVector3TransformCoord( movDir, mxRota );
+	// ...
+	// define the angles
+	mAngle = 2.0f * XM_PI / ( FLOAT )meridians;
+	pAngle = XM_PI / ( FLOAT )parallels;
+
+	// set the first point. it's the "top" point of the sphere
+	// that belongs to every parallel (and starts it in fact)
+	XMStoreFloat3( &vx.Pos, brush );
+	XMStoreFloat3( &vx.Norm, XMVector3Normalize( brush ) );
+	vertices.push_back( vx );
+
+	// and set the "last" point. it ends every parallel
+	XMStoreFloat3( &vx.Pos, -brush );
+	XMStoreFloat3( &vx.Norm, XMVector3Normalize( -brush ) );
+	vertices.push_back( vx );
+
+	// ///////////////////////////////////////////
+	// SET THE VERTICES VECTOR
+	// ...
+	// the first meridian (on the yz plane) is marked by the brush
+	// rotated around x axis by pAngle for every vertex, from the
+	// second one down to the one before the last. its coordinates
+	// are kept in separate arrays, for the transform kernels
+	UINT					profileSize = parallels - 1;
+	std::vector< float >	profile( 9 * profileSize );
+	float*					profileX = &profile[ 0 ];
+	float*					profileY = profileX + profileSize;
+	float*					profileZ = profileY + profileSize;
+	float*					posX = profileZ + profileSize;
+	float*					posY = posX + profileSize;
+	float*					posZ = posY + profileSize;
+	float*					normX = posZ + profileSize;
+	float*					normY = normX + profileSize;
+	float*					normZ = normY + profileSize;
 	
-	// find new eye position
-	vtrAt = vtrEye + movDir;
+	for( unsigned int j = 0; j < profileSize; j++ )
+	{
+		profileX[ j ] = 0.0f;
+		profileY[ j ] = radius * cosf( pAngle * ( j + 1 ) );
+		profileZ[ j ] = radius * sinf( pAngle * ( j + 1 ) );
+	}
 	
-	// store final result
-	XMStoreFloat3( &At, vtrAt );
-}
+	// every meridian is the first one retorsed on the xz plane by
+	// the right angle. normals are rotated the same way, and come
+	// out normalized, since the sphere's centre is the 0 point
+	vertices.reserve( 2 + meridians * profileSize );
+	for( unsigned int i = 0; i < meridians; i++ )
+	{
+		XMMATRIX rotation = XMMatrixRotationY( mAngle * i );
+		transformPoints( profileX, profileY, profileZ, profileSize, rotation, posX, posY, posZ );
+		transformNormals( profileX, profileY, profileZ, profileSize, rotation, normX, normY, normZ );
+		
+		for( unsigned int j = 0; j < profileSize; j++ )
+		{
+			vx.Pos = XMFLOAT3( posX[ j ], posY[ j ], posZ[ j ] );
+			vx.Norm = XMFLOAT3( normX[ j ], normY[ j ], normZ[ j ] );
+			vertices.push_back( vx );
+		}
+	}
 
-// returns view matrix
-XMMATRIX	Camera::GetView()
-{
-	return XMMatrixLookAtLH( 
-		XMLoadFloat3( &Eye ), 		// eye or camera position. point where view frustum begins
-		XMLoadFloat3( &At ), 		// point which camera is focusing on
-		XMLoadFloat3( &Up ) );		// world's up direction
+	// ///////////////////////////////////////////////
+	// SET THE INDICES VECTOR
+	// ...
+	// indices depend on the tessellation only, so common
+	// ones are just copied from the tables made while
+	// compiling. others are generated the same way now
+	const DWORD* topology = findSphereTopology( meridians, parallels );
+	indices.resize( SPHERE_INDEX_COUNT( meridians, parallels ) );
+	if( topology )
+		memcpy( &indices[ 0 ], topology, indices.size() * sizeof( DWORD ) );
+	else writeSphereIndices( meridians, parallels, &indices[ 0 ] );
 }
 
-// returns projection matrix
-XMMATRIX	Camera::GetProjection()
+// sphere is visible unless it lies entirely behind
+// any of the planes (see Camera::GetFrustumPlanes)
+bool	sphereInFrustum( const XMFLOAT4* planes, const XMFLOAT4& sphere )
 {
-	return XMMatrixPerspectiveFovLH( 
-		FoV, 						// field of view in radians
-		ScreenRatio, 				// ratio between the width and height of a client rectancgle
-		0.1f, 						// distance to the near clipping plane
-		100.0f );					// distance to the far clipping plane
+	for( UINT i = 0; i < 6; i++ )
+		if( planes[ i ].x * sphere.x + planes[ i ].y * sphere.y + planes[ i ].z * sphere.z + planes[ i ].w < -sphere.w )
+			return false;
+	return true;
 }
 
-// returns eye position. 
-XMFLOAT4	Camera::GetEyePos()
+// for every plane only two corners of the box matter - the one
+// furthest along plane's normal, and the one furthest against it.
+// if the first is behind the plane, so is the whole box. if only
+// the second is, the box crosses the plane
+int		boxInFrustum( const XMFLOAT4* planes, const XMFLOAT3& boxMin, const XMFLOAT3& boxMax )
 {
-	return XMFLOAT4( Eye.x, Eye.y, Eye.z, 0.0f );
+	int result = FRUSTUM_INSIDE;
+	for( UINT i = 0; i < 6; i++ )
+	{
+		const XMFLOAT4& p = planes[ i ];
+		float front = p.x * ( p.x > 0.0f ? boxMax.x : boxMin.x ) + p.y * ( p.y > 0.0f ? boxMax.y : boxMin.y ) + p.z * ( p.z > 0.0f ? boxMax.z : boxMin.z ) + p.w;
+		float back = p.x * ( p.x > 0.0f ? boxMin.x : boxMax.x ) + p.y * ( p.y > 0.0f ? boxMin.y : boxMax.y ) + p.z * ( p.z > 0.0f ? boxMin.z : boxMax.z ) + p.w;
+		if( front < 0.0f )
+			return FRUSTUM_OUTSIDE;
+		if( back < 0.0f )
+			result = FRUSTUM_PARTIAL;
+	}
+	return result;
 }
 
-// ////////////////////////////////////////////////
 // ///////////////////////////////////////////////
 // //////////////////////////////////////////////
 // 
-// OBJECT3D	:	METHODS, CONSTRUCTORS AND OPERATORS DEFINITIONS
+// TRANSFORM KERNELS
 // 
 // /////////////////////////////////////////
-// ////////////////////////////////////////
-// ///////////////////////////////////////
 
-// main constructor of the Object3D class
-// (default was disabled)
-Object3D::Object3D( 
-	ID3D10Device* pd3dDevice, 	// pointer to the device that will create buffers
-	void* vertices, 			// pointer to the array of Vertex structure in which we store the grid
-	DWORD* indices, 			// indices defining the triangles of that grid
-	UINT _vSize, 				// size of both arrays
-	UINT _iSize )
+// points and normals given to the kernels below are laid out SoA,
+// their x, y and z coordinates in separate arrays. so a single
+// instruction does the same coordinate of 16, 8 or 4 points,
+// depending on the widest vectors the compiler may use: AVX-512, 
+// AVX2, otherwise xnamath's (SSE). whatever doesn't fill the 
+// vector is done one by one. output arrays may be the input ones.
+// matrices are used as xnamath does, points being row vectors
+
+#if defined( __AVX512F__ )
+#define	TRANSFORM_LANES				16
+typedef __m512						TransformLanes;
+#define	LANES_LOAD( ptr )			_mm512_loadu_ps( ptr )
+#define	LANES_STORE( ptr, v )		_mm512_storeu_ps( ptr, v )
+#define	LANES_SET( f )				_mm512_set1_ps( f )
+#define	LANES_MADD( a, b, c )		_mm512_fmadd_ps( a, b, c )
+#define	LANES_MUL( a, b )			_mm512_mul_ps( a, b )
+#define	LANES_DIV( a, b )			_mm512_div_ps( a, b )
+#define	LANES_SQRT( a )				_mm512_sqrt_ps( a )
+#elif defined( __AVX2__ )
+#define	TRANSFORM_LANES				8
+typedef __m256						TransformLanes;
+#define	LANES_LOAD( ptr )			_mm256_loadu_ps( ptr )
+#define	LANES_STORE( ptr, v )		_mm256_storeu_ps( ptr, v )
+#define	LANES_SET( f )				_mm256_set1_ps( f )
+#if defined( __FMA__ )
+#define	LANES_MADD( a, b, c )		_mm256_fmadd_ps( a, b, c )
+#else
+#define	LANES_MADD( a, b, c )		_mm256_add_ps( _mm256_mul_ps( a, b ), c )	// FMA is a separate extension
+#endif
+#define	LANES_MUL( a, b )			_mm256_mul_ps( a, b )
+#define	LANES_DIV( a, b )			_mm256_div_ps( a, b )
+#define	LANES_SQRT( a )				_mm256_sqrt_ps( a )
+#else
+#define	TRANSFORM_LANES				4
+typedef XMVECTOR					TransformLanes;
+#define	LANES_LOAD( ptr )			XMLoadFloat4( ( const XMFLOAT4* )( ptr ) )
+#define	LANES_STORE( ptr, v )		XMStoreFloat4( ( XMFLOAT4* )( ptr ), v )
+#define	LANES_SET( f )				XMVectorReplicate( f )
+#define	LANES_MADD( a, b, c )		XMVectorMultiplyAdd( a, b, c )
+#define	LANES_MUL( a, b )			XMVectorMultiply( a, b )
+#define	LANES_DIV( a, b )			XMVectorDivide( a, b )
+#define	LANES_SQRT( a )				XMVectorSqrt( a )
+#endif
+
+// affine transform, there's no division by w
+void	transformPoints( const float* x, const float* y, const float* z, UINT count, CXMMATRIX matrix, float* outX, float* outY, float* outZ )
+{
+	XMFLOAT4X4	m;
+	UINT		i = 0;
+	XMStoreFloat4x4( &m, matrix );
 	
-	:	vSize( _vSize ), iSize( _iSize ),
-		stride( sizeof( Vertex ) ), offset( 0 )
+	TransformLanes	m11 = LANES_SET( m._11 ), m12 = LANES_SET( m._12 ), m13 = LANES_SET( m._13 );
+	TransformLanes	m21 = LANES_SET( m._21 ), m22 = LANES_SET( m._22 ), m23 = LANES_SET( m._23 );
+	TransformLanes	m31 = LANES_SET( m._31 ), m32 = LANES_SET( m._32 ), m33 = LANES_SET( m._33 );
+	TransformLanes	m41 = LANES_SET( m._41 ), m42 = LANES_SET( m._42 ), m43 = LANES_SET( m._43 );
+	
+	for( ; i + TRANSFORM_LANES <= count; i += TRANSFORM_LANES )
+	{
+		TransformLanes vx = LANES_LOAD( x + i ), vy = LANES_LOAD( y + i ), vz = LANES_LOAD( z + i );
+		LANES_STORE( outX + i, LANES_MADD( vx, m11, LANES_MADD( vy, m21, LANES_MADD( vz, m31, m41 ) ) ) );
+		LANES_STORE( outY + i, LANES_MADD( vx, m12, LANES_MADD( vy, m22, LANES_MADD( vz, m32, m42 ) ) ) );
+		LANES_STORE( outZ + i, LANES_MADD( vx, m13, LANES_MADD( vy, m23, LANES_MADD( vz, m33, m43 ) ) ) );
+	}
+	
+	for( ; i < count; i++ )
+	{
+		float px = x[ i ], py = y[ i ], pz = z[ i ];
+		outX[ i ] = px * m._11 + py * m._21 + pz * m._31 + m._41;
+		outY[ i ] = px * m._12 + py * m._22 + pz * m._32 + m._42;
+		outZ[ i ] = px * m._13 + py * m._23 + pz * m._33 + m._43;
+	}
+}
+
+// normals are transformed by the upper 3x3 part of the matrix, 
+// and normalized again. with non-uniform scaling pass the
+// inverse transpose of the matrix the points were transformed by
+void	transformNormals( const float* x, const float* y, const float* z, UINT count, CXMMATRIX matrix, float* outX, float* outY, float* outZ )
 {
-	// declare variables
-	HRESULT hr = S_OK;
-	D3D10_BUFFER_DESC bd;
-	ZeroMemory( &bd, sizeof( bd ) );
+	XMFLOAT4X4	m;
+	UINT		i = 0;
+	XMStoreFloat4x4( &m, matrix );
+	
+	TransformLanes	m11 = LANES_SET( m._11 ), m12 = LANES_SET( m._12 ), m13 = LANES_SET( m._13 );
+	TransformLanes	m21 = LANES_SET( m._21 ), m22 = LANES_SET( m._22 ), m23 = LANES_SET( m._23 );
+	TransformLanes	m31 = LANES_SET( m._31 ), m32 = LANES_SET( m._32 ), m33 = LANES_SET( m._33 );
+	TransformLanes	one = LANES_SET( 1.0f );
+	
+	for( ; i + TRANSFORM_LANES <= count; i += TRANSFORM_LANES )
+	{
+		TransformLanes vx = LANES_LOAD( x + i ), vy = LANES_LOAD( y + i ), vz = LANES_LOAD( z + i );
+		TransformLanes nx = LANES_MADD( vx, m11, LANES_MADD( vy, m21, LANES_MUL( vz, m31 ) ) );
+		TransformLanes ny = LANES_MADD( vx, m12, LANES_MADD( vy, m22, LANES_MUL( vz, m32 ) ) );
+		TransformLanes nz = LANES_MADD( vx, m13, LANES_MADD( vy, m23, LANES_MUL( vz, m33 ) ) );
+		TransformLanes inverse = LANES_DIV( one, LANES_SQRT( LANES_MADD( nx, nx, LANES_MADD( ny, ny, LANES_MUL( nz, nz ) ) ) ) );
+		LANES_STORE( outX + i, LANES_MUL( nx, inverse ) );
+		LANES_STORE( outY + i, LANES_MUL( ny, inverse ) );
+		LANES_STORE( outZ + i, LANES_MUL( nz, inverse ) );
+	}
+	
+	for( ; i < count; i++ )
+	{
+		float px = x[ i ], py = y[ i ], pz = z[ i ];
+		float nx = px * m._11 + py * m._21 + pz * m._31;
+		float ny = px * m._12 + py * m._22 + pz * m._32;
+		float nz = px * m._13 + py * m._23 + pz * m._33;
+		float inverse = 1.0f / sqrtf( nx * nx + ny * ny + nz * nz );
+		outX[ i ] = nx * inverse;
+		outY[ i ] = ny * inverse;
+		outZ[ i ] = nz * inverse;
+	}
+}
 
-	// prepare vertex buffer
-	bd.Usage = D3D10_USAGE_DEFAULT;
-	bd.ByteWidth = sizeof( Vertex ) * vSize;
-	bd.BindFlags = D3D10_BIND_VERTEX_BUFFER;
-	bd.CPUAccessFlags = 0;
-	bd.MiscFlags = 0;
+// full 4x4 transform followed by the perspective divide, e.g. by
+// the view-projection matrix into normalized device coordinates.
+// outW gets w before the divide (negative behind the camera),
+// it may be NULL
+void	projectPoints( const float* x, const float* y, const float* z, UINT count, CXMMATRIX matrix, float* outX, float* outY, float* outZ, float* outW )
+{
+	XMFLOAT4X4	m;
+	UINT		i = 0;
+	XMStoreFloat4x4( &m, matrix );
+	
+	TransformLanes	m11 = LANES_SET( m._11 ), m12 = LANES_SET( m._12 ), m13 = LANES_SET( m._13 ), m14 = LANES_SET( m._14 );
+	TransformLanes	m21 = LANES_SET( m._21 ), m22 = LANES_SET( m._22 ), m23 = LANES_SET( m._23 ), m24 = LANES_SET( m._24 );
+	TransformLanes	m31 = LANES_SET( m._31 ), m32 = LANES_SET( m._32 ), m33 = LANES_SET( m._33 ), m34 = LANES_SET( m._34 );
+	TransformLanes	m41 = LANES_SET( m._41 ), m42 = LANES_SET( m._42 ), m43 = LANES_SET( m._43 ), m44 = LANES_SET( m._44 );
+	TransformLanes	one = LANES_SET( 1.0f );
+	
+	for( ; i + TRANSFORM_LANES <= count; i += TRANSFORM_LANES )
+	{
+		TransformLanes vx = LANES_LOAD( x + i ), vy = LANES_LOAD( y + i ), vz = LANES_LOAD( z + i );
+		TransformLanes w = LANES_MADD( vx, m14, LANES_MADD( vy, m24, LANES_MADD( vz, m34, m44 ) ) );
+		TransformLanes inverse = LANES_DIV( one, w );
+		LANES_STORE( outX + i, LANES_MUL( LANES_MADD( vx, m11, LANES_MADD( vy, m21, LANES_MADD( vz, m31, m41 ) ) ), inverse ) );
+		LANES_STORE( outY + i, LANES_MUL( LANES_MADD( vx, m12, LANES_MADD( vy, m22, LANES_MADD( vz, m32, m42 ) ) ), inverse ) );
+		LANES_STORE( outZ + i, LANES_MUL( LANES_MADD( vx, m13, LANES_MADD( vy, m23, LANES_MADD( vz, m33, m43 ) ) ), inverse ) );
+		if( outW )
+			LANES_STORE( outW + i, w );
+	}
+	
+	for( ; i < count; i++ )
+	{
+		float px = x[ i ], py = y[ i ], pz = z[ i ];
+		float w = px * m._14 + py * m._24 + pz * m._34 + m._44;
+		outX[ i ] = ( px * m._11 + py * m._21 + pz * m._31 + m._41 ) / w;
+		outY[ i ] = ( px * m._12 + py * m._22 + pz * m._32 + m._42 ) / w;
+		outZ[ i ] = ( px * m._13 + py * m._23 + pz * m._33 + m._43 ) / w;
+		if( outW )
+			outW[ i ] = w;
+	}
+}
 
-	D3D10_SUBRESOURCE_DATA InitData;
-	InitData.pSysMem = vertices;
+// ///////////////////////////////////////////////
+// //////////////////////////////////////////////
+// 
+// ALLOCATION TRACKING
+// 
+// /////////////////////////////////////////
 
-	// store the actual buffer pointer and run CreateDevice method
-	hr = pd3dDevice->CreateBuffer( &bd, &InitData, &vBuffer );
-	if( FAILED( hr ) )
-		ERRORMACRO( L"Object construction failed. Unable to create vertex buffer" );
+// counters are kept as plain thread local integers, since
+// __declspec( thread ) variables cannot have constructors.
+// process wide counters are shared, so they're updated
+// with interlocked functions.
+static __declspec( thread )	UINT64	tlsAllocations	= 0;
+static __declspec( thread )	UINT64	tlsFrees		= 0;
+static __declspec( thread )	UINT64	tlsBytes		= 0;
 
-	// prepare index buffer
-	bd.Usage = D3D10_USAGE_DEFAULT;
-	bd.ByteWidth = sizeof( DWORD ) * iSize;
-	bd.BindFlags = D3D10_BIND_INDEX_BUFFER;
-	bd.CPUAccessFlags = 0;
-	bd.MiscFlags = 0;
-	InitData.pSysMem = indices;
+static volatile LONGLONG	processAllocations	= 0;
+static volatile LONGLONG	processFrees		= 0;
+static volatile LONGLONG	processBytes		= 0;
 
-	// store the actual buffer pointer and run CreateDevice method
-	hr = pd3dDevice->CreateBuffer( &bd, &InitData, &iBuffer );
-	if( FAILED( hr ) )
-		ERRORMACRO( L"Object construction failed. Unable to create index buffer" );
+// returns the counter of the calling thread
+AllocationCounter	getThreadAllocations()
+{
+	AllocationCounter	counter;
+	counter.allocations = tlsAllocations;
+	counter.frees = tlsFrees;
+	counter.bytes = tlsBytes;
+	return counter;
 }
 
-// copy constructor
-// copies the stuff that can be copied,
-// then copies buffers pointers and increase
-// their uses count
-Object3D::Object3D( const Object3D& o3d )
-	:	vSize( o3d.vSize ), 
-		iSize( o3d.iSize ),
-		stride( o3d.stride ), 
-		offset( o3d.offset )
+// returns the counter shared by all threads of the process
+AllocationCounter	getProcessAllocations()
 {
-	// assign the buffers
-	vBuffer = o3d.vBuffer;
-	iBuffer = o3d.iBuffer;
-	
-	// increment the buffers uses count
-	o3d.vBuffer->AddRef();
-	o3d.iBuffer->AddRef();
+	AllocationCounter	counter;
+	counter.allocations = processAllocations;
+	counter.frees = processFrees;
+	counter.bytes = processBytes;
+	return counter;
 }
 
-// assigment operator. works similar to the 
-// copy constructor. assign buffers pointers
-// then increases uses count.
-Object3D&	Object3D::operator=( const Object3D& o3d )
+#ifdef TRACK_ALLOCATIONS
+// the hook itself. replacing global new and delete operators
+// catches every allocation made by standard containers, 
+// shared_ptrs' control blocks and our own objects. it's
+// optional, since counting costs a bit, so enable it only
+// when looking for hidden allocations
+void*	operator new( size_t size )
 {
-	if( this != &o3d )
-	{
-		// release the left operand's buffers
-		vBuffer->Release();
-		iBuffer->Release();
-		
-		// assign everything
-		vSize = o3d.vSize; 
-		iSize = o3d.iSize;
-		stride = o3d.stride; 
-		offset = o3d.offset;
-		
-		// assign the buffers
-		vBuffer = o3d.vBuffer;
-		iBuffer = o3d.iBuffer;
-		
-		// increment the buffers uses count
-		o3d.vBuffer->AddRef();
-		o3d.iBuffer->AddRef();
-
-		return *this;
-	}
+	void*	ptr = malloc( size ? size : 1 );
+	if( ptr == NULL )
+		throw std::bad_alloc();
+	
+	tlsAllocations++;
+	tlsBytes += size;
+	InterlockedIncrement64( &processAllocations );
+	InterlockedExchangeAdd64( &processBytes, size );
+	return ptr;
 }
 
-// destructor. 
-Object3D::~Object3D()
+void*	operator new( size_t size, const std::nothrow_t& ) throw()
 {
-	vBuffer->Release();
-	iBuffer->Release();
+	void*	ptr = malloc( size ? size : 1 );
+	if( ptr == NULL )
+		return NULL;
+	
+	tlsAllocations++;
+	tlsBytes += size;
+	InterlockedIncrement64( &processAllocations );
+	InterlockedExchangeAdd64( &processBytes, size );
+	return ptr;
 }
 
-// function draws the object on the scene using provided device
-void	Object3D::Draw( 
-	ID3D10Device* pd3dDevice, 		// pointer to the device that will do the actual work
-	ID3D10EffectTechnique* Tech )	// pointer to the technique that needs to be used
+void	operator delete( void* ptr ) throw()
 {
-	// Variables
-	D3D10_TECHNIQUE_DESC techDesc;
-
-	// get vertex buffer and pass it into a device
-	pd3dDevice->IASetVertexBuffers( 0, 1, &vBuffer, &stride, &offset );
-
-	// set index buffer
-	pd3dDevice->IASetIndexBuffer( iBuffer, DXGI_FORMAT_R32_UINT, 0 );
+	if( ptr == NULL )
+		return;
 	
-	Tech->GetDesc( &techDesc );	
-	for( UINT p = 0; p < techDesc.Passes; ++p )
-	{
-		Tech->GetPassByIndex( p )->Apply( 0 );
-		pd3dDevice->DrawIndexed( iSize, 0, 0 );
-	}
+	tlsFrees++;
+	InterlockedIncrement64( &processFrees );
+	free( ptr );
 }
 
+// array and nothrow versions just forward to the ones above
+void*	operator new[]( size_t size )									{	return operator new( size );	}
+void*	operator new[]( size_t size, const std::nothrow_t& nt ) throw()	{	return operator new( size, nt );	}
+void	operator delete[]( void* ptr ) throw()							{	operator delete( ptr );	}
+void	operator delete( void* ptr, const std::nothrow_t& ) throw()		{	operator delete( ptr );	}
+void	operator delete[]( void* ptr, const std::nothrow_t& ) throw()	{	operator delete( ptr );	}
+#endif
+
 // ///////////////////////////////////////////////
 // //////////////////////////////////////////////
 // 
-// REMAINING PROCEDURES DEFINITIONS
+// BENCHMARK SUITE
 // 
 // /////////////////////////////////////////
 
-// given two vectors and a third vector direction, function 
-// creates a matrix describing a 3-dimensional carthesian
-// space with the xVec and yVec being its x and y axes
-XMMATRIX	getSpaceMatrix( XMFLOAT3 xVec, XMFLOAT3 yVec, bool dirZ )
+#ifdef BENCHMARK_SUITE
+
+// number of frames painted per measurement
+#define	BENCHMARK_FRAMES	16
+
+// writes a single row of results. columns are separated by
+// tabs, so the output can be pasted straight into a spreadsheet.
+// rows which aren't times say what their value counts
+static void	benchmarkValueRow( std::wostream& out, LPCWSTR subsystem, UINT count, double value, LPCWSTR unit )
 {
-	XMVECTOR	bongo, xDir, yDir, zDir;
-	xDir = XMLoadFloat3( &xVec );
-	yDir = XMLoadFloat3( &yVec );
-	if( dirZ )	
-		zDir = XMVector3Cross( xDir, yDir );
-	else zDir = XMVector3Cross( yDir, xDir );
-	return XMMatrixInverse( &bongo, 
-		XMMATRIX( xDir, yDir, zDir, XMVectorSet( 0.0f, 0.0f, 0.0f, 1.0f ) ) );
-}
\ No newline at end of file
+	out << subsystem << L"\t" << count << L"\t" << value << L" " << unit << std::endl;
+}
+
+static void	benchmarkRow( std::wostream& out, LPCWSTR subsystem, UINT count, double ms )
+{
+	benchmarkValueRow( out, subsystem, count, ms, L"ms" );
+}
+
+// results of the measured loops are stored here, so the 
+// compiler can't throw away the work nobody looks at
+static volatile float	benchmarkSink;
+
+// generates scenes of 10, 1k, 100k and 1M spheres, then
+// measures how long every subsystem takes for each of them.
+// Mateyko must be initialized, and have Camera, ShaderInput
+// and Space already bound. the scene is left empty afterwards
+void	runSceneBenchmarks( Mateyko& mat, Space& spa, SceneDistribution distribution, std::wostream& out )
+{
+	const UINT		sizes[] = { 10, 1000, 100000, 1000000 };
+	PreciseTimer	timer;
+	SceneDesc		desc;
+	
+	desc.distribution = distribution;
+	out << L"subsystem\tobjects\ttime" << std::endl;
+	
+	for( UINT s = 0; s < ARRAYSIZE( sizes ); s++ )
+	{
+		// make the scene bigger along with the number of spheres,
+		// so its density stays more or less the same
+		desc.count = sizes[ s ];
+		desc.extent = 2.0f * pow( ( float )sizes[ s ], 1.0f / 3.0f ) + 5.0f;
+		desc.height = desc.extent * 0.5f;
+		desc.floorSize = 2.0f * desc.extent;
+		SceneGenerator	generator( desc );
+		
+		// scene generation
+		timer.Restart();
+		generator.Populate( mat, spa );
+		benchmarkRow( out, L"generate", desc.count, timer.GetMilliseconds() );
+		
+		// painting. the first frame is not measured, 
+		// it fills the caches and the driver's queues
+		mat.PaintScene();
+		timer.Restart();
+		for( UINT f = 0; f < BENCHMARK_FRAMES; f++ )
+			mat.PaintScene();
+		benchmarkRow( out, L"paint", desc.count, timer.GetMilliseconds() / BENCHMARK_FRAMES );
+		
+		// snapshot round trip
+		timer.Restart();
+		mat.SaveScene( L"benchmark.snapshot" );
+		benchmarkRow( out, L"snapshot save", desc.count, timer.GetMilliseconds() );
+		
+		timer.Restart();
+		mat.LoadScene( L"benchmark.snapshot" );
+		benchmarkRow( out, L"snapshot load", desc.count, timer.GetMilliseconds() );
+		
+		// scene versions. capturing copies the whole scene, 
+		// but a single edit should cost the same for all sizes
+		{
+			SceneVersionStore	versions;
+			timer.Restart();
+			versions.Capture( mat, spa );
+			benchmarkRow( out, L"version capture", desc.count, timer.GetMilliseconds() );
+			
+			timer.Restart();
+			for( UINT e = 0; e < BENCHMARK_FRAMES; e++ )
+				versions.Recolor( ( e * 7919 ) % desc.count, XMFLOAT4( 1.0f, 0.0f, 0.0f, 1.0f ) );
+			benchmarkRow( out, L"version edit", desc.count, timer.GetMilliseconds() / BENCHMARK_FRAMES );
+			
+			mat.BindSceneVersions( &versions );
+			mat.PaintScene();
+			timer.Restart();
+			for( UINT f = 0; f < BENCHMARK_FRAMES; f++ )
+				mat.PaintScene();
+			benchmarkRow( out, L"paint version", desc.count, timer.GetMilliseconds() / BENCHMARK_FRAMES );
+			mat.BindSceneVersions( NULL );
+		}
+		
+		// broadphase. the first query sorts all the spheres, 
+		// later ones only fix the order after spheres moved
+		// a little (moving itself isn't measured)
+		{
+			timer.Restart();
+			spa.FindOverlaps();
+			benchmarkRow( out, L"overlaps first", desc.count, timer.GetMilliseconds() );
+			
+			double	total = 0.0;
+			for( UINT f = 0; f < BENCHMARK_FRAMES; f++ )
+			{
+				for( UINT i = 0; i < spa.size(); i++ )
+				{
+					XMFLOAT4 sphere = spa.GetSphere( i );
+					float step = ( ( i + f ) & 1 ) ? 0.05f : -0.05f;
+					spa.SetPosition( i, XMFLOAT3( sphere.x + step, sphere.y, sphere.z - step ) );
+				}
+				timer.Restart();
+				spa.FindOverlaps();
+				total += timer.GetMilliseconds();
+			}
+			benchmarkRow( out, L"overlaps moving", desc.count, total / BENCHMARK_FRAMES );
+		}
+		
+		// spatial grid, built anew every frame
+		{
+			SpatialGrid		grid;
+			timer.Restart();
+			for( UINT f = 0; f < BENCHMARK_FRAMES; f++ )
+				grid.Build( spa );
+			benchmarkRow( out, L"grid build", desc.count, timer.GetMilliseconds() / BENCHMARK_FRAMES );
+			
+			std::vector< SpherePair >	pairs;
+			timer.Restart();
+			grid.FindOverlaps( pairs );
+			benchmarkRow( out, L"grid overlaps", desc.count, timer.GetMilliseconds() );
+		}
+		
+		// ray picking. the tree is built once, then the whole
+		// client rectangle is picked in a coarse grid of pixels.
+		// both pick rows are in milliseconds per single pick, the
+		// one without the tree picks only 16 pixels of the diagonal
+		{
+			SphereBVH	bvh;
+			UINT		width, height, picks = 0;
+			
+			timer.Restart();
+			bvh.Build( spa );
+			benchmarkRow( out, L"bvh build", desc.count, timer.GetMilliseconds() );
+			
+			mat.BindBVH( &bvh );
+			mat.GetClientRectSize( width, height );
+			timer.Restart();
+			for( UINT y = 0; y < height; y += 16 )
+				for( UINT x = 0; x < width; x += 16, picks++ )
+					mat.Pick( x, y );
+			benchmarkRow( out, L"pick", desc.count, timer.GetMilliseconds() / max( picks, 1u ) );
+			mat.BindBVH( NULL );
+			
+			timer.Restart();
+			for( UINT i = 0; i < 16; i++ )
+				mat.Pick( i * width / 16, i * height / 16 );
+			benchmarkRow( out, L"pick without bvh", desc.count, timer.GetMilliseconds() / 16 );
+			
+			// shadow rays from a 256 x 256 grid on the ground towards
+			// a light high above. traced as closest hit, as any hit,
+			// and as any hit with an occluder cached for every 8 x 8 
+			// tile of the grid. steps per ray of every pass, the number
+			// of blocked rays and cache hits are written after the times
+			TraversalStats	closest, any, cached;
+			XMFLOAT3		light( 0.0f, 4.0f * desc.height, 0.0f );
+			RayHit			hit;
+			UINT			blocked = 0;
+			
+			for( UINT pass = 0; pass < 3; pass++ )
+			{
+				TraversalStats*	stats = pass == 0 ? &closest : pass == 1 ? &any : &cached;
+				timer.Restart();
+				for( UINT tile = 0; tile < 32 * 32; tile++ )
+				{
+					UINT occluder = NO_OBJECT;
+					for( UINT t = 0; t < 64; t++ )
+					{
+						float		x = ( ( tile % 32 ) * 8 + t % 8 ) / 128.0f - 1.0f;
+						float		z = ( ( tile / 32 ) * 8 + t / 8 ) / 128.0f - 1.0f;
+						XMFLOAT3	origin( x * desc.extent, -1.0f, z * desc.extent );
+						XMFLOAT3	direction( light.x - origin.x, light.y - origin.y, light.z - origin.z );
+						
+						if( pass == 0 )
+							bvh.Intersect( origin, direction, 1.0f, hit, stats );
+						else
+						{
+							if( pass == 1 )
+								occluder = NO_OBJECT;
+							if( bvh.Occluded( origin, direction, 1.0f, occluder, stats ) && pass == 2 )
+								blocked++;
+						}
+					}
+				}
+				benchmarkRow( out, pass == 0 ? L"shadow closest" : pass == 1 ? L"shadow any" : L"shadow cached", 256 * 256, timer.GetMilliseconds() );
+			}
+			benchmarkValueRow( out, L"shadow closest steps", 256 * 256, closest.GetStepsPerRay(), L"per ray" );
+			benchmarkValueRow( out, L"shadow any steps", 256 * 256, any.GetStepsPerRay(), L"per ray" );
+			benchmarkValueRow( out, L"shadow cached steps", 256 * 256, cached.GetStepsPerRay(), L"per ray" );
+			benchmarkValueRow( out, L"shadow blocked", 256 * 256, blocked, L"rays" );
+			benchmarkValueRow( out, L"shadow cache hits", 256 * 256, ( double )cached.cacheHits, L"hits" );
+		}
+		
+		// batched line of sight queries, from a point above the
+		// scene to every sphere (at most 64k of them). the first
+		// batch builds the tree, so the second one is measured
+		{
+			RayQueries				queries;
+			std::vector< RayQuery >	rays( min( desc.count, 65536u ) );
+			FloorDesc				floor;
+			bool					hasFloor = mat.GetFloor( floor );
+			UINT					count;
+			
+			for( UINT i = 0; i < rays.size(); i++ )
+			{
+				XMFLOAT4 sphere = spa.GetSphere( i );
+				rays[ i ].origin = XMFLOAT3( 0.0f, 2.0f * desc.height, 0.0f );
+				rays[ i ].direction = XMFLOAT3( sphere.x, sphere.y - 2.0f * desc.height, sphere.z );
+				rays[ i ].maxDistance = 1.0f;
+				rays[ i ].flags = RAY_ANY_HIT;
+			}
+			
+			queries.Submit( rays.data(), rays.size() );
+			queries.Kick( spa, hasFloor ? &floor : NULL );
+			queries.GetResults( count );
+			
+			timer.Restart();
+			queries.Submit( rays.data(), rays.size() );
+			queries.Kick( spa, hasFloor ? &floor : NULL );
+			queries.GetResults( count );
+			benchmarkRow( out, L"ray queries", count, timer.GetMilliseconds() );
+		}
+		
+		// floor lightmap, baked whole, then again after 
+		// a handful of spheres moved a little. spheres are
+		// moved in a copy, the scene stays as it was
+		{
+			JobSystem		jobs;
+			FloorLightmap	lightmap;
+			FloorDesc		floor;
+			Space			moved;
+			
+			if( mat.GetFloor( floor ) )
+			{
+				moved.SetSpheres( ( const XMFLOAT4* )spa.GetShaderPositionArray(), spa.size() );
+				lightmap.BindJobs( &jobs );
+				timer.Restart();
+				UINT texels = lightmap.Update( moved, floor );
+				benchmarkRow( out, L"lightmap bake", texels, timer.GetMilliseconds() );
+				
+				for( UINT i = 0; i < min( moved.size(), 8u ); i++ )
+				{
+					XMFLOAT4 sphere = moved.GetSphere( i );
+					moved.SetPosition( i, XMFLOAT3( sphere.x + 0.1f, sphere.y, sphere.z ) );
+				}
+				timer.Restart();
+				texels = lightmap.Update( moved, floor );
+				benchmarkRow( out, L"lightmap update", texels, timer.GetMilliseconds() );
+			}
+		}
+		
+		// transform hierarchy. all the spheres are attached to
+		// a single group, then the group is moved every frame
+		{
+			UINT group = spa.CreateNode( NO_NODE, XMMatrixIdentity() );
+			for( UINT i = 0; i < spa.size(); i++ )
+			{
+				XMFLOAT4 sphere = spa.GetSphere( i );
+				spa.AttachSphere( i, spa.CreateNode( group, XMMatrixTranslation( sphere.x, sphere.y, sphere.z ) ) );
+			}
+			spa.UpdateTransforms();
+			
+			timer.Restart();
+			for( UINT f = 0; f < BENCHMARK_FRAMES; f++ )
+			{
+				spa.SetLocal( group, XMMatrixTranslation( 0.0f, 0.01f * f, 0.0f ) );
+				spa.UpdateTransforms();
+			}
+			benchmarkRow( out, L"group move", desc.count, timer.GetMilliseconds() / BENCHMARK_FRAMES );
+			spa.RemoveNode( group );
+		}
+		
+		// keyframe animation, two position keys and two color 
+		// keys per object, evaluated at new time every frame
+		{
+			JobSystem		jobs;
+			AnimationSet	anim;
+			anim.BindJobs( &jobs );
+			for( UINT i = 0; i < spa.size(); i++ )
+			{
+				XMFLOAT4	sphere = spa.GetSphere( i );
+				float		times[ 2 ] = { 0.0f, 1.0f };
+				XMFLOAT4	positions[ 2 ] = { sphere, XMFLOAT4( sphere.x, sphere.y + 1.0f, sphere.z, 0.0f ) };
+				XMFLOAT4	colors[ 2 ] = { mat.GetColor( i ), XMFLOAT4( 1.0f, 1.0f, 1.0f, 1.0f ) };
+				anim.AddTrack( ANIMATE_POSITION, i, times, positions, 2 );
+				anim.AddTrack( ANIMATE_COLOR, i, times, colors, 2 );
+			}
+			
+			timer.Restart();
+			for( UINT f = 0; f < BENCHMARK_FRAMES; f++ )
+				anim.Evaluate( ( float )f / BENCHMARK_FRAMES, spa, mat );
+			benchmarkRow( out, L"animate", anim.GetTrackCount(), timer.GetMilliseconds() / BENCHMARK_FRAMES );
+		}
+		
+		// particles, as many as there are spheres, sprayed from
+		// above the middle of the scene. none of them dies, and
+		// the camera sees about a half of them
+		{
+			JobSystem		jobs;
+			ParticleSystem	particles;
+			Camera			cam( XMFLOAT3( 0.0f, desc.height, -desc.extent ), XMFLOAT3( 0.0f, 0.0f, 0.0f ), XMFLOAT3( 0.0f, 1.0f, 0.0f ) );
+			particles.BindJobs( &jobs );
+			particles.Reserve( desc.count );
+			particles.Emit( desc.count, XMFLOAT3( 0.0f, desc.height, 0.0f ), XMFLOAT3( 0.0f, 2.0f, 0.0f ), 
+				0.2f * desc.extent, 1000.0f, 0.05f, XMFLOAT4( 1.0f, 0.5f, 0.0f, 1.0f ) );
+			
+			timer.Restart();
+			for( UINT f = 0; f < BENCHMARK_FRAMES; f++ )
+				particles.Update( 0.016f );
+			benchmarkRow( out, L"particles update", particles.size(), timer.GetMilliseconds() / BENCHMARK_FRAMES );
+			
+			timer.Restart();
+			for( UINT f = 0; f < BENCHMARK_FRAMES; f++ )
+				particles.Cull( &cam );
+			benchmarkRow( out, L"particles cull", particles.size(), timer.GetMilliseconds() / BENCHMARK_FRAMES );
+		}
+		
+		// light clusters, a point light in every sphere (up to 64k of
+		// them), seen by the same camera the particles are
+		{
+			JobSystem			jobs;
+			LightClusters		clusters;
+			std::vector< Light >	lights( min( spa.size(), 65536u ) );
+			Camera				cam( XMFLOAT3( 0.0f, desc.height, -desc.extent ), XMFLOAT3( 0.0f, 0.0f, 0.0f ), XMFLOAT3( 0.0f, 1.0f, 0.0f ) );
+			
+			for( UINT i = 0; i < lights.size(); i++ )
+			{
+				XMFLOAT4 sphere = spa.GetSphere( i );
+				lights[ i ].position = XMFLOAT3( sphere.x, sphere.y, sphere.z );
+				lights[ i ].range = 2.0f;
+				lights[ i ].color = XMFLOAT3( 1.0f, 1.0f, 1.0f );
+				lights[ i ].spotCos = -1.0f;
+				lights[ i ].direction = XMFLOAT3( 0.0f, -1.0f, 0.0f );
+				lights[ i ].spotInnerCos = -1.0f;
+			}
+			
+			clusters.BindJobs( &jobs );
+			clusters.Build( lights.data(), lights.size(), &cam );
+			timer.Restart();
+			for( UINT f = 0; f < BENCHMARK_FRAMES; f++ )
+				clusters.Build( lights.data(), lights.size(), &cam );
+			benchmarkRow( out, L"light clusters", lights.size(), timer.GetMilliseconds() / BENCHMARK_FRAMES );
+		}
+		
+		// impostors picked among all the spheres, as seen by the same 
+		// camera. the count shows how many meshes they would replace.
+		// then the scene is painted with them, to compare with "paint"
+		{
+			JobSystem				jobs;
+			SphereImpostors			impostors;
+			std::vector< XMFLOAT4 >	colors( spa.size(), XMFLOAT4( 0.4f, 0.7f, 0.2f, 1.0f ) );
+			Camera					cam( XMFLOAT3( 0.0f, desc.height, -desc.extent ), XMFLOAT3( 0.0f, 0.0f, 0.0f ), XMFLOAT3( 0.0f, 1.0f, 0.0f ) );
+			const XMFLOAT4*			spheres = ( const XMFLOAT4* )spa.GetShaderPositionArray();
+			UINT					picked = 0;
+			
+			impostors.BindJobs( &jobs );
+			impostors.Select( &cam, spheres, colors.data(), NULL, NULL, spa.size(), 1080 );
+			timer.Restart();
+			for( UINT f = 0; f < BENCHMARK_FRAMES; f++ )
+				picked = impostors.Select( &cam, spheres, colors.data(), NULL, NULL, spa.size(), 1080 );
+			benchmarkRow( out, L"impostor select", spa.size(), timer.GetMilliseconds() / BENCHMARK_FRAMES );
+			benchmarkValueRow( out, L"impostors", spa.size(), picked, L"picked" );
+			
+			if( SUCCEEDED( impostors.InitDevice( mat.GetDevice(), mat.GetInput() ) ) )
+			{
+				mat.BindImpostors( &impostors );
+				mat.PaintScene();
+				timer.Restart();
+				for( UINT f = 0; f < BENCHMARK_FRAMES; f++ )
+					mat.PaintScene();
+				benchmarkRow( out, L"paint with impostors", desc.count, timer.GetMilliseconds() / BENCHMARK_FRAMES );
+				benchmarkValueRow( out, L"impostors drawn", desc.count, mat.GetStatistics().drawnImpostors, L"impostors" );
+				mat.BindImpostors( NULL );
+			}
+		}
+		
+		// space matrices of an oriented object per sphere, facing
+		// away from the middle of the scene. the general inverse
+		// is what getSpaceMatrix used to do for all of them
+		{
+			std::vector< XMFLOAT3 >		xAxes( spa.size() ), yAxes( spa.size() );
+			std::vector< XMFLOAT4X4 >	matrices( spa.size() );
+			XMVECTOR					determinant;
+			
+			for( UINT i = 0; i < spa.size(); i++ )
+			{
+				XMFLOAT4 sphere = spa.GetSphere( i );
+				XMVECTOR x = XMVector3Normalize( XMVectorSet( sphere.x, 0.0f, sphere.z + 0.5f, 0.0f ) );
+				XMStoreFloat3( &xAxes[ i ], x );
+				XMStoreFloat3( &yAxes[ i ], XMVector3Normalize( XMVector3Cross( x, XMVectorSet( 1.0f, 1.0f, 0.0f, 0.0f ) ) ) );
+			}
+			
+			timer.Restart();
+			for( UINT i = 0; i < spa.size(); i++ )
+			{
+				XMVECTOR x = XMLoadFloat3( &xAxes[ i ] );
+				XMVECTOR y = XMLoadFloat3( &yAxes[ i ] );
+				XMStoreFloat4x4( &matrices[ i ], XMMatrixInverse( &determinant, 
+					XMMATRIX( x, y, XMVector3Cross( x, y ), XMVectorSet( 0.0f, 0.0f, 0.0f, 1.0f ) ) ) );
+			}
+			benchmarkRow( out, L"space matrix inverse", spa.size(), timer.GetMilliseconds() );
+			
+			timer.Restart();
+			for( UINT i = 0; i < spa.size(); i++ )
+				XMStoreFloat4x4( &matrices[ i ], getSpaceMatrix( xAxes[ i ], yAxes[ i ], true ) );
+			benchmarkRow( out, L"space matrix", spa.size(), timer.GetMilliseconds() );
+			
+			timer.Restart();
+			getSpaceMatrices( xAxes.data(), yAxes.data(), spa.size(), true, matrices.data() );
+			benchmarkRow( out, L"space matrices", spa.size(), timer.GetMilliseconds() );
+		}
+		
+		// sphere centres moved by an affine matrix one by one, as
+		// XMVector3TransformCoord does it, then by the kernels
+		{
+			UINT					count = spa.size();
+			std::vector< float >	coords( 7 * count );
+			float*					x = &coords[ 0 ];
+			float*					y = x + count;
+			float*					z = y + count;
+			XMMATRIX				affine = XMMatrixMultiply( XMMatrixRotationY( 0.5f ), XMMatrixTranslation( 1.0f, 2.0f, 3.0f ) );
+			XMMATRIX				viewProjection = XMMatrixMultiply( 
+				XMMatrixLookAtLH( XMVectorSet( 0.0f, desc.height, -desc.extent, 1.0f ), XMVectorZero(), XMVectorSet( 0.0f, 1.0f, 0.0f, 0.0f ) ),
+				XMMatrixPerspectiveFovLH( XM_PIDIV4, 4.0f / 3.0f, 0.1f, 1000.0f ) );
+			
+			for( UINT i = 0; i < count; i++ )
+			{
+				XMFLOAT4 sphere = spa.GetSphere( i );
+				x[ i ] = sphere.x;
+				y[ i ] = sphere.y;
+				z[ i ] = sphere.z;
+			}
+			
+			timer.Restart();
+			for( UINT i = 0; i < count; i++ )
+			{
+				XMFLOAT3 p;
+				XMStoreFloat3( &p, XMVector3TransformCoord( XMVectorSet( x[ i ], y[ i ], z[ i ], 1.0f ), affine ) );
+				z[ count + i ] = p.x;
+			}
+			benchmarkRow( out, L"transform coord", count, timer.GetMilliseconds() );
+			
+			timer.Restart();
+			transformPoints( x, y, z, count, affine, z + count, z + 2 * count, z + 3 * count );
+			benchmarkRow( out, L"transform points", count, timer.GetMilliseconds() );
+			
+			timer.Restart();
+			transformNormals( x, y, z, count, affine, z + count, z + 2 * count, z + 3 * count );
+			benchmarkRow( out, L"transform normals", count, timer.GetMilliseconds() );
+			
+			timer.Restart();
+			projectPoints( x, y, z, count, viewProjection, z + count, z + 2 * count, z + 3 * count, z + 4 * count );
+			benchmarkRow( out, L"project points", count, timer.GetMilliseconds() );
+		}
+		
+		// vertices of a detailed sphere packed into the compact
+		// format, once for every frame, as if it was streamed
+		{
+			std::vector< Vertex >			vertices;
+			std::vector< DWORD >			indices;
+			std::vector< CompactVertex >	packed;
+			
+			buildSphereMesh( 32, 24, 1.0f, XMFLOAT4( 0.4f, 0.7f, 0.2f, 1.0f ), vertices, indices );
+			packed.resize( vertices.size() );
+			
+			timer.Restart();
+			for( UINT f = 0; f < BENCHMARK_FRAMES; f++ )
+				VertexFormat< CompactVertex >::Encode( vertices.data(), vertices.size(), packed.data() );
+			benchmarkRow( out, L"compact vertices", vertices.size(), timer.GetMilliseconds() / BENCHMARK_FRAMES );
+		}
+		
+		// sky light, projected once, then evaluated for the
+		// normal of every sphere's point facing the camera
+		{
+			SkyLight	sky;
+			XMVECTOR	sum = XMVectorZero();
+			
+			timer.Restart();
+			sky.Update();
+			benchmarkRow( out, L"sky projection", SKY_SH_SAMPLES, timer.GetMilliseconds() );
+			
+			timer.Restart();
+			for( UINT i = 0; i < spa.size(); i++ )
+			{
+				XMFLOAT4 sphere = spa.GetSphere( i );
+				XMVECTOR normal = XMVector3Normalize( XMVectorSet( -sphere.x, desc.height - sphere.y, -desc.extent - sphere.z, 0.0f ) );
+				sum = XMVectorAdd( sum, sky.Irradiance( normal ) );
+			}
+			benchmarkSink = XMVectorGetX( sum );
+			benchmarkRow( out, L"sky irradiance", spa.size(), timer.GetMilliseconds() );
+		}
+		
+		// every object recolored one by one, then all of them at once
+		// into a packed color table, which is then uploaded
+		{
+			ColorTable					table;
+			UINT						count = mat.GetObjectCount();
+			std::vector< ObjectHandle >	handles( count );
+			std::vector< XMFLOAT4 >		colors( count );
+			
+			for( UINT i = 0; i < count; i++ )
+			{
+				handles[ i ] = mat.GetHandle( i );
+				colors[ i ] = XMFLOAT4( ( i & 255 ) / 255.0f, 0.5f, 1.0f - ( i & 255 ) / 255.0f, 1.0f );
+			}
+			
+			// both rows write into the bound table, so they 
+			// differ only in the way the colors get there
+			mat.BindColorTable( &table );
+			table.Upload( mat.GetDevice() );
+			
+			timer.Restart();
+			for( UINT i = 0; i < count; i++ )
+				mat.updateColor( i, colors[ i ] );
+			benchmarkRow( out, L"recolor one by one", count, timer.GetMilliseconds() );
+			
+			table.Upload( mat.GetDevice() );
+			timer.Restart();
+			mat.UpdateColors( handles.data(), colors.data(), count );
+			benchmarkRow( out, L"recolor bulk", count, timer.GetMilliseconds() );
+			
+			// it only times queueing of the UpdateSubresource call,
+			// the copy itself is done whenever the driver wants to
+			timer.Restart();
+			table.Upload( mat.GetDevice() );
+			benchmarkRow( out, L"color upload (queued)", count, timer.GetMilliseconds() );
+			mat.BindColorTable( NULL );
+		}
+		
+		// scene removal
+		timer.Restart();
+		mat.RemoveAll();
+		spa.RemoveAll();
+		benchmarkRow( out, L"remove", desc.count, timer.GetMilliseconds() );
+	}
+}
+
+#endif